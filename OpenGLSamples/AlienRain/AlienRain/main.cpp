@@ -1,5 +1,6 @@
 #include <sb7.h>
 #include <sb7ktx.h>
+#include <sb7rng.h>
 #include <vmath.h>
 
 #define GLSL(version, shader) "#version " #version "\n" #shader  
@@ -67,24 +68,6 @@ static const GLchar* fragment_shader_source = GLSL
   }
 );
 
-// Random number generator
-static unsigned int seed = 0x13371337;
-
-static inline float random_float()
-{
-  float res;
-  unsigned int tmp;
-
-  seed *= 16807;
-
-  tmp = seed ^ (seed >> 4) ^ (seed << 15);
-
-  *((unsigned int *)&res) = (tmp >> 9) | 0x3F800000;
-
-  return (res - 1.0f);
-}
-
-
 class AlienRain : public sb7::application
 {
 public:
@@ -106,11 +89,13 @@ public:
     glBufferData(GL_UNIFORM_BUFFER, 256 * sizeof(vmath::vec4), 
                  NULL, GL_DYNAMIC_DRAW);
 
+    sb7::rng::legacy rng(0x13371337);
+
     for (int i = 0; i < 256; ++i) 
     {
-      droplet_x_offset[i] = random_float() * 2.0f - 1.0f;
-      droplet_rot_speed[i] = (random_float() + 0.5f)*((i & 1) ? -3.0f : 3.0f);
-      droplet_fall_speed[i] = random_float() + 0.2f;
+      droplet_x_offset[i] = rng.next_float() * 2.0f - 1.0f;
+      droplet_rot_speed[i] = (rng.next_float() + 0.5f)*((i & 1) ? -3.0f : 3.0f);
+      droplet_fall_speed[i] = rng.next_float() + 0.2f;
     }
 
     glBindVertexArray(render_vao);
@@ -3,6 +3,7 @@
 layout (location = 0) in vec3 position_3;
 layout (location = 1) in vec3 normal;
 
+layout (location = 9) in uint sub_object_index;
 layout (location = 10) in uint draw_id;
 
 out VS_OUT
@@ -17,6 +18,11 @@ uniform mat4 view_matrix;
 uniform mat4 proj_matrix;
 uniform mat4 viewproj_matrix;
 
+// In the merged mode each instance draws bucket_size asteroids, one of each
+// sub-object, and draw_id isn't used
+uniform uint bucket_size = 0u;
+uniform uint bucket_base = 0u;
+
 const vec4 color0 = vec4(0.29, 0.21, 0.18, 1.0);
 const vec4 color1 = vec4(0.58, 0.55, 0.51, 1.0);
 
@@ -32,9 +38,9 @@ int Random (int seed, int iterations)
 	return value;
 }
 
-vec4 RandomVector()
+vec4 RandomVector(uint asteroid)
 {
-	int r = Random(int(draw_id), 4);
+	int r = Random(int(asteroid), 4);
 	int g = Random(r, 2);
 	int b = Random(g, 2);
 	int a = Random(b, 2);
@@ -48,12 +54,13 @@ vec4 RandomVector()
 void main(void)
 {
 	vec4 position = vec4(position_3, 1.0);
+	uint asteroid = bucket_size != 0u ? bucket_base + uint(gl_InstanceID) * bucket_size + sub_object_index : draw_id;
 
 	mat4 m1;
 	mat4 m2;
 	mat4 m;
 	float t = time * 0.1;
-	float f = float(draw_id) / 30.0;
+	float f = float(asteroid) / 30.0;
 
 	float st = sin(t * 0.5 + f * 5.0);
 	float ct = cos(t * 0.5 + f * 5.0);
@@ -74,7 +81,7 @@ void main(void)
 	m1[3] = vec4(260.0 + 30.0 * d, 5.0 * sin(f * 123.123), 0.0, 1.0);
 
 	// translate to chaotic offset
-	vec4 random_offset = RandomVector();
+	vec4 random_offset = RandomVector(asteroid);
 
 	m2[0] = vec4(1.0, 0.0, 0.0, 0.0);
 	m2[1] = vec4(0.0, 1.0, 0.0, 0.0);
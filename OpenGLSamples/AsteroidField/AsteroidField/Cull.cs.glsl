@@ -0,0 +1,163 @@
+#version 450 core
+
+// Tests each asteroid's bounding sphere against the view frustum and
+// appends a draw command for every one that survives. The atomic counter
+// ends up holding the number of commands written.
+
+layout (local_size_x = 256) in;
+
+struct SubObject
+{
+	vec4 sphere;		// Center in xyz, radius in w
+	uint first;
+	uint count;
+};
+
+struct DrawArraysIndirectCommand
+{
+	uint count;
+	uint primCount;
+	uint first;
+	uint baseInstance;
+};
+
+layout (binding = 0, std430) readonly buffer SUB_OBJECT_BLOCK
+{
+	SubObject sub_object[];
+};
+
+layout (binding = 1, std430) writeonly buffer COMMAND_BLOCK
+{
+	DrawArraysIndirectCommand command[];
+};
+
+layout (binding = 0, offset = 0) uniform atomic_uint command_count;
+
+uniform float time = 0.0;
+uniform uint draw_count;
+uniform uint sub_object_count;
+
+// World space planes, normals pointing inwards
+uniform vec4 frustum_planes[6];
+
+int Random (int seed, int iterations)
+{
+	int value = seed;
+
+	for (int n = 0; n < iterations; ++n)
+	{
+		value = ((value >> 7) ^ (value << 9)) * 15485863;
+	}
+
+	return value;
+}
+
+vec4 RandomVector(uint draw_id)
+{
+	int r = Random(int(draw_id), 4);
+	int g = Random(r, 2);
+	int b = Random(g, 2);
+	int a = Random(b, 2);
+
+	return vec4(float(r & 0x3FF) / 1024.0,
+				float(g & 0x3FF) / 1024.0,
+				float(b & 0x3FF) / 1024.0,
+				float(a & 0x3FF) / 1024.0);
+}
+
+// The model matrix built by Asteroid.vs.glsl. The two must be kept in step.
+mat4 AsteroidMatrix(uint draw_id)
+{
+	mat4 m1;
+	mat4 m2;
+	mat4 m;
+	float t = time * 0.1;
+	float f = float(draw_id) / 30.0;
+
+	float st = sin(t * 0.5 + f * 5.0);
+	float ct = cos(t * 0.5 + f * 5.0);
+
+	float j = fract(f);
+	float d = cos(j * 3.14159);
+
+	m[0] = vec4( ct, 0.0,  st, 0.0);
+	m[1] = vec4(0.0, 1.0, 0.0, 0.0);
+	m[2] = vec4(-st, 0.0,  ct, 0.0);
+	m[3] = vec4(0.0, 0.0, 0.0, 1.0);
+
+	m1[0] = vec4(1.0, 0.0, 0.0, 0.0);
+	m1[1] = vec4(0.0, 1.0, 0.0, 0.0);
+	m1[2] = vec4(0.0, 0.0, 1.0, 0.0);
+	m1[3] = vec4(260.0 + 30.0 * d, 5.0 * sin(f * 123.123), 0.0, 1.0);
+
+	vec4 random_offset = RandomVector(draw_id);
+
+	m2[0] = vec4(1.0, 0.0, 0.0, 0.0);
+	m2[1] = vec4(0.0, 1.0, 0.0, 0.0);
+	m2[2] = vec4(0.0, 0.0, 1.0, 0.0);
+	m2[3] = vec4(10.0 * random_offset.x, 10.0 * random_offset.y, 10.0 * random_offset.z, 1.0);
+
+	m = m * m1 * m2;
+
+	st = sin(t * 2.1 * (600.0 + f) * 0.01);
+	ct = cos(t * 2.1 * (600.0 + f) * 0.01);
+
+	m1[0] = vec4( ct,  st, 0.0, 0.0);
+	m1[1] = vec4(-st,  ct, 0.0, 0.0);
+	m1[2] = vec4(0.0, 0.0, 1.0, 0.0);
+	m1[3] = vec4(0.0, 0.0, 0.0, 1.0);
+
+	m = m * m1;
+
+	st = sin(t * 1.7 * (700.0 + f) * 0.01);
+	ct = cos(t * 1.7 * (700.0 + f) * 0.01);
+
+	m1[0] = vec4(1.0, 0.0, 0.0, 0.0);
+	m1[1] = vec4(0.0,  ct,  st, 0.0);
+	m1[2] = vec4(0.0, -st,  ct, 0.0);
+	m1[3] = vec4(0.0, 0.0, 0.0, 1.0);
+
+	m = m * m1;
+
+	float f1 = 0.65 + cos(f * 1.1) * 0.2;
+	float f2 = 0.65 + cos(f * 1.1) * 0.2;
+	float f3 = 0.65 + cos(f * 1.3) * 0.2;
+
+	m1[0] = vec4( f1, 0.0, 0.0, 0.0);
+	m1[1] = vec4(0.0,  f2, 0.0, 0.0);
+	m1[2] = vec4(0.0, 0.0,  f3, 0.0);
+	m1[3] = vec4(0.0, 0.0, 0.0, 1.0);
+
+	return m * m1;
+}
+
+void main(void)
+{
+	uint draw_id = gl_GlobalInvocationID.x;
+
+	if (draw_id >= draw_count)
+	{
+		return;
+	}
+
+	SubObject object = sub_object[draw_id % sub_object_count];
+	mat4 m = AsteroidMatrix(draw_id);
+
+	vec3 center = (m * vec4(object.sphere.xyz, 1.0)).xyz;
+	float radius = object.sphere.w * max(length(m[0].xyz), max(length(m[1].xyz), length(m[2].xyz)));
+
+	for (int i = 0; i < 6; ++i)
+	{
+		if (dot(frustum_planes[i].xyz, center) + frustum_planes[i].w < -radius)
+		{
+			return;
+		}
+	}
+
+	uint index = atomicCounterIncrement(command_count);
+
+	command[index].count = object.count;
+	command[index].primCount = 1;
+	command[index].first = object.first;
+	command[index].baseInstance = draw_id;
+}
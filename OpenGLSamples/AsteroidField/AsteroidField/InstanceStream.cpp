@@ -0,0 +1,93 @@
+#include "InstanceStream.h"
+
+#include <chrono>
+
+InstanceStream::InstanceStream()
+  : stall_count(0),
+    stall_time(0.0),
+    m_buffer(0),
+    m_data(nullptr),
+    m_segment_size(0),
+    m_segment(0)
+{
+  for (int i = 0; i < SEGMENT_COUNT; ++i)
+    m_fence[i] = 0;
+}
+
+InstanceStream::~InstanceStream()
+{
+  // The context may already be gone here, so the buffer is only released
+  // by an explicit Destroy()
+}
+
+void InstanceStream::Create(GLsizeiptr segment_size)
+{
+  static const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+  Destroy();
+
+  m_segment_size = segment_size;
+  m_segment = 0;
+
+  glGenBuffers(1, &m_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+  glBufferStorage(GL_ARRAY_BUFFER, SEGMENT_COUNT * segment_size, nullptr, flags);
+
+  m_data = (unsigned char *)glMapBufferRange(GL_ARRAY_BUFFER, 0,
+                                             SEGMENT_COUNT * segment_size, flags);
+}
+
+void InstanceStream::Destroy()
+{
+  if (!m_buffer)
+    return;
+
+  // Nothing may still be reading the buffer when it goes away
+  for (int i = 0; i < SEGMENT_COUNT; ++i)
+  {
+    if (m_fence[i])
+    {
+      glClientWaitSync(m_fence[i], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+      glDeleteSync(m_fence[i]);
+      m_fence[i] = 0;
+    }
+  }
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+  glUnmapBuffer(GL_ARRAY_BUFFER);
+  glDeleteBuffers(1, &m_buffer);
+
+  m_buffer = 0;
+  m_data = nullptr;
+}
+
+void *InstanceStream::BeginSegment()
+{
+  GLsync& fence = m_fence[m_segment];
+
+  if (fence)
+  {
+    // A zero timeout only polls. Anything else is a stall.
+    if (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+    {
+      const auto start = std::chrono::steady_clock::now();
+
+      while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+        ;
+
+      stall_count++;
+      stall_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    glDeleteSync(fence);
+    fence = 0;
+  }
+
+  return m_data + SegmentOffset();
+}
+
+void InstanceStream::EndSegment()
+{
+  m_fence[m_segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  m_segment = (m_segment + 1) % SEGMENT_COUNT;
+}
@@ -0,0 +1,48 @@
+#ifndef __INSTANCESTREAM_H__
+#define __INSTANCESTREAM_H__
+
+#include <GL/gl3w.h>
+
+// A buffer that stays mapped for its whole life and is split into
+// SEGMENT_COUNT segments. Each frame the CPU writes one segment while the
+// GPU may still be reading the previous ones; a fence per segment says
+// when it can be written again. With three segments the CPU only waits if
+// it gets more than two frames ahead of the GPU.
+class InstanceStream
+{
+public:
+  enum { SEGMENT_COUNT = 3 };
+
+  InstanceStream();
+  ~InstanceStream();
+
+  // (Re)allocates the buffer. Needs a current context.
+  void Create(GLsizeiptr segment_size);
+  void Destroy();
+
+  // Waits for the GPU to finish with the next segment and returns it
+  void *BeginSegment();
+
+  // Fences the segment returned by BeginSegment(). Call after the draws
+  // that read it.
+  void EndSegment();
+
+  GLuint Buffer() const { return m_buffer; }
+  GLsizeiptr SegmentSize() const { return m_segment_size; }
+
+  // Offset of the segment being written, in bytes from the start of Buffer()
+  GLsizeiptr SegmentOffset() const { return m_segment * m_segment_size; }
+
+  // Number of times BeginSegment() had to wait, and for how long in total
+  int stall_count;
+  double stall_time;
+
+private:
+  GLuint m_buffer;
+  unsigned char *m_data;
+  GLsizeiptr m_segment_size;
+  int m_segment;
+  GLsync m_fence[SEGMENT_COUNT];
+};
+
+#endif /* __INSTANCESTREAM_H__ */
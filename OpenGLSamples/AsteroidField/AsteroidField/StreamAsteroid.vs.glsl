@@ -0,0 +1,49 @@
+#version 450 core
+
+// Asteroid.vs.glsl for the streamed mode. The model matrix is computed on
+// the CPU and arrives as a per-instance attribute, packed as the top three
+// rows of the affine matrix.
+
+layout (location = 0) in vec3 position_3;
+layout (location = 1) in vec3 normal;
+
+layout (location = 9) in uint sub_object_index;
+
+layout (location = 11) in vec4 model_row0;
+layout (location = 12) in vec4 model_row1;
+layout (location = 13) in vec4 model_row2;
+
+out VS_OUT
+{
+	vec3 normal;
+	vec4 color;
+} vs_out;
+
+uniform mat4 view_matrix;
+uniform mat4 proj_matrix;
+uniform mat4 viewproj_matrix;
+
+// Each sub-object is drawn with one instance per asteroid of that shape, so
+// the instance is the asteroid's index among them, as StreamTransforms()
+// numbers them
+uniform uint sub_object_count = 1u;
+
+const vec4 color0 = vec4(0.29, 0.21, 0.18, 1.0);
+const vec4 color1 = vec4(0.58, 0.55, 0.51, 1.0);
+
+void main(void)
+{
+	mat3x4 m = mat3x4(model_row0, model_row1, model_row2);
+
+	vec3 position = vec4(position_3, 1.0) * m;
+	vec3 n = vec4(normal, 0.0) * m;
+
+	gl_Position = viewproj_matrix * vec4(position, 1.0);
+	vs_out.normal = mat3(view_matrix) * n;
+
+	// The same color as Asteroid.vs.glsl gives the asteroid
+	uint asteroid = uint(gl_InstanceID) * sub_object_count + sub_object_index;
+	float j = fract(float(asteroid) / 30.0);
+
+	vs_out.color = mix(color0, color1, fract(j * 313.431));
+}
\ No newline at end of file
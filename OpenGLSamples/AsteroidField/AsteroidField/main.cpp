@@ -1,12 +1,19 @@
 #include <sb7.h>
+#include <sb7ext.h>
 #include <shader.h>
 #include <object.h>
 #include <vmath.h>
+#include <sb7threadpool.h>
+#include <sb7cmdlist.h>
+#include <sb7glstate.h>
+#include <sb7renderqueue.h>
 
-enum
-{
-  NUM_DRAWS = 50000
-};
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "InstanceStream.h"
 
 struct DrawArraysIndirectCommand
 {
@@ -16,44 +23,251 @@ struct DrawArraysIndirectCommand
   GLuint baseInstance;
 };
 
+// Must match SubObject in Cull.cs.glsl
+struct SubObjectBounds
+{
+  vmath::vec4 sphere;
+  GLuint first;
+  GLuint count;
+  GLuint pad[2];
+};
+
+enum
+{
+  CULL_GROUP_SIZE = 256  // Must match Cull.cs.glsl
+};
+
+enum
+{
+  DEFAULT_ASTEROID_COUNT = 50000
+};
+
+// Asteroid counts that 'N' cycles through and the benchmark sweeps
+static const int asteroid_counts[] = { 10000, 50000, 100000, 250000, 500000, 1000000 };
+
+static inline int Random(int seed, int iterations)
+{
+  uint32_t value = uint32_t(seed);
+
+  for (int n = 0; n < iterations; ++n) 
+  {
+    value = uint32_t((int32_t(value) >> 7) ^ int32_t(value << 9)) * 15485863u;
+  }
+
+  return int32_t(value);
+}
+
+// The model matrix that Asteroid.vs.glsl builds from draw_id and time
+static vmath::mat4 AsteroidMatrix(unsigned int draw_id, float time)
+{
+  const float t = time * 0.1f;
+  const float f = float(draw_id) / 30.0f;
+
+  float st = sinf(t * 0.5f + f * 5.0f);
+  float ct = cosf(t * 0.5f + f * 5.0f);
+
+  const float j = f - floorf(f);
+  const float d = cosf(j * 3.14159f);
+
+  const int r = Random(int(draw_id), 4);
+  const int g = Random(r, 2);
+  const int b = Random(g, 2);
+
+  // Rotate around Y, translate in XY and then to a chaotic offset
+  vmath::mat4 m = vmath::mat4(vmath::vec4( ct, 0.0f,  st, 0.0f),
+                              vmath::vec4(0.0f, 1.0f, 0.0f, 0.0f),
+                              vmath::vec4(-st, 0.0f,  ct, 0.0f),
+                              vmath::vec4(0.0f, 0.0f, 0.0f, 1.0f)) *
+                  vmath::translate(260.0f + 30.0f * d, 5.0f * sinf(f * 123.123f), 0.0f) *
+                  vmath::translate(10.0f * float(r & 0x3FF) / 1024.0f,
+                                   10.0f * float(g & 0x3FF) / 1024.0f,
+                                   10.0f * float(b & 0x3FF) / 1024.0f);
+
+  // Rotate around Z
+  st = sinf(t * 2.1f * (600.0f + f) * 0.01f);
+  ct = cosf(t * 2.1f * (600.0f + f) * 0.01f);
+
+  m = m * vmath::mat4(vmath::vec4( ct,  st, 0.0f, 0.0f),
+                      vmath::vec4(-st,  ct, 0.0f, 0.0f),
+                      vmath::vec4(0.0f, 0.0f, 1.0f, 0.0f),
+                      vmath::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+
+  // Rotate around X
+  st = sinf(t * 1.7f * (700.0f + f) * 0.01f);
+  ct = cosf(t * 1.7f * (700.0f + f) * 0.01f);
+
+  m = m * vmath::mat4(vmath::vec4(1.0f, 0.0f, 0.0f, 0.0f),
+                      vmath::vec4(0.0f,  ct,  st, 0.0f),
+                      vmath::vec4(0.0f, -st,  ct, 0.0f),
+                      vmath::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+
+  // Non-uniform scale
+  return m * vmath::scale(0.65f + cosf(f * 1.1f) * 0.2f,
+                          0.65f + cosf(f * 1.1f) * 0.2f,
+                          0.65f + cosf(f * 1.3f) * 0.2f);
+}
+
 class AsteroidField : public sb7::application
 {
 public:
+  AsteroidField()
+    : render_program(0),
+      cull_program(0),
+      stream_program(0),
+      draw_count(0),
+      recorder(thread_pool),
+      queue_frames(0),
+      queue_build_time(0.0),
+      queue_sort_time(0.0),
+      stream_frames(0),
+      stream_write_time(0.0),
+      mode(MODE_MULTIDRAW),
+      paused(false),
+      vsync(false),
+      has_indirect_count(false),
+      frame_count(0),
+      stats_start_time(0.0) {}
+
   void startup() override;
 
   void render(double current_time) override;
 
 protected:
+  enum MODE
+  {
+    MODE_FIRST,
+    MODE_MULTIDRAW = 0,
+    MODE_SEPARATE_DRAWS,
+    MODE_GPU_CULLING,
+    MODE_STREAMED,
+    MODE_INSTANCED,
+    MODE_MERGED,
+    MODE_QUEUED,
+    MODE_MAX = MODE_QUEUED
+  };
+
   void LoadShaders();
+  void BuildBoundingSpheres();
+  void BuildSubObjectIndices();
+  void SetAsteroidCount(int count);
+
+  void DrawAsteroids(MODE draw_mode, float t);
+  void DrawInstanced();
+  void DrawMerged();
+  void CullAsteroids(float t, const vmath::mat4& viewproj_matrix);
+  void RecordSeparateDraws(float t, const vmath::mat4& viewproj_matrix);
+  void QueueAsteroids(float t, const vmath::mat4& view_matrix, const vmath::mat4& viewproj_matrix);
+  GLuint ReadVisibleCount(MODE draw_mode);
+  void CountCommands(MODE draw_mode, int& calls, int& commands);
+  void CreateStream(int count);
+  void StreamTransforms(float t);
+  void DrawStreamed();
+  void ResetFrameStats();
+  void UpdateStats(double current_time);
+  void RunBenchmark();
+  double TimeFrames(MODE draw_mode);
 
   void onKey(int key, int action) override;
+  void shutdown() override;
 
   GLuint render_program;
+  GLuint cull_program;
+  GLuint stream_program;
   
   sb7::object object;
 
+  // Number of asteroids, and where the asteroids of each sub-object start
+  // when they are grouped by sub-object. Group s holds the asteroids s,
+  // s + G, s + 2 * G... for G sub-objects.
+  int draw_count;
+  std::vector<GLuint> group_first;
+
   GLuint indirect_draw_buffer;
   GLuint draw_index_buffer;
 
+  // draw_index_buffer in group order, for the instanced mode
+  GLuint grouped_index_buffer;
+
+  // Which sub-object each vertex belongs to, for the merged mode
+  GLuint sub_object_index_buffer;
+
+  // Inputs and outputs of the culling pass. The CPU culls against the
+  // same spheres in the separate draws mode.
+  std::vector<SubObjectBounds> sub_object_bounds;
+  GLuint sub_object_buffer;
+  GLuint culled_draw_buffer;
+  GLuint command_count_buffer;
+
   struct
   {
     GLuint time;
     GLuint view_matrix;
     GLuint proj_matrix;
     GLuint viewproj_matrix;
+    GLint bucket_size;
+    GLint bucket_base;
   } uniforms;
 
-  enum MODE
+  struct
   {
-    MODE_FIRST,
-    MODE_MULTIDRAW = 0,
-    MODE_SEPARATE_DRAWS,
-    MODE_MAX = MODE_SEPARATE_DRAWS
-  };
+    GLint time;
+    GLint draw_count;
+    GLint sub_object_count;
+    GLint frustum_planes;
+  } cull_uniforms;
+
+  struct
+  {
+    GLint view_matrix;
+    GLint proj_matrix;
+    GLint viewproj_matrix;
+    GLint sub_object_count;
+  } stream_uniforms;
+
+  // The streamed mode writes one packed model matrix per asteroid per
+  // frame, in group order so that each group is one instanced draw
+  sb7::thread_pool thread_pool;
+  InstanceStream stream;
+
+  // The separate draws mode culls and records its draws on the thread pool
+  sb7::cmd_recorder recorder;
+
+  // Every bind made while drawing goes through here
+  sb7::gl_state state;
+
+  // The queued mode culls on the thread pool, then sorts the visible
+  // asteroids by sub-object and depth and lets the queue batch them.
+  // Totals since the stats were last printed.
+  sb7::render_queue queue;
+  int queue_frames;
+  double queue_build_time;
+  double queue_sort_time;
+
+  // Totals since the stats were last printed
+  int stream_frames;
+  double stream_write_time;
 
   MODE mode;
   bool paused;
   bool vsync;
+
+  // GL_ARB_indirect_parameters lets the draw count come straight from the
+  // culling pass. Without it every culled command is zeroed instead.
+  bool has_indirect_count;
+
+  int frame_count;
+  double stats_start_time;
+};
+
+static const char * const mode_names[] =
+{
+  "multidraw",
+  "separate draws",
+  "GPU culling",
+  "streamed",
+  "instanced",
+  "merged",
+  "queued"
 };
 
 void AsteroidField::startup()
@@ -63,55 +277,221 @@ void AsteroidField::startup()
   object.load("../../../media/objects/asteroids.sbm");
 
   glGenBuffers(1, &indirect_draw_buffer);
+  glGenBuffers(1, &draw_index_buffer);
+  glGenBuffers(1, &grouped_index_buffer);
+  glGenBuffers(1, &culled_draw_buffer);
+
+  glGenBuffers(1, &command_count_buffer);
+  glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, command_count_buffer);
+  glBufferData(GL_ATOMIC_COUNTER_BUFFER, sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+
+  BuildBoundingSpheres();
+  BuildSubObjectIndices();
+  SetAsteroidCount(DEFAULT_ASTEROID_COUNT);
+
+  has_indirect_count = sb6IsExtensionSupported("GL_ARB_indirect_parameters") != 0;
+
+  state.enable(GL_DEPTH_TEST);
+  state.set_depth_func(GL_LEQUAL);
+
+  state.enable(GL_CULL_FACE);
+
+  if (info.flags.headless)
+  {
+    RunBenchmark();
+    glfwSetWindowShouldClose(window, GL_TRUE);
+  }
+}
+
+// (Re)creates everything that depends on the number of asteroids
+void AsteroidField::SetAsteroidCount(int count)
+{
+  const GLuint groups = object.get_sub_object_count();
+
+  draw_count = count;
+
+  group_first.resize(groups + 1);
+  group_first[0] = 0;
+
+  for (GLuint s = 0; s < groups; ++s)
+  {
+    group_first[s + 1] = group_first[s] + (count - s + groups - 1) / groups;
+  }
+
   glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_draw_buffer);
 
   glBufferData(GL_DRAW_INDIRECT_BUFFER, 
-               NUM_DRAWS * sizeof(DrawArraysIndirectCommand),
+               count * sizeof(DrawArraysIndirectCommand),
                nullptr, GL_STATIC_DRAW);
 
   DrawArraysIndirectCommand *cmd = (DrawArraysIndirectCommand*)
       glMapBufferRange(GL_DRAW_INDIRECT_BUFFER, 0,
-                       NUM_DRAWS * sizeof(DrawArraysIndirectCommand), 
+                       count * sizeof(DrawArraysIndirectCommand), 
                        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
 
-  for (int i = 0; i < NUM_DRAWS; ++i) 
+  for (int i = 0; i < count; ++i) 
   {
-    object.get_sub_object_info(i % object.get_sub_object_count(), 
-                               cmd[i].first, cmd[i].count);
+    object.get_sub_object_info(i % groups, cmd[i].first, cmd[i].count);
     cmd[i].primCount = 1;
     cmd[i].baseInstance = i;
   }
 
   glUnmapBuffer(GL_DRAW_INDIRECT_BUFFER);
 
-  glBindVertexArray(object.get_vao());
-
-  glGenBuffers(1, &draw_index_buffer);
   glBindBuffer(GL_ARRAY_BUFFER, draw_index_buffer);
-  glBufferData(GL_ARRAY_BUFFER, NUM_DRAWS * sizeof(GLuint), 
+  glBufferData(GL_ARRAY_BUFFER, count * sizeof(GLuint), 
                nullptr, GL_STATIC_DRAW);
 
   GLuint *draw_index = (GLuint*)glMapBufferRange(GL_ARRAY_BUFFER,
                                                  0,
-                                                 NUM_DRAWS * sizeof(GLuint),
+                                                 count * sizeof(GLuint),
                                                  GL_MAP_WRITE_BIT |
                                                  GL_MAP_INVALIDATE_BUFFER_BIT);
 
-  for (int i = 0; i < NUM_DRAWS; ++i) 
+  for (int i = 0; i < count; ++i) 
   {
     draw_index[i] = i;
   }
 
   glUnmapBuffer(GL_ARRAY_BUFFER);
 
+  glBindBuffer(GL_ARRAY_BUFFER, grouped_index_buffer);
+  glBufferData(GL_ARRAY_BUFFER, count * sizeof(GLuint), 
+               nullptr, GL_STATIC_DRAW);
+
+  draw_index = (GLuint*)glMapBufferRange(GL_ARRAY_BUFFER,
+                                         0,
+                                         count * sizeof(GLuint),
+                                         GL_MAP_WRITE_BIT |
+                                         GL_MAP_INVALIDATE_BUFFER_BIT);
+
+  for (GLuint s = 0; s < groups; ++s)
+  {
+    for (GLuint i = group_first[s]; i < group_first[s + 1]; ++i)
+    {
+      draw_index[i] = (i - group_first[s]) * groups + s;
+    }
+  }
+
+  glUnmapBuffer(GL_ARRAY_BUFFER);
+
+  glBindVertexArray(object.get_vao());
+  glBindBuffer(GL_ARRAY_BUFFER, draw_index_buffer);
   glVertexAttribIPointer(10, 1, GL_UNSIGNED_INT, 0, nullptr);
   glVertexAttribDivisor(10, 1);
   glEnableVertexAttribArray(10);
 
-  glEnable(GL_DEPTH_TEST);
-  glDepthFunc(GL_LEQUAL);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, culled_draw_buffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER,
+               count * sizeof(DrawArraysIndirectCommand),
+               nullptr, GL_DYNAMIC_DRAW);
+
+  CreateStream(count);
+
+  // The binds above went straight to GL
+  state.invalidate();
+}
+
+// Attribute 9 of the object's VAO: the index of the sub-object that each
+// vertex belongs to
+void AsteroidField::BuildSubObjectIndices()
+{
+  const GLuint groups = object.get_sub_object_count();
+  GLuint first, count;
+
+  object.get_sub_object_info(groups - 1, first, count);
+
+  std::vector<GLuint> sub_object_index(first + count, 0);
+
+  for (GLuint s = 0; s < groups; ++s)
+  {
+    object.get_sub_object_info(s, first, count);
+
+    for (GLuint v = first; v < first + count; ++v)
+    {
+      sub_object_index[v] = s;
+    }
+  }
 
-  glEnable(GL_CULL_FACE);
+  glGenBuffers(1, &sub_object_index_buffer);
+  glBindVertexArray(object.get_vao());
+  glBindBuffer(GL_ARRAY_BUFFER, sub_object_index_buffer);
+  glBufferData(GL_ARRAY_BUFFER, sub_object_index.size() * sizeof(GLuint),
+               sub_object_index.data(), GL_STATIC_DRAW);
+  glVertexAttribIPointer(9, 1, GL_UNSIGNED_INT, 0, nullptr);
+  glEnableVertexAttribArray(9);
+}
+
+// Reads the vertex positions back from the object's buffer and fits a
+// sphere around each sub-object: the center of its bounding box and the
+// distance to the furthest vertex from there.
+void AsteroidField::BuildBoundingSpheres()
+{
+  GLint buffer;
+  GLint size;
+  GLint stride;
+  GLvoid *offset;
+
+  glBindVertexArray(object.get_vao());
+  glGetVertexAttribiv(0, GL_VERTEX_ATTRIB_ARRAY_BUFFER_BINDING, &buffer);
+  glGetVertexAttribiv(0, GL_VERTEX_ATTRIB_ARRAY_SIZE, &size);
+  glGetVertexAttribiv(0, GL_VERTEX_ATTRIB_ARRAY_STRIDE, &stride);
+  glGetVertexAttribPointerv(0, GL_VERTEX_ATTRIB_ARRAY_POINTER, &offset);
+
+  if (stride == 0)
+  {
+    stride = size * sizeof(float);
+  }
+
+  const unsigned int sub_object_count = object.get_sub_object_count();
+  std::vector<SubObjectBounds>& bounds = sub_object_bounds;
+  std::vector<unsigned char> vertices;
+
+  bounds.resize(sub_object_count);
+  glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+  for (unsigned int i = 0; i < sub_object_count; ++i)
+  {
+    GLuint first, count;
+    object.get_sub_object_info(i, first, count);
+
+    vertices.resize(count * stride);
+    glGetBufferSubData(GL_ARRAY_BUFFER, (GLintptr)offset + first * stride,
+                       count * stride, vertices.data());
+
+    vmath::vec3 lo(1.0e30f);
+    vmath::vec3 hi(-1.0e30f);
+
+    for (GLuint v = 0; v < count; ++v)
+    {
+      const float *p = (const float *)&vertices[v * stride];
+
+      for (int j = 0; j < 3; ++j)
+      {
+        lo[j] = vmath::min(lo[j], p[j]);
+        hi[j] = vmath::max(hi[j], p[j]);
+      }
+    }
+
+    const vmath::vec3 center = (lo + hi) * 0.5f;
+    float radius = 0.0f;
+
+    for (GLuint v = 0; v < count; ++v)
+    {
+      const float *p = (const float *)&vertices[v * stride];
+
+      radius = vmath::max(radius, vmath::length(vmath::vec3(p[0], p[1], p[2]) - center));
+    }
+
+    bounds[i].sphere = vmath::vec4(center[0], center[1], center[2], radius);
+    bounds[i].first = first;
+    bounds[i].count = count;
+  }
+
+  glGenBuffers(1, &sub_object_buffer);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, sub_object_buffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, bounds.size() * sizeof(SubObjectBounds),
+               bounds.data(), GL_STATIC_DRAW);
 }
 
 void AsteroidField::render(double current_time)
@@ -129,13 +509,17 @@ void AsteroidField::render(double current_time)
 
   last_time = current_time;
 
-  float t = float(total_time);
-  int i = int(total_time * 3.0f);
-
   glViewport(0,0, info.windowWidth, info.windowHeight);
   glClearBufferfv(GL_COLOR, 0, black);
   glClearBufferfv(GL_DEPTH, 0, &one);
 
+  DrawAsteroids(mode, float(total_time));
+  state.end_frame();
+  UpdateStats(current_time);
+}
+
+void AsteroidField::DrawAsteroids(MODE draw_mode, float t)
+{
   const vmath::mat4 view_matrix = vmath::lookat(vmath::vec3(100.0f * cosf(t * 0.023f), 100.0f * cosf(t * 0.023f), 300.0f * sinf(t * 0.037f) - 600.0f),
                                                 vmath::vec3(0.0f, 0.0f, 260.0f),
                                                 vmath::normalize(vmath::vec3(0.1f - cosf(t * 0.1f) * 0.3f, 1.0f, 0.0f)));
@@ -144,29 +528,553 @@ void AsteroidField::render(double current_time)
                                                      (float)info.windowHeight, 
                                                      1.0f, 2000.0f);
 
-  glUseProgram(render_program);
+  if (draw_mode == MODE_GPU_CULLING)
+  {
+    CullAsteroids(t, proj_matrix * view_matrix);
+  }
+
+  state.use_program(render_program);
 
   glUniform1f(uniforms.time, t);
   glUniformMatrix4fv(uniforms.view_matrix, 1, GL_FALSE, view_matrix);
   glUniformMatrix4fv(uniforms.proj_matrix, 1, GL_FALSE, proj_matrix);
   glUniformMatrix4fv(uniforms.viewproj_matrix, 1, GL_FALSE, proj_matrix * view_matrix);
+  glUniform1ui(uniforms.bucket_size, 0);
 
-  glBindVertexArray(object.get_vao()); // No need to bind 2 times?
+  state.bind_vertex_array(object.get_vao());
 
-  if (mode == MODE_MULTIDRAW)
+  if (draw_mode == MODE_MULTIDRAW)
   {
-    glMultiDrawArraysIndirect(GL_TRIANGLES, nullptr, NUM_DRAWS, 0);
+    state.bind_buffer(GL_DRAW_INDIRECT_BUFFER, indirect_draw_buffer);
+    glMultiDrawArraysIndirect(GL_TRIANGLES, nullptr, draw_count, 0);
   } 
-  else if (mode == MODE_SEPARATE_DRAWS)
+  else if (draw_mode == MODE_SEPARATE_DRAWS)
+  {
+    RecordSeparateDraws(t, proj_matrix * view_matrix);
+    recorder.execute(state);
+  }
+  else if (draw_mode == MODE_STREAMED)
+  {
+    StreamTransforms(t);
+
+    state.use_program(stream_program);
+    glUniformMatrix4fv(stream_uniforms.view_matrix, 1, GL_FALSE, view_matrix);
+    glUniformMatrix4fv(stream_uniforms.proj_matrix, 1, GL_FALSE, proj_matrix);
+    glUniformMatrix4fv(stream_uniforms.viewproj_matrix, 1, GL_FALSE, proj_matrix * view_matrix);
+    glUniform1ui(stream_uniforms.sub_object_count, object.get_sub_object_count());
+
+    DrawStreamed();
+  }
+  else if (draw_mode == MODE_INSTANCED)
+  {
+    DrawInstanced();
+  }
+  else if (draw_mode == MODE_MERGED)
+  {
+    DrawMerged();
+  }
+  else if (draw_mode == MODE_QUEUED)
+  {
+    QueueAsteroids(t, view_matrix, proj_matrix * view_matrix);
+    queue.flush(state);
+  }
+  else if (draw_mode == MODE_GPU_CULLING)
+  {
+    state.bind_buffer(GL_DRAW_INDIRECT_BUFFER, culled_draw_buffer);
+
+    if (has_indirect_count)
+    {
+      state.bind_buffer(GL_PARAMETER_BUFFER_ARB, command_count_buffer);
+      glMultiDrawArraysIndirectCountARB(GL_TRIANGLES, 0, 0, draw_count, 0);
+    }
+    else
+    {
+      glMultiDrawArraysIndirect(GL_TRIANGLES, nullptr, draw_count, 0);
+    }
+  }
+}
+
+// One instanced draw per sub-object, with draw_id read from the grouped
+// copy of the draw indices
+void AsteroidField::DrawInstanced()
+{
+  state.bind_buffer(GL_ARRAY_BUFFER, grouped_index_buffer);
+  glVertexAttribIPointer(10, 1, GL_UNSIGNED_INT, 0, nullptr);
+
+  for (GLuint s = 0; s + 1 < group_first.size(); ++s)
+  {
+    GLuint first, count;
+    object.get_sub_object_info(s, first, count);
+    glDrawArraysInstancedBaseInstance(GL_TRIANGLES, first, count,
+                                      group_first[s + 1] - group_first[s],
+                                      group_first[s]);
+  }
+
+  state.bind_buffer(GL_ARRAY_BUFFER, draw_index_buffer);
+  glVertexAttribIPointer(10, 1, GL_UNSIGNED_INT, 0, nullptr);
+}
+
+// The sub-objects are stored one after another, so drawing all of their
+// vertices at once draws one asteroid of each. Every instance of that is a
+// bucket of asteroids, and Asteroid.vs.glsl works out which asteroid each
+// vertex belongs to from the instance and the vertex's sub-object. A
+// second draw covers the partial bucket at the end.
+void AsteroidField::DrawMerged()
+{
+  const GLuint groups = object.get_sub_object_count();
+  const GLuint buckets = draw_count / groups;
+  const GLuint remainder = draw_count % groups;
+  GLuint first, count, last_first;
+
+  object.get_sub_object_info(0, first, count);
+  object.get_sub_object_info(groups - 1, last_first, count);
+
+  glUniform1ui(uniforms.bucket_size, groups);
+  glUniform1ui(uniforms.bucket_base, 0);
+  glDrawArraysInstanced(GL_TRIANGLES, first, last_first + count - first, buckets);
+
+  if (remainder != 0)
+  {
+    object.get_sub_object_info(remainder - 1, last_first, count);
+
+    glUniform1ui(uniforms.bucket_base, buckets * groups);
+    glDrawArraysInstanced(GL_TRIANGLES, first, last_first + count - first, 1);
+  }
+
+  glUniform1ui(uniforms.bucket_size, 0);
+}
+
+// World space frustum planes, normals pointing inwards. Clip space is
+// -w <= x, y, z <= w, so each plane is row 3 of the matrix plus or minus
+// one of the others.
+static void FrustumPlanes(const vmath::mat4& viewproj_matrix, vmath::vec4 planes[6])
+{
+  for (int i = 0; i < 3; ++i)
+  {
+    for (int j = 0; j < 2; ++j)
+    {
+      vmath::vec4 plane;
+
+      for (int k = 0; k < 4; ++k)
+      {
+        plane[k] = viewproj_matrix[k][3] + (j ? -viewproj_matrix[k][i] : viewproj_matrix[k][i]);
+      }
+
+      planes[i * 2 + j] = plane / vmath::length(vmath::vec3(plane[0], plane[1], plane[2]));
+    }
+  }
+}
+
+// The test in Cull.cs.glsl: whether a sub-object's bounding sphere,
+// moved by the model matrix m, is inside the frustum. Also returns the
+// moved center.
+static bool SphereVisible(const vmath::vec4 planes[6], const vmath::vec4& sphere,
+                          const vmath::mat4& m, vmath::vec4& center)
+{
+  center = m * vmath::vec4(sphere[0], sphere[1], sphere[2], 1.0f);
+
+  const float scale = vmath::max(vmath::length(vmath::vec3(m[0][0], m[0][1], m[0][2])),
+                                 vmath::max(vmath::length(vmath::vec3(m[1][0], m[1][1], m[1][2])),
+                                            vmath::length(vmath::vec3(m[2][0], m[2][1], m[2][2]))));
+  const float radius = sphere[3] * scale;
+
+  for (int i = 0; i < 6; ++i)
+  {
+    if (planes[i][0] * center[0] + planes[i][1] * center[1] +
+        planes[i][2] * center[2] + planes[i][3] < -radius)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Runs Cull.cs.glsl to fill culled_draw_buffer with the commands of the
+// visible asteroids and command_count_buffer with how many there are.
+void AsteroidField::CullAsteroids(float t, const vmath::mat4& viewproj_matrix)
+{
+  vmath::vec4 planes[6];
+
+  FrustumPlanes(viewproj_matrix, planes);
+
+  const GLuint zero = 0;
+
+  state.bind_buffer(GL_ATOMIC_COUNTER_BUFFER, command_count_buffer);
+  glClearBufferData(GL_ATOMIC_COUNTER_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+
+  // Without a draw count, the commands past the last one written must draw
+  // nothing
+  if (!has_indirect_count)
+  {
+    state.bind_buffer(GL_SHADER_STORAGE_BUFFER, culled_draw_buffer);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+  }
+
+  state.use_program(cull_program);
+  glUniform1f(cull_uniforms.time, t);
+  glUniform1ui(cull_uniforms.draw_count, draw_count);
+  glUniform1ui(cull_uniforms.sub_object_count, object.get_sub_object_count());
+  glUniform4fv(cull_uniforms.frustum_planes, 6, planes[0]);
+
+  state.bind_buffer_base(GL_SHADER_STORAGE_BUFFER, 0, sub_object_buffer);
+  state.bind_buffer_base(GL_SHADER_STORAGE_BUFFER, 1, culled_draw_buffer);
+  state.bind_buffer_base(GL_ATOMIC_COUNTER_BUFFER, 0, command_count_buffer);
+
+  glDispatchCompute((draw_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+  glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+// The CPU version of Cull.cs.glsl. Each thread of the pool tests its share
+// of the asteroids and records a draw for every visible one, keyed by
+// sub-object so that the replay draws each shape in one run.
+void AsteroidField::RecordSeparateDraws(float t, const vmath::mat4& viewproj_matrix)
+{
+  vmath::vec4 planes[6];
+
+  FrustumPlanes(viewproj_matrix, planes);
+
+  const GLuint groups = object.get_sub_object_count();
+
+  recorder.record(draw_count, [&](sb7::cmd_list& list, size_t first, size_t last)
+  {
+    for (size_t j = first; j < last; ++j)
+    {
+      const SubObjectBounds& bounds = sub_object_bounds[j % groups];
+      const vmath::mat4 m = AsteroidMatrix(GLuint(j), t);
+
+      vmath::vec4 center;
+      const bool visible = SphereVisible(planes, bounds.sphere, m, center);
+
+      if (visible)
+      {
+        list.begin(j % groups);
+        list.draw_arrays_instanced_base_instance(GL_TRIANGLES, bounds.first, bounds.count,
+                                                 1, GLuint(j));
+      }
+    }
+  });
+}
+
+// Culls on the thread pool like RecordSeparateDraws(), but fills one
+// render_queue item per asteroid. Hidden asteroids get no vertices, which
+// the queue drops. The key sorts by sub-object and then front to back.
+void AsteroidField::QueueAsteroids(float t, const vmath::mat4& view_matrix, const vmath::mat4& viewproj_matrix)
+{
+  vmath::vec4 planes[6];
+
+  FrustumPlanes(viewproj_matrix, planes);
+
+  const GLuint groups = object.get_sub_object_count();
+  const GLuint vao = object.get_vao();
+  double start = glfwGetTime();
+
+  queue.clear();
+  sb7::render_queue::item *items = queue.push(draw_count);
+
+  thread_pool.parallel_for(draw_count, [&](size_t first, size_t last)
   {
-    for (int j = 0; j < NUM_DRAWS; ++j)
+    for (size_t j = first; j < last; ++j)
     {
-      GLuint first, count;
-      object.get_sub_object_info(j % object.get_sub_object_count(), 
-                                 first, count);
-      glDrawArraysInstancedBaseInstance(GL_TRIANGLES, first, count, 1, j);
+      const GLuint s = GLuint(j % groups);
+      const SubObjectBounds& bounds = sub_object_bounds[s];
+      const vmath::mat4 m = AsteroidMatrix(GLuint(j), t);
+
+      vmath::vec4 center;
+      const bool visible = SphereVisible(planes, bounds.sphere, m, center);
+
+      sb7::render_queue::item& item = items[j];
+
+      item.key = sb7::render_queue::make_key(0, 0, s, sb7::render_queue::depth_key(-(view_matrix * center)[2]));
+      item.program = render_program;
+      item.vao = vao;
+      item.texture = 0;
+      item.mode = GL_TRIANGLES;
+      item.first = bounds.first;
+      item.count = visible ? bounds.count : 0;
+      item.instance = GLuint(j);
     }
+  });
+
+  queue_build_time += glfwGetTime() - start;
+  start = glfwGetTime();
+
+  queue.sort();
+
+  queue_sort_time += glfwGetTime() - start;
+  queue_frames++;
+}
+
+// Reading the counter waits for the culling pass, so this is only done
+// when the count is about to be printed.
+GLuint AsteroidField::ReadVisibleCount(MODE draw_mode)
+{
+  GLuint count = draw_count;
+
+  if (draw_mode == MODE_SEPARATE_DRAWS)
+  {
+    count = GLuint(recorder.draw_count());
+  }
+  else if (draw_mode == MODE_QUEUED)
+  {
+    count = GLuint(queue.last_flush_counters().items);
+  }
+  else if (draw_mode == MODE_GPU_CULLING)
+  {
+    state.bind_buffer(GL_ATOMIC_COUNTER_BUFFER, command_count_buffer);
+    glGetBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(GLuint), &count);
   }
+
+  return count;
+}
+
+// Number of draw calls made per frame, and the number of draw commands
+// they carry between them
+void AsteroidField::CountCommands(MODE draw_mode, int& calls, int& commands)
+{
+  const int groups = object.get_sub_object_count();
+
+  switch (draw_mode)
+  {
+    case MODE_MULTIDRAW:
+      calls = 1;
+      commands = draw_count;
+      break;
+    case MODE_SEPARATE_DRAWS:
+      calls = commands = int(recorder.draw_count());
+      break;
+    case MODE_GPU_CULLING:
+      calls = 1;
+      commands = has_indirect_count ? int(ReadVisibleCount(draw_mode)) : draw_count;
+      break;
+    case MODE_STREAMED:
+    case MODE_INSTANCED:
+      calls = commands = vmath::min(groups, draw_count);
+      break;
+    case MODE_MERGED:
+      calls = commands = draw_count % groups ? 2 : 1;
+      break;
+    case MODE_QUEUED:
+      calls = int(queue.last_flush_counters().calls);
+      commands = int(queue.last_flush_counters().commands);
+      break;
+  }
+}
+
+// Puts the average frame time, the number of asteroids drawn and the last
+// frame's state changes in the title about once a second.
+void AsteroidField::UpdateStats(double current_time)
+{
+  ++frame_count;
+
+  if (current_time - stats_start_time < 1.0)
+  {
+    return;
+  }
+
+  char buffer[256];
+  const double frame_time = (current_time - stats_start_time) / frame_count;
+
+  if (mode == MODE_STREAMED && stream_frames != 0)
+  {
+    const double write_time = stream_write_time / stream_frames;
+
+    sprintf(buffer, "AsteroidField: %s, %.3f ms/frame, %d asteroids, %.3f ms to write (%.2f GB/s), %d stalls",
+            mode_names[mode], 1000.0 * frame_time, draw_count, 1000.0 * write_time,
+            draw_count * sizeof(vmath::mat3x4) / write_time * 1.0e-9, stream.stall_count);
+  }
+  else
+  {
+    sprintf(buffer, "AsteroidField: %s, %.3f ms/frame, %u of %d asteroids drawn%s",
+            mode_names[mode], 1000.0 * frame_time,
+            ReadVisibleCount(mode), draw_count,
+            mode == MODE_GPU_CULLING && !has_indirect_count ? " (no indirect count)" : "");
+  }
+
+  sprintf(buffer + strlen(buffer), ", %u state changes, %u elided",
+          state.last_frame_counters().calls, state.last_frame_counters().elided);
+
+  setWindowTitle(buffer);
+
+  frame_count = 0;
+  stats_start_time = current_time;
+  ResetFrameStats();
+}
+
+// Times every mode at every count in asteroid_counts and prints the
+// throughput of each: draw commands and asteroids per second. Each time
+// includes the culling pass or the transform writes, and waits for the GPU.
+void AsteroidField::RunBenchmark()
+{
+  const int saved_count = draw_count;
+  char buffer[256];
+
+  fprintf(stderr, "%-10s %-16s %10s %8s %10s %10s %12s %12s %8s %8s\n", "asteroids", "mode", "ms/frame",
+          "calls", "commands", "drawn", "Mcommands/s", "Masteroids/s", "state", "elided");
+
+  for (int count : asteroid_counts)
+  {
+    SetAsteroidCount(count);
+
+    for (int m = MODE_FIRST; m <= MODE_MAX; ++m)
+    {
+      const double frame_time = TimeFrames(MODE(m));
+      const GLuint drawn = ReadVisibleCount(MODE(m));
+      const sb7::gl_state::counters& changes = state.last_frame_counters();
+      int calls, commands;
+
+      CountCommands(MODE(m), calls, commands);
+
+      sprintf(buffer, "%-10d %-16s %10.3f %8d %10d %10u %12.2f %12.2f %8u %8u", count, mode_names[m],
+              1000.0 * frame_time, calls, commands, drawn,
+              commands / frame_time * 1.0e-6, drawn / frame_time * 1.0e-6,
+              changes.calls, changes.elided);
+
+      if (m == MODE_STREAMED)
+      {
+        const double write_time = stream_write_time / stream_frames;
+
+        fprintf(stderr, "%s  (write %.3f ms, %.2f GB/s, %d stalls)\n", buffer, 1000.0 * write_time,
+                count * sizeof(vmath::mat3x4) / write_time * 1.0e-9, stream.stall_count);
+      }
+      else if (m == MODE_QUEUED)
+      {
+        fprintf(stderr, "%s  (cull %.3f ms, sort %.3f ms)\n", buffer,
+                1000.0 * queue_build_time / queue_frames, 1000.0 * queue_sort_time / queue_frames);
+      }
+      else
+      {
+        fprintf(stderr, "%s\n", buffer);
+      }
+    }
+  }
+
+  fprintf(stderr, "(%s, %u CPU threads, %d stream segments)\n",
+          has_indirect_count ? "glMultiDrawArraysIndirectCountARB" : "zeroed commands, no GL_ARB_indirect_parameters",
+          thread_pool.size(), int(InstanceStream::SEGMENT_COUNT));
+  setWindowTitle(buffer);
+
+  SetAsteroidCount(saved_count);
+}
+
+// Returns the average time of the frames drawn in one mode over about half
+// a second, after one frame to warm up. The streamed mode's stats start
+// from zero.
+double AsteroidField::TimeFrames(MODE draw_mode)
+{
+  static const int max_frames = 64;
+  static const float one = 1.0f;
+  static const float black[] = {0.0f, 0.0f, 0.0f, 1.0f};
+
+  int frames = 0;
+
+  DrawAsteroids(draw_mode, 0.0f);
+  state.end_frame();
+  glFinish();
+  ResetFrameStats();
+
+  const double start = glfwGetTime();
+
+  do
+  {
+    glViewport(0, 0, info.windowWidth, info.windowHeight);
+    glClearBufferfv(GL_COLOR, 0, black);
+    glClearBufferfv(GL_DEPTH, 0, &one);
+    DrawAsteroids(draw_mode, float(frames) * (1.0f / 60.0f));
+    state.end_frame();
+    frames++;
+  } while (glfwGetTime() - start < 0.5 && frames < max_frames);
+
+  glFinish();
+
+  return (glfwGetTime() - start) / frames;
+}
+
+// Allocates a ring of InstanceStream::SEGMENT_COUNT frames' worth of
+// transforms for count asteroids and points attributes 11 to 13 of the
+// object's VAO at it.
+void AsteroidField::CreateStream(int count)
+{
+  stream.Create(count * sizeof(vmath::mat3x4));
+
+  glBindVertexArray(object.get_vao());
+  glBindBuffer(GL_ARRAY_BUFFER, stream.Buffer());
+
+  for (int i = 0; i < 3; ++i)
+  {
+    glVertexAttribPointer(11 + i, 4, GL_FLOAT, GL_FALSE, sizeof(vmath::mat3x4),
+                          (const GLvoid *)(i * sizeof(vmath::vec4)));
+    glVertexAttribDivisor(11 + i, 1);
+    glEnableVertexAttribArray(11 + i);
+  }
+
+  ResetFrameStats();
+}
+
+void AsteroidField::ResetFrameStats()
+{
+  stream_frames = 0;
+  stream_write_time = 0.0;
+  queue_frames = 0;
+  queue_build_time = 0.0;
+  queue_sort_time = 0.0;
+  stream.stall_count = 0;
+  stream.stall_time = 0.0;
+}
+
+// Computes every asteroid's model matrix on the thread pool, writing them
+// straight into the mapped segment in group order.
+void AsteroidField::StreamTransforms(float t)
+{
+  vmath::mat3x4 *transforms = (vmath::mat3x4 *)stream.BeginSegment();
+  const GLuint groups = object.get_sub_object_count();
+  const double start = glfwGetTime();
+
+  thread_pool.parallel_for(draw_count, [&](size_t first, size_t last)
+  {
+    GLuint s = GLuint(std::upper_bound(group_first.begin(), group_first.end(),
+                                       GLuint(first)) - group_first.begin()) - 1;
+
+    for (size_t slot = first; slot < last; ++slot)
+    {
+      while (slot >= group_first[s + 1])
+      {
+        s++;
+      }
+
+      const GLuint draw_id = (GLuint(slot) - group_first[s]) * groups + s;
+
+      transforms[slot] = vmath::pack_affine(AsteroidMatrix(draw_id, t));
+    }
+  });
+
+  stream_write_time += glfwGetTime() - start;
+  stream_frames++;
+}
+
+// One instanced draw per sub-object. baseInstance selects the group within
+// the segment that was just written.
+void AsteroidField::DrawStreamed()
+{
+  const GLuint base = GLuint(stream.SegmentOffset() / sizeof(vmath::mat3x4));
+
+  for (GLuint s = 0; s + 1 < group_first.size(); ++s)
+  {
+    GLuint first, count;
+    object.get_sub_object_info(s, first, count);
+    glDrawArraysInstancedBaseInstance(GL_TRIANGLES, first, count,
+                                      group_first[s + 1] - group_first[s],
+                                      base + group_first[s]);
+  }
+
+  stream.EndSegment();
+}
+
+void AsteroidField::shutdown()
+{
+  stream.Destroy();
+  queue.destroy();
 }
 
 void AsteroidField::LoadShaders()
@@ -188,6 +1096,40 @@ void AsteroidField::LoadShaders()
   uniforms.proj_matrix = glGetUniformLocation(render_program, "proj_matrix");
   uniforms.viewproj_matrix = 
       glGetUniformLocation(render_program, "viewproj_matrix");
+  uniforms.bucket_size = glGetUniformLocation(render_program, "bucket_size");
+  uniforms.bucket_base = glGetUniformLocation(render_program, "bucket_base");
+
+  shaders[0] = sb7::shader::load("StreamAsteroid.vs.glsl", GL_VERTEX_SHADER);
+  shaders[1] = sb7::shader::load("Asteroid.fs.glsl", GL_FRAGMENT_SHADER);
+
+  if (stream_program)
+  {
+    glDeleteProgram(stream_program);
+  }
+
+  stream_program = sb7::program::link_from_shaders(shaders, 2, true);
+
+  stream_uniforms.view_matrix = glGetUniformLocation(stream_program, "view_matrix");
+  stream_uniforms.proj_matrix = glGetUniformLocation(stream_program, "proj_matrix");
+  stream_uniforms.viewproj_matrix = glGetUniformLocation(stream_program, "viewproj_matrix");
+  stream_uniforms.sub_object_count = glGetUniformLocation(stream_program, "sub_object_count");
+
+  GLuint cs = sb7::shader::load("Cull.cs.glsl", GL_COMPUTE_SHADER);
+
+  if (cull_program)
+  {
+    glDeleteProgram(cull_program);
+  }
+
+  cull_program = sb7::program::link_from_shaders(&cs, 1, true);
+
+  cull_uniforms.time = glGetUniformLocation(cull_program, "time");
+  cull_uniforms.draw_count = glGetUniformLocation(cull_program, "draw_count");
+  cull_uniforms.sub_object_count = glGetUniformLocation(cull_program, "sub_object_count");
+  cull_uniforms.frustum_planes = glGetUniformLocation(cull_program, "frustum_planes");
+
+  // A new program may reuse a deleted one's name
+  state.invalidate();
 }
 
 void AsteroidField::onKey(int key, int action)
@@ -213,6 +1155,18 @@ void AsteroidField::onKey(int key, int action)
     case 'R':
       LoadShaders();
       break;
+    case 'B':
+      RunBenchmark();
+      break;
+    case 'N':
+      {
+        const int count = sizeof(asteroid_counts) / sizeof(asteroid_counts[0]);
+        int n = 0;
+        while (n < count && asteroid_counts[n] <= draw_count)
+          n++;
+        SetAsteroidCount(asteroid_counts[n % count]);
+      }
+      break;
     }
   }
 }
@@ -0,0 +1,72 @@
+#include "ResolveReference.h"
+
+#include <string.h>
+#include <vector>
+
+static void UnpackUnorm4x8(GLuint packed, float c[4])
+{
+  for (int i = 0; i < 4; ++i)
+  {
+    c[i] = float((packed >> (i * 8)) & 0xFF) / 255.0f;
+  }
+}
+
+void ResolveReference(const GLuint *heads, int width, int height,
+                      const ListNode *nodes, int k,
+                      const float background[4], float *result)
+{
+  std::vector<GLuint> frag_color(k);
+  std::vector<float> frag_depth(k);
+
+  for (int p = 0; p < width * height; ++p)
+  {
+    int frag_count = 0;
+    GLuint index = heads[p];
+
+    while (index != 0xFFFFFFFF)
+    {
+      const ListNode& node = nodes[index];
+      float depth;
+
+      memcpy(&depth, &node.depth, sizeof(depth));
+
+      if (frag_count < k || depth < frag_depth[k - 1])
+      {
+        int j = frag_count < k ? frag_count++ : k - 1;
+
+        while (j > 0 && frag_depth[j - 1] > depth)
+        {
+          frag_depth[j] = frag_depth[j - 1];
+          frag_color[j] = frag_color[j - 1];
+          j--;
+        }
+
+        frag_depth[j] = depth;
+        frag_color[j] = node.color;
+      }
+
+      index = node.next;
+    }
+
+    float C[3] = { 0.0f, 0.0f, 0.0f };
+    float A = 0.0f;
+
+    for (int i = 0; i < frag_count && A < 0.99f; ++i)
+    {
+      float c[4];
+      UnpackUnorm4x8(frag_color[i], c);
+
+      for (int j = 0; j < 3; ++j)
+      {
+        C[j] += (1.0f - A) * c[3] * c[j];
+      }
+      A += (1.0f - A) * c[3];
+    }
+
+    for (int j = 0; j < 3; ++j)
+    {
+      result[p * 4 + j] = C[j] + (1.0f - A) * background[j];
+    }
+    result[p * 4 + 3] = 1.0f;
+  }
+}
@@ -0,0 +1,23 @@
+#ifndef __RESOLVEREFERENCE_H__
+#define __RESOLVEREFERENCE_H__
+
+#include <GL/gl3w.h>
+
+// A node of the fragment lists as append.fs.glsl writes it
+struct ListNode
+{
+  GLuint color;   // RGBA8, as packUnorm4x8
+  GLuint depth;   // Bits of a float
+  GLuint next;
+  GLuint facing;
+};
+
+// CPU version of resolve.fs.glsl for a whole image. heads holds width x
+// height head pointers, row by row from the bottom like the image they
+// were read from; result gets an RGBA float color per pixel in the same
+// order.
+void ResolveReference(const GLuint *heads, int width, int height,
+                      const ListNode *nodes, int k,
+                      const float background[4], float *result);
+
+#endif /* __RESOLVEREFERENCE_H__ */
@@ -0,0 +1,557 @@
+#include "SoftwareRasterizer.h"
+
+#include <sb6mfile.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SOFTWARE_RASTERIZER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Reads the first sub-object with the chunk layout sb7::object::load()
+// reads
+bool SoftwareMesh::Load(const char *filename)
+{
+  FILE *infile = fopen(filename, "rb");
+
+  positions.clear();
+
+  if (!infile)
+    return false;
+
+  fseek(infile, 0, SEEK_END);
+  const size_t filesize = ftell(infile);
+  fseek(infile, 0, SEEK_SET);
+
+  std::vector<unsigned char> data(filesize);
+  const size_t bytes_read = fread(data.data(), 1, filesize, infile);
+  fclose(infile);
+
+  if (bytes_read != filesize || filesize < sizeof(SB6M_HEADER))
+    return false;
+
+  const SB6M_HEADER *header = (const SB6M_HEADER *)data.data();
+
+  if (header->magic != SB6M_MAGIC)
+    return false;
+
+  const SB6M_VERTEX_ATTRIB_CHUNK *vertex_attrib_chunk = nullptr;
+  const SB6M_CHUNK_VERTEX_DATA *vertex_data_chunk = nullptr;
+  const SB6M_CHUNK_INDEX_DATA *index_data_chunk = nullptr;
+  const SB6M_CHUNK_SUB_OBJECT_LIST *sub_object_chunk = nullptr;
+  const unsigned char *ptr = data.data() + header->size;
+
+  for (unsigned int i = 0; i < header->num_chunks; ++i)
+  {
+    const SB6M_CHUNK_HEADER *chunk = (const SB6M_CHUNK_HEADER *)ptr;
+
+    switch (chunk->chunk_type)
+    {
+      case SB6M_CHUNK_TYPE_VERTEX_ATTRIBS:
+        vertex_attrib_chunk = (const SB6M_VERTEX_ATTRIB_CHUNK *)chunk;
+        break;
+      case SB6M_CHUNK_TYPE_VERTEX_DATA:
+        vertex_data_chunk = (const SB6M_CHUNK_VERTEX_DATA *)chunk;
+        break;
+      case SB6M_CHUNK_TYPE_INDEX_DATA:
+        index_data_chunk = (const SB6M_CHUNK_INDEX_DATA *)chunk;
+        break;
+      case SB6M_CHUNK_TYPE_SUB_OBJECT_LIST:
+        sub_object_chunk = (const SB6M_CHUNK_SUB_OBJECT_LIST *)chunk;
+        break;
+      default:
+        break;
+    }
+
+    ptr += chunk->size;
+  }
+
+  if (!vertex_attrib_chunk || !vertex_data_chunk ||
+      vertex_attrib_chunk->attrib_count == 0)
+    return false;
+
+  // Attribute 0 is the position
+  const SB6M_VERTEX_ATTRIB_DECL& position = vertex_attrib_chunk->attrib_data[0];
+
+  if (position.type != GL_FLOAT || position.size < 3)
+    return false;
+
+  const unsigned int stride = position.stride ? position.stride : position.size * sizeof(float);
+  const unsigned char *vertex_data = data.data() + vertex_data_chunk->data_offset + position.data_offset;
+  const unsigned int vertex_count = vertex_data_chunk->total_vertices;
+
+  // What render_sub_object(0) draws: indices from the start of the index
+  // data, or a range of vertices
+  unsigned int first = 0;
+  unsigned int count = index_data_chunk ? index_data_chunk->index_count : vertex_count;
+
+  if (sub_object_chunk && sub_object_chunk->count != 0)
+  {
+    first = sub_object_chunk->sub_object[0].first;
+    count = sub_object_chunk->sub_object[0].count;
+  }
+
+  positions.reserve(count - count % 3);
+
+  for (unsigned int i = 0; i + 2 < count; i += 3)
+  {
+    for (unsigned int j = 0; j < 3; ++j)
+    {
+      unsigned int v = first + i + j;
+
+      if (index_data_chunk)
+      {
+        const unsigned char *index_data = data.data() + index_data_chunk->index_data_offset;
+
+        v = index_data_chunk->index_type == GL_UNSIGNED_SHORT ?
+            ((const unsigned short *)index_data)[i + j] :
+            ((const unsigned int *)index_data)[i + j];
+      }
+
+      if (v >= vertex_count)
+      {
+        positions.clear();
+        return false;
+      }
+
+      const float *p = (const float *)(vertex_data + v * stride);
+      positions.push_back(vmath::vec4(p[0], p[1], p[2], 1.0f));
+    }
+  }
+
+  return true;
+}
+
+SoftwareRasterizer::SoftwareRasterizer(sb7::thread_pool& pool)
+  : m_pool(pool),
+    m_width(0),
+    m_height(0),
+    m_allocated(0),
+    m_arenas(pool.size())
+{
+}
+
+GLuint SoftwareRasterizer::Build(const SoftwareMesh& mesh, const vmath::mat4& mvp, int width, int height)
+{
+  const size_t pixels = size_t(width) * height;
+  const size_t parts = m_arenas.size();
+  const size_t triangles = mesh.positions.size() / 3;
+
+  if (m_width != width || m_height != height)
+  {
+    m_width = width;
+    m_height = height;
+    m_atomic_heads = std::vector<std::atomic<GLuint> >(pixels);
+    m_heads.resize(pixels);
+  }
+
+  if (m_nodes.empty())
+  {
+    m_nodes.resize(pixels);
+  }
+
+  for (;;)
+  {
+    m_allocated = 0;
+
+    m_pool.parallel_for(pixels, [&](size_t first, size_t last)
+    {
+      for (size_t p = first; p < last; ++p)
+      {
+        m_atomic_heads[p].store(0xFFFFFFFF, std::memory_order_relaxed);
+      }
+    });
+
+    // One part per thread, as in sb7::cmd_recorder, so each arena is only
+    // touched by one thread
+    m_pool.parallel_for(parts, [&](size_t first_part, size_t last_part)
+    {
+      for (size_t part = first_part; part < last_part; ++part)
+      {
+        Arena& arena = m_arenas[part];
+
+        arena.next = arena.end = 0;
+        arena.fragments = 0;
+        arena.full = false;
+
+        RasterizeRange(mesh, mvp, triangles * part / parts, triangles * (part + 1) / parts, arena);
+      }
+    });
+
+    GLuint64 fragments = 0;
+    bool full = false;
+
+    for (const Arena& arena : m_arenas)
+    {
+      fragments += arena.fragments;
+      full = full || arena.full;
+    }
+
+    if (!full)
+    {
+      m_pool.parallel_for(pixels, [&](size_t first, size_t last)
+      {
+        for (size_t p = first; p < last; ++p)
+        {
+          m_heads[p] = m_atomic_heads[p].load(std::memory_order_relaxed);
+        }
+      });
+
+      return GLuint(fragments);
+    }
+
+    // Every arena may end with a partly used chunk
+    m_nodes.resize(size_t(fragments + fragments / 4 + parts * ARENA_NODES));
+  }
+}
+
+void SoftwareRasterizer::Resolve(int k, const float background[4], float *result) const
+{
+  m_pool.parallel_for(m_height, [&](size_t first, size_t last)
+  {
+    ResolveReference(&m_heads[first * m_width], m_width, int(last - first),
+                     m_nodes.data(), k, background, result + first * m_width * 4);
+  });
+}
+
+// The color append.vs.glsl gives a vertex
+static vmath::vec4 VertexColor(const vmath::vec4& position)
+{
+  const float length = sqrtf(position[0] * position[0] +
+                             position[1] * position[1] +
+                             position[2] * position[2]);
+  const float scale = length > 0.0f ? 0.7f / length : 0.0f;
+
+  return vmath::vec4(fabsf(position[0]) * scale + 0.3f,
+                     fabsf(position[1]) * scale + 0.3f,
+                     fabsf(position[2]) * scale + 0.3f,
+                     0.3f);
+}
+
+void SoftwareRasterizer::RasterizeRange(const SoftwareMesh& mesh, const vmath::mat4& mvp,
+                                        size_t first, size_t last, Arena& arena)
+{
+  for (size_t t = first; t < last; ++t)
+  {
+    ClipVertex v[3];
+    unsigned int outside_all = 0x3F;
+
+    for (int i = 0; i < 3; ++i)
+    {
+      const vmath::vec4& p = mesh.positions[t * 3 + i];
+
+      v[i].position = mvp * p;
+      v[i].color = VertexColor(p);
+
+      // One bit per side of the view volume the vertex is outside
+      const vmath::vec4& c = v[i].position;
+      const unsigned int outside = (c[0] < -c[3] ? 0x01 : 0) | (c[0] > c[3] ? 0x02 : 0) |
+                                   (c[1] < -c[3] ? 0x04 : 0) | (c[1] > c[3] ? 0x08 : 0) |
+                                   (c[2] < -c[3] ? 0x10 : 0) | (c[2] > c[3] ? 0x20 : 0);
+      outside_all &= outside;
+    }
+
+    if (outside_all)
+    {
+      continue;
+    }
+
+    // Clip against the near plane, z >= -w. The other sides are left to
+    // the bounding box and the depth test in RasterizeTriangle().
+    ClipVertex polygon[4];
+    int count = 0;
+
+    for (int i = 0; i < 3; ++i)
+    {
+      const ClipVertex& a = v[i];
+      const ClipVertex& b = v[(i + 1) % 3];
+      const float da = a.position[2] + a.position[3];
+      const float db = b.position[2] + b.position[3];
+
+      if (da >= 0.0f)
+      {
+        polygon[count++] = a;
+      }
+
+      if ((da >= 0.0f) != (db >= 0.0f))
+      {
+        const float s = da / (da - db);
+
+        polygon[count].position = a.position + (b.position - a.position) * s;
+        polygon[count].color = a.color + (b.color - a.color) * s;
+        count++;
+      }
+    }
+
+    for (int i = 1; i + 1 < count; ++i)
+    {
+      RasterizeTriangle(polygon[0], polygon[i], polygon[i + 1], arena);
+    }
+  }
+}
+
+void SoftwareRasterizer::RasterizeTriangle(const ClipVertex& a, const ClipVertex& b, const ClipVertex& c,
+                                           Arena& arena)
+{
+  const ClipVertex *v[3] = { &a, &b, &c };
+  float x[3], y[3], z[3], inv_w[3];
+
+  for (int i = 0; i < 3; ++i)
+  {
+    const vmath::vec4& p = v[i]->position;
+
+    inv_w[i] = 1.0f / p[3];
+    x[i] = floorf(((p[0] * inv_w[i]) * 0.5f + 0.5f) * m_width * 256.0f + 0.5f) / 256.0f;
+    y[i] = floorf(((p[1] * inv_w[i]) * 0.5f + 0.5f) * m_height * 256.0f + 0.5f) / 256.0f;
+    z[i] = (p[2] * inv_w[i]) * 0.5f + 0.5f;
+  }
+
+  float area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+
+  if (area == 0.0f)
+  {
+    return;
+  }
+
+  // Counter-clockwise is front facing. Back faces are turned around so
+  // that inside is always where every edge function is positive.
+  const GLuint facing = area > 0.0f ? 1u : 0u;
+
+  if (area < 0.0f)
+  {
+    std::swap(v[1], v[2]);
+    std::swap(x[1], x[2]);
+    std::swap(y[1], y[2]);
+    std::swap(z[1], z[2]);
+    std::swap(inv_w[1], inv_w[2]);
+    area = -area;
+  }
+
+  // Pixels whose centers the bounding box covers
+  const int min_x = std::max(0, int(ceilf(std::min(x[0], std::min(x[1], x[2])) - 0.5f)));
+  const int max_x = std::min(m_width - 1, int(floorf(std::max(x[0], std::max(x[1], x[2])) - 0.5f)));
+  const int min_y = std::max(0, int(ceilf(std::min(y[0], std::min(y[1], y[2])) - 0.5f)));
+  const int max_y = std::min(m_height - 1, int(floorf(std::max(y[0], std::max(y[1], y[2])) - 0.5f)));
+
+  if (min_x > max_x || min_y > max_y)
+  {
+    return;
+  }
+
+  // Edge i runs between the other two vertices, so its function is the
+  // barycentric weight of vertex i times area:
+  //   e(px, py) = ex[i] * (px - ox[i]) + ey[i] * (py - oy[i])
+  // An edge owns the pixels right on it if it is a left or top edge.
+  float ex[3], ey[3], ox[3], oy[3];
+  bool owns[3];
+
+  for (int i = 0; i < 3; ++i)
+  {
+    const int from = (i + 1) % 3;
+    const int to = (i + 2) % 3;
+    const float dx = x[to] - x[from];
+    const float dy = y[to] - y[from];
+
+    ex[i] = -dy;
+    ey[i] = dx;
+    ox[i] = x[from];
+    oy[i] = y[from];
+    owns[i] = dy < 0.0f || (dy == 0.0f && dx < 0.0f);
+  }
+
+  const float inv_area = 1.0f / area;
+  float color[3][4];
+
+  for (int i = 0; i < 3; ++i)
+  {
+    for (int j = 0; j < 4; ++j)
+    {
+      color[i][j] = v[i]->color[j];
+    }
+  }
+
+  for (int tile_y = min_y; tile_y <= max_y; tile_y += TILE_SIZE)
+  {
+    const int tile_max_y = std::min(tile_y + TILE_SIZE - 1, max_y);
+
+    for (int tile_x = min_x; tile_x <= max_x; tile_x += TILE_SIZE)
+    {
+      const int tile_max_x = std::min(tile_x + TILE_SIZE - 1, max_x);
+
+      // An edge function is largest at one corner of the tile. If that is
+      // outside, so is the whole tile.
+      bool outside = false;
+
+      for (int i = 0; i < 3 && !outside; ++i)
+      {
+        const float cx = (ex[i] >= 0.0f ? tile_max_x : tile_x) + 0.5f;
+        const float cy = (ey[i] >= 0.0f ? tile_max_y : tile_y) + 0.5f;
+
+        outside = ex[i] * (cx - ox[i]) + ey[i] * (cy - oy[i]) < 0.0f;
+      }
+
+      if (outside)
+      {
+        continue;
+      }
+
+      for (int py = tile_y; py <= tile_max_y; ++py)
+      {
+        for (int px = tile_x; px <= tile_max_x; px += 4)
+        {
+          const int lanes = std::min(4, tile_max_x - px + 1);
+          int mask;
+          float lane_z[4];
+          GLuint lane_color[4];
+
+#ifdef SOFTWARE_RASTERIZER_SSE2
+          const __m128 zero = _mm_setzero_ps();
+          const __m128 fx = _mm_add_ps(_mm_set1_ps(float(px)), _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f));
+          const __m128 fy = _mm_set1_ps(py + 0.5f);
+          __m128 inside = _mm_castsi128_ps(_mm_cmplt_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(lanes)));
+          __m128 l[3];
+
+          for (int i = 0; i < 3; ++i)
+          {
+            const __m128 e = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ex[i]), _mm_sub_ps(fx, _mm_set1_ps(ox[i]))),
+                                        _mm_mul_ps(_mm_set1_ps(ey[i]), _mm_sub_ps(fy, _mm_set1_ps(oy[i]))));
+
+            inside = _mm_and_ps(inside, owns[i] ? _mm_cmpge_ps(e, zero) : _mm_cmpgt_ps(e, zero));
+            l[i] = _mm_mul_ps(e, _mm_set1_ps(inv_area));
+          }
+
+          if (_mm_movemask_ps(inside) == 0)
+          {
+            continue;
+          }
+
+          // Depth is linear in the window, the color in the clip space
+          const __m128 depth = _mm_add_ps(_mm_add_ps(_mm_mul_ps(l[0], _mm_set1_ps(z[0])),
+                                                     _mm_mul_ps(l[1], _mm_set1_ps(z[1]))),
+                                          _mm_mul_ps(l[2], _mm_set1_ps(z[2])));
+
+          inside = _mm_and_ps(inside, _mm_and_ps(_mm_cmpge_ps(depth, zero),
+                                                 _mm_cmple_ps(depth, _mm_set1_ps(1.0f))));
+          mask = _mm_movemask_ps(inside);
+
+          if (mask == 0)
+          {
+            continue;
+          }
+
+          __m128 q[3];
+
+          for (int i = 0; i < 3; ++i)
+          {
+            q[i] = _mm_mul_ps(l[i], _mm_set1_ps(inv_w[i]));
+          }
+
+          const __m128 inv_q = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(_mm_add_ps(q[0], q[1]), q[2]));
+          __m128i packed = _mm_setzero_si128();
+
+          for (int j = 0; j < 4; ++j)
+          {
+            __m128 channel = _mm_add_ps(_mm_add_ps(_mm_mul_ps(q[0], _mm_set1_ps(color[0][j])),
+                                                   _mm_mul_ps(q[1], _mm_set1_ps(color[1][j]))),
+                                        _mm_mul_ps(q[2], _mm_set1_ps(color[2][j])));
+
+            // packUnorm4x8
+            channel = _mm_min_ps(_mm_max_ps(_mm_mul_ps(channel, inv_q), zero), _mm_set1_ps(1.0f));
+            packed = _mm_or_si128(packed, _mm_slli_epi32(_mm_cvtps_epi32(_mm_mul_ps(channel, _mm_set1_ps(255.0f))),
+                                                         j * 8));
+          }
+
+          _mm_storeu_ps(lane_z, depth);
+          _mm_storeu_si128((__m128i *)lane_color, packed);
+#else
+          mask = 0;
+
+          for (int lane = 0; lane < lanes; ++lane)
+          {
+            const float fx = px + lane + 0.5f;
+            const float fy = py + 0.5f;
+            float l[3], q[3];
+            bool inside = true;
+
+            for (int i = 0; i < 3; ++i)
+            {
+              const float e = ex[i] * (fx - ox[i]) + ey[i] * (fy - oy[i]);
+
+              inside = inside && (owns[i] ? e >= 0.0f : e > 0.0f);
+              l[i] = e * inv_area;
+              q[i] = l[i] * inv_w[i];
+            }
+
+            lane_z[lane] = l[0] * z[0] + l[1] * z[1] + l[2] * z[2];
+
+            if (!inside || !(lane_z[lane] >= 0.0f && lane_z[lane] <= 1.0f))
+            {
+              continue;
+            }
+
+            const float inv_q = 1.0f / (q[0] + q[1] + q[2]);
+
+            lane_color[lane] = 0;
+
+            for (int j = 0; j < 4; ++j)
+            {
+              const float channel = (q[0] * color[0][j] + q[1] * color[1][j] + q[2] * color[2][j]) * inv_q;
+
+              // Rounds half to even, as _mm_cvtps_epi32 does
+              lane_color[lane] |= GLuint(nearbyintf(std::min(std::max(channel, 0.0f), 1.0f) * 255.0f)) << (j * 8);
+            }
+
+            mask |= 1 << lane;
+          }
+#endif
+
+          for (int lane = 0; lane < 4; ++lane)
+          {
+            if (mask & (1 << lane))
+            {
+              Store(px + lane, py, lane_color[lane], lane_z[lane], facing, arena);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// What append.fs.glsl does for one fragment
+void SoftwareRasterizer::Store(int x, int y, GLuint color, float depth, GLuint facing, Arena& arena)
+{
+  arena.fragments++;
+
+  if (arena.next == arena.end)
+  {
+    if (arena.full)
+    {
+      return;
+    }
+
+    const GLuint first = m_allocated.fetch_add(ARENA_NODES, std::memory_order_relaxed);
+
+    if (size_t(first) + ARENA_NODES > m_nodes.size())
+    {
+      arena.full = true;
+      return;
+    }
+
+    arena.next = first;
+    arena.end = first + ARENA_NODES;
+  }
+
+  const GLuint index = arena.next++;
+  ListNode& node = m_nodes[index];
+
+  node.color = color;
+  memcpy(&node.depth, &depth, sizeof(node.depth));
+  node.next = m_atomic_heads[size_t(y) * m_width + x].exchange(index, std::memory_order_relaxed);
+  node.facing = facing;
+}
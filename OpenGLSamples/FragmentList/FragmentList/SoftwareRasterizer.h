@@ -0,0 +1,94 @@
+#ifndef __SOFTWARERASTERIZER_H__
+#define __SOFTWARERASTERIZER_H__
+
+#include <vmath.h>
+#include <sb7threadpool.h>
+
+#include <atomic>
+#include <vector>
+
+#include "ResolveReference.h"
+
+// The triangles of an .sbm file's first sub-object. sb7::object uploads
+// its vertices and keeps no copy, so the file is read again here.
+struct SoftwareMesh
+{
+  // Three per triangle, with w set to 1
+  std::vector<vmath::vec4> positions;
+
+  bool Load(const char *filename);
+};
+
+// Builds the lists that append.vs.glsl and append.fs.glsl build, on the
+// CPU. The triangles are split between the threads of the pool. Each
+// thread walks a triangle's bounding box in 8x8 pixel tiles, skips the
+// tiles that an edge rules out, and tests the rest four pixels at a time
+// against the edge functions with SSE.
+//
+// Nodes come out of one shared array. Each thread takes ARENA_NODES at a
+// time for itself, so the only atomic per fragment is the exchange of the
+// pixel's head pointer, as on the GPU.
+//
+// Vertices are snapped to 1/256 of a pixel, pixel centers are at the half
+// and ties go to top and left edges. That is what GPUs commonly do, so
+// the lists should only differ for fragments right on an edge. The nodes
+// come out in a different order, which the sort in the resolve hides.
+class SoftwareRasterizer
+{
+public:
+  explicit SoftwareRasterizer(sb7::thread_pool& pool);
+
+  // Rasterizes mesh through mvp into width x height lists. If the node
+  // storage fills up, it is grown and the lists built again. Returns the
+  // number of fragments.
+  GLuint Build(const SoftwareMesh& mesh, const vmath::mat4& mvp, int width, int height);
+
+  // ResolveReference() over the lists from the last Build(), split
+  // between the threads by rows
+  void Resolve(int k, const float background[4], float *result) const;
+
+  // Row by row from the bottom, as ResolveReference() takes them
+  const GLuint *Heads() const           { return m_heads.data(); }
+  const ListNode *Nodes() const         { return m_nodes.data(); }
+
+private:
+  enum
+  {
+    TILE_SIZE = 8,
+    ARENA_NODES = 4096
+  };
+
+  struct alignas(64) Arena
+  {
+    GLuint next;
+    GLuint end;
+    GLuint fragments;
+    bool full;
+  };
+
+  struct ClipVertex
+  {
+    vmath::vec4 position;
+    vmath::vec4 color;
+  };
+
+  void RasterizeRange(const SoftwareMesh& mesh, const vmath::mat4& mvp,
+                      size_t first, size_t last, Arena& arena);
+  void RasterizeTriangle(const ClipVertex& a, const ClipVertex& b, const ClipVertex& c,
+                         Arena& arena);
+  void Store(int x, int y, GLuint color, float depth, GLuint facing, Arena& arena);
+
+  sb7::thread_pool& m_pool;
+  int m_width;
+  int m_height;
+
+  // Built with atomics, then copied to m_heads for the resolve
+  std::vector<std::atomic<GLuint> > m_atomic_heads;
+  std::vector<GLuint> m_heads;
+
+  std::vector<ListNode> m_nodes;
+  std::atomic<GLuint> m_allocated;
+  std::vector<Arena> m_arenas;
+};
+
+#endif /* __SOFTWARERASTERIZER_H__ */
@@ -1,20 +1,38 @@
 #version 450
 
-layout (binding = 0, offset = 0) uniform atomic_uint fill_counter;
+// The application defines TILED for MODE_TILED, along with TILE_SIZE
 
-layout (binding = 0, r32ui) coherent uniform uimage2D head_pointer;
+#ifdef TILED
 
-struct list_item
+// x counts the fragments the tile drew this frame. Its nodes are y to
+// y + z; tiles.cs.glsl sets those from what it drew last frame, and zeroes
+// x. Each tile's nodes stay together, so the resolve reads them from
+// nearby memory. header is only written by tiles.cs.glsl.
+layout (binding = 1, std430) buffer tile_block
 {
-	vec4 color;
-	float depth;
-	int facing;
-	uint next;
+	uvec4 header;
+	uvec4 tiles[];
 };
 
+uniform uint tiles_x;
+
+#else
+
+layout (binding = 0, offset = 0) uniform atomic_uint fill_counter;
+
+// Number of nodes item[] has room for. The counter keeps counting past
+// it, so the application can read back how many it would have needed.
+uniform uint max_nodes;
+
+#endif
+
+layout (binding = 0, r32ui) coherent uniform uimage2D head_pointer;
+
+// One 16 byte node per fragment: x is the color packed as RGBA8, y the
+// depth's bits, z the next node and w the facing
 layout (binding = 0, std430) buffer list_item_block
 {
-	list_item item[];
+	uvec4 item[];
 };
 
 in VS_OUT
@@ -27,11 +45,29 @@ void main(void)
 {
 	ivec2 P = ivec2(gl_FragCoord.xy);
 
+#ifdef TILED
+	uint tile = uint(P.y / TILE_SIZE) * tiles_x + uint(P.x / TILE_SIZE);
+	uint slot = atomicAdd(tiles[tile].x, 1u);
+
+	if (slot >= tiles[tile].z)
+	{
+		return;
+	}
+
+	uint index = tiles[tile].y + slot;
+#else
 	uint index = atomicCounterIncrement(fill_counter);
+
+	if (index >= max_nodes)
+	{
+		return;
+	}
+#endif
+
 	uint old_head = imageAtomicExchange(head_pointer, P, index);
 
-	item[index].color = fs_in.color;
-	item[index].depth = gl_FragCoord.z;
-	item[index].facing = gl_FrontFacing ? 1 : 0;
-	item[index].next = old_head;
-}
\ No newline at end of file
+	item[index] = uvec4(packUnorm4x8(fs_in.color),
+						floatBitsToUint(gl_FragCoord.z),
+						old_head,
+						gl_FrontFacing ? 1u : 0u);
+}
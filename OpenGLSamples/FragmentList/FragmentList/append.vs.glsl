@@ -15,6 +15,9 @@ void main(void)
 	vec4 p = mvp * position;
 
 	gl_Position = p;
-	vs_out.color = vec4(1.0);
+
+	// Translucent, and tinted by position so that the layers can be told
+	// apart
+	vs_out.color = vec4(abs(normalize(position.xyz)) * 0.7 + 0.3, 0.3);
 	vs_out.pos = p / p.w;
-}
\ No newline at end of file
+}
@@ -0,0 +1,27 @@
+#version 450 core
+
+// Weighted-blended OIT, the fallback for when the fragment lists would not
+// fit in memory. Target 0 sums weighted premultiplied color and alpha with
+// additive blending; target 1 multiplies the fragments' (1 - alpha)
+// together. Nothing is stored per fragment, so nothing can overflow, but
+// the weights only approximate the order.
+
+layout (location = 0) out vec4 accumulation;
+layout (location = 1) out float revealage;
+
+in VS_OUT
+{
+	vec4 pos;
+	vec4 color;
+} fs_in;
+
+void main(void)
+{
+	vec4 c = fs_in.color;
+
+	// Nearer fragments weigh more
+	float weight = clamp(pow(1.0 - gl_FragCoord.z, 3.0) * 3000.0, 0.01, 3000.0);
+
+	accumulation = vec4(c.rgb * c.a, c.a) * weight;
+	revealage = c.a;
+}
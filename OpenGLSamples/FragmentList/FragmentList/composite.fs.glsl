@@ -0,0 +1,22 @@
+#version 450 core
+
+// Resolves what blend.fs.glsl accumulated over the same background as
+// resolve.fs.glsl
+
+layout (binding = 0) uniform sampler2D accumulation;
+layout (binding = 1) uniform sampler2D revealage;
+
+layout (location = 0) out vec4 color;
+
+uniform vec4 background = vec4(0.1, 0.1, 0.1, 1.0);
+
+void main(void)
+{
+	ivec2 P = ivec2(gl_FragCoord.xy);
+	vec4 accum = texelFetch(accumulation, P, 0);
+	float reveal = texelFetch(revealage, P, 0).r;
+
+	vec3 average = accum.rgb / max(accum.a, 1.0e-5);
+
+	color = vec4(average * (1.0 - reveal) + background.rgb * reveal, 1.0);
+}
@@ -5,7 +5,74 @@
 #include <sb7ktx.h>
 #include <shader.h>
 
+#include <math.h>
+#include <algorithm>
+#include <chrono>
 #include <string>
+#include <vector>
+
+#include "ResolveReference.h"
+#include "SoftwareRasterizer.h"
+
+enum
+{
+  // Nodes per pixel to start with. The buffer grows from there.
+  INITIAL_NODES_PER_PIXEL = 1,
+
+  // Must match list_item_block in append.fs.glsl
+  NODE_SIZE = 16,
+
+  // Largest fragment buffer to allocate before giving up on lists
+  MAX_FRAGMENT_BUFFER_SIZE = 256 * 1024 * 1024,
+
+  // The fragment count is read back this many frames late
+  READBACK_FRAMES = 3,
+
+  K_COUNT = 4,
+
+  // Pixels along a side of a tile in MODE_TILED, and the nodes a tile is
+  // given beyond what it drew last frame. Passed to the shaders.
+  TILE_SIZE = 16,
+  MIN_TILE_NODES = 64,
+
+  // Bytes before the tiles in tile_buffer
+  TILE_HEADER_SIZE = 16,
+
+  // Timestamps taken around the reset, build and resolve passes
+  PASS_COUNT = 3,
+  TIMESTAMP_COUNT = PASS_COUNT + 1,
+
+  // Frames averaged for the pass times in the title
+  TIMED_FRAMES = 64
+};
+
+// How the head pointers are reset and the nodes laid out
+enum list_mode
+{
+  // A full-screen pass writes the heads, fenced with every barrier bit
+  MODE_CLEAR_PASS,
+  // glClearTexImage resets the heads, and only the append's writes are
+  // fenced
+  MODE_CLEAR_TEXTURE,
+  // As MODE_CLEAR_TEXTURE, with each tile's nodes kept together
+  MODE_TILED,
+  MODE_COUNT
+};
+
+static const char *mode_names[MODE_COUNT] = { "clear pass", "clear texture", "tiled" };
+static const char *pass_names[PASS_COUNT] = { "reset", "build", "resolve" };
+
+// Nodes tiles.cs.glsl sets aside for a tile that drew count fragments
+static GLuint64 tile_reserve(GLuint count)
+{
+  return GLuint64(count) + count / 4 + MIN_TILE_NODES;
+}
+
+// Fragments per pixel that the resolve can keep, one program each
+static const int k_values[K_COUNT] = { 4, 8, 16, 32 };
+
+// Must match background in resolve.fs.glsl
+static const float background[] = { 0.1f, 0.1f, 0.1f, 1.0f };
 
 class FragmentList : public sb7::application
 {
@@ -13,18 +80,63 @@ public:
   FragmentList():
       clear_program(0),
       append_program(0),
-      resolve_program(0) {}
+      tiled_append_program(0),
+      tile_program(0),
+      blend_program(0),
+      composite_program(0),
+      software(pool),
+      fragment_buffer(0),
+      head_pointer_image(0),
+      blend_texture(0),
+      node_capacity(0),
+      max_node_capacity(0),
+      readback_frame(0),
+      fragment_count(0),
+      timed_frames(0),
+      k_index(1),
+      mode(MODE_CLEAR_TEXTURE),
+      blended(false)
+  {
+    for (int i = 0; i < K_COUNT; ++i)
+    {
+      resolve_programs[i] = 0;
+    }
+
+    for (int i = 0; i < PASS_COUNT; ++i)
+    {
+      pass_time[i] = 0.0;
+    }
+  }
 
   virtual void startup() override;
   virtual void render(double current_time) override;
+  virtual void shutdown() override;
   virtual void onKey(int key, int action) override;
+  virtual void onResize(int w, int h) override;
 
   void load_shaders();
 
 protected:
+  void create_targets();
+  void resize_fragment_buffer(GLuint nodes);
+  void read_fragment_count();
+  void read_pass_times();
+  vmath::mat4 frame_mvp(float t) const;
+  void draw_lists(const vmath::mat4& mvp, const GLuint *timestamps = nullptr);
+  void draw_blended(const vmath::mat4& mvp);
+  GLuint fit_lists(const vmath::mat4& mvp);
+  void check_reference();
+  void check_software();
+  void run_benchmark();
+  void update_title();
+
   GLuint clear_program;
   GLuint append_program;
-  GLuint resolve_program;
+  GLuint tiled_append_program;
+  GLuint tile_program;
+  GLuint resolve_programs[K_COUNT];
+  GLuint blend_program;
+  GLuint composite_program;
 
   struct
   {
@@ -44,65 +156,318 @@ protected:
   struct
   {
     GLuint mvp;
+    GLuint max_nodes;
+    GLuint tiled_mvp;
+    GLuint tiles_x;
+    GLuint tile_count;
+    GLuint tile_max_nodes;
+    GLuint blend_mvp;
   } uniforms;
 
   sb7::object object;
 
+  // The same mesh, for the software rasterizer
+  sb7::thread_pool pool;
+  SoftwareMesh software_mesh;
+  SoftwareRasterizer software;
+
+  // The lists: a head pointer per pixel and node storage, both sized to
+  // the window
   GLuint fragment_buffer;
   GLuint head_pointer_image;
   GLuint atomic_counter_buffer;
   GLuint dummy_vao;
+
+  // MODE_TILED's per-tile counts and node ranges, after a header that
+  // tiles.cs.glsl fills in. See append.fs.glsl.
+  GLuint tile_buffer;
+  GLuint tiles_x;
+  GLuint tiles_y;
+
+  // The weighted-blended fallback's targets
+  GLuint blend_fbo;
+  GLuint blend_texture;
+  GLuint reveal_texture;
+
+  // Nodes in fragment_buffer, and the most there can ever be
+  GLuint node_capacity;
+  GLuint max_node_capacity;
+
+  // The fill counter is copied here at the end of each frame, into one of
+  // READBACK_FRAMES slots, and read once its fence has passed. This way
+  // reading it never stalls.
+  GLuint readback_buffer;
+  const GLuint *readback_data;
+  GLsync readback_fence[READBACK_FRAMES];
+  int readback_frame;
+
+  // Fragments the last frame read back tried to store. In MODE_TILED,
+  // the nodes its tiles asked for.
+  GLuint fragment_count;
+
+  // Timestamps for each readback slot's frame, whether they are still to
+  // be read, and the pass times summed since the title last showed them
+  GLuint frame_queries[READBACK_FRAMES][TIMESTAMP_COUNT];
+  bool frame_queries_pending[READBACK_FRAMES];
+  double pass_time[PASS_COUNT];
+  int timed_frames;
+
+  // Which of k_values the resolve uses
+  int k_index;
+
+  // One of list_mode
+  int mode;
+
+  // Set when the lists would need more than max_node_capacity nodes.
+  // Cleared on resize.
+  bool blended;
 };
 
 void FragmentList::startup()
 {
   load_shaders();
 
-  uniforms.mvp = glGetUniformLocation(append_program, "mvp");
-
   glGenBuffers(1, &uniforms_buffer);
   glBindBuffer(GL_UNIFORM_BUFFER, uniforms_buffer);
   glBufferData(GL_UNIFORM_BUFFER, sizeof(uniforms_block), 
                nullptr, GL_DYNAMIC_DRAW);
 
   object.load("../../../media/objects/dragon.sbm");
+  software_mesh.Load("../../../media/objects/dragon.sbm");
+
+  GLint max_block_size;
+  glGetIntegerv(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &max_block_size);
+  max_node_capacity = GLuint(std::min<GLint64>(max_block_size, MAX_FRAGMENT_BUFFER_SIZE) / NODE_SIZE);
 
   glGenBuffers(1, &fragment_buffer);
-  glBindBuffer(GL_SHADER_STORAGE_BUFFER, fragment_buffer);
-  glBufferData(GL_SHADER_STORAGE_BUFFER, 1024 * 1024 * 16, nullptr, GL_DYNAMIC_COPY);
 
   glGenBuffers(1, &atomic_counter_buffer);
   glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, atomic_counter_buffer);
   glBufferData(GL_ATOMIC_COUNTER_BUFFER, 4, nullptr, GL_DYNAMIC_COPY);
 
-  glGenTextures(1, &head_pointer_image);
-  glBindTexture(GL_TEXTURE_2D, head_pointer_image);
-  glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32UI, 1024, 1024);
+  static const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+  glGenBuffers(1, &readback_buffer);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, readback_buffer);
+  glBufferStorage(GL_COPY_WRITE_BUFFER, READBACK_FRAMES * sizeof(GLuint), nullptr, flags);
+  readback_data = (const GLuint *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0,
+                                                   READBACK_FRAMES * sizeof(GLuint), flags);
+
+  for (int i = 0; i < READBACK_FRAMES; ++i)
+  {
+    readback_fence[i] = 0;
+    frame_queries_pending[i] = false;
+    glGenQueries(TIMESTAMP_COUNT, frame_queries[i]);
+  }
+
+  glGenBuffers(1, &tile_buffer);
+
+  glGenFramebuffers(1, &blend_fbo);
+
+  create_targets();
 
   glGenVertexArrays(1, &dummy_vao);
   glBindVertexArray(dummy_vao);
+
+  if (info.flags.headless)
+  {
+    check_reference();
+    check_software();
+    run_benchmark();
+    glfwSetWindowShouldClose(window, GL_TRUE);
+  }
 }
 
-void FragmentList::render(double current_time)
+// (Re)creates everything that is sized to the window, and goes back to
+// the lists
+void FragmentList::create_targets()
 {
-  static const GLfloat zeros[] = { 0.0f, 0.0f, 0.0f, 0.0f };
-  static const GLfloat gray[] = { 0.1f, 0.1f, 0.1f, 0.0f };
-  static const GLfloat ones[] = { 1.0f };
+  if (head_pointer_image)
+  {
+    glDeleteTextures(1, &head_pointer_image);
+    glDeleteTextures(1, &blend_texture);
+    glDeleteTextures(1, &reveal_texture);
+  }
 
-  const float f = (float)current_time;
+  glGenTextures(1, &head_pointer_image);
+  glBindTexture(GL_TEXTURE_2D, head_pointer_image);
+  glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32UI, info.windowWidth, info.windowHeight);
+
+  glGenTextures(1, &blend_texture);
+  glBindTexture(GL_TEXTURE_2D, blend_texture);
+  glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA16F, info.windowWidth, info.windowHeight);
+
+  glGenTextures(1, &reveal_texture);
+  glBindTexture(GL_TEXTURE_2D, reveal_texture);
+  glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, info.windowWidth, info.windowHeight);
+
+  static const GLenum draw_buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+
+  glBindFramebuffer(GL_FRAMEBUFFER, blend_fbo);
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, blend_texture, 0);
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, reveal_texture, 0);
+  glDrawBuffers(2, draw_buffers);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  // Every tile starts with no fragments, so the first tiled frame gives
+  // each MIN_TILE_NODES
+  tiles_x = (info.windowWidth + TILE_SIZE - 1) / TILE_SIZE;
+  tiles_y = (info.windowHeight + TILE_SIZE - 1) / TILE_SIZE;
+
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, tile_buffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, TILE_HEADER_SIZE + GLsizeiptr(tiles_x) * tiles_y * 4 * sizeof(GLuint),
+               nullptr, GL_DYNAMIC_COPY);
+  glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+
+  resize_fragment_buffer(std::min<GLuint>(info.windowWidth * info.windowHeight * INITIAL_NODES_PER_PIXEL,
+                                          max_node_capacity));
+  blended = false;
+  fragment_count = 0;
+  update_title();
+}
 
-  glViewport(0, 0, info.windowWidth, info.windowHeight);
+// Reallocates the node storage. Frames still in flight keep the old
+// storage, so nothing has to wait.
+void FragmentList::resize_fragment_buffer(GLuint nodes)
+{
+  node_capacity = nodes;
 
-  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | 
-                  GL_ATOMIC_COUNTER_BARRIER_BIT | 
-                  GL_SHADER_STORAGE_BARRIER_BIT);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, fragment_buffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, GLsizeiptr(nodes) * NODE_SIZE, nullptr, GL_DYNAMIC_COPY);
+}
 
-  glUseProgram(clear_program);
-  glBindVertexArray(dummy_vao);
-  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+// Picks up the fill counts of earlier frames that the GPU has finished
+// with. Grows the node storage to fit with a quarter to spare, or falls
+// back to blending if it cannot.
+void FragmentList::read_fragment_count()
+{
+  for (int i = 0; i < READBACK_FRAMES; ++i)
+  {
+    const int slot = (readback_frame + i) % READBACK_FRAMES;
+    GLsync& fence = readback_fence[slot];
+
+    if (!fence || glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+    {
+      continue;
+    }
 
-  glUseProgram(append_program);
+    glDeleteSync(fence);
+    fence = 0;
 
+    fragment_count = readback_data[slot];
+
+    if (fragment_count > node_capacity && !blended)
+    {
+      const GLuint64 wanted = GLuint64(fragment_count) + fragment_count / 4;
+
+      if (wanted <= max_node_capacity)
+      {
+        resize_fragment_buffer(GLuint(wanted));
+      }
+      else
+      {
+        blended = true;
+      }
+
+      update_title();
+    }
+  }
+}
+
+void FragmentList::update_title()
+{
+  char buffer[256];
+
+  if (blended)
+  {
+    sprintf(buffer, "FragmentList: weighted-blended fallback, %u fragments would need %.1f MB",
+            fragment_count, double(fragment_count) * NODE_SIZE / (1024.0 * 1024.0));
+  }
+  else
+  {
+    sprintf(buffer, "FragmentList: fragment lists (%s), K = %d, %u nodes (%.1f MB) for %dx%d",
+            mode_names[mode], k_values[k_index], node_capacity, double(node_capacity) * NODE_SIZE / (1024.0 * 1024.0),
+            info.windowWidth, info.windowHeight);
+  }
+
+  setWindowTitle(buffer);
+}
+
+// Adds up the pass times of the frames whose timestamps have landed, and
+// shows their average every TIMED_FRAMES frames
+void FragmentList::read_pass_times()
+{
+  for (int i = 0; i < READBACK_FRAMES; ++i)
+  {
+    GLuint available = GL_FALSE;
+
+    if (frame_queries_pending[i])
+    {
+      glGetQueryObjectuiv(frame_queries[i][PASS_COUNT], GL_QUERY_RESULT_AVAILABLE, &available);
+    }
+
+    if (!available)
+    {
+      continue;
+    }
+
+    GLuint64 timestamps[TIMESTAMP_COUNT];
+
+    for (int t = 0; t < TIMESTAMP_COUNT; ++t)
+    {
+      glGetQueryObjectui64v(frame_queries[i][t], GL_QUERY_RESULT, &timestamps[t]);
+    }
+
+    for (int p = 0; p < PASS_COUNT; ++p)
+    {
+      pass_time[p] += double(timestamps[p + 1] - timestamps[p]) * 1.0e-6;
+    }
+
+    frame_queries_pending[i] = false;
+
+    if (++timed_frames == TIMED_FRAMES)
+    {
+      char buffer[256];
+
+      sprintf(buffer, "FragmentList: %s, K = %d, %s %.3f ms, %s %.3f ms, %s %.3f ms",
+              mode_names[mode], k_values[k_index],
+              pass_names[0], pass_time[0] / timed_frames,
+              pass_names[1], pass_time[1] / timed_frames,
+              pass_names[2], pass_time[2] / timed_frames);
+      setWindowTitle(buffer);
+
+      for (int p = 0; p < PASS_COUNT; ++p)
+      {
+        pass_time[p] = 0.0;
+      }
+
+      timed_frames = 0;
+    }
+  }
+}
+
+void FragmentList::render(double current_time)
+{
+  read_fragment_count();
+
+  if (blended)
+  {
+    draw_blended(frame_mvp((float)current_time));
+  }
+  else
+  {
+    read_pass_times();
+
+    // draw_lists() moves readback_frame on
+    const int slot = readback_frame;
+
+    draw_lists(frame_mvp((float)current_time), frame_queries[slot]);
+    frame_queries_pending[slot] = true;
+  }
+}
+
+vmath::mat4 FragmentList::frame_mvp(float f) const
+{
   vmath::mat4 model_matrix = vmath::scale(7.0f);
   vmath::vec3 view_position = vmath::vec3(cosf(f * 0.35f) * 120.0f, 
                                           cosf(f*0.4f) * 30.0f, 
@@ -117,37 +482,213 @@ void FragmentList::render(double current_time)
                                                (float)info.windowHeight,
                                                0.1f, 1000.0f);
 
-  glUniformMatrix4fv(uniforms.mvp, 1, GL_FALSE, proj_matrix * mv_matrix);
+  return proj_matrix * mv_matrix;
+}
+
+// Builds the lists and resolves them. timestamps, if given, receives
+// TIMESTAMP_COUNT timestamps, taken around the reset, build and resolve
+// passes.
+void FragmentList::draw_lists(const vmath::mat4& mvp, const GLuint *timestamps)
+{
+  glViewport(0, 0, info.windowWidth, info.windowHeight);
+
+  if (timestamps)
+  {
+    glQueryCounter(timestamps[0], GL_TIMESTAMP);
+  }
+
+  if (mode == MODE_CLEAR_PASS)
+  {
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | 
+                    GL_ATOMIC_COUNTER_BARRIER_BIT | 
+                    GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glBindImageTexture(0, head_pointer_image, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
+
+    glUseProgram(clear_program);
+    glBindVertexArray(dummy_vao);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+  }
+  else
+  {
+    // The last frame's append wrote the heads with image atomics. The
+    // barrier after it has GL_TEXTURE_UPDATE_BARRIER_BIT, so this clear
+    // waits for those writes.
+    static const GLuint empty = 0xFFFFFFFF;
+    glClearTexImage(head_pointer_image, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, &empty);
+
+    glBindImageTexture(0, head_pointer_image, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
+  }
+
+  if (mode == MODE_TILED)
+  {
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, tile_buffer);
+
+    glUseProgram(tile_program);
+    glUniform1ui(uniforms.tile_count, tiles_x * tiles_y);
+    glUniform1ui(uniforms.tile_max_nodes, node_capacity);
+    glDispatchCompute(1, 1, 1);
+
+    // The append reads the ranges just written
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glUseProgram(tiled_append_program);
+
+    glUniformMatrix4fv(uniforms.tiled_mvp, 1, GL_FALSE, mvp);
+    glUniform1ui(uniforms.tiles_x, tiles_x);
+  }
+  else
+  {
+    glUseProgram(append_program);
 
-  static const unsigned int zero = 0;
-  glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 0, atomic_counter_buffer);
-  glBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(zero), &zero);
+    glUniformMatrix4fv(uniforms.mvp, 1, GL_FALSE, mvp);
+    glUniform1ui(uniforms.max_nodes, node_capacity);
+
+    static const unsigned int zero = 0;
+    glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 0, atomic_counter_buffer);
+    glBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(zero), &zero);
+  }
 
   glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, fragment_buffer);
 
-  glBindImageTexture(0, head_pointer_image, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
-  
-  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | 
-                  GL_ATOMIC_COUNTER_BARRIER_BIT | 
-                  GL_SHADER_STORAGE_BARRIER_BIT);
+  if (mode == MODE_CLEAR_PASS)
+  {
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | 
+                    GL_ATOMIC_COUNTER_BARRIER_BIT | 
+                    GL_SHADER_STORAGE_BARRIER_BIT);
+  }
+
+  if (timestamps)
+  {
+    glQueryCounter(timestamps[1], GL_TIMESTAMP);
+  }
 
   object.render();
   
-  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | 
-                  GL_ATOMIC_COUNTER_BARRIER_BIT | 
-                  GL_SHADER_STORAGE_BARRIER_BIT);
+  if (mode == MODE_CLEAR_PASS)
+  {
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | 
+                    GL_ATOMIC_COUNTER_BARRIER_BIT | 
+                    GL_SHADER_STORAGE_BARRIER_BIT |
+                    GL_BUFFER_UPDATE_BARRIER_BIT);
+  }
+  else
+  {
+    // The resolve reads the heads and nodes through the shader, and the
+    // counts are copied or read back through GL. This also covers the
+    // next frame's reset of the counts, and of the heads, which
+    // glClearTexImage writes as a texture update.
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | 
+                    GL_SHADER_STORAGE_BARRIER_BIT |
+                    GL_BUFFER_UPDATE_BARRIER_BIT |
+                    GL_TEXTURE_UPDATE_BARRIER_BIT);
+  }
+
+  // Keep the count for read_fragment_count(). If the slot is still
+  // waiting from READBACK_FRAMES frames ago, that count is dropped. The
+  // tile header's first word is the nodes the tiles asked for.
+  GLsync& fence = readback_fence[readback_frame];
+
+  if (fence)
+  {
+    glDeleteSync(fence);
+  }
+
+  glBindBuffer(GL_COPY_READ_BUFFER, mode == MODE_TILED ? tile_buffer : atomic_counter_buffer);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, readback_buffer);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0,
+                      readback_frame * sizeof(GLuint), sizeof(GLuint));
+  fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  readback_frame = (readback_frame + 1) % READBACK_FRAMES;
 
-  glUseProgram(resolve_program);
+  if (timestamps)
+  {
+    glQueryCounter(timestamps[2], GL_TIMESTAMP);
+  }
+
+  glUseProgram(resolve_programs[k_index]);
   glBindVertexArray(dummy_vao);
 
-  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | 
-                  GL_ATOMIC_COUNTER_BARRIER_BIT | 
-                  GL_SHADER_STORAGE_BARRIER_BIT);
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+  if (timestamps)
+  {
+    glQueryCounter(timestamps[3], GL_TIMESTAMP);
+  }
+}
+
+// Accumulates weighted color into blend_texture and revealage into
+// reveal_texture, then composites them over the background
+void FragmentList::draw_blended(const vmath::mat4& mvp)
+{
+  static const GLfloat zeros[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+  static const GLfloat ones[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+
+  glViewport(0, 0, info.windowWidth, info.windowHeight);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, blend_fbo);
+  glClearBufferfv(GL_COLOR, 0, zeros);
+  glClearBufferfv(GL_COLOR, 1, ones);
+
+  glEnable(GL_BLEND);
+  glBlendFunci(0, GL_ONE, GL_ONE);
+  glBlendFunci(1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+
+  glUseProgram(blend_program);
+  glUniformMatrix4fv(uniforms.blend_mvp, 1, GL_FALSE, mvp);
+
+  object.render();
+
+  glDisable(GL_BLEND);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  glUseProgram(composite_program);
+  glBindTextureUnit(0, blend_texture);
+  glBindTextureUnit(1, reveal_texture);
+  glBindVertexArray(dummy_vao);
 
   glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 }
 
-GLuint LoadShader(std::string const &filename, GLuint shader_type)
+void FragmentList::shutdown()
+{
+  for (int i = 0; i < READBACK_FRAMES; ++i)
+  {
+    if (readback_fence[i])
+    {
+      glDeleteSync(readback_fence[i]);
+    }
+
+    glDeleteQueries(TIMESTAMP_COUNT, frame_queries[i]);
+  }
+
+  glBindBuffer(GL_COPY_WRITE_BUFFER, readback_buffer);
+  glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+  glDeleteBuffers(1, &readback_buffer);
+  glDeleteBuffers(1, &fragment_buffer);
+  glDeleteBuffers(1, &atomic_counter_buffer);
+  glDeleteBuffers(1, &tile_buffer);
+  glDeleteBuffers(1, &uniforms_buffer);
+  glDeleteTextures(1, &head_pointer_image);
+  glDeleteTextures(1, &blend_texture);
+  glDeleteTextures(1, &reveal_texture);
+  glDeleteFramebuffers(1, &blend_fbo);
+  glDeleteVertexArrays(1, &dummy_vao);
+}
+
+void FragmentList::onResize(int w, int h)
+{
+  sb7::application::onResize(w, h);
+
+  if (w != 0 && h != 0)
+  {
+    create_targets();
+  }
+}
+
+// defines, if given, go straight after the #version line
+GLuint LoadShader(std::string const &filename, GLuint shader_type,
+                  std::string const &defines = std::string())
 {
   GLuint result_shader;
 
@@ -179,7 +720,18 @@ GLuint LoadShader(std::string const &filename, GLuint shader_type)
 
   result_shader = glCreateShader(shader_type);
 
-  glShaderSource(result_shader, 1, &data, nullptr);
+  const char *version_end = strchr(data, '\n');
+  const GLchar *sources[3] = { data, defines.c_str(), "" };
+  GLint lengths[3] = { GLint(filesize), GLint(defines.size()), 0 };
+
+  if (version_end && !defines.empty())
+  {
+    lengths[0] = GLint(version_end + 1 - data);
+    sources[2] = version_end + 1;
+    lengths[2] = GLint(filesize) - lengths[0];
+  }
+
+  glShaderSource(result_shader, 3, sources, lengths);
   delete[] data;
   glCompileShader(result_shader);
 
@@ -194,78 +746,356 @@ GLuint LoadShader(std::string const &filename, GLuint shader_type)
   return result_shader;
 }
 
-void FragmentList::load_shaders()
+// Links vs and fs into a new program, replacing program if it is set
+static GLuint LinkProgram(const char *vs, const char *fs, GLuint program,
+                          std::string const &defines = std::string())
 {
   char buffer[4096];
   GLuint shaders[2];
 
-  shaders[0] = LoadShader("clear.vs.glsl", GL_VERTEX_SHADER);
-  shaders[1] = LoadShader("clear.fs.glsl", GL_FRAGMENT_SHADER);
+  shaders[0] = LoadShader(vs, GL_VERTEX_SHADER);
+  shaders[1] = LoadShader(fs, GL_FRAGMENT_SHADER, defines);
 
-  if (clear_program)
+  if (program)
   {
-    glDeleteProgram(clear_program);
+    glDeleteProgram(program);
   }
 
-  clear_program = glCreateProgram();
+  program = glCreateProgram();
 
   for (int i = 0; i < 2; ++i)
   {
-    glAttachShader(clear_program, shaders[i]);
+    glAttachShader(program, shaders[i]);
+    glDeleteShader(shaders[i]);
   }
 
-  glLinkProgram(clear_program);
+  glLinkProgram(program);
 
-  glGetProgramInfoLog(clear_program, 4096, nullptr, buffer);
+  glGetProgramInfoLog(program, 4096, nullptr, buffer);
 
   OutputDebugStringA(buffer);
   OutputDebugStringA("\n");
 
+  return program;
+}
 
-  shaders[0] = LoadShader("append.vs.glsl", GL_VERTEX_SHADER);
-  shaders[1] = LoadShader("append.fs.glsl", GL_FRAGMENT_SHADER);
+// As LinkProgram(), for a compute shader
+static GLuint LinkComputeProgram(const char *cs, GLuint program,
+                                 std::string const &defines = std::string())
+{
+  char buffer[4096];
+  GLuint shader = LoadShader(cs, GL_COMPUTE_SHADER, defines);
 
-  if (append_program)
+  if (program)
   {
-    glDeleteProgram(append_program);
+    glDeleteProgram(program);
   }
 
-  append_program = glCreateProgram();
+  program = glCreateProgram();
 
-  for (int i = 0; i < 2; ++i)
-  {
-    glAttachShader(append_program, shaders[i]);
-  }
+  glAttachShader(program, shader);
+  glDeleteShader(shader);
 
-  glLinkProgram(append_program);
+  glLinkProgram(program);
 
-  glGetProgramInfoLog(append_program, 4096, nullptr, buffer);
+  glGetProgramInfoLog(program, 4096, nullptr, buffer);
 
   OutputDebugStringA(buffer);
   OutputDebugStringA("\n");
 
+  return program;
+}
+
+void FragmentList::load_shaders()
+{
+  const std::string tile_defines = "#define TILE_SIZE " + std::to_string(int(TILE_SIZE)) + "\n"
+                                   "#define MIN_TILE_NODES " + std::to_string(int(MIN_TILE_NODES)) + "u\n";
 
-  shaders[0] = LoadShader("resolve.vs.glsl", GL_VERTEX_SHADER);
-  shaders[1] = LoadShader("resolve.fs.glsl", GL_FRAGMENT_SHADER);
+  clear_program = LinkProgram("clear.vs.glsl", "clear.fs.glsl", clear_program);
+  append_program = LinkProgram("append.vs.glsl", "append.fs.glsl", append_program);
+  tiled_append_program = LinkProgram("append.vs.glsl", "append.fs.glsl", tiled_append_program,
+                                     "#define TILED\n" + tile_defines);
+  tile_program = LinkComputeProgram("tiles.cs.glsl", tile_program, tile_defines);
 
-  if (resolve_program)
+  for (int i = 0; i < K_COUNT; ++i)
   {
-    glDeleteProgram(resolve_program);
+    resolve_programs[i] = LinkProgram("resolve.vs.glsl", "resolve.fs.glsl", resolve_programs[i],
+                                      "#define K " + std::to_string(k_values[i]) + "\n");
   }
 
-  resolve_program = glCreateProgram();
+  blend_program = LinkProgram("append.vs.glsl", "blend.fs.glsl", blend_program);
+  composite_program = LinkProgram("resolve.vs.glsl", "composite.fs.glsl", composite_program);
 
-  for (int i = 0; i < 2; ++i)
+  uniforms.mvp = glGetUniformLocation(append_program, "mvp");
+  uniforms.max_nodes = glGetUniformLocation(append_program, "max_nodes");
+  uniforms.tiled_mvp = glGetUniformLocation(tiled_append_program, "mvp");
+  uniforms.tiles_x = glGetUniformLocation(tiled_append_program, "tiles_x");
+  uniforms.tile_count = glGetUniformLocation(tile_program, "tile_count");
+  uniforms.tile_max_nodes = glGetUniformLocation(tile_program, "max_nodes");
+  uniforms.blend_mvp = glGetUniformLocation(blend_program, "mvp");
+}
+
+// Draws the lists for mvp until the node storage holds every fragment,
+// growing it in between. Returns the number of fragments, or zero if they
+// can never fit.
+GLuint FragmentList::fit_lists(const vmath::mat4& mvp)
+{
+  GLuint count = 0;
+
+  if (mode == MODE_TILED)
   {
-    glAttachShader(resolve_program, shaders[i]);
+    // Each frame's ranges come from the last frame's counts, so the
+    // second frame of the same view always fits unless the storage has
+    // to grow
+    std::vector<GLuint> tiles(tiles_x * tiles_y * 4);
+
+    for (;;)
+    {
+      GLuint64 needed = 0;
+      bool dropped = false;
+
+      draw_lists(mvp);
+      glGetNamedBufferSubData(tile_buffer, TILE_HEADER_SIZE, tiles.size() * sizeof(GLuint), tiles.data());
+
+      count = 0;
+
+      for (size_t t = 0; t < tiles.size(); t += 4)
+      {
+        count += tiles[t];
+        needed += tile_reserve(tiles[t]);
+        dropped = dropped || tiles[t] > tiles[t + 2];
+      }
+
+      if (!dropped)
+      {
+        return count;
+      }
+
+      if (needed > max_node_capacity)
+      {
+        return 0;
+      }
+
+      if (needed > node_capacity)
+      {
+        resize_fragment_buffer(GLuint(needed));
+      }
+    }
   }
 
-  glLinkProgram(resolve_program);
+  for (;;)
+  {
+    draw_lists(mvp);
+    glGetNamedBufferSubData(atomic_counter_buffer, 0, sizeof(count), &count);
 
-  glGetProgramInfoLog(resolve_program, 4096, nullptr, buffer);
+    if (count <= node_capacity)
+    {
+      return count;
+    }
 
-  OutputDebugStringA(buffer);
-  OutputDebugStringA("\n");
+    if (count > max_node_capacity)
+    {
+      return 0;
+    }
+
+    resize_fragment_buffer(count);
+  }
+}
+
+// Returns how many of the pixels of two RGBA images differ by more than
+// 1/255 in any color channel, and sets max_error to the largest difference
+static int CompareImages(const float *a, const float *b, int pixels, float& max_error)
+{
+  int bad_pixels = 0;
+
+  max_error = 0.0f;
+
+  for (int p = 0; p < pixels; ++p)
+  {
+    float error = 0.0f;
+
+    for (int c = 0; c < 3; ++c)
+    {
+      error = std::max(error, fabsf(a[p * 4 + c] - b[p * 4 + c]));
+    }
+
+    max_error = std::max(max_error, error);
+
+    if (error > 1.0f / 255.0f)
+    {
+      bad_pixels++;
+    }
+  }
+
+  return bad_pixels;
+}
+
+// Resolves one frame at every K on the GPU and with ResolveReference(),
+// from the same lists, and prints how far apart they are. The GPU result
+// is rounded to 8 bits, so up to half a step is expected.
+void FragmentList::check_reference()
+{
+  const int width = info.windowWidth;
+  const int height = info.windowHeight;
+  const int saved_k_index = k_index;
+  const vmath::mat4 mvp = frame_mvp(0.0f);
+
+  std::vector<GLuint> heads(width * height);
+  std::vector<ListNode> nodes;
+  std::vector<float> gpu(width * height * 4);
+  std::vector<float> cpu(width * height * 4);
+
+  for (k_index = 0; k_index < K_COUNT; ++k_index)
+  {
+    const GLuint count = fit_lists(mvp);
+
+    if (count == 0)
+    {
+      fprintf(stderr, "FragmentList: lists do not fit, no reference check\n");
+      break;
+    }
+
+    // Tiled lists leave gaps, so all of the storage is read
+    nodes.resize(node_capacity);
+
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+    glGetTextureImage(head_pointer_image, 0, GL_RED_INTEGER, GL_UNSIGNED_INT,
+                      GLsizei(heads.size() * sizeof(GLuint)), heads.data());
+    glGetNamedBufferSubData(fragment_buffer, 0, nodes.size() * sizeof(ListNode), nodes.data());
+
+    glReadBuffer(GL_BACK);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, gpu.data());
+
+    ResolveReference(heads.data(), width, height, nodes.data(), k_values[k_index],
+                     background, cpu.data());
+
+    float max_error;
+    const int bad_pixels = CompareImages(gpu.data(), cpu.data(), width * height, max_error);
+
+    fprintf(stderr, "FragmentList: %s, K = %2d, %u fragments, max error %.4f, %d pixels off by more than 1/255\n",
+            mode_names[mode], k_values[k_index], count, max_error, bad_pixels);
+  }
+
+  k_index = saved_k_index;
+}
+
+// Builds and resolves one frame's lists with SoftwareRasterizer at the
+// current K and compares the result with the GPU's. Lists that differ at
+// triangle edges make some pixels differ. Also prints how fast the
+// software build and resolve ran.
+void FragmentList::check_software()
+{
+  typedef std::chrono::steady_clock clock;
+
+  const int width = info.windowWidth;
+  const int height = info.windowHeight;
+  const vmath::mat4 mvp = frame_mvp(0.0f);
+  char buffer[256];
+
+  if (software_mesh.positions.empty())
+  {
+    fprintf(stderr, "FragmentList: no mesh for the software rasterizer\n");
+    return;
+  }
+
+  std::vector<float> gpu(width * height * 4);
+  std::vector<float> cpu(width * height * 4);
+
+  const GLuint gpu_count = fit_lists(mvp);
+
+  if (gpu_count == 0)
+  {
+    fprintf(stderr, "FragmentList: lists do not fit, no software check\n");
+    return;
+  }
+
+  glReadBuffer(GL_BACK);
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, gpu.data());
+
+  // The first build sizes the node storage, the second is timed
+  software.Build(software_mesh, mvp, width, height);
+
+  const clock::time_point start = clock::now();
+  const GLuint count = software.Build(software_mesh, mvp, width, height);
+  const clock::time_point built = clock::now();
+  software.Resolve(k_values[k_index], background, cpu.data());
+  const clock::time_point resolved = clock::now();
+
+  const double build_time = std::chrono::duration<double>(built - start).count();
+  const double resolve_time = std::chrono::duration<double>(resolved - built).count();
+
+  float max_error;
+  const int bad_pixels = CompareImages(gpu.data(), cpu.data(), width * height, max_error);
+
+  sprintf(buffer, "FragmentList: software, K = %d, %u fragments (GPU %u), build %.2f ms (%.1f Mfragments/s), "
+                  "resolve %.2f ms (%.1f Mfragments/s), %u threads",
+          k_values[k_index], count, gpu_count,
+          1000.0 * build_time, count / build_time * 1.0e-6,
+          1000.0 * resolve_time, count / resolve_time * 1.0e-6, pool.size());
+  fprintf(stderr, "FragmentList: software, max error %.4f, %d pixels off by more than 1/255\n",
+          max_error, bad_pixels);
+  setWindowTitle(buffer);
+}
+
+// Times each pass in every mode at every K over the same frame, and prints
+// the fragments resolved per second
+void FragmentList::run_benchmark()
+{
+  static const int frames = 16;
+
+  const int saved_k_index = k_index;
+  const int saved_mode = mode;
+  const vmath::mat4 mvp = frame_mvp(0.0f);
+  char buffer[256] = "FragmentList: lists do not fit, no benchmark";
+  GLuint queries[TIMESTAMP_COUNT];
+
+  glGenQueries(TIMESTAMP_COUNT, queries);
+
+  for (mode = 0; mode < MODE_COUNT; ++mode)
+  {
+    for (k_index = 0; k_index < K_COUNT; ++k_index)
+    {
+      const GLuint count = fit_lists(mvp);
+
+      if (count == 0)
+      {
+        fprintf(stderr, "FragmentList: %s, lists do not fit, no benchmark\n", mode_names[mode]);
+        break;
+      }
+
+      double total[PASS_COUNT] = { 0.0 };
+
+      for (int i = 0; i < frames; ++i)
+      {
+        GLuint64 timestamps[TIMESTAMP_COUNT];
+
+        draw_lists(mvp, queries);
+
+        for (int t = 0; t < TIMESTAMP_COUNT; ++t)
+        {
+          glGetQueryObjectui64v(queries[t], GL_QUERY_RESULT, &timestamps[t]);
+        }
+
+        for (int p = 0; p < PASS_COUNT; ++p)
+        {
+          total[p] += double(timestamps[p + 1] - timestamps[p]) * 1.0e-9 / frames;
+        }
+      }
+
+      sprintf(buffer, "FragmentList: %-13s K = %2d, reset %.3f ms, build %.3f ms, resolve %.3f ms, "
+                      "%.1f Mfragments/s (%u fragments, %dx%d)",
+              mode_names[mode], k_values[k_index], 1000.0 * total[0], 1000.0 * total[1],
+              1000.0 * total[2], count / total[2] * 1.0e-6,
+              count, info.windowWidth, info.windowHeight);
+      fprintf(stderr, "%s\n", buffer);
+    }
+  }
+
+  glDeleteQueries(TIMESTAMP_COUNT, queries);
+
+  k_index = saved_k_index;
+  mode = saved_mode;
+  setWindowTitle(buffer);
 }
 
 void FragmentList::onKey(int key, int action)
@@ -277,6 +1107,23 @@ void FragmentList::onKey(int key, int action)
     case 'R':
       load_shaders();
       break;
+    case 'K':
+      k_index = (k_index + 1) % K_COUNT;
+      update_title();
+      break;
+    case 'M':
+      mode = (mode + 1) % MODE_COUNT;
+      update_title();
+      break;
+    case 'C':
+      check_reference();
+      break;
+    case 'S':
+      check_software();
+      break;
+    case 'B':
+      run_benchmark();
+      break;
     }
   }
 }
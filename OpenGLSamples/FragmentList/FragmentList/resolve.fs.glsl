@@ -1,50 +1,70 @@
 #version 450 core
 
-layout (binding = 0, r32ui) coherent uniform uimage2D head_pointer;
+// Keeps the K nearest fragments of each pixel's list in registers, sorted
+// by insertion as they are read, then composites them front to back over
+// the background. ResolveReference.cpp does the same on the CPU and the
+// two must be kept in step. The application defines K.
 
-struct list_item
-{
-	vec4 color;
-	float depth;
-	int facing;
-	uint next;	
-};
+#ifndef K
+#define K 8
+#endif
 
+layout (binding = 0, r32ui) coherent uniform uimage2D head_pointer;
+
+// See append.fs.glsl
 layout (binding = 0, std430) buffer list_item_block
 {
-	list_item item[];
+	uvec4 item[];
 };
 
 layout (location = 0) out vec4 color;
 
-const uint max_fragments = 10;
+uniform vec4 background = vec4(0.1, 0.1, 0.1, 1.0);
 
 void main(void)
 {
-	uint frag_count = 0;
-	float depth_accum = 0.0;
+	uint  frag_color[K];
+	float frag_depth[K];
+	int frag_count = 0;
 	ivec2 P = ivec2(gl_FragCoord.xy);
 
 	uint index = imageLoad(head_pointer, P).x;
 
-	while(index != 0xFFFFFFFF && frag_count < max_fragments)
+	while (index != 0xFFFFFFFF)
 	{
-		list_item this_item = item[index];
+		uvec4 this_item = item[index];
+		float depth = uintBitsToFloat(this_item.y);
 
-		if (this_item.facing != 0)
-		{
-			depth_accum -= this_item.depth;
-		}
-		else
+		// Once full, a fragment behind all K is dropped and one in front
+		// pushes the furthest out
+		if (frag_count < K || depth < frag_depth[K - 1])
 		{
-			depth_accum += this_item.depth;
+			int j = frag_count < K ? frag_count++ : K - 1;
+
+			while (j > 0 && frag_depth[j - 1] > depth)
+			{
+				frag_depth[j] = frag_depth[j - 1];
+				frag_color[j] = frag_color[j - 1];
+				j--;
+			}
+
+			frag_depth[j] = depth;
+			frag_color[j] = this_item.x;
 		}
 
-		index = this_item.next;
-		frag_count++;
+		index = this_item.z;
 	}
 
-	depth_accum *= 3000.0;
+	vec3 C = vec3(0.0);
+	float A = 0.0;
+
+	for (int i = 0; i < frag_count && A < 0.99; i++)
+	{
+		vec4 c = unpackUnorm4x8(frag_color[i]);
+
+		C += (1.0 - A) * c.a * c.rgb;
+		A += (1.0 - A) * c.a;
+	}
 
-	color = vec4(depth_accum, depth_accum, depth_accum, 1.0);
-}
\ No newline at end of file
+	color = vec4(C + (1.0 - A) * background.rgb, 1.0);
+}
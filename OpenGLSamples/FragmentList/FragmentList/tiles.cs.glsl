@@ -0,0 +1,90 @@
+#version 450 core
+
+// Runs before the tiled append. Gives each tile a range of nodes big
+// enough for what it drew last frame, plus a quarter and MIN_TILE_NODES,
+// and zeroes its count; tile_reserve() in main.cpp must match. The ranges
+// are laid out in tile order with a prefix sum across one work group. A
+// range that runs past max_nodes is cut short, and the header records
+// what every range asked for, so the application can grow the storage.
+// The application defines MIN_TILE_NODES.
+
+#define THREADS 1024
+
+layout (local_size_x = THREADS) in;
+
+// See append.fs.glsl. header is x, the nodes asked for; y, the fragments
+// drawn last frame; z, how many of them were dropped.
+layout (binding = 1, std430) buffer tile_block
+{
+	uvec4 header;
+	uvec4 tiles[];
+};
+
+uniform uint tile_count;
+uniform uint max_nodes;
+
+shared uint partial[THREADS];
+shared uint fragments;
+shared uint dropped;
+
+uint reserve(uint count)
+{
+	return count + count / 4u + MIN_TILE_NODES;
+}
+
+void main(void)
+{
+	uint t = gl_LocalInvocationIndex;
+	uint per_thread = (tile_count + THREADS - 1u) / THREADS;
+	uint first = min(t * per_thread, tile_count);
+	uint last = min(first + per_thread, tile_count);
+	uint sum = 0u;
+	uint my_fragments = 0u;
+	uint my_dropped = 0u;
+
+	if (t == 0u)
+	{
+		fragments = 0u;
+		dropped = 0u;
+	}
+
+	for (uint i = first; i < last; i++)
+	{
+		uvec4 tile = tiles[i];
+
+		sum += reserve(tile.x);
+		my_fragments += tile.x;
+		my_dropped += tile.x - min(tile.x, tile.z);
+	}
+
+	partial[t] = sum;
+	barrier();
+
+	atomicAdd(fragments, my_fragments);
+	atomicAdd(dropped, my_dropped);
+
+	// Inclusive scan of the per-thread sums
+	for (uint offset = 1u; offset < THREADS; offset *= 2u)
+	{
+		uint before = t >= offset ? partial[t - offset] : 0u;
+		barrier();
+		partial[t] += before;
+		barrier();
+	}
+
+	uint base = partial[t] - sum;
+
+	for (uint i = first; i < last; i++)
+	{
+		uint wanted = reserve(tiles[i].x);
+		uint given = base < max_nodes ? min(wanted, max_nodes - base) : 0u;
+
+		tiles[i] = uvec4(0u, base, given, 0u);
+		base += wanted;
+	}
+
+	if (t == THREADS - 1u)
+	{
+		header = uvec4(partial[t], fragments, dropped, 0u);
+	}
+}
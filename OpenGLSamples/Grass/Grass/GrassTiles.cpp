@@ -0,0 +1,367 @@
+#include "GrassTiles.h"
+
+#include <shader.h>
+#include <sb7rng.h>
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+// Candidates tried for each point of the pattern. More spread the points
+// more evenly and take longer.
+static const int PATTERN_CANDIDATES = 32;
+
+// The density where the density map is zero, as a share of TILE_BLADES
+static const float MIN_DENSITY = 0.15f;
+
+// The textures cover this many units and repeat, as bake.cs.glsl samples
+// them
+static const float TEXTURE_SPAN = 1024.0f;
+
+static GLuint FloatBits(float f)
+{
+  GLuint bits;
+
+  memcpy(&bits, &f, sizeof(bits));
+  return bits;
+}
+
+// Interleaves the low 16 bits of x and z, x in the even bits
+static GLuint MortonKey(GLuint x, GLuint z)
+{
+  x = (x | (x << 8)) & 0x00FF00FF;
+  x = (x | (x << 4)) & 0x0F0F0F0F;
+  x = (x | (x << 2)) & 0x33333333;
+  x = (x | (x << 1)) & 0x55555555;
+
+  z = (z | (z << 8)) & 0x00FF00FF;
+  z = (z | (z << 4)) & 0x0F0F0F0F;
+  z = (z | (z << 2)) & 0x33333333;
+  z = (z | (z << 1)) & 0x55555555;
+
+  return x | (z << 1);
+}
+
+// Puts blades first to last, four words each, in the order of their keys
+static void SortBlades(GLuint *blades, const GLuint *keys, GLuint first, GLuint last)
+{
+  std::pair<GLuint, GLuint> order[GrassTiles::TILE_BLADES];
+  GLuint sorted[GrassTiles::TILE_BLADES * 4];
+
+  for (GLuint i = first; i < last; ++i)
+  {
+    order[i - first] = std::make_pair(keys[i], i);
+  }
+
+  std::sort(order, order + (last - first));
+
+  for (GLuint i = first; i < last; ++i)
+  {
+    memcpy(&sorted[(i - first) * 4], &blades[order[i - first].second * 4], 4 * sizeof(GLuint));
+  }
+
+  memcpy(&blades[first * 4], sorted, (last - first) * 4 * sizeof(GLuint));
+}
+
+// From the eye to the middle of a tile, across the ground
+static float TileDistance(int x, int z, const vmath::vec3& eye)
+{
+  const vmath::vec2 center = GrassTiles::TileOrigin(x, z) + vmath::vec2(GrassTiles::TILE_SIZE * 0.5f);
+  const float dx = center[0] - eye[0];
+  const float dz = center[1] - eye[2];
+
+  return sqrtf(dx * dx + dz * dz);
+}
+
+GrassTiles::GrassTiles(sb7::thread_pool& pool)
+  : m_pool(pool),
+    m_density_width(0),
+    m_density_height(0),
+    m_instance_buffer(0),
+    m_blade_buffer(0),
+    m_tile_buffer(0),
+    m_bake_program(0)
+{
+}
+
+void GrassTiles::Create(GLuint density_texture)
+{
+  glGetTextureLevelParameteriv(density_texture, 0, GL_TEXTURE_WIDTH, &m_density_width);
+  glGetTextureLevelParameteriv(density_texture, 0, GL_TEXTURE_HEIGHT, &m_density_height);
+
+  m_density.resize(m_density_width * m_density_height);
+
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glGetTextureImage(density_texture, 0, GL_RED, GL_UNSIGNED_BYTE,
+                    GLsizei(m_density.size()), m_density.data());
+
+  MakePattern();
+
+  const Slot free_slot = { -1, -1, 0 };
+
+  m_slots.assign(SLOT_COUNT, free_slot);
+  m_tile_slots.assign(WORLD_TILES * WORLD_TILES, -1);
+
+  // Handed out from the back, lowest first
+  m_free.clear();
+
+  for (int s = SLOT_COUNT - 1; s >= 0; --s)
+  {
+    m_free.push_back(s);
+  }
+
+  glGenBuffers(1, &m_instance_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, m_instance_buffer);
+  glBufferData(GL_ARRAY_BUFFER, GLsizeiptr(SLOT_COUNT) * TILE_BLADES * INSTANCE_SIZE,
+               nullptr, GL_DYNAMIC_DRAW);
+
+  glGenBuffers(1, &m_blade_buffer);
+  glGenBuffers(1, &m_tile_buffer);
+
+  GLuint cs = sb7::shader::load("bake.cs.glsl", GL_COMPUTE_SHADER);
+  m_bake_program = sb7::program::link_from_shaders(&cs, 1, true);
+}
+
+void GrassTiles::Destroy()
+{
+  glDeleteProgram(m_bake_program);
+  glDeleteBuffers(1, &m_tile_buffer);
+  glDeleteBuffers(1, &m_blade_buffer);
+  glDeleteBuffers(1, &m_instance_buffer);
+
+  m_bake_program = 0;
+  m_tile_buffer = 0;
+  m_blade_buffer = 0;
+  m_instance_buffer = 0;
+}
+
+int GrassTiles::Update(const vmath::vec3& eye, float distance, int max_tiles)
+{
+  // A tile is kept a little past where it is streamed in, so one at the
+  // edge doesn't go back and forth
+  const float keep = distance + TILE_SIZE;
+
+  for (int s = 0; s < SLOT_COUNT; ++s)
+  {
+    Slot& slot = m_slots[s];
+
+    if (slot.x < 0 || TileDistance(slot.x, slot.z, eye) <= keep)
+    {
+      continue;
+    }
+
+    m_tile_slots[slot.z * WORLD_TILES + slot.x] = -1;
+    slot.x = -1;
+    slot.z = -1;
+    slot.blades = 0;
+    m_free.push_back(s);
+  }
+
+  const int x0 = std::max(0, int(floorf((eye[0] - distance) / TILE_SIZE)) + WORLD_TILES / 2);
+  const int x1 = std::min(WORLD_TILES - 1, int(floorf((eye[0] + distance) / TILE_SIZE)) + WORLD_TILES / 2);
+  const int z0 = std::max(0, int(floorf((eye[2] - distance) / TILE_SIZE)) + WORLD_TILES / 2);
+  const int z1 = std::min(WORLD_TILES - 1, int(floorf((eye[2] + distance) / TILE_SIZE)) + WORLD_TILES / 2);
+
+  m_missing.clear();
+
+  for (int z = z0; z <= z1; ++z)
+  {
+    for (int x = x0; x <= x1; ++x)
+    {
+      if (m_tile_slots[z * WORLD_TILES + x] >= 0)
+      {
+        continue;
+      }
+
+      const float d = TileDistance(x, z, eye);
+
+      if (d <= distance)
+      {
+        m_missing.push_back(std::make_pair(d, z * WORLD_TILES + x));
+      }
+    }
+  }
+
+  const size_t count = std::min(std::min(size_t(std::max(max_tiles, 0)), m_free.size()),
+                                m_missing.size());
+
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  std::partial_sort(m_missing.begin(), m_missing.begin() + count, m_missing.end());
+
+  // Per tile: the slot and the number of blades, which bake.cs.glsl reads,
+  // and the tile
+  m_tile_data.resize(count * 4);
+  m_blade_data.resize(count * TILE_BLADES * 4);
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    const int tile = m_missing[i].second;
+
+    m_tile_data[i * 4 + 0] = GLuint(m_free.back());
+    m_tile_data[i * 4 + 2] = GLuint(tile % WORLD_TILES);
+    m_tile_data[i * 4 + 3] = GLuint(tile / WORLD_TILES);
+    m_free.pop_back();
+  }
+
+  m_pool.parallel_for(count, [&](size_t first, size_t last)
+  {
+    for (size_t i = first; i < last; ++i)
+    {
+      m_tile_data[i * 4 + 1] = PlaceBlades(int(m_tile_data[i * 4 + 2]), int(m_tile_data[i * 4 + 3]),
+                                           &m_blade_data[i * TILE_BLADES * 4]);
+    }
+  });
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    const int s = int(m_tile_data[i * 4 + 0]);
+    Slot& slot = m_slots[s];
+
+    slot.x = int(m_tile_data[i * 4 + 2]);
+    slot.z = int(m_tile_data[i * 4 + 3]);
+    slot.blades = m_tile_data[i * 4 + 1];
+    m_tile_slots[slot.z * WORLD_TILES + slot.x] = s;
+  }
+
+  // Orphaning these lets the driver hand out fresh memory if the last
+  // bake is still reading them
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_blade_buffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, m_blade_data.size() * sizeof(GLuint),
+               m_blade_data.data(), GL_STREAM_DRAW);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_tile_buffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, m_tile_data.size() * sizeof(GLuint),
+               m_tile_data.data(), GL_STREAM_DRAW);
+
+  glUseProgram(m_bake_program);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_instance_buffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_blade_buffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, m_tile_buffer);
+  glDispatchCompute(TILE_BLADES / 256, GLuint(count), 1);
+
+  // The results are read as vertex attributes
+  glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+  return int(count);
+}
+
+// Each point is the best of PATTERN_CANDIDATES random ones, the one
+// furthest from all the points so far. Distances wrap around the tile.
+void GrassTiles::MakePattern()
+{
+  sb7::rng::pcg32 rng(0x67726173);
+
+  m_pattern.resize(TILE_BLADES);
+
+  for (int i = 0; i < TILE_BLADES; ++i)
+  {
+    float best_distance = -1.0f;
+
+    for (int c = 0; c < PATTERN_CANDIDATES; ++c)
+    {
+      const float cx = rng.next_float() * TILE_SIZE;
+      const float cz = rng.next_float() * TILE_SIZE;
+      const vmath::vec2 candidate(cx, cz);
+      float nearest = float(TILE_SIZE * TILE_SIZE);
+
+      for (int j = 0; j < i && nearest > best_distance; ++j)
+      {
+        float dx = fabsf(candidate[0] - m_pattern[j][0]);
+        float dz = fabsf(candidate[1] - m_pattern[j][1]);
+
+        dx = std::min(dx, TILE_SIZE - dx);
+        dz = std::min(dz, TILE_SIZE - dz);
+        nearest = std::min(nearest, dx * dx + dz * dz);
+      }
+
+      if (nearest > best_distance)
+      {
+        best_distance = nearest;
+        m_pattern[i] = candidate;
+      }
+    }
+  }
+}
+
+// The density map filtered bilinearly, with the texture repeating as it
+// does in bake.cs.glsl
+float GrassTiles::Density(float x, float z) const
+{
+  const float u = (x / TEXTURE_SPAN + 0.5f) * m_density_width - 0.5f;
+  const float v = (z / TEXTURE_SPAN + 0.5f) * m_density_height - 0.5f;
+  const float fu = floorf(u);
+  const float fv = floorf(v);
+  const float su = u - fu;
+  const float sv = v - fv;
+
+  int u0 = int(fu) % m_density_width;
+  int v0 = int(fv) % m_density_height;
+
+  if (u0 < 0) u0 += m_density_width;
+  if (v0 < 0) v0 += m_density_height;
+
+  const int u1 = (u0 + 1) % m_density_width;
+  const int v1 = (v0 + 1) % m_density_height;
+
+  const unsigned char *row0 = &m_density[v0 * m_density_width];
+  const unsigned char *row1 = &m_density[v1 * m_density_width];
+
+  const float top = row0[u0] + (row0[u1] - row0[u0]) * su;
+  const float bottom = row1[u0] + (row1[u1] - row1[u0]) * su;
+  const float length = (top + (bottom - top) * sv) / 255.0f;
+
+  return MIN_DENSITY + (1.0f - MIN_DENSITY) * length;
+}
+
+GLuint GrassTiles::PlaceBlades(int x, int z, GLuint *blades) const
+{
+  const int tile = z * WORLD_TILES + x;
+  const vmath::vec2 origin = TileOrigin(x, z);
+
+  // The same shift every time the tile comes back
+  sb7::rng::pcg32 rng(static_cast<uint64_t>(tile));
+  const float shift_x = rng.next_float() * TILE_SIZE;
+  const float shift_z = rng.next_float() * TILE_SIZE;
+
+  GLuint keys[TILE_BLADES];
+  GLuint count = 0;
+
+  for (int i = 0; i < TILE_BLADES; ++i)
+  {
+    float px = m_pattern[i][0] + shift_x;
+    float pz = m_pattern[i][1] + shift_z;
+
+    if (px >= TILE_SIZE) px -= TILE_SIZE;
+    if (pz >= TILE_SIZE) pz -= TILE_SIZE;
+
+    // On a grid of 1/8th units across the tile
+    keys[count] = MortonKey(GLuint(px * 8.0f), GLuint(pz * 8.0f));
+
+    px += origin[0];
+    pz += origin[1];
+
+    if (float(i) >= Density(px, pz) * TILE_BLADES)
+    {
+      continue;
+    }
+
+    // Position, and a seed unique to the blade for its random tint
+    blades[count * 4 + 0] = FloatBits(px);
+    blades[count * 4 + 1] = FloatBits(pz);
+    blades[count * 4 + 2] = GLuint(tile) * TILE_BLADES + GLuint(i);
+    blades[count * 4 + 3] = 0;
+    ++count;
+  }
+
+  // The billboards draw the first quarter, so that stays the same blades,
+  // but each part is put in Morton order so that blades near each other
+  // in the tile are near each other in the buffer too
+  SortBlades(blades, keys, 0, count / 4);
+  SortBlades(blades, keys, count / 4, count);
+
+  return count;
+}
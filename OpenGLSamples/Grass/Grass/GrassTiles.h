@@ -0,0 +1,115 @@
+#ifndef __GRASSTILES_H__
+#define __GRASSTILES_H__
+
+#include <sb7.h>
+#include <vmath.h>
+#include <sb7threadpool.h>
+
+#include <utility>
+#include <vector>
+
+// Places blades over a field of WORLD_TILES x WORLD_TILES tiles, far more
+// than fit in memory at once, and keeps the tiles around the eye in a
+// fixed number of slots of one GPU buffer.
+//
+// Every tile takes its blades from the same blue noise pattern of
+// TILE_BLADES points, shifted by a different amount in each tile. The
+// pattern is made once with Mitchell's best candidate algorithm on a
+// torus, so that it tiles, and any prefix of it is an even spread too. A
+// point is kept if its index is less than TILE_BLADES times the density
+// map at the point, so thin areas get fewer blades rather than gaps.
+// Kept points are chosen in pattern order, so the first quarter of a
+// tile's blades is itself spread evenly, which is what the billboards
+// draw. That quarter and the rest are then each put in Morton order.
+//
+// Update() frees the slots of tiles that have gone out of range and fills
+// a bounded number of free ones with the nearest missing tiles. Blades are
+// placed on the pool's threads, and bake.cs.glsl works out the rest of
+// each blade straight into its slot.
+class GrassTiles
+{
+public:
+  enum
+  {
+    TILE_SIZE = 32,
+    TILE_BLADES = TILE_SIZE * TILE_SIZE,
+    WORLD_TILES = 256,
+    WORLD_SIZE = WORLD_TILES * TILE_SIZE,
+
+    // Enough for every tile within about 900 units of the eye
+    SLOT_COUNT = 2560,
+
+    // Bytes bake.cs.glsl writes per blade
+    INSTANCE_SIZE = 4 * sizeof(GLuint)
+  };
+
+  // A slot's blades start at instance slot * TILE_BLADES
+  struct Slot
+  {
+    // The tile held, or -1 if the slot is free
+    int x;
+    int z;
+    GLuint blades;
+  };
+
+  explicit GrassTiles(sb7::thread_pool& pool);
+
+  // Copies the density map out of density_texture, makes the pattern and
+  // the buffers and loads bake.cs.glsl. The bake reads the other textures
+  // from the units main.cpp leaves them bound to.
+  void Create(GLuint density_texture);
+  void Destroy();
+
+  // Frees the tiles further than distance + TILE_SIZE from eye, then
+  // streams in up to max_tiles of the missing ones within distance,
+  // nearest first. Returns the number streamed.
+  int Update(const vmath::vec3& eye, float distance, int max_tiles);
+
+  // The blades, four words each, in slots of TILE_BLADES
+  GLuint Buffer() const                 { return m_instance_buffer; }
+  const Slot *Slots() const             { return m_slots.data(); }
+  int Resident() const                  { return SLOT_COUNT - int(m_free.size()); }
+
+  // The lowest corner of a tile. The field is centered on the origin.
+  static vmath::vec2 TileOrigin(int x, int z)
+  {
+    return vmath::vec2(float(x * TILE_SIZE - WORLD_SIZE / 2),
+                       float(z * TILE_SIZE - WORLD_SIZE / 2));
+  }
+
+private:
+  void MakePattern();
+  float Density(float x, float z) const;
+
+  // Writes the kept blades of tile (x, z) to blades, four words each as
+  // bake.cs.glsl reads them, and returns how many there are
+  GLuint PlaceBlades(int x, int z, GLuint *blades) const;
+
+  sb7::thread_pool& m_pool;
+
+  std::vector<vmath::vec2> m_pattern;
+
+  std::vector<unsigned char> m_density;
+  int m_density_width;
+  int m_density_height;
+
+  std::vector<Slot> m_slots;
+  std::vector<int> m_free;
+
+  // The slot each tile is in, or -1
+  std::vector<int> m_tile_slots;
+
+  // Tiles in range with no slot, and their distance from the eye
+  std::vector<std::pair<float, int> > m_missing;
+
+  // The tiles of the last Update(), and their blades
+  std::vector<GLuint> m_tile_data;
+  std::vector<GLuint> m_blade_data;
+
+  GLuint m_instance_buffer;
+  GLuint m_blade_buffer;
+  GLuint m_tile_buffer;
+  GLuint m_bake_program;
+};
+
+#endif /* __GRASSTILES_H__ */
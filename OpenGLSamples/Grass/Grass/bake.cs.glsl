@@ -0,0 +1,94 @@
+#version 450 core
+
+// Works out once what grass.vs.glsl would otherwise redo for every vertex
+// of every blade: the tint, the four texture lookups and the palette
+// color. GrassTiles places the blades of each tile it streams in, and
+// this writes them into the tile's slot, four words per blade:
+//
+//   x, y  position in x and z, as float bits
+//   z     orientation, length and bend as RGBA8, w unused
+//   w     color as RGBA8
+//
+// There is one row of work groups per tile.
+
+layout (local_size_x = 256) in;
+
+layout (binding = 0) uniform sampler1D grasspallete_texture;
+layout (binding = 1) uniform sampler2D length_texture;
+layout (binding = 2) uniform sampler2D orientation_texture;
+layout (binding = 3) uniform sampler2D grasscolor_texture;
+layout (binding = 4) uniform sampler2D bend_texture;
+
+layout (binding = 0, std430) writeonly buffer instance_block
+{
+	uvec4 instance_data[];
+};
+
+// Per blade from GrassTiles: x and z as float bits and a seed, in rows of
+// tile_blades per tile
+layout (binding = 1, std430) readonly buffer blade_block
+{
+	uvec4 blades[];
+};
+
+// Per tile: its slot and number of blades, then the tile
+layout (binding = 2, std430) readonly buffer tile_block
+{
+	uvec4 tiles[];
+};
+
+// Must match GrassTiles::TILE_BLADES
+const uint tile_blades = 1024u;
+
+int Random (int seed, int iterations)
+{
+	int value = seed;
+
+	for (int n = 0; n < iterations; ++n) 
+	{
+		value = ((value >> 7) ^ (value << 9)) * 15485863;
+	}
+
+	return value;
+}
+
+vec4 RandomVector(int seed)
+{
+	int r = Random(seed, 4);
+	int g = Random(r, 2);
+	int b = Random(g, 2);
+	int a = Random(b, 2);
+
+	return vec4(float(r & 0x3FF)/1024.0,
+				float(g & 0x3FF)/1024.0,
+				float(b & 0x3FF)/1024.0,
+				float(a & 0x3FF)/1024.0);
+}
+
+void main(void)
+{
+	uvec4 tile = tiles[gl_WorkGroupID.y];
+	uint i = gl_GlobalInvocationID.x;
+
+	if (i >= tile.y)
+	{
+		return;
+	}
+
+	uvec4 blade = blades[gl_WorkGroupID.y * tile_blades + i];
+	vec2 offset = uintBitsToFloat(blade.xy);
+	int id = int(blade.z);
+
+	vec2 texcoord = offset / 1024.0 + vec2(0.5);
+
+	float bend = textureLod(bend_texture, texcoord, 0.0).r;
+	float orientation = textureLod(orientation_texture, texcoord, 0.0).r;
+	float blade_length = textureLod(length_texture, texcoord, 0.0).r;
+
+	vec4 color = textureLod(grasspallete_texture, textureLod(grasscolor_texture, texcoord, 0.0).r, 0.0) +
+				 vec4(RandomVector(id).xyz * vec3(0.1, 0.5, 0.1), 1.0);
+
+	instance_data[tile.x * tile_blades + i] = uvec4(blade.xy,
+	                                                packUnorm4x8(vec4(orientation, blade_length, bend, 0.0)),
+	                                                packUnorm4x8(color));
+}
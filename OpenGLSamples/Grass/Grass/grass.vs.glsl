@@ -1,41 +1,19 @@
 #version 450 core
 
-in vec4 vVertex;
+// z is 1 for billboard vertices
+layout (location = 0) in vec4 vVertex;
+
+// What bake.cs.glsl worked out for this instance's blade. Each tile's
+// blades are together in a slot, so that a draw can pick out a tile with
+// its base instance.
+layout (location = 1) in uvec4 instance;
 
 out vec4 color;
 
 uniform mat4 mvpMatrix;
 
-layout (binding = 0) uniform sampler1D grasspallete_texture;
-layout (binding = 1) uniform sampler2D length_texture;
-layout (binding = 2) uniform sampler2D orientation_texture;
-layout (binding = 3) uniform sampler2D grasscolor_texture;
-layout (binding = 4) uniform sampler2D bend_texture;
-
-int Random (int seed, int iterations)
-{
-	int value = seed;
-
-	for (int n = 0; n < iterations; ++n) 
-	{
-		value = ((value >> 7) ^ (value << 9)) * 15485863;
-	}
-
-	return value;
-}
-
-vec4 RandomVector(int seed)
-{
-	int r = Random(gl_InstanceID, 4);
-	int g = Random(r, 2);
-	int b = Random(g, 2);
-	int a = Random(b, 2);
-
-	return vec4(float(r & 0x3FF)/1024.0,
-							float(g & 0x3FF)/1024.0,
-							float(b & 0x3FF)/1024.0,
-							float(a & 0x3FF)/1024.0);
-}
+// Billboards turn to face this
+uniform vec3 eye;
 
 mat4 CunstructRotationMatrix(float angle)
 {
@@ -50,32 +28,35 @@ mat4 CunstructRotationMatrix(float angle)
 
 void main(void)
 {
-	vec4 offset = vec4(float(gl_InstanceID >> 10) - 512.0,
+	bool billboard = vVertex.z > 0.5;
+	vec4 vertex = vec4(vVertex.xy, 0.0, 1.0);
+
+	vec4 offset = vec4(uintBitsToFloat(instance.x),
 										 0.0f,
-										 float(gl_InstanceID & 0x3FF) - 512.0,
+										 uintBitsToFloat(instance.y),
 										 0.0f);
 
-	int number1 = Random(gl_InstanceID, 3);
-	int number2 = Random(number1, 2);
+	// Orientation, length and bend
+	vec4 shape = unpackUnorm4x8(instance.z);
 
-	offset += vec4(float(number1 & 0xFF) / 256.0,
-								 0.0f,
-								 float(number2 & 0xFF) / 256.0,
-								 0.0f);
+	float bend_factor = shape.z * 2.0;
+	float bend_amount = cos(vertex.y);
 
-	vec2 texcoord = offset.xz / 1024.0 + vec2(0.5);
+	float angle = shape.x * 2.0 * 3.141592;
 
-	float bend_factor = texture(bend_texture, texcoord).r * 2.0;
-	float bend_amount = cos(vVertex.y);
+	if (billboard)
+	{
+		// Turn the blade's width across the line to the eye
+		vec2 to_eye = eye.xz - offset.xz;
+		angle = atan(to_eye.x, -to_eye.y);
+	}
 
-	float angle = texture(orientation_texture, texcoord).r * 2.0 * 3.141592;
 	mat4 rot = CunstructRotationMatrix(angle);
-	vec4 position = (rot * (vVertex + vec4(0.0,0.0, bend_amount * bend_factor,0.0))) + offset;
+	vec4 position = (rot * (vertex + vec4(0.0,0.0, bend_amount * bend_factor,0.0))) + offset;
 
-	position *= vec4(1.0, texture(length_texture, texcoord).r * 0.9 + 0.3, 1.0, 1.0);
+	position *= vec4(1.0, shape.y * 0.9 + 0.3, 1.0, 1.0);
 
 	gl_Position = mvpMatrix * position;
 
-	color = texture(grasspallete_texture, texture(grasscolor_texture, texcoord).r)+
-					vec4(RandomVector(gl_InstanceID).xyz * vec3(0.1, 0.5, 0.1), 1.0);
-}
\ No newline at end of file
+	color = unpackUnorm4x8(instance.w);
+}
@@ -2,7 +2,12 @@
 #include <vmath.h>
 #include <sb7ktx.h>
 
+#include <math.h>
+#include <chrono>
 #include <string>
+#include <vector>
+
+#include "GrassTiles.h"
 
 #define GLSL(version, shader) "#version " #version "\n" #shader  
 
@@ -32,19 +37,148 @@ static const GLchar* fragment_shader_source = GLSL
 
 );
 
+enum
+{
+  LOD_COUNT = 4,
+
+  // The most tiles streamed in a frame
+  STREAM_TILES = 32,
+
+  // Timer queries in flight, and frames averaged for the title
+  TIMER_QUERIES = 4,
+  TIMED_FRAMES = 64
+};
+
+enum
+{
+  // Every tile in memory at full detail
+  MODE_BRUTE_FORCE,
+  // Tiles culled against the frustum, at a level of detail for their
+  // distance
+  MODE_CULLED,
+  MODE_COUNT
+};
+
+static const char *mode_names[MODE_COUNT] = { "brute force", "culled" };
+
+struct DrawArraysIndirectCommand
+{
+  GLuint count;
+  GLuint primCount;
+  GLuint first;
+  GLuint baseInstance;
+};
+
+// Each level of detail's vertices in grass_buffer, the share of a tile's
+// blades it draws, and the distance from the eye to a tile's center up to
+// which it is used. Tiles further than the last are not drawn.
+static const struct
+{
+  GLuint first;
+  GLuint count;
+  GLuint share;
+  float distance;
+} lods[LOD_COUNT] =
+{
+  {  0, 6, 1,  64.0f },
+  {  6, 4, 1, 160.0f },
+  { 10, 3, 1, 320.0f },
+  { 13, 3, 4, 800.0f }
+};
+
+// Tiles are streamed in a little before they are needed
+static const float stream_distance = lods[LOD_COUNT - 1].distance + GrassTiles::TILE_SIZE;
+
+// The eye circles the middle of the field
+static vmath::vec3 EyeAt(float t)
+{
+  const float r = 2500.0f;
+
+  return vmath::vec3(sinf(t) * r, 25.0f, cosf(t) * r);
+}
+
+// Planes with normals pointing inwards, from a combined view-projection
+// matrix
+static void FrustumPlanes(const vmath::mat4& viewproj_matrix, vmath::vec4 planes[6])
+{
+  for (int i = 0; i < 3; ++i)
+  {
+    for (int j = 0; j < 2; ++j)
+    {
+      vmath::vec4 plane;
+
+      for (int k = 0; k < 4; ++k)
+      {
+        plane[k] = viewproj_matrix[k][3] + (j ? -viewproj_matrix[k][i] : viewproj_matrix[k][i]);
+      }
+
+      planes[i * 2 + j] = plane / vmath::length(vmath::vec3(plane[0], plane[1], plane[2]));
+    }
+  }
+}
+
+static bool BoxVisible(const vmath::vec4 planes[6], const vmath::vec3& box_min, const vmath::vec3& box_max)
+{
+  for (int i = 0; i < 6; ++i)
+  {
+    // The corner furthest along the plane's normal
+    float d = planes[i][3];
+
+    for (int k = 0; k < 3; ++k)
+    {
+      d += planes[i][k] * (planes[i][k] >= 0.0f ? box_max[k] : box_min[k]);
+    }
+
+    if (d < 0.0f)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
 class Grass : public sb7::application
 {
 public:
+  Grass()
+    : tiles(pool),
+      mode(MODE_CULLED),
+      blades_drawn(0),
+      timer_frame(0),
+      timed_frames(0),
+      gpu_time(0.0),
+      cull_time(0.0),
+      stream_time(0.0),
+      tiles_streamed(0)
+  {
+  }
+
   void startup(void) override
   {
-    static const GLfloat grass_blade[] =
+    // Each level of detail in turn. z is 1 for the billboard, which is
+    // turned to face the eye and stands in for four blades.
+    static constexpr vmath::vec3 grass_blade[] =
     {
-       -0.3f, 0.0f,
-        0.3f, 0.0f,
-       -0.2f, 1.0f,
-        0.1f, 1.3f,
-      -0.05f, 2.3f,
-        0.0f, 3.3f
+      vmath::vec3( -0.3f, 0.0f, 0.0f),
+      vmath::vec3(  0.3f, 0.0f, 0.0f),
+      vmath::vec3( -0.2f, 1.0f, 0.0f),
+      vmath::vec3(  0.1f, 1.3f, 0.0f),
+      vmath::vec3(-0.05f, 2.3f, 0.0f),
+      vmath::vec3(  0.0f, 3.3f, 0.0f),
+
+      vmath::vec3( -0.3f, 0.0f, 0.0f),
+      vmath::vec3(  0.3f, 0.0f, 0.0f),
+      vmath::vec3( -0.1f, 1.6f, 0.0f),
+      vmath::vec3(  0.0f, 3.3f, 0.0f),
+
+      vmath::vec3( -0.3f, 0.0f, 0.0f),
+      vmath::vec3(  0.3f, 0.0f, 0.0f),
+      vmath::vec3(  0.0f, 3.3f, 0.0f),
+
+      vmath::vec3( -0.6f, 0.0f, 1.0f),
+      vmath::vec3(  0.6f, 0.0f, 1.0f),
+      vmath::vec3(  0.0f, 3.3f, 1.0f)
     };
 
     glGenBuffers(1, &grass_buffer);
@@ -55,9 +189,18 @@ public:
     glGenVertexArrays(1, &grass_vao);
     glBindVertexArray(grass_vao);
 
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
     glEnableVertexAttribArray(0);
 
+    glGenBuffers(1, &draw_buffer);
+
+    glGenQueries(TIMER_QUERIES, timer_queries);
+
+    for (int i = 0; i < TIMER_QUERIES; ++i)
+    {
+      timer_pending[i] = false;
+    }
+
     grass_program = glCreateProgram();
     GLuint grass_vs = glCreateShader(GL_VERTEX_SHADER);
     GLuint grass_fs = glCreateShader(GL_FRAGMENT_SHADER);
@@ -109,6 +252,7 @@ public:
     glDeleteShader(grass_vs);
 
     uniforms.mvp_matrix = glGetUniformLocation(grass_program, "mvpMatrix");
+    uniforms.eye = glGetUniformLocation(grass_program, "eye");
 
     glActiveTexture(GL_TEXTURE1);
     tex_grass_length = 
@@ -122,17 +266,151 @@ public:
     glActiveTexture(GL_TEXTURE4);
     tex_grass_bend = 
         sb7::ktx::file::load("../../../media/textures/grass_bend.ktx");
+
+    tiles.Create(tex_grass_length);
+
+    glBindVertexArray(grass_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, tiles.Buffer());
+    glVertexAttribIPointer(1, 4, GL_UNSIGNED_INT, 0, nullptr);
+    glVertexAttribDivisor(1, 1);
+    glEnableVertexAttribArray(1);
+
+    // Everything around the starting point, so the first frame is whole
+    const auto start = std::chrono::steady_clock::now();
+    const int streamed = tiles.Update(EyeAt(0.0f), stream_distance, GrassTiles::SLOT_COUNT);
+    const double stream_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (info.flags.headless)
+    {
+      fprintf(stderr, "Grass: streamed %d tiles, %u slots of %d bytes, in %.3f ms\n",
+              streamed, unsigned(GrassTiles::SLOT_COUNT), int(GrassTiles::TILE_BLADES * GrassTiles::INSTANCE_SIZE),
+              1000.0 * stream_time);
+
+      RunBenchmark();
+      glfwSetWindowShouldClose(window, GL_TRUE);
+    }
   }
 
   void shutdown(void) override
   {
+    glDeleteQueries(TIMER_QUERIES, timer_queries);
+    glDeleteBuffers(1, &draw_buffer);
+    tiles.Destroy();
     glDeleteProgram(grass_program);
   }
 
   void render(double current_time) override
   {
-    float t = (float)current_time * 0.02f;
-    float r = 550.0f;
+    ReadTimers();
+
+    const int slot = timer_frame;
+
+    DrawFrame((float)current_time * 0.02f, timer_queries[slot], STREAM_TILES);
+    timer_pending[slot] = true;
+    timer_frame = (timer_frame + 1) % TIMER_QUERIES;
+  }
+
+  void onKey(int key, int action) override
+  {
+    if (action)
+    {
+      switch (key)
+      {
+      case 'M':
+        mode = (mode + 1) % MODE_COUNT;
+        break;
+      case 'B':
+        RunBenchmark();
+        break;
+      }
+    }
+  }
+
+private:
+  // Fills commands with one per tile in memory. In MODE_CULLED, tiles
+  // are culled against the frustum and by distance and each gets its
+  // level of detail.
+  void BuildCommands(const vmath::mat4& viewproj_matrix, const vmath::vec3& eye)
+  {
+    // Room for blades leaning out of their tile, and their tallest height
+    static const float margin = 2.5f;
+    static const float height = 4.5f;
+
+    vmath::vec4 planes[6];
+    FrustumPlanes(viewproj_matrix, planes);
+
+    commands.clear();
+    blades_drawn = 0;
+
+    for (int l = 0; l < LOD_COUNT; ++l)
+    {
+      lod_tiles[l] = 0;
+    }
+
+    const GrassTiles::Slot *slots = tiles.Slots();
+
+    for (GLuint s = 0; s < GrassTiles::SLOT_COUNT; ++s)
+    {
+      if (slots[s].x < 0)
+      {
+        continue;
+      }
+
+      int l = 0;
+
+      if (mode == MODE_CULLED)
+      {
+        const vmath::vec2 origin = GrassTiles::TileOrigin(slots[s].x, slots[s].z);
+        const vmath::vec3 box_min(origin[0] - margin, 0.0f, origin[1] - margin);
+        const vmath::vec3 box_max(origin[0] + GrassTiles::TILE_SIZE + margin, height,
+                                  origin[1] + GrassTiles::TILE_SIZE + margin);
+
+        if (!BoxVisible(planes, box_min, box_max))
+        {
+          continue;
+        }
+
+        const float distance = vmath::length((box_min + box_max) * 0.5f - eye);
+
+        while (l < LOD_COUNT && distance >= lods[l].distance)
+        {
+          ++l;
+        }
+
+        if (l == LOD_COUNT)
+        {
+          continue;
+        }
+      }
+
+      // The first blades of a tile are spread over all of it
+      const GLuint blades = slots[s].blades / lods[l].share;
+
+      if (blades == 0)
+      {
+        continue;
+      }
+
+      lod_tiles[l]++;
+      blades_drawn += blades;
+
+      const DrawArraysIndirectCommand command = { lods[l].count, blades, lods[l].first, s * GrassTiles::TILE_BLADES };
+      commands.push_back(command);
+    }
+  }
+
+  // Streams in up to max_tiles tiles around the eye at time t, then draws
+  // the field as seen from there. timer_query, if not zero, times the
+  // draws.
+  void DrawFrame(float t, GLuint timer_query, int max_tiles)
+  {
+    const vmath::vec3 eye = EyeAt(t);
+
+    const auto stream_start = std::chrono::steady_clock::now();
+
+    tiles_streamed += tiles.Update(eye, stream_distance, max_tiles);
+
+    stream_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - stream_start).count();
 
     static const GLfloat black[] = {0.0f, 0.0f, 0.0f, 1.0f};
     static const GLfloat one = 1.0f;
@@ -140,7 +418,7 @@ public:
     glClearBufferfv(GL_DEPTH, 0, &one);
 
     vmath::mat4 mv_matrix = 
-        vmath::lookat(vmath::vec3(sinf(t) * r, 25.0f, cosf(t) * r),
+        vmath::lookat(eye,
                       vmath::vec3(0.0f, -50.0f, 0.0f),
                       vmath::vec3(0.0f, 1.0f, 0.0f));
 
@@ -149,10 +427,13 @@ public:
                                                 (float)info.windowHeight,
                                                 0.1f, 1000.0f); 
 
+    const vmath::mat4 mvp_matrix = prj_matrix * mv_matrix;
+
     glUseProgram(grass_program);
 
     glUniformMatrix4fv(uniforms.mvp_matrix, 1, 
-                       GL_FALSE, (prj_matrix * mv_matrix));
+                       GL_FALSE, mvp_matrix);
+    glUniform3fv(uniforms.eye, 1, eye);
 
     glEnable(GL_DEPTH_TEST);
     glDepthFunc(GL_LEQUAL);
@@ -161,13 +442,145 @@ public:
 
     glBindVertexArray(grass_vao);
 
-    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0,6, 1024 * 1024);
+    const auto start = std::chrono::steady_clock::now();
+
+    BuildCommands(mvp_matrix, eye);
+
+    cull_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Orphan last frame's commands, which may still be in use
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, draw_buffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, GrassTiles::SLOT_COUNT * sizeof(DrawArraysIndirectCommand),
+                 nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, commands.size() * sizeof(DrawArraysIndirectCommand),
+                    commands.data());
+
+    if (timer_query)
+    {
+      glBeginQuery(GL_TIME_ELAPSED, timer_query);
+    }
+
+    glMultiDrawArraysIndirect(GL_TRIANGLE_STRIP, nullptr, GLsizei(commands.size()), 0);
+
+    if (timer_query)
+    {
+      glEndQuery(GL_TIME_ELAPSED);
+    }
+  }
+
+  // Adds up the draw times that have landed, and shows their average
+  // every TIMED_FRAMES frames
+  void ReadTimers()
+  {
+    for (int i = 0; i < TIMER_QUERIES; ++i)
+    {
+      GLuint available = GL_FALSE;
+
+      if (timer_pending[i])
+      {
+        glGetQueryObjectuiv(timer_queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+      }
+
+      if (!available)
+      {
+        continue;
+      }
+
+      GLuint64 elapsed;
+      glGetQueryObjectui64v(timer_queries[i], GL_QUERY_RESULT, &elapsed);
+      gpu_time += double(elapsed) * 1.0e-9;
+      timer_pending[i] = false;
+
+      if (++timed_frames == TIMED_FRAMES)
+      {
+        char buffer[256];
+
+        sprintf(buffer, "Grass: %s, %u blades, LOD tiles %u/%u/%u/%u, %d resident, %.1f streamed, draw %.2f ms, cull %.3f ms, stream %.3f ms",
+                mode_names[mode], blades_drawn,
+                lod_tiles[0], lod_tiles[1], lod_tiles[2], lod_tiles[3], tiles.Resident(),
+                double(tiles_streamed) / timed_frames, 1000.0 * gpu_time / timed_frames,
+                1000.0 * cull_time / timed_frames, 1000.0 * stream_time / timed_frames);
+        setWindowTitle(buffer);
+
+        gpu_time = 0.0;
+        cull_time = 0.0;
+        stream_time = 0.0;
+        tiles_streamed = 0;
+        timed_frames = 0;
+      }
+    }
+  }
+
+  // Draws the same frames in each mode, waiting for each frame's timer,
+  // and prints the blades drawn, the draw and cull times and what was
+  // streamed
+  void RunBenchmark()
+  {
+    static const int frames = 32;
+
+    const int saved_mode = mode;
+    char buffer[256];
+    GLuint query;
+
+    glGenQueries(1, &query);
+
+    for (mode = 0; mode < MODE_COUNT; ++mode)
+    {
+      double draw_total = 0.0;
+      double cull_total = 0.0;
+      double stream_total = 0.0;
+      double blades_total = 0.0;
+      double tiles_total = 0.0;
+
+      for (int i = 0; i < frames; ++i)
+      {
+        GLuint64 elapsed;
+
+        // Once around the field
+        const float t = 6.2831853f * i / frames;
+
+        // The frames are far apart, so each streams in every tile it
+        // is missing
+        cull_time = 0.0;
+        stream_time = 0.0;
+        tiles_streamed = 0;
+        DrawFrame(t, query, GrassTiles::SLOT_COUNT);
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+
+        draw_total += double(elapsed) * 1.0e-9;
+        cull_total += cull_time;
+        stream_total += stream_time;
+        blades_total += blades_drawn;
+        tiles_total += tiles_streamed;
+      }
+
+      sprintf(buffer, "Grass: %-11s %9.0f blades, draw %.3f ms, cull %.3f ms, %.0f tiles streamed in %.3f ms",
+              mode_names[mode], blades_total / frames,
+              1000.0 * draw_total / frames, 1000.0 * cull_total / frames,
+              tiles_total / frames, 1000.0 * stream_total / frames);
+      fprintf(stderr, "%s\n", buffer);
+    }
+
+    glDeleteQueries(1, &query);
+
+    mode = saved_mode;
+    cull_time = 0.0;
+    stream_time = 0.0;
+    tiles_streamed = 0;
+    setWindowTitle(buffer);
   }
 
 private:
   GLuint grass_buffer;
   GLuint grass_vao;
 
+  sb7::thread_pool pool;
+  GrassTiles tiles;
+
+  // The frame's commands
+  GLuint draw_buffer;
+  std::vector<DrawArraysIndirectCommand> commands;
+
   GLuint grass_program;
 
   GLuint tex_grass_color;
@@ -178,7 +591,26 @@ private:
   struct
   {
     GLuint mvp_matrix;
+    GLuint eye;
   } uniforms;
+
+  // One of MODE_BRUTE_FORCE and MODE_CULLED
+  int mode;
+
+  // What the last frame drew
+  GLuint blades_drawn;
+  GLuint lod_tiles[LOD_COUNT];
+
+  // Draw timers, read back a few frames late, and the draw, cull and
+  // stream times and tiles streamed since the title last showed them
+  GLuint timer_queries[TIMER_QUERIES];
+  bool timer_pending[TIMER_QUERIES];
+  int timer_frame;
+  int timed_frames;
+  double gpu_time;
+  double cull_time;
+  double stream_time;
+  GLuint tiles_streamed;
 };
 
 DECLARE_MAIN(Grass);
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <sb7.h>
+#include <vmath.h>
 
 #include <vector>
 
@@ -23,12 +24,12 @@ public:
       1.0f, 1.0f, 0.0f, 1.0f
     };
 
-    static const GLfloat instance_positions[] =
+    static constexpr vmath::vec4 instance_positions[] =
     {
-      -2.0f, -2.0f, 0.0f, 0.0f,
-       2.0f, -2.0f, 0.0f, 0.0f,
-       2.0f,  2.0f, 0.0f, 0.0f,
-      -2.0f,  2.0f, 0.0f, 0.0f
+      vmath::vec4(-2.0f, -2.0f, 0.0f, 0.0f),
+      vmath::vec4( 2.0f, -2.0f, 0.0f, 0.0f),
+      vmath::vec4( 2.0f,  2.0f, 0.0f, 0.0f),
+      vmath::vec4(-2.0f,  2.0f, 0.0f, 0.0f)
     };
 
     GLuint offset = 0;
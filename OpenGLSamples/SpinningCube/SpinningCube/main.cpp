@@ -1,8 +1,46 @@
 #include "sb7.h"
 #include "vmath.h"
+#include "vmath_lazy.h"
+#include "sb7cmdlist.h"
+#include "sb7glstate.h"
 
 #define GLSL(version, shader) "#version " #version "\n" #shader  
 
+// vmath's constexpr paths, checked once here rather than in every user of
+// vmath.h. perspective() runs constexpr_tan in place of tanf, so its
+// reference values are 1/tanf of half the field of view.
+static constexpr bool close_to(double a, double b, double tolerance)
+{
+  return (a - b <= tolerance) && (b - a <= tolerance);
+}
+
+static_assert(close_to(vmath::constexpr_sin(0.5), 0.479425538604203, 1e-12), "constexpr_sin");
+static_assert(close_to(vmath::constexpr_sin(2.5), 0.598472144103956, 1e-12), "constexpr_sin");
+static_assert(close_to(vmath::constexpr_sin(-4.0), 0.756802495307928, 1e-12), "constexpr_sin");
+static_assert(close_to(vmath::constexpr_sin(20.0), 0.912945250727628, 1e-12), "constexpr_sin");
+static_assert(close_to(vmath::constexpr_cos(1.0), 0.540302305868140, 1e-12), "constexpr_cos");
+static_assert(close_to(vmath::constexpr_tan(1.0), 1.557407724654902, 1e-12), "constexpr_tan");
+static_assert(close_to(vmath::constexpr_tan(-0.3), -0.309336249609623, 1e-12), "constexpr_tan");
+static_assert(close_to(vmath::constexpr_tan(0.25f), 0.255341921, 1e-6), "constexpr_tan");
+
+static_assert(close_to(vmath::perspective(90.0f, 1.0f, 1.0f, 3.0f)[1][1], 1.0, 1e-6), "perspective");
+static_assert(close_to(vmath::perspective(90.0f, 2.0f, 1.0f, 3.0f)[0][0], 0.5, 1e-6), "perspective");
+static_assert(close_to(vmath::perspective(60.0f, 1.0f, 1.0f, 3.0f)[1][1], 1.732050808, 1e-6), "perspective");
+static_assert(close_to(vmath::perspective(50.0f, 1.0f, 1.0f, 3.0f)[1][1], 2.144506921, 1e-6), "perspective");
+static_assert(close_to(vmath::perspective(10.0f, 1.0f, 1.0f, 3.0f)[1][1], 11.430052302, 1e-5), "perspective");
+static_assert(close_to(vmath::perspective(170.0f, 1.0f, 1.0f, 3.0f)[1][1], 0.087488664, 1e-6), "perspective");
+static_assert(vmath::perspective(90.0f, 1.0f, 1.0f, 3.0f)[2][2] == -2.0f, "perspective");
+static_assert(vmath::perspective(90.0f, 1.0f, 1.0f, 3.0f)[3][2] == -3.0f, "perspective");
+static_assert(vmath::perspective(90.0f, 1.0f, 1.0f, 3.0f)[2][3] == -1.0f, "perspective");
+static_assert(vmath::frustum(-1.0f, 1.0f, -1.0f, 1.0f, 1.0f, 3.0f)[3][2] == -3.0f, "frustum");
+static_assert(vmath::ortho(-2.0f, 2.0f, -1.0f, 1.0f, 0.5f, 10.5f)[0][0] == 0.5f, "ortho");
+static_assert(vmath::ortho(-2.0f, 2.0f, -1.0f, 1.0f, 0.5f, 10.5f)[2][2] == -0.2f, "ortho");
+static_assert(vmath::ortho(-2.0f, 2.0f, -1.0f, 1.0f, 0.5f, 10.5f)[3][2] == 1.1f, "ortho");
+static_assert(vmath::translate(1.0f, 2.0f, 3.0f)[3][1] == 2.0f, "translate");
+static_assert((vmath::translate(1.0f, 2.0f, 3.0f) * vmath::scale(2.0f))[3][2] == 3.0f, "translate");
+static_assert((vmath::scale(2.0f) * vmath::translate(1.0f, 2.0f, 3.0f))[3][2] == 6.0f, "scale");
+static_assert((vmath::mat4::identity() * vmath::vec4(1.0f, 2.0f, 3.0f, 1.0f))[2] == 3.0f, "identity");
+
 static const GLchar* vertex_shader_source = GLSL
 (
   450 core,
@@ -54,6 +92,9 @@ static const GLchar* fragment_shader_source = GLSL
 class SpinningCube : public sb7::application
 {
 public:
+  SpinningCube()
+    : recorder(pool) {}
+
   void LoadShaders()
   {
     program = glCreateProgram();
@@ -84,55 +125,55 @@ public:
     glGenVertexArrays(1, &vao);
     glBindVertexArray(vao);
 
-    static const GLfloat vertex_position[] =
+    static constexpr vmath::vec3 vertex_position[] =
     {
-      -0.25f,  0.25f, -0.25f,
-      -0.25f, -0.25f, -0.25f,
-      0.25f, -0.25f, -0.25f,
+      vmath::vec3(-0.25f,  0.25f, -0.25f),
+      vmath::vec3(-0.25f, -0.25f, -0.25f),
+      vmath::vec3( 0.25f, -0.25f, -0.25f),
 
-      0.25f, -0.25f, -0.25f,
-      0.25f,  0.25f, -0.25f,
-      -0.25f,  0.25f, -0.25f,
+      vmath::vec3( 0.25f, -0.25f, -0.25f),
+      vmath::vec3( 0.25f,  0.25f, -0.25f),
+      vmath::vec3(-0.25f,  0.25f, -0.25f),
 
-      0.25f, -0.25f, -0.25f,
-      0.25f, -0.25f,  0.25f,
-      0.25f,  0.25f, -0.25f,
+      vmath::vec3( 0.25f, -0.25f, -0.25f),
+      vmath::vec3( 0.25f, -0.25f,  0.25f),
+      vmath::vec3( 0.25f,  0.25f, -0.25f),
 
-      0.25f, -0.25f,  0.25f,
-      0.25f,  0.25f,  0.25f,
-      0.25f,  0.25f, -0.25f,
+      vmath::vec3( 0.25f, -0.25f,  0.25f),
+      vmath::vec3( 0.25f,  0.25f,  0.25f),
+      vmath::vec3( 0.25f,  0.25f, -0.25f),
 
-      0.25f, -0.25f,  0.25f,
-      -0.25f, -0.25f,  0.25f,
-      0.25f,  0.25f,  0.25f,
+      vmath::vec3( 0.25f, -0.25f,  0.25f),
+      vmath::vec3(-0.25f, -0.25f,  0.25f),
+      vmath::vec3( 0.25f,  0.25f,  0.25f),
 
-      -0.25f, -0.25f,  0.25f,
-      -0.25f,  0.25f,  0.25f,
-      0.25f,  0.25f,  0.25f,
+      vmath::vec3(-0.25f, -0.25f,  0.25f),
+      vmath::vec3(-0.25f,  0.25f,  0.25f),
+      vmath::vec3( 0.25f,  0.25f,  0.25f),
 
-      -0.25f, -0.25f,  0.25f,
-      -0.25f, -0.25f, -0.25f,
-      -0.25f,  0.25f,  0.25f,
+      vmath::vec3(-0.25f, -0.25f,  0.25f),
+      vmath::vec3(-0.25f, -0.25f, -0.25f),
+      vmath::vec3(-0.25f,  0.25f,  0.25f),
 
-      -0.25f, -0.25f, -0.25f,
-      -0.25f,  0.25f, -0.25f,
-      -0.25f,  0.25f,  0.25f,
+      vmath::vec3(-0.25f, -0.25f, -0.25f),
+      vmath::vec3(-0.25f,  0.25f, -0.25f),
+      vmath::vec3(-0.25f,  0.25f,  0.25f),
 
-      -0.25f, -0.25f,  0.25f,
-      0.25f, -0.25f,  0.25f,
-      0.25f, -0.25f, -0.25f,
+      vmath::vec3(-0.25f, -0.25f,  0.25f),
+      vmath::vec3( 0.25f, -0.25f,  0.25f),
+      vmath::vec3( 0.25f, -0.25f, -0.25f),
 
-      0.25f, -0.25f, -0.25f,
-      -0.25f, -0.25f, -0.25f,
-      -0.25f, -0.25f,  0.25f,
+      vmath::vec3( 0.25f, -0.25f, -0.25f),
+      vmath::vec3(-0.25f, -0.25f, -0.25f),
+      vmath::vec3(-0.25f, -0.25f,  0.25f),
 
-      -0.25f,  0.25f, -0.25f,
-      0.25f,  0.25f, -0.25f,
-      0.25f,  0.25f,  0.25f,
+      vmath::vec3(-0.25f,  0.25f, -0.25f),
+      vmath::vec3( 0.25f,  0.25f, -0.25f),
+      vmath::vec3( 0.25f,  0.25f,  0.25f),
 
-      0.25f,  0.25f,  0.25f,
-      -0.25f,  0.25f,  0.25f,
-      -0.25f,  0.25f, -0.25f
+      vmath::vec3( 0.25f,  0.25f,  0.25f),
+      vmath::vec3(-0.25f,  0.25f,  0.25f),
+      vmath::vec3(-0.25f,  0.25f, -0.25f)
     };
 
     glGenBuffers(1, &buffer);
@@ -145,11 +186,13 @@ public:
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
     glEnableVertexAttribArray(0);
 
-    glEnable(GL_CULL_FACE);
+    state.enable(GL_CULL_FACE);
     glFrontFace(GL_CW);
 
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LEQUAL);
+    state.enable(GL_DEPTH_TEST);
+    state.set_depth_func(GL_LEQUAL);
+
+    onResize(info.windowWidth, info.windowHeight);
   }
 
   virtual void render(double current_time) override
@@ -160,26 +203,32 @@ public:
     glClearBufferfv(GL_COLOR, 0, green);
     glClearBufferfi(GL_DEPTH_STENCIL, 0, 1.0f, 0);
 
-    glUseProgram(program);
+    state.use_program(program);
 
     glUniformMatrix4fv(proj_location, 1, GL_FALSE, proj_matrix);
 
-    for (int i = 0; i < 24; ++i) 
+    // The cubes' matrices are built on the worker threads, which record
+    // the uniform updates and draws for this thread to replay
+    recorder.record(24, [&](sb7::cmd_list& list, size_t first, size_t last)
     {
-      float f = float(i) + (float)current_time*0.314f;
-      vmath::mat4 mv_matrix =
-          vmath::translate(0.0f, 0.0f, -20.0f)*
-          vmath::translate(sinf(2.1f*f)*2.0f,
-                           cosf(1.7f*f)*2.0f,
-                           sinf(1.3f*f)*cosf(1.5f*f)*2.0f)*
-          vmath::rotate((float)current_time*45.0f, 0.0f, 1.0f, 0.0f)*
-          vmath::rotate((float)current_time*81.0f, 1.0f, 0.0f, 0.0f);
-
-      glUniformMatrix4fv(mv_location, 1, GL_FALSE, mv_matrix);
-
-      glDrawArrays(GL_TRIANGLES, 0, 36);
-    }
-
+      for (size_t i = first; i < last; ++i)
+      {
+        float f = float(i) + (float)current_time*0.314f;
+        vmath::mat4 mv_matrix =
+            view_matrix*
+            vmath::lazy::translate(sinf(2.1f*f)*2.0f,
+                                   cosf(1.7f*f)*2.0f,
+                                   sinf(1.3f*f)*cosf(1.5f*f)*2.0f)*
+            vmath::lazy::rotate_y((float)current_time*45.0f)*
+            vmath::lazy::rotate_x((float)current_time*81.0f);
+
+        list.uniform_matrix4fv(mv_location, mv_matrix);
+        list.draw_arrays(GL_TRIANGLES, 0, 36);
+      }
+    });
+
+    recorder.execute(state);
+    state.end_frame();
   }
 
   virtual void shutdown() override
@@ -190,6 +239,60 @@ public:
     glDeleteBuffers(1, &buffer);
   }
 
+  virtual void onKey(int key, int action) override
+  {
+    if (action && key == 'B')
+    {
+      run_benchmark();
+    }
+  }
+
+  // Times the model-view construction from render() built with full matrix
+  // products against the same chain built with vmath::lazy.
+  void run_benchmark()
+  {
+    const int iterations = 1000000;
+    volatile float sink = 0.0f;
+
+    double start = glfwGetTime();
+    for (int i = 0; i < iterations; ++i)
+    {
+      float f = float(i) * 0.0001f;
+      vmath::mat4 mv_matrix =
+          view_matrix*
+          vmath::translate(sinf(2.1f*f)*2.0f,
+                           cosf(1.7f*f)*2.0f,
+                           sinf(1.3f*f)*cosf(1.5f*f)*2.0f)*
+          vmath::rotate(f*45.0f, 0.0f, 1.0f, 0.0f)*
+          vmath::rotate(f*81.0f, 1.0f, 0.0f, 0.0f);
+      sink = sink + mv_matrix[3][0];
+    }
+    double eager_time = glfwGetTime() - start;
+
+    start = glfwGetTime();
+    for (int i = 0; i < iterations; ++i)
+    {
+      float f = float(i) * 0.0001f;
+      vmath::mat4 mv_matrix =
+          view_matrix*
+          vmath::lazy::translate(sinf(2.1f*f)*2.0f,
+                                 cosf(1.7f*f)*2.0f,
+                                 sinf(1.3f*f)*cosf(1.5f*f)*2.0f)*
+          vmath::lazy::rotate_y(f*45.0f)*
+          vmath::lazy::rotate_x(f*81.0f);
+      sink = sink + mv_matrix[3][0];
+    }
+    double lazy_time = glfwGetTime() - start;
+
+    char buffer[256];
+    sprintf(buffer, "model-view x%d: eager %.1f ns, lazy %.1f ns (%.2fx)",
+            iterations,
+            eager_time * 1e9 / iterations,
+            lazy_time * 1e9 / iterations,
+            eager_time / lazy_time);
+    setWindowTitle(buffer);
+  }
+
   virtual void onResize(int w, int h) override
   {
     sb7::application::onResize(w, h);
@@ -198,15 +301,24 @@ public:
   }
 
 private:
+  // The camera never moves, so this is worked out at compile time
+  static constexpr vmath::mat4 view_matrix = vmath::translate(0.0f, 0.0f, -20.0f);
+
   GLuint vao;
   GLuint buffer;
   GLuint program;
   GLuint mv_location;
   GLuint proj_location;
 
+  sb7::thread_pool pool;
+  sb7::cmd_recorder recorder;
+  sb7::gl_state state;
+
   float aspect_ratio;
 
   vmath::mat4 proj_matrix;
 };
 
+constexpr vmath::mat4 SpinningCube::view_matrix;
+
 DECLARE_MAIN(SpinningCube)
\ No newline at end of file
@@ -0,0 +1,643 @@
+#include "CpuSolver.h"
+
+#include <math.h>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CPU_SOLVER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+enum
+{
+  // Number of point ranges the PBD and implicit integrators split their
+  // loops into. Fixed so that their sums don't depend on the thread count.
+  RANGE_COUNT = 64
+};
+
+const char * const integrator_names[] =
+{
+  "explicit",
+  "semi-implicit Euler",
+  "PBD",
+  "implicit Euler"
+};
+
+CpuSolver::CpuSolver(sb7::thread_pool& pool)
+  : t(0.07f),
+    k(7.1f),
+    c(2.8f),
+    gravity(0.0f, -0.08f, 0.0f),
+    integrator(INTEGRATOR_EXPLICIT),
+    pbd_iterations(8),
+    cg_iterations(32),
+    cg_tolerance(1.0e-4f),
+    m_pool(pool),
+    m_count(0),
+    m_current(0)
+{
+}
+
+void CpuSolver::Init(const SpringNetwork& network, const vmath::vec3 *velocities)
+{
+  m_count = network.PointCount();
+  m_current = 0;
+
+  const int n = PointCount();
+
+  for (int i = 0; i < 2; ++i)
+  {
+    m_state[i].x.resize(n);
+    m_state[i].y.resize(n);
+    m_state[i].z.resize(n);
+    m_state[i].vx.resize(n);
+    m_state[i].vy.resize(n);
+    m_state[i].vz.resize(n);
+  }
+
+  m_mass.resize(n);
+  m_offsets = network.offsets;
+  m_neighbours = network.neighbours;
+  m_rest_lengths = network.rest_lengths;
+
+  if (velocities)
+  {
+    SetState(network.positions.data(), velocities);
+  }
+  else
+  {
+    const std::vector<vmath::vec3> at_rest(n, vmath::vec3(0.0f));
+
+    SetState(network.positions.data(), at_rest.data());
+  }
+}
+
+void CpuSolver::SetState(const vmath::vec4 *positions, const vmath::vec3 *velocities)
+{
+  State& s = m_state[m_current];
+  const int n = PointCount();
+
+  for (int i = 0; i < n; ++i)
+  {
+    s.x[i] = positions[i][0];
+    s.y[i] = positions[i][1];
+    s.z[i] = positions[i][2];
+    m_mass[i] = positions[i][3];
+    s.vx[i] = velocities[i][0];
+    s.vy[i] = velocities[i][1];
+    s.vz[i] = velocities[i][2];
+  }
+}
+
+void CpuSolver::GetState(vmath::vec4 *positions, vmath::vec3 *velocities) const
+{
+  const State& s = m_state[m_current];
+  const int n = PointCount();
+
+  for (int i = 0; i < n; ++i)
+  {
+    if (positions)
+      positions[i] = vmath::vec4(s.x[i], s.y[i], s.z[i], m_mass[i]);
+    if (velocities)
+      velocities[i] = vmath::vec3(s.vx[i], s.vy[i], s.vz[i]);
+  }
+}
+
+void CpuSolver::Step(int iterations)
+{
+  for (int i = 0; i < iterations; ++i)
+  {
+    switch (integrator)
+    {
+      case INTEGRATOR_EXPLICIT:
+      case INTEGRATOR_SEMI_IMPLICIT_EULER:
+        {
+          const bool semi_implicit = integrator == INTEGRATOR_SEMI_IMPLICIT_EULER;
+
+          ForRanges([this, semi_implicit](int first, int last)
+          {
+            UpdateRange(first, last, semi_implicit);
+          });
+        }
+        break;
+      case INTEGRATOR_PBD:
+        StepPbd();
+        break;
+      case INTEGRATOR_IMPLICIT_EULER:
+        StepImplicit();
+        break;
+    }
+
+    m_current ^= 1;
+  }
+}
+
+bool CpuSolver::IsFixed(int i) const
+{
+  return m_offsets[i] == m_offsets[i + 1];
+}
+
+bool CpuSolver::IsConnected(int from, int to) const
+{
+  for (int s = m_offsets[from]; s < m_offsets[from + 1]; ++s)
+  {
+    if (m_neighbours[s] == to)
+      return true;
+  }
+
+  return false;
+}
+
+void CpuSolver::ForRanges(const std::function<void(int, int)>& fn)
+{
+  const size_t n = PointCount();
+
+  m_pool.parallel_for(RANGE_COUNT, [&](size_t first, size_t last)
+  {
+    for (size_t r = first; r < last; ++r)
+      fn(int(n * r / RANGE_COUNT), int(n * (r + 1) / RANGE_COUNT));
+  });
+}
+
+double CpuSolver::SumRanges(const std::function<double(int, int)>& fn)
+{
+  const size_t n = PointCount();
+  double partial[RANGE_COUNT];
+
+  m_pool.parallel_for(RANGE_COUNT, [&](size_t first, size_t last)
+  {
+    for (size_t r = first; r < last; ++r)
+      partial[r] = fn(int(n * r / RANGE_COUNT), int(n * (r + 1) / RANGE_COUNT));
+  });
+
+  double sum = 0.0;
+
+  for (int r = 0; r < RANGE_COUNT; ++r)
+    sum += partial[r];
+
+  return sum;
+}
+
+// Updates points [first, last). This is the body of update.vs.glsl.
+void CpuSolver::UpdateRange(int first, int last, bool semi_implicit)
+{
+  const State& in = m_state[m_current];
+  State& out = m_state[m_current ^ 1];
+  const float *px = in.x.data();
+  const float *py = in.y.data();
+  const float *pz = in.z.data();
+
+  int i = first;
+
+#ifdef CPU_SOLVER_SSE2
+  const __m128 tt = _mm_set1_ps(t);
+  const __m128 half_tt = _mm_set1_ps(0.5f * t * t);
+  const __m128 neg_k = _mm_set1_ps(-k);
+  const __m128 damping = _mm_set1_ps(c);
+  const __m128 gx = _mm_set1_ps(gravity[0]);
+  const __m128 gy = _mm_set1_ps(gravity[1]);
+  const __m128 gz = _mm_set1_ps(gravity[2]);
+  const __m128 max_s = _mm_set1_ps(25.0f);
+  const __m128 min_s = _mm_set1_ps(-25.0f);
+  const int *offsets = m_offsets.data();
+  const int *neighbours = m_neighbours.data();
+  const float *rest_lengths = m_rest_lengths.data();
+
+  for (; i + 4 <= last; i += 4)
+  {
+    const __m128 x = _mm_loadu_ps(px + i);
+    const __m128 y = _mm_loadu_ps(py + i);
+    const __m128 z = _mm_loadu_ps(pz + i);
+    const __m128 m = _mm_loadu_ps(&m_mass[i]);
+    const __m128 ux = _mm_loadu_ps(&in.vx[i]);
+    const __m128 uy = _mm_loadu_ps(&in.vy[i]);
+    const __m128 uz = _mm_loadu_ps(&in.vz[i]);
+    const __m128i counts = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(offsets + i + 1)),
+                                         _mm_loadu_si128((const __m128i*)(offsets + i)));
+
+    // F = gravity * m - c * u
+    __m128 fx = _mm_sub_ps(_mm_mul_ps(gx, m), _mm_mul_ps(damping, ux));
+    __m128 fy = _mm_sub_ps(_mm_mul_ps(gy, m), _mm_mul_ps(damping, uy));
+    __m128 fz = _mm_sub_ps(_mm_mul_ps(gz, m), _mm_mul_ps(damping, uz));
+
+    int max_count = 0;
+
+    for (int l = 0; l < 4; ++l)
+      max_count = vmath::max(max_count, offsets[i + l + 1] - offsets[i + l]);
+
+    // Spring j of all four points at once. Points with fewer springs read
+    // themselves; the resulting NaNs are masked off below.
+    for (int j = 0; j < max_count; ++j)
+    {
+      const __m128 valid = _mm_castsi128_ps(_mm_cmpgt_epi32(counts, _mm_set1_epi32(j)));
+      int q[4];
+      float rest[4];
+
+      for (int l = 0; l < 4; ++l)
+      {
+        const int spring = offsets[i + l] + j;
+        const bool exists = spring < offsets[i + l + 1];
+
+        q[l] = exists ? neighbours[spring] : i + l;
+        rest[l] = exists ? rest_lengths[spring] : 1.0f;
+      }
+
+      const __m128 dx = _mm_sub_ps(_mm_setr_ps(px[q[0]], px[q[1]], px[q[2]], px[q[3]]), x);
+      const __m128 dy = _mm_sub_ps(_mm_setr_ps(py[q[0]], py[q[1]], py[q[2]], py[q[3]]), y);
+      const __m128 dz = _mm_sub_ps(_mm_setr_ps(pz[q[0]], pz[q[1]], pz[q[2]], pz[q[3]]), z);
+      const __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx),
+                                                           _mm_mul_ps(dy, dy)),
+                                                _mm_mul_ps(dz, dz)));
+      const __m128 rest_length = _mm_setr_ps(rest[0], rest[1], rest[2], rest[3]);
+
+      // -k * (rest_length - x) * normalize(d)
+      const __m128 scale = _mm_and_ps(_mm_div_ps(_mm_mul_ps(neg_k, _mm_sub_ps(rest_length, len)), len), valid);
+
+      fx = _mm_add_ps(fx, _mm_mul_ps(dx, scale));
+      fy = _mm_add_ps(fy, _mm_mul_ps(dy, scale));
+      fz = _mm_add_ps(fz, _mm_mul_ps(dz, scale));
+    }
+
+    const __m128 connected = _mm_castsi128_ps(_mm_cmpgt_epi32(counts, _mm_setzero_si128()));
+
+    // Fixed nodes get no force at all
+    const __m128 ax = _mm_and_ps(_mm_div_ps(fx, m), connected);
+    const __m128 ay = _mm_and_ps(_mm_div_ps(fy, m), connected);
+    const __m128 az = _mm_and_ps(_mm_div_ps(fz, m), connected);
+
+    const __m128 vx = _mm_add_ps(ux, _mm_mul_ps(ax, tt));
+    const __m128 vy = _mm_add_ps(uy, _mm_mul_ps(ay, tt));
+    const __m128 vz = _mm_add_ps(uz, _mm_mul_ps(az, tt));
+    __m128 sx, sy, sz;
+
+    if (semi_implicit)
+    {
+      sx = _mm_mul_ps(vx, tt);
+      sy = _mm_mul_ps(vy, tt);
+      sz = _mm_mul_ps(vz, tt);
+    }
+    else
+    {
+      sx = _mm_add_ps(_mm_mul_ps(ux, tt), _mm_mul_ps(ax, half_tt));
+      sy = _mm_add_ps(_mm_mul_ps(uy, tt), _mm_mul_ps(ay, half_tt));
+      sz = _mm_add_ps(_mm_mul_ps(uz, tt), _mm_mul_ps(az, half_tt));
+    }
+
+    sx = _mm_min_ps(_mm_max_ps(sx, min_s), max_s);
+    sy = _mm_min_ps(_mm_max_ps(sy, min_s), max_s);
+    sz = _mm_min_ps(_mm_max_ps(sz, min_s), max_s);
+
+    _mm_storeu_ps(&out.x[i], _mm_add_ps(x, sx));
+    _mm_storeu_ps(&out.y[i], _mm_add_ps(y, sy));
+    _mm_storeu_ps(&out.z[i], _mm_add_ps(z, sz));
+    _mm_storeu_ps(&out.vx[i], vx);
+    _mm_storeu_ps(&out.vy[i], vy);
+    _mm_storeu_ps(&out.vz[i], vz);
+  }
+#endif
+
+  for (; i < last; ++i)
+  {
+    const vmath::vec3 p(px[i], py[i], pz[i]);
+    const vmath::vec3 u(in.vx[i], in.vy[i], in.vz[i]);
+    const float m = m_mass[i];
+    vmath::vec3 F = gravity * m - c * u;
+
+    for (int s = m_offsets[i]; s < m_offsets[i + 1]; ++s)
+    {
+      const int q = m_neighbours[s];
+      const vmath::vec3 d = vmath::vec3(px[q], py[q], pz[q]) - p;
+      const float x = vmath::length(d);
+      F += d * (-k * (m_rest_lengths[s] - x) / x);
+    }
+
+    if (IsFixed(i))
+      F = vmath::vec3(0.0f);
+
+    const vmath::vec3 a = F / m;
+    const vmath::vec3 v = u + a * t;
+    vmath::vec3 s = semi_implicit ? v * t : u * t + a * (0.5f * t * t);
+
+    s = vmath::clamp(s, vmath::vec3(-25.0f), vmath::vec3(25.0f));
+
+    out.x[i] = p[0] + s[0];
+    out.y[i] = p[1] + s[1];
+    out.z[i] = p[2] + s[2];
+    out.vx[i] = v[0];
+    out.vy[i] = v[1];
+    out.vz[i] = v[2];
+  }
+}
+
+// Jacobi style projection: each point moves by the average of the
+// corrections its constraints ask for, over-relaxed by omega.
+void CpuSolver::StepPbd()
+{
+  static const float omega = 1.5f;
+
+  const State& in = m_state[m_current];
+  State& out = m_state[m_current ^ 1];
+
+  m_projected.resize(PointCount());
+
+  // Predict positions from gravity and damping alone. The damping is
+  // applied implicitly so that it can't overshoot at large time steps.
+  ForRanges([&](int first, int last)
+  {
+    for (int i = first; i < last; ++i)
+    {
+      vmath::vec3 v(in.vx[i], in.vy[i], in.vz[i]);
+
+      if (!IsFixed(i))
+        v = (v + gravity * t) / (1.0f + c * t / m_mass[i]);
+
+      out.x[i] = in.x[i] + v[0] * t;
+      out.y[i] = in.y[i] + v[1] * t;
+      out.z[i] = in.z[i] + v[2] * t;
+    }
+  });
+
+  for (int iteration = 0; iteration < pbd_iterations; ++iteration)
+  {
+    ForRanges([&](int first, int last)
+    {
+      for (int i = first; i < last; ++i)
+      {
+        const vmath::vec3 p(out.x[i], out.y[i], out.z[i]);
+        vmath::vec3 correction(0.0f);
+        int count = 0;
+
+        for (int s = m_offsets[i]; s < m_offsets[i + 1]; ++s)
+        {
+          const int q = m_neighbours[s];
+          const vmath::vec3 d = p - vmath::vec3(out.x[q], out.y[q], out.z[q]);
+          const float x = vmath::length(d);
+          const float w = 1.0f / m_mass[i];
+          const float w_q = IsFixed(q) ? 0.0f : 1.0f / m_mass[q];
+
+          if (x > 0.0f)
+            correction -= d * ((x - m_rest_lengths[s]) / x * w / (w + w_q));
+          count++;
+        }
+
+        if (count != 0)
+          correction *= omega / float(count);
+
+        m_projected.x[i] = p[0] + correction[0];
+        m_projected.y[i] = p[1] + correction[1];
+        m_projected.z[i] = p[2] + correction[2];
+      }
+    });
+
+    out.x.swap(m_projected.x);
+    out.y.swap(m_projected.y);
+    out.z.swap(m_projected.z);
+  }
+
+  // The velocity is whatever moves the point to its projected position
+  ForRanges([&](int first, int last)
+  {
+    const vmath::vec3 max_s(25.0f);
+
+    for (int i = first; i < last; ++i)
+    {
+      const vmath::vec3 p(in.x[i], in.y[i], in.z[i]);
+      const vmath::vec3 s = vmath::clamp(vmath::vec3(out.x[i], out.y[i], out.z[i]) - p, -max_s, max_s);
+
+      out.x[i] = p[0] + s[0];
+      out.y[i] = p[1] + s[1];
+      out.z[i] = p[2] + s[2];
+      out.vx[i] = s[0] / t;
+      out.vy[i] = s[1] / t;
+      out.vz[i] = s[2] / t;
+    }
+  });
+}
+
+// Stiffness of the spring along dir with length x, applied to w. The
+// transverse term is dropped when the spring is compressed so that the
+// system matrix stays positive definite.
+static inline vmath::vec3 ApplySpringJacobian(const vmath::vec3& dir, float x,
+                                              float k, float rest_length,
+                                              const vmath::vec3& w)
+{
+  const float transverse = vmath::max(0.0f, 1.0f - rest_length / x);
+
+  return (w * transverse + dir * ((1.0f - transverse) * vmath::dot(dir, w))) * k;
+}
+
+// (M + h*c*I - h^2 * df/dx) * in. Fixed points map to themselves; their
+// entries in every vector CG sees are zero.
+void CpuSolver::MultiplySystem(const Field& in, Field& out)
+{
+  const State& state = m_state[m_current];
+  const float h = t;
+
+  ForRanges([&](int first, int last)
+  {
+    for (int i = first; i < last; ++i)
+    {
+      const vmath::vec3 w(in.x[i], in.y[i], in.z[i]);
+      vmath::vec3 result = w;
+
+      if (!IsFixed(i))
+      {
+        const vmath::vec3 p(state.x[i], state.y[i], state.z[i]);
+        vmath::vec3 jw(0.0f);
+
+        for (int s = m_offsets[i]; s < m_offsets[i + 1]; ++s)
+        {
+          const int q = m_neighbours[s];
+          const vmath::vec3 d = vmath::vec3(state.x[q], state.y[q], state.z[q]) - p;
+          const float x = vmath::length(d);
+
+          if (x > 0.0f)
+            jw += ApplySpringJacobian(d / x, x, k, m_rest_lengths[s],
+                                      vmath::vec3(in.x[q], in.y[q], in.z[q]) - w);
+        }
+
+        result = w * (m_mass[i] + h * c) - jw * (h * h);
+      }
+
+      out.x[i] = result[0];
+      out.y[i] = result[1];
+      out.z[i] = result[2];
+    }
+  });
+}
+
+// Solves (M - h*df/dv - h^2*df/dx) * dv = h * (f + h * df/dx * v) for the
+// change in velocity, then moves each point with its new velocity.
+void CpuSolver::StepImplicit()
+{
+  const State& in = m_state[m_current];
+  State& out = m_state[m_current ^ 1];
+  const int n = PointCount();
+  const float h = t;
+
+  m_delta_v.resize(n);
+  m_residual.resize(n);
+  m_direction.resize(n);
+  m_product.resize(n);
+
+  // dv starts at zero, so the first residual is the right hand side
+  double rr = SumRanges([&](int first, int last)
+  {
+    double sum = 0.0;
+
+    for (int i = first; i < last; ++i)
+    {
+      vmath::vec3 b(0.0f);
+
+      if (!IsFixed(i))
+      {
+        const vmath::vec3 p(in.x[i], in.y[i], in.z[i]);
+        const vmath::vec3 u(in.vx[i], in.vy[i], in.vz[i]);
+        vmath::vec3 F = gravity * m_mass[i] - c * u;
+        vmath::vec3 jv(0.0f);
+
+        for (int s = m_offsets[i]; s < m_offsets[i + 1]; ++s)
+        {
+          const int q = m_neighbours[s];
+          const vmath::vec3 d = vmath::vec3(in.x[q], in.y[q], in.z[q]) - p;
+          const float x = vmath::length(d);
+
+          if (x > 0.0f)
+          {
+            F += d * (k * (x - m_rest_lengths[s]) / x);
+            jv += ApplySpringJacobian(d / x, x, k, m_rest_lengths[s],
+                                      vmath::vec3(in.vx[q], in.vy[q], in.vz[q]) - u);
+          }
+        }
+
+        b = (F + jv * h) * h;
+      }
+
+      m_delta_v.x[i] = m_delta_v.y[i] = m_delta_v.z[i] = 0.0f;
+      m_residual.x[i] = m_direction.x[i] = b[0];
+      m_residual.y[i] = m_direction.y[i] = b[1];
+      m_residual.z[i] = m_direction.z[i] = b[2];
+
+      sum += vmath::dot(b, b);
+    }
+
+    return sum;
+  });
+
+  const double threshold = rr * double(cg_tolerance) * double(cg_tolerance);
+
+  for (int iteration = 0; iteration < cg_iterations && rr > threshold; ++iteration)
+  {
+    MultiplySystem(m_direction, m_product);
+
+    const double pap = SumRanges([&](int first, int last)
+    {
+      double sum = 0.0;
+
+      for (int i = first; i < last; ++i)
+      {
+        sum += m_direction.x[i] * m_product.x[i] +
+               m_direction.y[i] * m_product.y[i] +
+               m_direction.z[i] * m_product.z[i];
+      }
+
+      return sum;
+    });
+
+    if (pap <= 0.0)
+      break;
+
+    const float alpha = float(rr / pap);
+
+    const double rr_next = SumRanges([&](int first, int last)
+    {
+      double sum = 0.0;
+
+      for (int i = first; i < last; ++i)
+      {
+        m_delta_v.x[i] += alpha * m_direction.x[i];
+        m_delta_v.y[i] += alpha * m_direction.y[i];
+        m_delta_v.z[i] += alpha * m_direction.z[i];
+        m_residual.x[i] -= alpha * m_product.x[i];
+        m_residual.y[i] -= alpha * m_product.y[i];
+        m_residual.z[i] -= alpha * m_product.z[i];
+
+        sum += m_residual.x[i] * m_residual.x[i] +
+               m_residual.y[i] * m_residual.y[i] +
+               m_residual.z[i] * m_residual.z[i];
+      }
+
+      return sum;
+    });
+
+    const float beta = float(rr_next / rr);
+    rr = rr_next;
+
+    ForRanges([&](int first, int last)
+    {
+      for (int i = first; i < last; ++i)
+      {
+        m_direction.x[i] = m_residual.x[i] + beta * m_direction.x[i];
+        m_direction.y[i] = m_residual.y[i] + beta * m_direction.y[i];
+        m_direction.z[i] = m_residual.z[i] + beta * m_direction.z[i];
+      }
+    });
+  }
+
+  ForRanges([&](int first, int last)
+  {
+    const vmath::vec3 max_s(25.0f);
+
+    for (int i = first; i < last; ++i)
+    {
+      const vmath::vec3 p(in.x[i], in.y[i], in.z[i]);
+      const vmath::vec3 v = vmath::vec3(in.vx[i], in.vy[i], in.vz[i]) +
+                            vmath::vec3(m_delta_v.x[i], m_delta_v.y[i], m_delta_v.z[i]);
+      const vmath::vec3 s = vmath::clamp(v * h, -max_s, max_s);
+
+      out.x[i] = p[0] + s[0];
+      out.y[i] = p[1] + s[1];
+      out.z[i] = p[2] + s[2];
+      out.vx[i] = v[0];
+      out.vy[i] = v[1];
+      out.vz[i] = v[2];
+    }
+  });
+}
+
+Energy CpuSolver::MeasureEnergy() const
+{
+  const State& s = m_state[m_current];
+  const int n = PointCount();
+  Energy energy = { 0.0, 0.0, 0.0f, true };
+
+  for (int i = 0; i < n; ++i)
+  {
+    const vmath::vec3 p(s.x[i], s.y[i], s.z[i]);
+    const vmath::vec3 v(s.vx[i], s.vy[i], s.vz[i]);
+    const float speed = vmath::length(v);
+
+    energy.kinetic += 0.5 * m_mass[i] * speed * speed;
+    energy.potential -= m_mass[i] * vmath::dot(gravity, p);
+    energy.max_speed = vmath::max(energy.max_speed, speed);
+
+    for (int spring = m_offsets[i]; spring < m_offsets[i + 1]; ++spring)
+    {
+      const int q = m_neighbours[spring];
+
+      // Count each spring once, even when both ends list it
+      if (q < i && IsConnected(q, i))
+        continue;
+
+      const float stretch = vmath::length(vmath::vec3(s.x[q], s.y[q], s.z[q]) - p) - m_rest_lengths[spring];
+
+      energy.potential += 0.5 * k * stretch * stretch;
+    }
+  }
+
+  // Hitting the per-step displacement clamp is as good as diverging
+  energy.stable = std::isfinite(energy.kinetic) && std::isfinite(energy.potential) &&
+                  energy.max_speed * t < 25.0f;
+
+  return energy;
+}
@@ -0,0 +1,127 @@
+#ifndef __CPUSOLVER_H__
+#define __CPUSOLVER_H__
+
+#include <vmath.h>
+#include <sb7threadpool.h>
+#include <functional>
+#include <vector>
+
+#include "Topology.h"
+
+enum INTEGRATOR_t
+{
+  // The original scheme of update.vs.glsl: s = u*t + a*t*t/2, v = u + a*t
+  INTEGRATOR_EXPLICIT,
+  // v = u + a*t, s = v*t
+  INTEGRATOR_SEMI_IMPLICIT_EULER,
+  // Position based dynamics. Springs become distance constraints that are
+  // projected a fixed number of times per step.
+  INTEGRATOR_PBD,
+  // Backward Euler, linearized once per step and solved with conjugate
+  // gradient on the connection graph.
+  INTEGRATOR_IMPLICIT_EULER,
+  INTEGRATOR_MAX = INTEGRATOR_IMPLICIT_EULER
+};
+
+extern const char * const integrator_names[];
+
+struct Energy
+{
+  double kinetic;
+  double potential;
+  float max_speed;
+  bool stable;
+};
+
+// CPU version of update.vs.glsl. Positions and velocities are kept as
+// separate x/y/z arrays so that four points can be updated at once with
+// SSE. Each iteration is split across the thread pool by ranges of points.
+// Like the shader, every point reads the positions from the previous
+// iteration and writes to a second set of arrays.
+//
+// The explicit integrators are the only ones the shaders implement. The
+// others trade more work per step for stability at larger time steps.
+class CpuSolver
+{
+public:
+  explicit CpuSolver(sb7::thread_pool& pool);
+
+  // Takes the springs and initial positions from the network. velocities
+  // may be null, in which case everything starts at rest.
+  void Init(const SpringNetwork& network, const vmath::vec3 *velocities);
+
+  void SetState(const vmath::vec4 *positions, const vmath::vec3 *velocities);
+  void GetState(vmath::vec4 *positions, vmath::vec3 *velocities) const;
+
+  void Step(int iterations);
+
+  // Kinetic energy, plus spring and gravitational potential energy. The
+  // step is unstable once anything stops being finite or a point moves as
+  // far as the displacement clamp allows.
+  Energy MeasureEnergy() const;
+
+  int PointCount() const { return m_count; }
+
+  // The same defaults as the uniforms in update.vs.glsl. Rest lengths are
+  // per spring and come from the network.
+  float t;
+  float k;
+  float c;
+  vmath::vec3 gravity;
+
+  INTEGRATOR_t integrator;
+  int pbd_iterations;
+  int cg_iterations;
+  float cg_tolerance;
+
+private:
+  struct Field
+  {
+    std::vector<float> x, y, z;
+
+    void resize(int n) { x.resize(n); y.resize(n); z.resize(n); }
+  };
+
+  struct State
+  {
+    std::vector<float> x, y, z;
+    std::vector<float> vx, vy, vz;
+  };
+
+  void UpdateRange(int first, int last, bool semi_implicit);
+  void StepPbd();
+  void StepImplicit();
+
+  bool IsFixed(int i) const;
+  bool IsConnected(int from, int to) const;
+
+  // Calls fn(first, last) over ranges of points in parallel. SumRanges adds
+  // up the values fn returns in the same order whatever the number of
+  // threads.
+  void ForRanges(const std::function<void(int, int)>& fn);
+  double SumRanges(const std::function<double(int, int)>& fn);
+
+  // out = A * in for the implicit step's system matrix
+  void MultiplySystem(const Field& in, Field& out);
+
+  sb7::thread_pool& m_pool;
+  int m_count;
+  int m_current;
+
+  State m_state[2];
+  std::vector<float> m_mass;
+
+  // The springs, in the same CSR layout as SpringNetwork
+  std::vector<int> m_offsets;
+  std::vector<int> m_neighbours;
+  std::vector<float> m_rest_lengths;
+
+  // Scratch space for the PBD and implicit integrators
+  Field m_projected;
+  Field m_delta_v;
+  Field m_residual;
+  Field m_direction;
+  Field m_product;
+};
+
+#endif /* __CPUSOLVER_H__ */
@@ -0,0 +1,427 @@
+#include "Topology.h"
+
+#include <GL/glcorearb.h>
+#include <sb6mfile.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+// Fills in the CSR arrays, the line list and the rest lengths from a list
+// of springs. Each pair (a, b) with a < b is one spring, added to both
+// points unless that point is pinned.
+static void BuildNetwork(const std::vector<std::pair<int, int> >& springs,
+                         const std::vector<bool>& pinned,
+                         SpringNetwork& network)
+{
+  const int n = network.PointCount();
+  std::vector<int> counts(n, 0);
+
+  for (const auto& spring : springs)
+  {
+    if (!pinned[spring.first])
+      counts[spring.first]++;
+    if (!pinned[spring.second])
+      counts[spring.second]++;
+  }
+
+  network.offsets.assign(n + 1, 0);
+
+  for (int i = 0; i < n; ++i)
+    network.offsets[i + 1] = network.offsets[i] + counts[i];
+
+  network.neighbours.resize(network.offsets[n]);
+  network.rest_lengths.resize(network.offsets[n]);
+  network.lines.clear();
+  network.lines.reserve(springs.size() * 2);
+
+  std::vector<int> next(network.offsets.begin(), network.offsets.end() - 1);
+
+  for (const auto& spring : springs)
+  {
+    const int a = spring.first;
+    const int b = spring.second;
+    const vmath::vec4& pa = network.positions[a];
+    const vmath::vec4& pb = network.positions[b];
+    const float length = vmath::length(vmath::vec3(pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2]));
+
+    if (!pinned[a])
+    {
+      network.neighbours[next[a]] = b;
+      network.rest_lengths[next[a]++] = length;
+    }
+    if (!pinned[b])
+    {
+      network.neighbours[next[b]] = a;
+      network.rest_lengths[next[b]++] = length;
+    }
+
+    network.lines.push_back(a);
+    network.lines.push_back(b);
+  }
+}
+
+static void UpdateExtent(SpringNetwork& network)
+{
+  network.extent = 0.0f;
+
+  for (const auto& p : network.positions)
+  {
+    for (int i = 0; i < 3; ++i)
+      network.extent = vmath::max(network.extent, fabsf(p[i]));
+  }
+}
+
+void BuildGridNetwork(int points_x, int points_y, float rest_length,
+                      SpringNetwork& network)
+{
+  const int points_total = points_x * points_y;
+
+  network.positions.resize(points_total);
+  network.offsets.resize(points_total + 1);
+  network.neighbours.clear();
+  network.rest_lengths.clear();
+  network.lines.clear();
+  network.grid_width = points_x;
+
+  int n = 0;
+
+  network.offsets[0] = 0;
+
+  for (int j = 0; j < points_y; ++j)
+  {
+    float fj = (float)j / (float)points_y;
+
+    for (int i = 0; i < points_x; ++i)
+    {
+      float fi = (float)i / (float)points_x;
+
+      network.positions[n] = vmath::vec4((fi - 0.5f) * float(points_x),
+                                         (fj - 0.5f) * float(points_y),
+                                         0.6f * sinf(fi) * cosf(fj), 1.0f);
+
+      // Left, down, right, up: the order update.vs.glsl has always summed
+      // the forces in.
+      if (j != (points_y - 1))
+      {
+        if (i != 0)
+          network.neighbours.push_back(n - 1);
+
+        if (j != 0)
+          network.neighbours.push_back(n - points_x);
+
+        if (i != (points_x - 1))
+          network.neighbours.push_back(n + 1);
+
+        network.neighbours.push_back(n + points_x);
+      }
+
+      n++;
+      network.offsets[n] = int(network.neighbours.size());
+    }
+  }
+
+  network.rest_lengths.assign(network.neighbours.size(), rest_length);
+
+  for (int j = 0; j < points_y; ++j)
+  {
+    for (int i = 0; i < points_x - 1; ++i)
+    {
+      network.lines.push_back(i + j * points_x);
+      network.lines.push_back(1 + i + j * points_x);
+    }
+  }
+
+  for (int i = 0; i < points_x; ++i)
+  {
+    for (int j = 0; j < points_y - 1; ++j)
+    {
+      network.lines.push_back(i + j * points_x);
+      network.lines.push_back(points_x + i + j * points_x);
+    }
+  }
+
+  UpdateExtent(network);
+}
+
+// sb7::object only keeps its vertices on the GPU, so the file is parsed
+// here using the same chunk layout that sb7::object::load() reads.
+bool LoadMeshNetwork(const char *filename, SpringNetwork& network)
+{
+  FILE *infile = fopen(filename, "rb");
+
+  if (!infile)
+    return false;
+
+  fseek(infile, 0, SEEK_END);
+  const size_t filesize = ftell(infile);
+  fseek(infile, 0, SEEK_SET);
+
+  std::vector<unsigned char> data(filesize);
+  const size_t bytes_read = fread(data.data(), 1, filesize, infile);
+  fclose(infile);
+
+  if (bytes_read != filesize || filesize < sizeof(SB6M_HEADER))
+    return false;
+
+  const SB6M_HEADER *header = (const SB6M_HEADER *)data.data();
+
+  if (header->magic != SB6M_MAGIC)
+    return false;
+
+  const SB6M_VERTEX_ATTRIB_CHUNK *vertex_attrib_chunk = nullptr;
+  const SB6M_CHUNK_VERTEX_DATA *vertex_data_chunk = nullptr;
+  const SB6M_CHUNK_INDEX_DATA *index_data_chunk = nullptr;
+  const unsigned char *ptr = data.data() + header->size;
+
+  for (unsigned int i = 0; i < header->num_chunks; ++i)
+  {
+    const SB6M_CHUNK_HEADER *chunk = (const SB6M_CHUNK_HEADER *)ptr;
+
+    switch (chunk->chunk_type)
+    {
+      case SB6M_CHUNK_TYPE_VERTEX_ATTRIBS:
+        vertex_attrib_chunk = (const SB6M_VERTEX_ATTRIB_CHUNK *)chunk;
+        break;
+      case SB6M_CHUNK_TYPE_VERTEX_DATA:
+        vertex_data_chunk = (const SB6M_CHUNK_VERTEX_DATA *)chunk;
+        break;
+      case SB6M_CHUNK_TYPE_INDEX_DATA:
+        index_data_chunk = (const SB6M_CHUNK_INDEX_DATA *)chunk;
+        break;
+      default:
+        break;
+    }
+
+    ptr += chunk->size;
+  }
+
+  if (!vertex_attrib_chunk || !vertex_data_chunk ||
+      vertex_attrib_chunk->attrib_count == 0)
+    return false;
+
+  // Attribute 0 is the position
+  const SB6M_VERTEX_ATTRIB_DECL& position = vertex_attrib_chunk->attrib_data[0];
+
+  if (position.type != GL_FLOAT || position.size < 3)
+    return false;
+
+  const unsigned int stride = position.stride ? position.stride : position.size * sizeof(float);
+  const unsigned char *vertex_data = data.data() + vertex_data_chunk->data_offset + position.data_offset;
+  const unsigned int vertex_count = vertex_data_chunk->total_vertices;
+
+  // Weld vertices that share a position
+  float mesh_extent = 0.0f;
+
+  for (unsigned int i = 0; i < vertex_count; ++i)
+  {
+    const float *v = (const float *)(vertex_data + i * stride);
+
+    for (int j = 0; j < 3; ++j)
+      mesh_extent = vmath::max(mesh_extent, fabsf(v[j]));
+  }
+
+  const float quantum = vmath::max(mesh_extent, 1.0e-6f) * 1.0e-5f;
+  std::unordered_map<uint64_t, int> welded;
+  std::vector<int> remap(vertex_count);
+
+  network.positions.clear();
+
+  for (unsigned int i = 0; i < vertex_count; ++i)
+  {
+    const float *v = (const float *)(vertex_data + i * stride);
+    uint64_t key = 0;
+
+    for (int j = 0; j < 3; ++j)
+      key = (key << 21) | (uint64_t(int64_t(floorf(v[j] / quantum + 0.5f)) + (1 << 20)) & 0x1FFFFF);
+
+    auto it = welded.find(key);
+
+    if (it == welded.end())
+    {
+      it = welded.insert(std::make_pair(key, int(network.positions.size()))).first;
+      network.positions.push_back(vmath::vec4(v[0], v[1], v[2], 1.0f));
+    }
+
+    remap[i] = it->second;
+  }
+
+  // Triangle edges, each once
+  std::vector<unsigned int> indices;
+
+  if (index_data_chunk)
+  {
+    const unsigned char *index_data = data.data() + index_data_chunk->index_data_offset;
+
+    indices.resize(index_data_chunk->index_count);
+
+    for (unsigned int i = 0; i < index_data_chunk->index_count; ++i)
+    {
+      indices[i] = index_data_chunk->index_type == GL_UNSIGNED_SHORT ?
+                   ((const unsigned short *)index_data)[i] :
+                   ((const unsigned int *)index_data)[i];
+    }
+  }
+  else
+  {
+    indices.resize(vertex_count);
+
+    for (unsigned int i = 0; i < vertex_count; ++i)
+      indices[i] = i;
+  }
+
+  std::vector<std::pair<int, int> > springs;
+
+  for (size_t i = 0; i + 2 < indices.size(); i += 3)
+  {
+    for (int e = 0; e < 3; ++e)
+    {
+      const int a = remap[indices[i + e]];
+      const int b = remap[indices[i + (e + 1) % 3]];
+
+      if (a != b)
+        springs.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+    }
+  }
+
+  std::sort(springs.begin(), springs.end());
+  springs.erase(std::unique(springs.begin(), springs.end()), springs.end());
+
+  if (springs.empty())
+    return false;
+
+  // Scale so that the average spring is one unit long
+  double total_length = 0.0;
+  float top = -mesh_extent;
+  float bottom = mesh_extent;
+
+  for (const auto& spring : springs)
+  {
+    const vmath::vec4 d = network.positions[spring.second] - network.positions[spring.first];
+    total_length += vmath::length(vmath::vec3(d[0], d[1], d[2]));
+  }
+
+  const float scale = float(double(springs.size()) / total_length);
+
+  for (auto& p : network.positions)
+  {
+    p = vmath::vec4(p[0] * scale, p[1] * scale, p[2] * scale, 1.0f);
+    top = vmath::max(top, p[1]);
+    bottom = vmath::min(bottom, p[1]);
+  }
+
+  // Hang the mesh from its topmost vertices
+  std::vector<bool> pinned(network.positions.size());
+
+  for (size_t i = 0; i < network.positions.size(); ++i)
+    pinned[i] = network.positions[i][1] >= top - 0.02f * (top - bottom);
+
+  network.grid_width = 0;
+
+  BuildNetwork(springs, pinned, network);
+  UpdateExtent(network);
+
+  return true;
+}
+
+// Interleaves the low 10 bits of x with two zero bits after each
+static inline uint32_t SpreadBits(uint32_t x)
+{
+  x &= 0x3FF;
+  x = (x | (x << 16)) & 0x030000FF;
+  x = (x | (x << 8)) & 0x0300F00F;
+  x = (x | (x << 4)) & 0x030C30C3;
+  x = (x | (x << 2)) & 0x09249249;
+
+  return x;
+}
+
+void ReorderNetwork(SpringNetwork& network)
+{
+  const int n = network.PointCount();
+
+  if (n == 0)
+    return;
+
+  vmath::vec3 lo(network.positions[0][0], network.positions[0][1], network.positions[0][2]);
+  vmath::vec3 hi = lo;
+
+  for (const auto& p : network.positions)
+  {
+    for (int i = 0; i < 3; ++i)
+    {
+      lo[i] = vmath::min(lo[i], p[i]);
+      hi[i] = vmath::max(hi[i], p[i]);
+    }
+  }
+
+  std::vector<std::pair<uint32_t, int> > order(n);
+
+  for (int i = 0; i < n; ++i)
+  {
+    uint32_t code = 0;
+
+    for (int j = 0; j < 3; ++j)
+    {
+      const float range = hi[j] - lo[j];
+      const float f = range > 0.0f ? (network.positions[i][j] - lo[j]) / range : 0.0f;
+
+      code |= SpreadBits(uint32_t(f * 1023.0f + 0.5f)) << j;
+    }
+
+    order[i] = std::make_pair(code, i);
+  }
+
+  std::sort(order.begin(), order.end());
+
+  // new_index[old point] and the inverse
+  std::vector<int> new_index(n);
+
+  for (int i = 0; i < n; ++i)
+    new_index[order[i].second] = i;
+
+  SpringNetwork sorted;
+
+  sorted.positions.resize(n);
+  sorted.offsets.resize(n + 1);
+  sorted.neighbours.reserve(network.neighbours.size());
+  sorted.rest_lengths.reserve(network.rest_lengths.size());
+  sorted.offsets[0] = 0;
+
+  for (int i = 0; i < n; ++i)
+  {
+    const int old = order[i].second;
+    std::vector<std::pair<int, float> > springs;
+
+    sorted.positions[i] = network.positions[old];
+
+    for (int s = network.offsets[old]; s < network.offsets[old + 1]; ++s)
+      springs.push_back(std::make_pair(new_index[network.neighbours[s]], network.rest_lengths[s]));
+
+    std::sort(springs.begin(), springs.end());
+
+    for (const auto& spring : springs)
+    {
+      sorted.neighbours.push_back(spring.first);
+      sorted.rest_lengths.push_back(spring.second);
+    }
+
+    sorted.offsets[i + 1] = int(sorted.neighbours.size());
+  }
+
+  sorted.lines.resize(network.lines.size());
+
+  for (size_t i = 0; i < network.lines.size(); ++i)
+    sorted.lines[i] = new_index[network.lines[i]];
+
+  // A grid in Morton order is no longer a grid as far as the tiled compute
+  // shader is concerned
+  sorted.grid_width = 0;
+  sorted.extent = network.extent;
+
+  network = std::move(sorted);
+}
@@ -0,0 +1,48 @@
+#ifndef __TOPOLOGY_H__
+#define __TOPOLOGY_H__
+
+#include <vmath.h>
+#include <vector>
+
+// A spring network in compressed sparse row form. The springs of point i
+// go to neighbours[offsets[i]] .. neighbours[offsets[i + 1] - 1], and each
+// has its own rest length. A point with no springs of its own is pinned in
+// place, although other points may still be attached to it.
+struct SpringNetwork
+{
+  std::vector<vmath::vec4> positions;   // xyz, and the mass in w
+  std::vector<int> offsets;             // PointCount() + 1 entries
+  std::vector<int> neighbours;
+  std::vector<float> rest_lengths;
+
+  // Every spring once, as pairs of indices for GL_LINES
+  std::vector<unsigned int> lines;
+
+  // Points per row when the network is a regular grid, otherwise 0
+  int grid_width;
+
+  // Largest absolute coordinate of the initial positions
+  float extent;
+
+  int PointCount() const { return int(positions.size()); }
+  int SpringCount(int i) const { return offsets[i + 1] - offsets[i]; }
+};
+
+// The original cloth: a points_x by points_y grid where each point is
+// connected to its four neighbours. The top row has no springs of its own
+// and so stays fixed.
+void BuildGridNetwork(int points_x, int points_y, float rest_length,
+                      SpringNetwork& network);
+
+// Builds a network from the triangles of an .sbm mesh. Vertices that share
+// a position are welded, every triangle edge becomes a spring at its
+// initial length, and the topmost vertices are pinned. The mesh is scaled
+// so that the average spring is one unit long, like the grid. Returns
+// false if the file can't be read.
+bool LoadMeshNetwork(const char *filename, SpringNetwork& network);
+
+// Renumbers the points along a Morton (Z-order) curve through their initial
+// positions, so that points that are close in space are close in memory.
+void ReorderNetwork(SpringNetwork& network);
+
+#endif /* __TOPOLOGY_H__ */
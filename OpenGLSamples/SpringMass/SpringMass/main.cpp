@@ -3,21 +3,56 @@
 #include <shader.h>
 #include <vector>
 
+#include "CpuSolver.h"
+#include "Topology.h"
+
+// The compute shaders bind each of these at the binding point of the same
+// number
 enum BUFFER_TYPE_t
 {
   POSITION_A,
   POSITION_B,
   VELOCITY_A,
   VELOCITY_B,
-  CONNECTION
+  SPRING_OFFSETS,
+  SPRING_NEIGHBOURS,
+  SPRING_REST_LENGTHS,
+  BUFFER_COUNT
+};
+
+enum SOLVER_t
+{
+  SOLVER_TRANSFORM_FEEDBACK,
+  SOLVER_COMPUTE,
+  SOLVER_CPU,
+  SOLVER_MAX = SOLVER_CPU
+};
+
+static const char * const solver_names[] =
+{
+  "transform feedback",
+  "compute shader",
+  "CPU"
 };
 
+// Must match update.cs.glsl
 enum
 {
-  POINTS_X = 50,
-  POINTS_Y = 50,
-  POINTS_TOTAL = (POINTS_X * POINTS_Y),
-  CONNECTIONS_TOTAL = (POINTS_X - 1) * POINTS_Y + (POINTS_Y - 1) * POINTS_X
+  COMPUTE_TILE_SIZE = 32,
+  MAX_SUBSTEPS = COMPUTE_TILE_SIZE / 2 - 1
+};
+
+static const int grid_sizes[] = { 50, 128, 256, 512, 1024 };
+
+static const char * const mesh_names[] = { "torus", "sphere" };
+
+enum
+{
+  MESH_COUNT = sizeof(mesh_names) / sizeof(mesh_names[0]),
+  CSR_GROUP_SIZE = 256,  // Must match update_csr.cs.glsl
+
+  // Past this the solvers take more than a frame at the larger grids
+  MAX_ITERATIONS_PER_FRAME = 1024
 };
 
 class SpringMass: public sb7::application
@@ -26,10 +61,19 @@ public:
   SpringMass(): 
       m_iteration_index(0),
       m_update_program(0),
+      m_compute_program(0),
+      m_csr_program(0),
       m_render_program(0),
+      m_mesh(-1),
       draw_points(true),
       draw_lines(true),
-      iterations_per_frame(16) {}
+      iterations_per_frame(16),
+      substeps(4),
+      time_step(0.07f),
+      print_energy(false),
+      solver(SOLVER_TRANSFORM_FEEDBACK),
+      integrator(INTEGRATOR_EXPLICIT),
+      m_cpu_solver(m_thread_pool) {}
 
   void startup() override;
   void shutdown() override;
@@ -37,21 +81,79 @@ public:
   void onKey(int key, int action) override;
 
   void LoadShaders();
+  void CreateNetwork(const SpringNetwork& network);
+  void CreateGrid(int points_x, int points_y);
+  bool LoadMesh(int mesh);
+  void UpdateTitle();
+  void SetSolver(SOLVER_t new_solver);
+
+  int PointsTotal() const { return m_network.PointCount(); }
+  int LinesTotal() const { return int(m_network.lines.size()) / 2; }
+
+  void Update(SOLVER_t solver, int iterations);
+  void UpdateTransformFeedback(int iterations);
+  void UpdateCompute(int iterations);
+  void UpdateCpu(int iterations);
+  void ReadGpuState(vmath::vec4 *positions, vmath::vec3 *velocities);
+  bool CheckSolver(SOLVER_t gpu_solver, int iterations);
+  double MeasureSolver(SOLVER_t solver);
+  void RunBenchmark();
+  void RunIntegratorTest();
+  void PrintEnergy();
 
 protected:
   GLuint m_vao[2];
-  GLuint m_vbo[5];
+  GLuint m_vbo[BUFFER_COUNT];
   GLuint m_index_buffer;
   GLuint m_pos_tbo[2];
+  GLuint m_spring_tbo[2];
   GLuint m_update_program;
+  GLuint m_compute_program;
+  GLuint m_csr_program;
   GLuint m_render_program;
 
-  GLuint m_C_loc;
+  struct
+  {
+    GLint grid_size;
+    GLint source;
+    GLint substeps;
+    GLint t;
+    GLint integrator;
+  } m_compute_uniforms;
+
+  struct
+  {
+    GLint point_count;
+    GLint source;
+    GLint t;
+    GLint integrator;
+  } m_csr_uniforms;
+
+  struct
+  {
+    GLint t;
+    GLint integrator;
+  } m_update_uniforms;
+
+  GLint m_scale_loc;
   GLuint m_iteration_index;
 
+  // The network being simulated, and which of mesh_names it came from, or
+  // -1 for a grid
+  SpringNetwork m_network;
+  int m_mesh;
+
   bool draw_points;
   bool draw_lines;
   int iterations_per_frame;
+  int substeps;
+  float time_step;
+  bool print_energy;
+  SOLVER_t solver;
+  INTEGRATOR_t integrator;
+
+  sb7::thread_pool m_thread_pool;
+  CpuSolver m_cpu_solver;
 };
 
 void SpringMass::LoadShaders()
@@ -88,6 +190,34 @@ void SpringMass::LoadShaders()
   glDeleteShader(vs);
   glDeleteShader(fs);
 
+  GLuint cs = sb7::shader::load("update.cs.glsl", GL_COMPUTE_SHADER);
+
+  if (m_compute_program)
+    glDeleteProgram(m_compute_program);
+
+  m_compute_program = sb7::program::link_from_shaders(&cs, 1, true);
+
+  m_compute_uniforms.grid_size = glGetUniformLocation(m_compute_program, "grid_size");
+  m_compute_uniforms.source = glGetUniformLocation(m_compute_program, "source");
+  m_compute_uniforms.substeps = glGetUniformLocation(m_compute_program, "substeps");
+  m_compute_uniforms.t = glGetUniformLocation(m_compute_program, "t");
+  m_compute_uniforms.integrator = glGetUniformLocation(m_compute_program, "integrator");
+
+  cs = sb7::shader::load("update_csr.cs.glsl", GL_COMPUTE_SHADER);
+
+  if (m_csr_program)
+    glDeleteProgram(m_csr_program);
+
+  m_csr_program = sb7::program::link_from_shaders(&cs, 1, true);
+
+  m_csr_uniforms.point_count = glGetUniformLocation(m_csr_program, "point_count");
+  m_csr_uniforms.source = glGetUniformLocation(m_csr_program, "source");
+  m_csr_uniforms.t = glGetUniformLocation(m_csr_program, "t");
+  m_csr_uniforms.integrator = glGetUniformLocation(m_csr_program, "integrator");
+
+  m_update_uniforms.t = glGetUniformLocation(m_update_program, "t");
+  m_update_uniforms.integrator = glGetUniformLocation(m_update_program, "integrator");
+
   vs = sb7::shader::load("render.vs.glsl", GL_VERTEX_SHADER);
   fs = sb7::shader::load("render.fs.glsl", GL_FRAGMENT_SHADER);
 
@@ -106,134 +236,222 @@ void SpringMass::LoadShaders()
   glGetShaderInfoLog(vs, 1024, nullptr, buffer);
   glGetShaderInfoLog(fs, 1024, nullptr, buffer);
   glGetProgramInfoLog(m_update_program, 1024, nullptr, buffer);
+
+  m_scale_loc = glGetUniformLocation(m_render_program, "scale");
 }
 
 void SpringMass::startup()
 {
   LoadShaders();
 
-  vmath::vec4 *initial_positions = new vmath::vec4[POINTS_TOTAL];
-  vmath::vec3 *initial_velocities = new vmath::vec3[POINTS_TOTAL];
-  vmath::ivec4 *connection_vectors = new vmath::ivec4[POINTS_TOTAL];
+  glGenVertexArrays(2, m_vao);
+  glGenBuffers(BUFFER_COUNT, m_vbo);
+  glGenTextures(2, m_pos_tbo);
+  glGenTextures(2, m_spring_tbo);
+  glGenBuffers(1, &m_index_buffer);
 
-  int n = 0;
+  CreateGrid(50, 50);
 
-  for (int j = 0; j < POINTS_Y; ++j)
+  if (info.flags.headless)
   {
-    float fj = (float)j / (float)POINTS_Y;
-
-    for (int i = 0; i < POINTS_X; ++i)
-    {
-      float fi = (float)i / (float)POINTS_X;
-
-      initial_positions[n] = vmath::vec4((fi - 0.5f) * float(POINTS_X),
-                                         (fj - 0.5f) * float(POINTS_Y),
-                                         0.6f * sinf(fi) * cosf(fj), 1.0f);
-      initial_velocities[n] = vmath::vec3(0.0f);
-      connection_vectors[n] = vmath::ivec4(-1);
+    CheckSolver(SOLVER_TRANSFORM_FEEDBACK, 256);
+    CheckSolver(SOLVER_COMPUTE, 256);
+    RunBenchmark();
+    RunIntegratorTest();
+    glfwSetWindowShouldClose(window, GL_TRUE);
+  }
+  else
+  {
+    UpdateTitle();
+  }
+}
 
-      if (j != (POINTS_Y - 1))
-      {
-        if (i != 0)
-          connection_vectors[n][0] = n - 1;
+// (Re)creates every buffer for a spring network and resets the
+// simulation.
+void SpringMass::CreateNetwork(const SpringNetwork& network)
+{
+  m_network = network;
+  m_iteration_index = 0;
 
-        if (j != 0)
-          connection_vectors[n][1] = n - POINTS_X;
+  m_cpu_solver.Init(m_network, nullptr);
 
-        if (i != (POINTS_X - 1))
-          connection_vectors[n][2] = n + 1;
+  const int points_total = PointsTotal();
+  const std::vector<vmath::vec3> initial_velocities(points_total, vmath::vec3(0.0f));
 
-        if (j != (POINTS_Y - 1))
-          connection_vectors[n][3] = n + POINTS_X;
-      }
+  glBindBuffer(GL_ARRAY_BUFFER, m_vbo[SPRING_OFFSETS]);
+  glBufferData(GL_ARRAY_BUFFER, m_network.offsets.size() * sizeof(int),
+               m_network.offsets.data(), GL_STATIC_DRAW);
 
-      n++;
-    }
-  }
+  // The buffers of a network without springs still need some storage
+  glBindBuffer(GL_ARRAY_BUFFER, m_vbo[SPRING_NEIGHBOURS]);
+  glBufferData(GL_ARRAY_BUFFER, vmath::max(m_network.neighbours.size(), size_t(1)) * sizeof(int),
+               nullptr, GL_STATIC_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, m_network.neighbours.size() * sizeof(int),
+                  m_network.neighbours.data());
 
-  glGenVertexArrays(2, m_vao);
-  glGenBuffers(5, m_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, m_vbo[SPRING_REST_LENGTHS]);
+  glBufferData(GL_ARRAY_BUFFER, vmath::max(m_network.rest_lengths.size(), size_t(1)) * sizeof(float),
+               nullptr, GL_STATIC_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, m_network.rest_lengths.size() * sizeof(float),
+                  m_network.rest_lengths.data());
 
   for (int i = 0; i < 2; ++i)
   {
     glBindVertexArray(m_vao[i]);
 
     glBindBuffer(GL_ARRAY_BUFFER, m_vbo[POSITION_A + i]);
-    glBufferData(GL_ARRAY_BUFFER, POINTS_TOTAL * sizeof(vmath::vec4),
-                 initial_positions, GL_DYNAMIC_COPY);
+    glBufferData(GL_ARRAY_BUFFER, points_total * sizeof(vmath::vec4),
+                 m_network.positions.data(), GL_DYNAMIC_COPY);
     glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, nullptr);
     glEnableVertexAttribArray(0);
 
     glBindBuffer(GL_ARRAY_BUFFER, m_vbo[VELOCITY_A + i]);
-    glBufferData(GL_ARRAY_BUFFER, POINTS_TOTAL * sizeof(vmath::vec3), 
-                 initial_velocities, GL_DYNAMIC_COPY);
+    glBufferData(GL_ARRAY_BUFFER, points_total * sizeof(vmath::vec3), 
+                 initial_velocities.data(), GL_DYNAMIC_COPY);
     glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
     glEnableVertexAttribArray(1);
 
-    glBindBuffer(GL_ARRAY_BUFFER, m_vbo[CONNECTION]);
-    glBufferData(GL_ARRAY_BUFFER, POINTS_TOTAL * sizeof(vmath::ivec4), 
-                 connection_vectors, GL_STATIC_DRAW);
-    glVertexAttribIPointer(2, 4, GL_INT, 0, nullptr);
+    // Point n's springs run from offsets[n] to offsets[n + 1]
+    glBindBuffer(GL_ARRAY_BUFFER, m_vbo[SPRING_OFFSETS]);
+    glVertexAttribIPointer(2, 1, GL_INT, 0, nullptr);
     glEnableVertexAttribArray(2);
+    glVertexAttribIPointer(3, 1, GL_INT, 0, (const GLvoid *)sizeof(int));
+    glEnableVertexAttribArray(3);
   }
 
-  delete[] initial_positions;
-  delete[] initial_velocities;
-  delete[] connection_vectors;
-
-  glGenTextures(2, m_pos_tbo);
   glBindTexture(GL_TEXTURE_BUFFER, m_pos_tbo[0]);
   glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, m_vbo[POSITION_A]);
   glBindTexture(GL_TEXTURE_BUFFER, m_pos_tbo[1]);
   glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, m_vbo[POSITION_B]);
 
-  int lines = (POINTS_X - 1) * POINTS_Y + (POINTS_Y - 1) * POINTS_X;
+  // The springs stay bound to texture units 1 and 2 for update.vs.glsl
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_BUFFER, m_spring_tbo[0]);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, m_vbo[SPRING_NEIGHBOURS]);
+  glActiveTexture(GL_TEXTURE2);
+  glBindTexture(GL_TEXTURE_BUFFER, m_spring_tbo[1]);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_R32F, m_vbo[SPRING_REST_LENGTHS]);
+  glActiveTexture(GL_TEXTURE0);
 
-  glGenBuffers(1, &m_index_buffer);
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffer);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, lines * 2 * sizeof(int), 
-               nullptr, GL_STATIC_DRAW);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_network.lines.size() * sizeof(unsigned int), 
+               m_network.lines.data(), GL_STATIC_DRAW);
+}
 
-  int *e = (int*)(glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, 0, 
-                                   lines * 2 * sizeof(int), 
-                                   GL_MAP_WRITE_BIT | 
-                                   GL_MAP_INVALIDATE_BUFFER_BIT));
+void SpringMass::CreateGrid(int points_x, int points_y)
+{
+  SpringNetwork network;
 
-  for (int j = 0; j < POINTS_Y; ++j)
-  {
-    for (int i = 0; i < POINTS_X - 1; ++i)
-    {
-      *e++ = i + j * POINTS_X;
-      *e++ = 1 + i + j * POINTS_X;
-    }
-  }
+  BuildGridNetwork(points_x, points_y, 0.88f, network);
+  CreateNetwork(network);
+  m_mesh = -1;
+}
+
+// Loads one of mesh_names from the media directory. Its points are put in
+// Morton order so that springs mostly join points that are close in memory.
+bool SpringMass::LoadMesh(int mesh)
+{
+  char filename[256];
+  SpringNetwork network;
 
-  for (int i = 0; i < POINTS_X; ++i)
+  sprintf(filename, "../../../media/objects/%s.sbm", mesh_names[mesh]);
+
+  if (!LoadMeshNetwork(filename, network))
   {
-    for (int j = 0; j < POINTS_Y - 1; ++j)
-    {
-      *e++ = i + j * POINTS_X;
-      *e++ = POINTS_X + i + j * POINTS_X;
-    }
+    fprintf(stderr, "Unable to load %s\n", filename);
+    return false;
   }
 
-  glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+  ReorderNetwork(network);
+  CreateNetwork(network);
+  m_mesh = mesh;
+
+  return true;
 }
 
 void SpringMass::shutdown()
 {
   glDeleteProgram(m_update_program);
-  glDeleteBuffers(5, m_vbo);
-  glDeleteVertexArrays(2, m_vbo);
+  glDeleteProgram(m_compute_program);
+  glDeleteProgram(m_csr_program);
+  glDeleteProgram(m_render_program);
+  glDeleteTextures(2, m_pos_tbo);
+  glDeleteTextures(2, m_spring_tbo);
+  glDeleteBuffers(1, &m_index_buffer);
+  glDeleteBuffers(BUFFER_COUNT, m_vbo);
+  glDeleteVertexArrays(2, m_vao);
 }
 
-void SpringMass::render(double t)
+void SpringMass::UpdateTitle()
+{
+  char buffer[256];
+
+  char topology[64];
+
+  if (m_mesh == -1)
+    sprintf(topology, "%dx%d", m_network.grid_width, PointsTotal() / m_network.grid_width);
+  else
+    sprintf(topology, "%s (%d points)", mesh_names[m_mesh], PointsTotal());
+
+  sprintf(buffer, "SpringMass: %s, %s solver, %s, %d iterations of %.3g per frame, %d per dispatch",
+          topology, solver_names[solver], integrator_names[integrator],
+          iterations_per_frame, time_step, substeps);
+  setWindowTitle(buffer);
+}
+
+// The GPU solvers only implement the explicit integrators
+static inline bool GpuSupports(INTEGRATOR_t integrator)
+{
+  return integrator <= INTEGRATOR_SEMI_IMPLICIT_EULER;
+}
+
+void SpringMass::SetSolver(SOLVER_t new_solver)
+{
+  if (new_solver == SOLVER_CPU && solver != SOLVER_CPU)
+  {
+    std::vector<vmath::vec4> positions(PointsTotal());
+    std::vector<vmath::vec3> velocities(PointsTotal());
+
+    ReadGpuState(positions.data(), velocities.data());
+    m_cpu_solver.SetState(positions.data(), velocities.data());
+  }
+
+  if (new_solver != SOLVER_CPU && !GpuSupports(integrator))
+  {
+    integrator = INTEGRATOR_EXPLICIT;
+  }
+
+  solver = new_solver;
+}
+
+void SpringMass::Update(SOLVER_t solver, int iterations)
+{
+  m_cpu_solver.t = time_step;
+  m_cpu_solver.integrator = integrator;
+
+  switch (solver)
+  {
+    case SOLVER_TRANSFORM_FEEDBACK:
+      UpdateTransformFeedback(iterations);
+      break;
+    case SOLVER_COMPUTE:
+      UpdateCompute(iterations);
+      break;
+    case SOLVER_CPU:
+      UpdateCpu(iterations);
+      break;
+  }
+}
+
+void SpringMass::UpdateTransformFeedback(int iterations)
 {
   glUseProgram(m_update_program);
+  glUniform1f(m_update_uniforms.t, time_step);
+  glUniform1i(m_update_uniforms.integrator, integrator);
 
   glEnable(GL_RASTERIZER_DISCARD);
 
-  for (int i = iterations_per_frame; i != 0; --i)
+  for (int i = iterations; i != 0; --i)
   {
     glBindVertexArray(m_vao[m_iteration_index & 1]);
     glBindTexture(GL_TEXTURE_BUFFER, m_pos_tbo[m_iteration_index & 1]);
@@ -244,11 +462,314 @@ void SpringMass::render(double t)
                      m_vbo[VELOCITY_A + (m_iteration_index & 1)]);
 
     glBeginTransformFeedback(GL_POINTS);
-    glDrawArrays(GL_POINTS, 0, POINTS_TOTAL);
+    glDrawArrays(GL_POINTS, 0, PointsTotal());
     glEndTransformFeedback();    
   }
 
   glDisable(GL_RASTERIZER_DISCARD);
+}
+
+// On a grid, each dispatch runs up to `substeps` iterations out of shared
+// memory and swaps the buffers once. Any other network runs one iteration
+// per dispatch. Buffers are bound once per call; between dispatches only
+// the source index and the step count change.
+void SpringMass::UpdateCompute(int iterations)
+{
+  for (int i = 0; i < BUFFER_COUNT; ++i)
+  {
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, i, m_vbo[i]);
+  }
+
+  if (m_network.grid_width != 0)
+  {
+    const int points_x = m_network.grid_width;
+    const int points_y = PointsTotal() / points_x;
+
+    glUseProgram(m_compute_program);
+    glUniform2i(m_compute_uniforms.grid_size, points_x, points_y);
+    glUniform1f(m_compute_uniforms.t, time_step);
+    glUniform1i(m_compute_uniforms.integrator, integrator);
+
+    while (iterations > 0)
+    {
+      const int steps = iterations < substeps ? iterations : substeps;
+      const int stride = COMPUTE_TILE_SIZE - 2 * steps;
+
+      glUniform1i(m_compute_uniforms.source, m_iteration_index & 1);
+      glUniform1i(m_compute_uniforms.substeps, steps);
+      glDispatchCompute((points_x + stride - 1) / stride,
+                        (points_y + stride - 1) / stride, 1);
+      glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+      ++m_iteration_index;
+      iterations -= steps;
+    }
+  }
+  else
+  {
+    glUseProgram(m_csr_program);
+    glUniform1i(m_csr_uniforms.point_count, PointsTotal());
+    glUniform1f(m_csr_uniforms.t, time_step);
+    glUniform1i(m_csr_uniforms.integrator, integrator);
+
+    for (int i = iterations; i != 0; --i)
+    {
+      glUniform1i(m_csr_uniforms.source, m_iteration_index & 1);
+      glDispatchCompute((PointsTotal() + CSR_GROUP_SIZE - 1) / CSR_GROUP_SIZE, 1, 1);
+      glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+      ++m_iteration_index;
+    }
+  }
+
+  glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT |
+                  GL_TEXTURE_FETCH_BARRIER_BIT |
+                  GL_BUFFER_UPDATE_BARRIER_BIT);
+
+  glBindVertexArray(m_vao[m_iteration_index & 1]);
+}
+
+// Runs the CPU solver and uploads its result into the buffers that the
+// next GPU iteration would read, so that the two can be swapped at any time.
+void SpringMass::UpdateCpu(int iterations)
+{
+  std::vector<vmath::vec4> positions(PointsTotal());
+  std::vector<vmath::vec3> velocities(PointsTotal());
+
+  m_cpu_solver.Step(iterations);
+  m_cpu_solver.GetState(positions.data(), velocities.data());
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_vbo[POSITION_A + (m_iteration_index & 1)]);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, positions.size() * sizeof(vmath::vec4), positions.data());
+  glBindBuffer(GL_ARRAY_BUFFER, m_vbo[VELOCITY_A + (m_iteration_index & 1)]);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, velocities.size() * sizeof(vmath::vec3), velocities.data());
+
+  glBindVertexArray(m_vao[m_iteration_index & 1]);
+}
+
+void SpringMass::ReadGpuState(vmath::vec4 *positions, vmath::vec3 *velocities)
+{
+  glBindBuffer(GL_ARRAY_BUFFER, m_vbo[POSITION_A + (m_iteration_index & 1)]);
+  glGetBufferSubData(GL_ARRAY_BUFFER, 0, PointsTotal() * sizeof(vmath::vec4), positions);
+  glBindBuffer(GL_ARRAY_BUFFER, m_vbo[VELOCITY_A + (m_iteration_index & 1)]);
+  glGetBufferSubData(GL_ARRAY_BUFFER, 0, PointsTotal() * sizeof(vmath::vec3), velocities);
+}
+
+// Starts a GPU solver and the CPU solver from the current GPU state, runs
+// both for the given number of iterations and compares the results.
+bool SpringMass::CheckSolver(SOLVER_t gpu_solver, int iterations)
+{
+  static const float tolerance = 5.0e-3f;
+
+  if (!GpuSupports(integrator))
+  {
+    fprintf(stderr, "%s vs CPU: skipped, the %s integrator only runs on the CPU\n",
+            solver_names[gpu_solver], integrator_names[integrator]);
+    return false;
+  }
+
+  const int points_total = PointsTotal();
+  std::vector<vmath::vec4> gpu_positions(points_total);
+  std::vector<vmath::vec3> gpu_velocities(points_total);
+  std::vector<vmath::vec4> cpu_positions(points_total);
+  std::vector<vmath::vec3> cpu_velocities(points_total);
+
+  ReadGpuState(gpu_positions.data(), gpu_velocities.data());
+  m_cpu_solver.SetState(gpu_positions.data(), gpu_velocities.data());
+
+  Update(gpu_solver, iterations);
+  m_cpu_solver.Step(iterations);
+
+  ReadGpuState(gpu_positions.data(), gpu_velocities.data());
+  m_cpu_solver.GetState(cpu_positions.data(), cpu_velocities.data());
+
+  float position_error = 0.0f;
+  float velocity_error = 0.0f;
+
+  for (int n = 0; n < points_total; ++n)
+  {
+    for (int i = 0; i < 3; ++i)
+    {
+      position_error = vmath::max(position_error, fabsf(gpu_positions[n][i] - cpu_positions[n][i]));
+      velocity_error = vmath::max(velocity_error, fabsf(gpu_velocities[n][i] - cpu_velocities[n][i]));
+    }
+  }
+
+  const bool pass = position_error <= tolerance && velocity_error <= tolerance;
+  char buffer[256];
+
+  sprintf(buffer, "%s vs CPU after %d iterations: max position error %g, max velocity error %g (%s)",
+          solver_names[gpu_solver], iterations, position_error, velocity_error, pass ? "PASS" : "FAIL");
+  fprintf(stderr, "%s\n", buffer);
+  setWindowTitle(buffer);
+
+  return pass;
+}
+
+// Returns iterations per second for one solver on the current grid. The CPU
+// solver is timed without uploading its results.
+double SpringMass::MeasureSolver(SOLVER_t solver)
+{
+  const int batch = solver == SOLVER_CPU ? 8 : 64;
+  int iterations = 0;
+  double start;
+  double elapsed;
+
+  if (solver == SOLVER_CPU)
+  {
+    m_cpu_solver.Step(1);
+  }
+  else
+  {
+    Update(solver, batch);
+    glFinish();
+  }
+
+  start = glfwGetTime();
+
+  do
+  {
+    if (solver == SOLVER_CPU)
+    {
+      m_cpu_solver.Step(batch);
+    }
+    else
+    {
+      Update(solver, batch);
+      glFinish();
+    }
+    iterations += batch;
+    elapsed = glfwGetTime() - start;
+  } while (elapsed < 0.5);
+
+  return double(iterations) / elapsed;
+}
+
+void SpringMass::RunBenchmark()
+{
+  const SpringNetwork saved_network = m_network;
+  const int saved_mesh = m_mesh;
+  char buffer[256];
+
+  fprintf(stderr, "%-10s %20s %20s %20s\n", "network", "transform feedback", "compute shader", "CPU");
+
+  for (int size : grid_sizes)
+  {
+    double rate[SOLVER_MAX + 1];
+
+    for (int s = 0; s <= SOLVER_MAX; ++s)
+    {
+      CreateGrid(size, size);
+      rate[s] = MeasureSolver(SOLVER_t(s));
+    }
+
+    sprintf(buffer, "%4dx%-5d %20.1f %20.1f %20.1f", size, size,
+            rate[SOLVER_TRANSFORM_FEEDBACK], rate[SOLVER_COMPUTE], rate[SOLVER_CPU]);
+    fprintf(stderr, "%s\n", buffer);
+  }
+
+  for (int mesh = 0; mesh < MESH_COUNT; ++mesh)
+  {
+    double rate[SOLVER_MAX + 1];
+
+    for (int s = 0; s <= SOLVER_MAX; ++s)
+    {
+      if (!LoadMesh(mesh))
+        break;
+      rate[s] = MeasureSolver(SOLVER_t(s));
+    }
+
+    if (m_mesh != mesh)
+      continue;
+
+    sprintf(buffer, "%-10s %20.1f %20.1f %20.1f", mesh_names[mesh],
+            rate[SOLVER_TRANSFORM_FEEDBACK], rate[SOLVER_COMPUTE], rate[SOLVER_CPU]);
+    fprintf(stderr, "%s\n", buffer);
+  }
+
+  fprintf(stderr, "(iterations per second, %d iterations per dispatch, %u CPU threads)\n",
+          substeps, m_thread_pool.size());
+  setWindowTitle(buffer);
+
+  CreateNetwork(saved_network);
+  m_mesh = saved_mesh;
+}
+
+// Runs two seconds' worth of default frames on a 50x50 grid with every
+// integrator at 1, 4 and 16 times the default time step, and reports the
+// cost and the final state.
+void SpringMass::RunIntegratorTest()
+{
+  static const int step_scales[] = { 1, 4, 16 };
+  static const float simulated_time = 0.07f * 16.0f * 60.0f * 2.0f;
+  static const int size = 50;
+
+  SpringNetwork network;
+
+  BuildGridNetwork(size, size, 0.88f, network);
+
+  fprintf(stderr, "%dx%d grid, %g time units:\n", size, size, simulated_time);
+  fprintf(stderr, "%-20s %8s %8s %12s %12s %12s %10s\n", "integrator", "step", "steps",
+          "ms/step", "kinetic", "potential", "max speed");
+
+  for (int i = 0; i <= INTEGRATOR_MAX; ++i)
+  {
+    for (int scale : step_scales)
+    {
+      CpuSolver cpu_solver(m_thread_pool);
+
+      cpu_solver.Init(network, nullptr);
+      cpu_solver.integrator = INTEGRATOR_t(i);
+      cpu_solver.t = 0.07f * float(scale);
+
+      const int steps = int(simulated_time / cpu_solver.t + 0.5f);
+      const double start = glfwGetTime();
+
+      cpu_solver.Step(steps);
+
+      const double elapsed = glfwGetTime() - start;
+      const Energy energy = cpu_solver.MeasureEnergy();
+
+      fprintf(stderr, "%-20s %8.3g %8d %12.4f %12.4g %12.4g %10.4g%s\n",
+              integrator_names[i], cpu_solver.t, steps, 1000.0 * elapsed / steps,
+              energy.kinetic, energy.potential, energy.max_speed,
+              energy.stable ? "" : " UNSTABLE");
+    }
+  }
+}
+
+// Prints the energy of the current state. A GPU solver's state is read
+// back into the CPU solver first.
+void SpringMass::PrintEnergy()
+{
+  if (solver != SOLVER_CPU)
+  {
+    std::vector<vmath::vec4> positions(PointsTotal());
+    std::vector<vmath::vec3> velocities(PointsTotal());
+
+    ReadGpuState(positions.data(), velocities.data());
+    m_cpu_solver.SetState(positions.data(), velocities.data());
+  }
+
+  const Energy energy = m_cpu_solver.MeasureEnergy();
+  char buffer[256];
+
+  sprintf(buffer, "%s: energy %.6g (kinetic %.6g, potential %.6g), max speed %.4g%s",
+          integrator_names[integrator], energy.kinetic + energy.potential,
+          energy.kinetic, energy.potential, energy.max_speed,
+          energy.stable ? "" : ", UNSTABLE");
+  fprintf(stderr, "%s\n", buffer);
+  setWindowTitle(buffer);
+}
+
+void SpringMass::render(double t)
+{
+  Update(solver, iterations_per_frame);
+
+  if (print_energy)
+  {
+    PrintEnergy();
+  }
 
   static const GLfloat black[] = {0.0f, 0.0f, 0.0f, 0.0f};
 
@@ -256,16 +777,17 @@ void SpringMass::render(double t)
   glClearBufferfv(GL_COLOR, 0, black);
 
   glUseProgram(m_render_program);
+  glUniform1f(m_scale_loc, 0.75f / m_network.extent);
 
   if (draw_points)
   {
     glPointSize(4.0f);
-    glDrawArrays(GL_POINTS, 0, POINTS_TOTAL);
+    glDrawArrays(GL_POINTS, 0, PointsTotal());
   }
   if (draw_lines)
   {
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffer);
-    glDrawElements(GL_LINES, CONNECTIONS_TOTAL * 2, GL_UNSIGNED_INT, nullptr);
+    glDrawElements(GL_LINES, LinesTotal() * 2, GL_UNSIGNED_INT, nullptr);
   }
 }
 
@@ -284,11 +806,75 @@ void SpringMass::onKey(int key, int action)
       case 'P':
         draw_points = !draw_points;
         break;
+      case 'S':
+        SetSolver(solver == SOLVER_MAX ? SOLVER_t(0) : SOLVER_t(solver + 1));
+        UpdateTitle();
+        break;
+      case 'I':
+        integrator = integrator == INTEGRATOR_MAX ? INTEGRATOR_t(0) : INTEGRATOR_t(integrator + 1);
+        if (!GpuSupports(integrator))
+          SetSolver(SOLVER_CPU);
+        UpdateTitle();
+        break;
+      case 'E':
+        print_energy = !print_energy;
+        if (!print_energy)
+          UpdateTitle();
+        break;
+      case 'K':
+        RunIntegratorTest();
+        break;
+      case 'G':
+        {
+          const int count = sizeof(grid_sizes) / sizeof(grid_sizes[0]);
+          int n = 0;
+          while (n < count && grid_sizes[n] <= m_network.grid_width)
+            n++;
+          CreateGrid(grid_sizes[n % count], grid_sizes[n % count]);
+          UpdateTitle();
+        }
+        break;
+      case 'M':
+        LoadMesh((m_mesh + 1) % MESH_COUNT);
+        UpdateTitle();
+        break;
+      case 'T':
+        substeps = substeps * 2 > MAX_SUBSTEPS ? 1 : substeps * 2;
+        UpdateTitle();
+        break;
+      case 'C':
+        CheckSolver(SOLVER_TRANSFORM_FEEDBACK, 256);
+        CheckSolver(SOLVER_COMPUTE, 256);
+        break;
+      case 'B':
+        RunBenchmark();
+        break;
       case GLFW_KEY_KP_ADD:
-        ++iterations_per_frame;
+        if (iterations_per_frame < MAX_ITERATIONS_PER_FRAME)
+          ++iterations_per_frame;
+        UpdateTitle();
         break;
       case GLFW_KEY_KP_SUBTRACT:
-        --iterations_per_frame;
+        if (iterations_per_frame > 1)
+          --iterations_per_frame;
+        UpdateTitle();
+        break;
+      // Fewer, larger steps for the same simulated time per frame
+      case GLFW_KEY_KP_MULTIPLY:
+        if (iterations_per_frame > 1)
+        {
+          iterations_per_frame /= 2;
+          time_step *= 2.0f;
+        }
+        UpdateTitle();
+        break;
+      case GLFW_KEY_KP_DIVIDE:
+        if (iterations_per_frame * 2 <= MAX_ITERATIONS_PER_FRAME)
+        {
+          iterations_per_frame *= 2;
+          time_step *= 0.5f;
+        }
+        UpdateTitle();
         break;
       default:
         break;
@@ -0,0 +1,198 @@
+#version 450 core
+
+// Compute shader version of update.vs.glsl for a cloth laid out on a grid.
+// Springs may only join points that are next to each other on the grid;
+// update_csr.cs.glsl handles any other network.
+//
+// Each work group copies a TILE_SIZE x TILE_SIZE block of the grid into
+// shared memory and runs several iterations on it before writing anything
+// back. Points on the edge of the block can't see all of their neighbours,
+// so every iteration leaves one more ring of points around the edge out of
+// date. Only points at least `substeps` away from the edge are written out,
+// and the blocks of neighbouring work groups overlap to cover the rest.
+
+layout (local_size_x = 16, local_size_y = 16) in;
+
+#define TILE_SIZE           32
+#define GROUP_SIZE          256
+#define POINTS_PER_THREAD   ((TILE_SIZE * TILE_SIZE) / GROUP_SIZE)
+
+// Both halves of the ping-pong pair stay bound. `source` selects which one
+// is read; the other is written.
+layout (std430, binding = 0) buffer POSITION_BLOCK
+{
+    vec4 position_mass[];
+} position_buffer[2];
+
+// Velocities are tightly packed vec3s, as written by transform feedback
+layout (std430, binding = 2) buffer VELOCITY_BLOCK
+{
+    float velocity[];
+} velocity_buffer[2];
+
+// The springs in the same CSR layout as SpringNetwork
+layout (std430, binding = 4) readonly buffer SPRING_OFFSET_BLOCK
+{
+    int spring_offset[];
+};
+
+layout (std430, binding = 5) readonly buffer SPRING_NEIGHBOUR_BLOCK
+{
+    int spring_neighbour[];
+};
+
+layout (std430, binding = 6) readonly buffer SPRING_REST_LENGTH_BLOCK
+{
+    float spring_rest_length[];
+};
+
+uniform ivec2 grid_size;
+uniform int source;
+
+// Number of iterations to run. At most (TILE_SIZE / 2) - 1.
+uniform int substeps = 4;
+
+uniform float t = 0.07;
+uniform float k = 7.1;
+const vec3 gravity = vec3(0.0, -0.08, 0.0);
+uniform float c = 2.8;
+
+// 0: the original integrator, 1: semi-implicit Euler
+uniform int integrator = 0;
+
+shared float s_x[TILE_SIZE * TILE_SIZE];
+shared float s_y[TILE_SIZE * TILE_SIZE];
+shared float s_z[TILE_SIZE * TILE_SIZE];
+shared float s_vx[TILE_SIZE * TILE_SIZE];
+shared float s_vy[TILE_SIZE * TILE_SIZE];
+shared float s_vz[TILE_SIZE * TILE_SIZE];
+
+void main(void)
+{
+    const int dst = 1 - source;
+    ivec2 origin = ivec2(gl_WorkGroupID.xy) * (TILE_SIZE - 2 * substeps) - substeps;
+
+    int global_index[POINTS_PER_THREAD];
+    bool active[POINTS_PER_THREAD];
+    float mass[POINTS_PER_THREAD];
+    int first_spring[POINTS_PER_THREAD];
+    int last_spring[POINTS_PER_THREAD];
+    vec3 new_p[POINTS_PER_THREAD];
+    vec3 new_v[POINTS_PER_THREAD];
+
+    for (int n = 0; n < POINTS_PER_THREAD; n++)
+    {
+        int i = int(gl_LocalInvocationIndex) + n * GROUP_SIZE;
+        ivec2 local_pos = ivec2(i % TILE_SIZE, i / TILE_SIZE);
+        ivec2 pos = origin + local_pos;
+        bool in_grid = all(greaterThanEqual(pos, ivec2(0))) && all(lessThan(pos, grid_size));
+        int g = pos.y * grid_size.x + pos.x;
+
+        vec4 pm = vec4(0.0, 0.0, 0.0, 1.0);
+        vec3 v = vec3(0.0);
+        first_spring[n] = 0;
+        last_spring[n] = 0;
+
+        if (in_grid)
+        {
+            pm = position_buffer[source].position_mass[g];
+            v = vec3(velocity_buffer[source].velocity[g * 3 + 0],
+                     velocity_buffer[source].velocity[g * 3 + 1],
+                     velocity_buffer[source].velocity[g * 3 + 2]);
+            first_spring[n] = spring_offset[g];
+            last_spring[n] = spring_offset[g + 1];
+        }
+
+        global_index[n] = in_grid ? g : -1;
+        active[n] = in_grid &&
+                    all(greaterThan(local_pos, ivec2(0))) &&
+                    all(lessThan(local_pos, ivec2(TILE_SIZE - 1)));
+        mass[n] = pm.w;
+
+        s_x[i] = pm.x;
+        s_y[i] = pm.y;
+        s_z[i] = pm.z;
+        s_vx[i] = v.x;
+        s_vy[i] = v.y;
+        s_vz[i] = v.z;
+    }
+
+    barrier();
+
+    for (int step = 0; step < substeps; step++)
+    {
+        for (int n = 0; n < POINTS_PER_THREAD; n++)
+        {
+            int i = int(gl_LocalInvocationIndex) + n * GROUP_SIZE;
+            vec3 p = vec3(s_x[i], s_y[i], s_z[i]);
+            vec3 u = vec3(s_vx[i], s_vy[i], s_vz[i]);
+
+            new_p[n] = p;
+            new_v[n] = u;
+
+            if (active[n])
+            {
+                float m = mass[n];
+                vec3 F = gravity * m - c * u;
+                bool fixed_node = first_spring[n] == last_spring[n];
+
+                for (int j = first_spring[n]; j < last_spring[n]; j++)
+                {
+                    // Where the neighbour is in the tile
+                    int g = spring_neighbour[j];
+                    ivec2 q_pos = ivec2(g % grid_size.x, g / grid_size.x) - origin;
+                    int q_index = q_pos.y * TILE_SIZE + q_pos.x;
+                    vec3 q = vec3(s_x[q_index], s_y[q_index], s_z[q_index]);
+                    vec3 d = q - p;
+                    float x = length(d);
+                    F += -k * (spring_rest_length[j] - x) * normalize(d);
+                }
+
+                if (fixed_node)
+                {
+                    F = vec3(0.0);
+                }
+
+                vec3 a = F / m;
+                vec3 v = u + a * t;
+                vec3 s = integrator == 1 ? v * t : u * t + 0.5 * a * t * t;
+
+                new_v[n] = v;
+                new_p[n] = p + clamp(s, vec3(-25.0), vec3(25.0));
+            }
+        }
+
+        barrier();
+
+        for (int n = 0; n < POINTS_PER_THREAD; n++)
+        {
+            int i = int(gl_LocalInvocationIndex) + n * GROUP_SIZE;
+
+            s_x[i] = new_p[n].x;
+            s_y[i] = new_p[n].y;
+            s_z[i] = new_p[n].z;
+            s_vx[i] = new_v[n].x;
+            s_vy[i] = new_v[n].y;
+            s_vz[i] = new_v[n].z;
+        }
+
+        barrier();
+    }
+
+    for (int n = 0; n < POINTS_PER_THREAD; n++)
+    {
+        int i = int(gl_LocalInvocationIndex) + n * GROUP_SIZE;
+        ivec2 local_pos = ivec2(i % TILE_SIZE, i / TILE_SIZE);
+        int g = global_index[n];
+
+        if (g != -1 &&
+            all(greaterThanEqual(local_pos, ivec2(substeps))) &&
+            all(lessThan(local_pos, ivec2(TILE_SIZE - substeps))))
+        {
+            position_buffer[dst].position_mass[g] = vec4(new_p[n], mass[n]);
+            velocity_buffer[dst].velocity[g * 3 + 0] = new_v[n].x;
+            velocity_buffer[dst].velocity[g * 3 + 1] = new_v[n].y;
+            velocity_buffer[dst].velocity[g * 3 + 2] = new_v[n].z;
+        }
+    }
+}
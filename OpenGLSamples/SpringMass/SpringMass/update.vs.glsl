@@ -2,9 +2,14 @@
 
 layout (location = 0) in vec4 position_mass;
 layout (location = 1) in vec3 velocity;
-layout (location = 2) in ivec4 connection;
+// The springs of this point are [first_spring, last_spring) in
+// tex_neighbours and tex_rest_lengths. A point with none is fixed.
+layout (location = 2) in int first_spring;
+layout (location = 3) in int last_spring;
 
-uniform samplerBuffer tex_position;
+layout (binding = 0) uniform samplerBuffer tex_position;
+layout (binding = 1) uniform isamplerBuffer tex_neighbours;
+layout (binding = 2) uniform samplerBuffer tex_rest_lengths;
 
 out vec4 tf_position_mass;
 out vec3 tf_velocity;
@@ -15,7 +20,9 @@ uniform float k = 7.1;
 
 const vec3 gravity = vec3(0.0, -0.08, 0.0);
 uniform float c = 2.8;
-uniform float rest_length = 0.88;
+
+// 0: the original integrator, 1: semi-implicit Euler
+uniform int integrator = 0;
 
 void main(void)
 {
@@ -24,19 +31,15 @@ void main(void)
 
    vec3 u = velocity;
    vec3 F = gravity * m - c * u;
-   bool fixed_node = true;
+   bool fixed_node = first_spring == last_spring;
 
-   for (int i = 0; i < 4; ++i) 
+   for (int i = first_spring; i < last_spring; ++i) 
    {
-      if (connection[i] != -1)
-      {
-         vec3 q = texelFetch(tex_position, connection[i]).xyz;
-         vec3 d = q - p;
-
-         float x = length(d);
-         F += -k * (rest_length - x) * normalize(d);
-         fixed_node = false;
-      }
+      vec3 q = texelFetch(tex_position, texelFetch(tex_neighbours, i).x).xyz;
+      vec3 d = q - p;
+
+      float x = length(d);
+      F += -k * (texelFetch(tex_rest_lengths, i).x - x) * normalize(d);
    }
 
    if (fixed_node) 
@@ -50,6 +53,11 @@ void main(void)
 
    vec3 v = u + a * t;
 
+   if (integrator == 1)
+   {
+      s = v * t;
+   }
+
    s = clamp(s, vec3(-25.0), vec3(25.0));
 
    tf_position_mass = vec4(p + s, m);
@@ -0,0 +1,88 @@
+#version 450 core
+
+// Compute shader version of update.vs.glsl for any spring network. One
+// invocation per point and one iteration per dispatch; neighbours can be
+// anywhere, so nothing is kept in shared memory. Points are best numbered
+// so that neighbours are close together in the buffers.
+
+layout (local_size_x = 256) in;
+
+layout (std430, binding = 0) buffer POSITION_BLOCK
+{
+    vec4 position_mass[];
+} position_buffer[2];
+
+layout (std430, binding = 2) buffer VELOCITY_BLOCK
+{
+    float velocity[];
+} velocity_buffer[2];
+
+layout (std430, binding = 4) readonly buffer SPRING_OFFSET_BLOCK
+{
+    int spring_offset[];
+};
+
+layout (std430, binding = 5) readonly buffer SPRING_NEIGHBOUR_BLOCK
+{
+    int spring_neighbour[];
+};
+
+layout (std430, binding = 6) readonly buffer SPRING_REST_LENGTH_BLOCK
+{
+    float spring_rest_length[];
+};
+
+uniform int point_count;
+uniform int source;
+
+uniform float t = 0.07;
+uniform float k = 7.1;
+const vec3 gravity = vec3(0.0, -0.08, 0.0);
+uniform float c = 2.8;
+
+// 0: the original integrator, 1: semi-implicit Euler
+uniform int integrator = 0;
+
+void main(void)
+{
+    const int dst = 1 - source;
+    int g = int(gl_GlobalInvocationID.x);
+
+    if (g >= point_count)
+        return;
+
+    vec4 pm = position_buffer[source].position_mass[g];
+    vec3 p = pm.xyz;
+    float m = pm.w;
+    vec3 u = vec3(velocity_buffer[source].velocity[g * 3 + 0],
+                  velocity_buffer[source].velocity[g * 3 + 1],
+                  velocity_buffer[source].velocity[g * 3 + 2]);
+
+    int first_spring = spring_offset[g];
+    int last_spring = spring_offset[g + 1];
+    vec3 F = gravity * m - c * u;
+
+    for (int j = first_spring; j < last_spring; j++)
+    {
+        vec3 q = position_buffer[source].position_mass[spring_neighbour[j]].xyz;
+        vec3 d = q - p;
+        float x = length(d);
+        F += -k * (spring_rest_length[j] - x) * normalize(d);
+    }
+
+    if (first_spring == last_spring)
+    {
+        F = vec3(0.0);
+    }
+
+    vec3 a = F / m;
+    vec3 v = u + a * t;
+    vec3 s = integrator == 1 ? v * t : u * t + 0.5 * a * t * t;
+
+    s = clamp(s, vec3(-25.0), vec3(25.0));
+
+    position_buffer[dst].position_mass[g] = vec4(p + s, m);
+    velocity_buffer[dst].velocity[g * 3 + 0] = v.x;
+    velocity_buffer[dst].velocity[g * 3 + 1] = v.y;
+    velocity_buffer[dst].velocity[g * 3 + 2] = v.z;
+}
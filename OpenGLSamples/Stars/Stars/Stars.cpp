@@ -1,8 +1,11 @@
 #include <sb7.h>
 #include <sb7ktx.h>
+#include <sb7rng.h>
+#include <sb7threadpool.h>
 #include <vmath.h>
 
 #include <cmath>
+#include <vector>
 
 #define GLSL(version, shader) "#version " #version "\n" #shader  
 
@@ -47,27 +50,17 @@ static const GLchar* fragment_shader_source = GLSL
   }
 );
 
-static unsigned int seed = 0x133371337;
-
-static inline float random_float()
-{
-  float res;
-  unsigned int tmp;
-
-  seed *= 16807;
-
-  tmp = seed ^ (seed >> 4) ^ (seed << 15);
-
-  *((unsigned int *)&res) = (tmp >> 9) | 0x3F800000;
-
-  return (res - 1.0f);
-}
-
 enum
 {
-  NUM_STARS = 2000
+  // The stars that came from the old global seed
+  LEGACY_STARS = 1000,
+  STAR_COUNT_COUNT = 4
 };
 
+// 'S' cycles through these. Stars past LEGACY_STARS come from
+// sb7::rng::parallel_fill_uniform.
+static const int star_counts[STAR_COUNT_COUNT] = { LEGACY_STARS, 50000, 500000, 2000000 };
+
 class Stars : public sb7::application
 {
 private:
@@ -75,8 +68,16 @@ private:
 
   void startup() override;
   void render(double time) override;
+  void onKey(int key, int action) override;
+
+  // Fills star_buffer with count stars
+  void MakeStars(int count);
 
 protected:
+  sb7::thread_pool pool;
+  int star_count_index;
+  int star_count;
+
   GLuint program;
   GLuint star_texture;
   GLuint star_vao;
@@ -137,37 +138,91 @@ void Stars::startup()
   star_texture = sb7::ktx::file::load("../../../media/textures/star.ktx");
 
   glGenVertexArrays(1, &star_vao);
+  glGenBuffers(1, &star_buffer);
+
+  star_count_index = 0;
+  MakeStars(star_counts[star_count_index]);
+}
+
+void Stars::MakeStars(int count)
+{
+  const double start = glfwGetTime();
+
   glBindVertexArray(star_vao);
 
-  struct star_t
-  {
-    vmath::vec3 position;
-    vmath::vec3 color;
-  };
+  // Positions are stored as half floats and colors as normalized bytes,
+  // 12 bytes per star instead of 24. Each attribute gets its own block so
+  // positions can be converted in bulk.
+  const GLsizeiptr position_size = count * sizeof(vmath::vec4h);
+  const GLsizeiptr color_size = count * sizeof(GLuint);
 
-  glGenBuffers(1, &star_buffer);
   glBindBuffer(GL_ARRAY_BUFFER, star_buffer);
-  glBufferData(GL_ARRAY_BUFFER, NUM_STARS * sizeof(star_t), 
+  glBufferData(GL_ARRAY_BUFFER, position_size + color_size, 
                nullptr, GL_STATIC_DRAW);
 
-  star_t *star = (star_t*)glMapBufferRange(GL_ARRAY_BUFFER, 0, NUM_STARS * sizeof(star_t), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  unsigned char *data = (unsigned char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, position_size + color_size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  vmath::half *star_position = (vmath::half*)data;
+  GLuint *star_color = (GLuint*)(data + position_size);
+
+  // The seed is the truncated value of the old global seed, so the first
+  // LEGACY_STARS are the star field the sample has always had. The rest
+  // are filled on every core.
+  std::vector<float> r(size_t(count) * 6);
+  sb7::rng::legacy rng(0x33371337);
+  rng.fill_uniform(r.data(), LEGACY_STARS * 6);
+  sb7::rng::parallel_fill_uniform(r.data() + LEGACY_STARS * 6, r.size() - LEGACY_STARS * 6,
+                                  0x73746172, pool.size());
 
-  for (int i = 0; i < 1000; ++i) 
+  pool.parallel_for(size_t(count), [&](size_t first, size_t last)
   {
-    star[i].position[0] = (random_float() * 2.0f - 1.0f) * 100.0f;
-    star[i].position[1] = (random_float() * 2.0f - 1.0f) * 100.0f;
-    star[i].position[2] = random_float();
-    star[i].color[0] = 0.8f + random_float() * 0.2f;
-    star[i].color[1] = 0.8f + random_float() * 0.2f;
-    star[i].color[2] = 0.8f + random_float() * 0.2f;
-  }
+    std::vector<float> position((last - first) * 4);
+
+    for (size_t i = first; i < last; ++i)
+    {
+      const float *ri = &r[i * 6];
+      float *p = &position[(i - first) * 4];
+
+      p[0] = (ri[0] * 2.0f - 1.0f) * 100.0f;
+      p[1] = (ri[1] * 2.0f - 1.0f) * 100.0f;
+      p[2] = ri[2];
+      p[3] = 1.0f;
+      star_color[i] = vmath::packUnorm4x8(vmath::vec4(0.8f + ri[3] * 0.2f,
+                                                      0.8f + ri[4] * 0.2f,
+                                                      0.8f + ri[5] * 0.2f,
+                                                      1.0f));
+    }
+
+    vmath::float_to_half(star_position + first * 4, position.data(), position.size());
+  });
 
   glUnmapBuffer(GL_ARRAY_BUFFER);
 
-  glVertexAttribPointer(0,3,GL_FLOAT, GL_FALSE, sizeof(star_t), NULL);
-  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(star_t), (void*)sizeof(vmath::vec3));
+  glVertexAttribPointer(0, 4, GL_HALF_FLOAT, GL_FALSE, 0, NULL);
+  glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, (void*)position_size);
   glEnableVertexAttribArray(0);
   glEnableVertexAttribArray(1);
+
+  star_count = count;
+  const double init_time = glfwGetTime() - start;
+
+  char buffer[128];
+  sprintf(buffer, "Stars: %d stars, made in %.1f ms on %u threads",
+          star_count, init_time * 1000.0, pool.size());
+  setWindowTitle(buffer);
+}
+
+void Stars::onKey(int key, int action)
+{
+  if (action)
+  {
+    switch (key)
+    {
+    case 'S':
+      star_count_index = (star_count_index + 1) % STAR_COUNT_COUNT;
+      MakeStars(star_counts[star_count_index]);
+      break;
+    }
+  }
 }
 
 void Stars::render(double current_time)
@@ -201,7 +256,7 @@ void Stars::render(double current_time)
   glBindVertexArray(star_vao);
 
   glEnable(GL_PROGRAM_POINT_SIZE);
-  glDrawArrays(GL_POINTS, 0, NUM_STARS);
+  glDrawArrays(GL_POINTS, 0, star_count);
 }
 
 DECLARE_MAIN(Stars);
\ No newline at end of file
@@ -0,0 +1,339 @@
+#include "TextureResidency.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+TextureResidency::TextureResidency()
+  : uploads(0),
+    misses(0),
+    evictions(0),
+    stall_count(0),
+    stall_time(0.0),
+    m_budget(0),
+    m_uploads_per_frame(0),
+    m_generator(nullptr),
+    m_head(NONE),
+    m_tail(NONE),
+    m_resident(0),
+    m_frame(0),
+    m_staging_buffer(0),
+    m_staging(nullptr),
+    m_segment_size(0),
+    m_segment(0)
+{
+  for (int i = 0; i < SEGMENT_COUNT; ++i)
+    m_fence[i] = 0;
+}
+
+void TextureResidency::Create(GLuint texture_count, GLuint budget, GLuint uploads_per_frame,
+                              Generator generator)
+{
+  static const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+  Destroy();
+
+  m_budget = budget;
+  m_uploads_per_frame = uploads_per_frame;
+  m_generator = generator;
+
+  m_slots.clear();
+  m_slots.reserve(budget);
+  m_id_slots.assign(texture_count, NONE);
+  m_free.clear();
+  m_head = NONE;
+  m_tail = NONE;
+  m_resident = 0;
+  m_frame = 0;
+  m_scratch.resize(TEXTURE_TEXELS);
+
+  uploads = 0;
+  misses = 0;
+  evictions = 0;
+  stall_count = 0;
+  stall_time = 0.0;
+
+  m_segment_size = GLsizeiptr(uploads_per_frame) * TEXTURE_TEXELS * sizeof(GLuint);
+  m_segment = 0;
+
+  glGenBuffers(1, &m_staging_buffer);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_staging_buffer);
+  glBufferStorage(GL_PIXEL_UNPACK_BUFFER, SEGMENT_COUNT * m_segment_size, nullptr, flags);
+
+  m_staging = (unsigned char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+                                                SEGMENT_COUNT * m_segment_size, flags);
+
+  // Other uploads in the sample read from client memory
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void TextureResidency::Destroy()
+{
+  if (!m_staging_buffer)
+    return;
+
+  // Nothing may still be reading the buffer or the textures when they go
+  for (int i = 0; i < SEGMENT_COUNT; ++i)
+  {
+    if (m_fence[i])
+    {
+      glClientWaitSync(m_fence[i], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+      glDeleteSync(m_fence[i]);
+      m_fence[i] = 0;
+    }
+  }
+
+  std::vector<GLuint> names;
+  names.reserve(m_slots.size());
+
+  for (const Slot& slot : m_slots)
+  {
+    if (slot.loaded)
+      glMakeTextureHandleNonResidentARB(slot.handle);
+
+    names.push_back(slot.name);
+  }
+
+  if (!names.empty())
+    glDeleteTextures(GLsizei(names.size()), names.data());
+
+  m_slots.clear();
+  m_free.clear();
+  m_id_slots.clear();
+  m_head = NONE;
+  m_tail = NONE;
+  m_resident = 0;
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_staging_buffer);
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  glDeleteBuffers(1, &m_staging_buffer);
+
+  m_staging_buffer = 0;
+  m_staging = nullptr;
+}
+
+void TextureResidency::BeginFrame()
+{
+  GLsync& fence = m_fence[m_segment];
+
+  if (fence)
+  {
+    // A zero timeout only polls. Anything else is a stall.
+    if (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+    {
+      const auto start = std::chrono::steady_clock::now();
+
+      while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+        ;
+
+      stall_count++;
+      stall_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    glDeleteSync(fence);
+    fence = 0;
+  }
+
+  // Every frame up to m_frame - SEGMENT_COUNT has now finished
+  ++m_frame;
+  uploads = 0;
+  misses = 0;
+}
+
+GLuint64 TextureResidency::Request(GLuint id)
+{
+  if (id >= m_id_slots.size())
+    return 0;
+
+  int s = m_id_slots[id];
+
+  if (s != NONE)
+  {
+    Slot& slot = m_slots[s];
+
+    if (slot.last_used != m_frame)
+    {
+      Unlink(s);
+      PushFront(s);
+      slot.last_used = m_frame;
+    }
+
+    return slot.handle;
+  }
+
+  if (uploads == m_uploads_per_frame || (s = TakeSlot()) == NONE)
+  {
+    misses++;
+    return 0;
+  }
+
+  Upload(s, id);
+
+  Slot& slot = m_slots[s];
+
+  slot.id = id;
+  slot.loaded = true;
+  slot.last_used = m_frame;
+  m_id_slots[id] = s;
+  PushFront(s);
+
+  glMakeTextureHandleResidentARB(slot.handle);
+  m_resident++;
+
+  return slot.handle;
+}
+
+void TextureResidency::EndFrame()
+{
+  if (uploads)
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  // Fenced even without uploads, as it also says when the frame's
+  // textures are no longer in use
+  m_fence[m_segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  m_segment = (m_segment + 1) % SEGMENT_COUNT;
+}
+
+// Makes the next ALLOC_CHUNK textures, or as many as the budget has left.
+// Their handles are taken now, while nothing else is going on, but only
+// made resident when the textures are loaded.
+bool TextureResidency::AllocateChunk()
+{
+  const GLuint first = GLuint(m_slots.size());
+  const GLuint count = std::min(GLuint(ALLOC_CHUNK), m_budget - first);
+
+  if (count == 0)
+    return false;
+
+  std::vector<GLuint> names(count);
+  glCreateTextures(GL_TEXTURE_2D, GLsizei(count), names.data());
+
+  for (GLuint i = 0; i < count; ++i)
+  {
+    glTextureStorage2D(names[i], TEXTURE_LEVELS, GL_RGBA8, TEXTURE_SIZE, TEXTURE_SIZE);
+
+    const Slot slot = { names[i], glGetTextureHandleARB(names[i]), 0, false, 0, NONE, NONE };
+    m_slots.push_back(slot);
+  }
+
+  // Handed out from the back, lowest first
+  for (GLuint i = count; i > 0; --i)
+    m_free.push_back(int(first + i - 1));
+
+  return true;
+}
+
+// An empty slot if there is one or the budget allows another chunk,
+// otherwise the least recently used, if the GPU is done with it
+int TextureResidency::TakeSlot()
+{
+  if (m_free.empty())
+    AllocateChunk();
+
+  if (!m_free.empty())
+  {
+    const int s = m_free.back();
+    m_free.pop_back();
+    return s;
+  }
+
+  if (m_tail == NONE || m_slots[m_tail].last_used + SEGMENT_COUNT > m_frame)
+    return NONE;
+
+  const int s = m_tail;
+  Slot& slot = m_slots[s];
+
+  Unlink(s);
+  glMakeTextureHandleNonResidentARB(slot.handle);
+  m_resident--;
+  m_id_slots[slot.id] = NONE;
+  slot.loaded = false;
+  evictions++;
+
+  return s;
+}
+
+// Builds the mip chain by averaging 2x2 blocks and copies it into this
+// frame's segment of the staging buffer, then loads each level from there
+void TextureResidency::Upload(int slot, GLuint id)
+{
+  GLuint *level = m_scratch.data();
+
+  m_generator(id, level);
+
+  for (int size = TEXTURE_SIZE; size > 1; size /= 2)
+  {
+    const unsigned char *src = (const unsigned char *)level;
+    level += size * size;
+    unsigned char *dst = (unsigned char *)level;
+    const int half = size / 2;
+
+    for (int y = 0; y < half; ++y)
+    {
+      for (int x = 0; x < half; ++x)
+      {
+        const unsigned char *a = src + ((2 * y) * size + 2 * x) * 4;
+        const unsigned char *b = a + size * 4;
+
+        for (int c = 0; c < 4; ++c)
+          dst[(y * half + x) * 4 + c] = (unsigned char)((a[c] + a[c + 4] + b[c] + b[c + 4] + 2) / 4);
+      }
+    }
+  }
+
+  if (uploads == 0)
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_staging_buffer);
+
+  const GLsizeiptr offset = m_segment * m_segment_size +
+                            GLsizeiptr(uploads) * TEXTURE_TEXELS * sizeof(GLuint);
+
+  memcpy(m_staging + offset, m_scratch.data(), TEXTURE_TEXELS * sizeof(GLuint));
+
+  GLsizeiptr level_offset = offset;
+
+  for (int l = 0; l < TEXTURE_LEVELS; ++l)
+  {
+    const int size = TEXTURE_SIZE >> l;
+
+    glTextureSubImage2D(m_slots[slot].name, l, 0, 0, size, size, GL_RGBA, GL_UNSIGNED_BYTE,
+                        (const void *)level_offset);
+    level_offset += size * size * sizeof(GLuint);
+  }
+
+  uploads++;
+}
+
+void TextureResidency::Unlink(int slot)
+{
+  Slot& s = m_slots[slot];
+
+  if (s.prev != NONE)
+    m_slots[s.prev].next = s.next;
+  else if (m_head == slot)
+    m_head = s.next;
+
+  if (s.next != NONE)
+    m_slots[s.next].prev = s.prev;
+  else if (m_tail == slot)
+    m_tail = s.prev;
+
+  s.prev = NONE;
+  s.next = NONE;
+}
+
+void TextureResidency::PushFront(int slot)
+{
+  Slot& s = m_slots[slot];
+
+  s.prev = NONE;
+  s.next = m_head;
+
+  if (m_head != NONE)
+    m_slots[m_head].prev = slot;
+  else
+    m_tail = slot;
+
+  m_head = slot;
+}
@@ -0,0 +1,115 @@
+#ifndef __TEXTURERESIDENCY_H__
+#define __TEXTURERESIDENCY_H__
+
+#include <GL/gl3w.h>
+
+#include <vector>
+
+// Keeps up to a budget of small textures loaded and their bindless
+// handles resident, out of a much larger set that are only known by id.
+//
+// Textures are made on first use. GL names, storage and handles are
+// allocated ALLOC_CHUNK at a time, and only as the budget fills. Texel
+// data, with every mip level worked out on the CPU, goes through one
+// persistently mapped staging buffer that is split into SEGMENT_COUNT
+// segments with a fence each, as InstanceStream does in AsteroidField.
+// At most uploads_per_frame textures are loaded a frame, so a burst of new
+// textures is spread over frames instead of stalling one.
+//
+// Once the budget is used, the texture used least recently is dropped for
+// the new one, provided the GPU can no longer be reading it.
+class TextureResidency
+{
+public:
+  enum
+  {
+    TEXTURE_LEVELS = 5,
+    TEXTURE_SIZE = (1 << (TEXTURE_LEVELS - 1)),
+
+    // Texels of a texture over all its levels
+    TEXTURE_TEXELS = (4 * TEXTURE_SIZE * TEXTURE_SIZE - 1) / 3,
+
+    ALLOC_CHUNK = 256,
+    SEGMENT_COUNT = 3
+  };
+
+  // Writes the TEXTURE_SIZE x TEXTURE_SIZE RGBA8 texels of texture id's
+  // top level
+  typedef void (*Generator)(GLuint id, GLuint *texels);
+
+  TextureResidency();
+
+  // Needs a current context
+  void Create(GLuint texture_count, GLuint budget, GLuint uploads_per_frame,
+              Generator generator);
+  void Destroy();
+
+  // Call once a frame before Request()
+  void BeginFrame();
+
+  // The resident handle of texture id, which is marked as used this
+  // frame. If the texture isn't loaded and can't be this frame, returns 0
+  // and counts a miss.
+  GLuint64 Request(GLuint id);
+
+  // Fences this frame's uploads. Call after the draws.
+  void EndFrame();
+
+  GLuint Budget() const                 { return m_budget; }
+  GLuint Allocated() const              { return GLuint(m_slots.size()); }
+  GLuint Resident() const               { return m_resident; }
+
+  // This frame's uploads and misses, and evictions since Create()
+  GLuint uploads;
+  GLuint misses;
+  GLuint evictions;
+
+  // Number of times BeginFrame() had to wait for the GPU, and for how
+  // long in total
+  int stall_count;
+  double stall_time;
+
+private:
+  enum { NONE = -1 };
+
+  // Slots make a list from the most recently used to the least
+  struct Slot
+  {
+    GLuint name;
+    GLuint64 handle;
+    GLuint id;
+    bool loaded;
+    int last_used;
+    int prev;
+    int next;
+  };
+
+  bool AllocateChunk();
+  int TakeSlot();
+  void Upload(int slot, GLuint id);
+  void Unlink(int slot);
+  void PushFront(int slot);
+
+  GLuint m_budget;
+  GLuint m_uploads_per_frame;
+  Generator m_generator;
+
+  std::vector<Slot> m_slots;
+  std::vector<int> m_id_slots;
+  std::vector<int> m_free;
+  int m_head;
+  int m_tail;
+  GLuint m_resident;
+  int m_frame;
+
+  // Level 0 from the generator, then the smaller levels
+  std::vector<GLuint> m_scratch;
+
+  GLuint m_staging_buffer;
+  unsigned char *m_staging;
+  GLsizeiptr m_segment_size;
+  int m_segment;
+  GLsync m_fence[SEGMENT_COUNT];
+};
+
+#endif /* __TEXTURERESIDENCY_H__ */
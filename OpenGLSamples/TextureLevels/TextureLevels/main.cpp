@@ -3,6 +3,30 @@
 #include <vmath.h>
 #include <sb7color.h>
 #include <object.h>
+#include <sb7rng.h>
+
+#include <math.h>
+
+#include "TextureResidency.h"
+
+// The sample's original pattern, XOR stripes masked with a random color,
+// with the color picked by id so that any texture can be made on its own
+static void make_texture(GLuint id, GLuint *texels)
+{
+  sb7::rng::pcg32 rng(id);
+
+  unsigned int r = (rng.next_uint() & 0xFCFF3F) << (rng.next_uint() % 12);
+
+  for (int k = 0; k < TextureResidency::TEXTURE_SIZE * TextureResidency::TEXTURE_SIZE; ++k)
+  {
+    // Read in rows of 32, as the sample always has
+    const unsigned int i = k / 32;
+    const unsigned int j = k % 32;
+    const unsigned int v = (i ^ j) << 3;
+
+    texels[k] = ((v | (v << 8) | (v << 16)) & r) | 0x20202020;
+  }
+}
 
 class TextureLevels : public sb7::application
 {
@@ -14,14 +38,29 @@ public:
 
 protected:
   void load_shaders();
+  void reset_handles();
+  void update_handles(float t);
+  void update_title();
 
   enum 
   {
+    // Tori drawn, each showing one texture at a time
     NUM_TEXTURES = 384,
-    TEXTURE_LEVELS = 5,
-    TEXTURE_SIZE = (1 << (TEXTURE_LEVELS - 1))
+
+    // Textures the tori go through, made as they are first shown
+    TEXTURE_COUNT = 100000,
+    UPLOADS_PER_FRAME = 32,
+
+    BUDGET_COUNT = 4,
+    TITLE_FRAMES = 64
   };
 
+  static const GLuint budgets[BUDGET_COUNT];
+
+  // Each torus moves on to its next texture this often, in seconds. The
+  // tori are staggered so that a few change each frame.
+  static const float switch_period;
+
   GLuint program;
 
   struct 
@@ -30,11 +69,23 @@ protected:
     GLuint vp_matrix;
   } uniforms;
 
-  struct
-  {
-    GLuint name;
-    GLuint64 handle;
-  } textures[1024];
+  TextureResidency residency;
+  int budget_index;
+
+  // Shown until a torus's texture is loaded
+  GLuint fallback_texture;
+  GLuint64 fallback_handle;
+
+  // The texture each torus shows, or -1 for the fallback, and a copy of
+  // TEXTURE_BLOCK, laid out as std140 has it
+  int texture_ids[NUM_TEXTURES];
+  GLuint64 handles[NUM_TEXTURES * 2];
+
+  // Summed over the frames since the title last changed
+  GLuint frames;
+  GLuint uploads;
+  GLuint misses;
+  GLuint handles_written;
 
   struct 
   {
@@ -46,44 +97,23 @@ protected:
   {
     vmath::mat4 view;
     vmath::mat4 projection;
-    vmath::mat4 model[NUM_TEXTURES];
+    vmath::mat3x4 model[NUM_TEXTURES];
   };
 
   sb7::object object;
 };
 
-static unsigned int seed = 0x13371337;
-
-static inline unsigned int random_uint()
-{
-  float res;
-  unsigned int tmp;
-
-  seed *= 16807;
-
-  tmp = seed ^ (seed >> 4) ^ (seed << 15);
-
-  return tmp;
-}
+const GLuint TextureLevels::budgets[BUDGET_COUNT] = { 1024, 4096, 16384, 131072 };
+const float TextureLevels::switch_period = 2.0f;
 
+// Only makes the buffers and a fallback texture. The textures themselves
+// come in a few a frame as the tori ask for them.
 void TextureLevels::startup()
 {
-  int i; 
-  int j;
+  static const GLuint gray = 0xFF808080;
 
-  unsigned char tex_data[32 * 32 * 4];
-  unsigned int mutated_data[32 * 32];
-  memset(tex_data, 0, sizeof(tex_data));
-
-  for (i = 0; i < 32; ++i)
-  {
-    for (j = 0; j < 32; ++j)
-    {
-      tex_data[i * 4 * 32 + j * 4] = (i^j) << 3;
-      tex_data[i * 4 * 32 + j * 4 + 1] = (i^j) << 3;
-      tex_data[i * 4 * 32 + j * 4 + 2] = (i^j) << 3;
-    }
-  }
+  budget_index = 1;
+  frames = uploads = misses = handles_written = 0;
 
   glGenBuffers(1, &buffers.transformBuffer);
   glBindBuffer(GL_UNIFORM_BUFFER, buffers.transformBuffer);
@@ -93,47 +123,113 @@ void TextureLevels::startup()
                   nullptr, 
                   GL_MAP_WRITE_BIT);
 
+  glCreateTextures(GL_TEXTURE_2D, 1, &fallback_texture);
+  glTextureStorage2D(fallback_texture, 1, GL_RGBA8, 1, 1);
+  glTextureSubImage2D(fallback_texture, 0, 0, 0, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, &gray);
+  fallback_handle = glGetTextureHandleARB(fallback_texture);
+  glMakeTextureHandleResidentARB(fallback_handle);
+
+  // Only the entries that change are written after this
   glGenBuffers(1, &buffers.textureHandleBuffer);
   glBindBuffer(GL_UNIFORM_BUFFER, buffers.textureHandleBuffer);
 
   glBufferStorage(GL_UNIFORM_BUFFER,
                   NUM_TEXTURES * sizeof(GLuint64) * 2,
                   nullptr,
-                  GL_MAP_WRITE_BIT);
+                  GL_DYNAMIC_STORAGE_BIT);
 
-  GLuint64 *pHandles = 
-      (GLuint64*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, 
-                                  NUM_TEXTURES * sizeof(GLuint64) * 2, 
-                                  GL_MAP_WRITE_BIT | 
-                                  GL_MAP_INVALIDATE_BUFFER_BIT);
+  residency.Create(TEXTURE_COUNT, budgets[budget_index], UPLOADS_PER_FRAME, make_texture);
+  reset_handles();
 
-  for (i = 0; i < NUM_TEXTURES; ++i)
+  load_shaders();
+
+  object.load("../../../media/objects/torus_nrms_tc.sbm");
+}
+
+// Points every torus at the fallback texture
+void TextureLevels::reset_handles()
+{
+  for (int i = 0; i < NUM_TEXTURES; ++i)
   {
-    unsigned int r = (random_uint() & 0xFCFF3F) << (random_uint() % 12);
+    texture_ids[i] = -1;
+    handles[i * 2] = fallback_handle;
+    handles[i * 2 + 1] = 0;
+  }
 
-    glGenTextures(1, &textures[i].name);
-    glBindTexture(GL_TEXTURE_2D, textures[i].name);
-    glTexStorage2D(GL_TEXTURE_2D, TEXTURE_LEVELS, GL_RGBA8, 
-                   TEXTURE_SIZE, TEXTURE_SIZE);
+  glBindBuffer(GL_UNIFORM_BUFFER, buffers.textureHandleBuffer);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(handles), handles);
+}
 
-    for (j = 0; j < 32 * 32; ++j)
+// Asks for each torus's texture at time t and writes the handles that
+// changed to TEXTURE_BLOCK, one glBufferSubData per run of them. A torus
+// whose new texture isn't loaded yet keeps its old one, which is asked
+// for too so that it stays loaded.
+void TextureLevels::update_handles(float t)
+{
+  bool changed[NUM_TEXTURES];
+
+  for (int i = 0; i < NUM_TEXTURES; ++i)
+  {
+    const float phase = float(i) / NUM_TEXTURES;
+    const GLuint page = GLuint(floorf(t / switch_period + phase));
+    const GLuint id = (GLuint(i) + NUM_TEXTURES * page) % TEXTURE_COUNT;
+    const GLuint64 handle = residency.Request(id);
+
+    changed[i] = false;
+
+    if (!handle)
     {
-      mutated_data[j] = (((unsigned int*)tex_data)[j] & r) | 0x20202020;
+      if (texture_ids[i] >= 0)
+      {
+        residency.Request(GLuint(texture_ids[i]));
+      }
+      continue;
     }
 
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, TEXTURE_SIZE, TEXTURE_SIZE, 
-                    GL_RGBA, GL_UNSIGNED_BYTE, mutated_data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-    textures[i].handle = glGetTextureHandleARB(textures[i].name);
-    glMakeTextureHandleResidentARB(textures[i].handle);
-    pHandles[i * 2] = textures[i].handle;
+    texture_ids[i] = int(id);
+
+    if (handles[i * 2] != handle)
+    {
+      handles[i * 2] = handle;
+      changed[i] = true;
+    }
   }
 
-  glUnmapBuffer(GL_UNIFORM_BUFFER);
+  glBindBuffer(GL_UNIFORM_BUFFER, buffers.textureHandleBuffer);
 
-  load_shaders();
+  for (int first = 0; first < NUM_TEXTURES; ++first)
+  {
+    if (!changed[first])
+    {
+      continue;
+    }
 
-  object.load("../../../media/objects/torus_nrms_tc.sbm");
+    int last = first;
+
+    while (last + 1 < NUM_TEXTURES && changed[last + 1])
+    {
+      ++last;
+    }
+
+    glBufferSubData(GL_UNIFORM_BUFFER, first * sizeof(GLuint64) * 2,
+                    (last - first + 1) * sizeof(GLuint64) * 2, &handles[first * 2]);
+
+    handles_written += last - first + 1;
+    first = last;
+  }
+}
+
+void TextureLevels::update_title()
+{
+  char buffer[256];
+
+  sprintf(buffer, "TextureLevels: budget %u, %u allocated, %u resident, %.1f uploads, %.1f misses, %.1f handles written a frame, %u evictions",
+          residency.Budget(), residency.Allocated(), residency.Resident(),
+          double(uploads) / frames, double(misses) / frames, double(handles_written) / frames,
+          residency.evictions);
+  setWindowTitle(buffer);
+
+  frames = uploads = misses = handles_written = 0;
 }
 
 void TextureLevels::render(double currentTime)
@@ -143,6 +239,9 @@ void TextureLevels::render(double currentTime)
 
   const float f = (float)currentTime;
 
+  residency.BeginFrame();
+  update_handles(f);
+
   vmath::mat4 proj_matrix = vmath::perspective(70.0f,
       (float)info.windowHeight / (float)info.windowHeight,
       0.1f, 500.0f);
@@ -167,13 +266,13 @@ void TextureLevels::render(double currentTime)
   float angle3 = 0.1f * f;
   for (int i = 0; i < NUM_TEXTURES; ++i)
   {
-    pMatrices->model[i] =
+    pMatrices->model[i] = vmath::pack_affine(
         vmath::translate(float(i % 32)*4.0f - 62.0f,
                          float(i >> 5) * 6.0f - 33.0f,
                          15.0f * sinf(angle * 0.19f) + 3.0f *
                          cosf(angle2 * 6.26f) + 30.0f * sinf(angle3))*
         vmath::rotate(angle * 130.0f, 1.0f, 0.0f, 0.0f) *
-        vmath::rotate(angle * 140.0f, 0.0f, 0.0f, 1.0f);
+        vmath::rotate(angle * 140.0f, 0.0f, 0.0f, 1.0f));
 
     angle += 1.0f;
     angle2 += 4.1f;
@@ -191,24 +290,55 @@ void TextureLevels::render(double currentTime)
   glUseProgram(program);
 
   object.render(NUM_TEXTURES);
+
+  residency.EndFrame();
+
+  uploads += residency.uploads;
+  misses += residency.misses;
+
+  if (++frames == TITLE_FRAMES)
+  {
+    update_title();
+  }
 }
 
 void TextureLevels::shutdown()
 {
-  for (int i = 0; i < NUM_TEXTURES; ++i)
-  {
-    glMakeTextureHandleNonResidentARB(textures[i].handle);
-    glDeleteTextures(1, &textures[i].name);
-  }
+  residency.Destroy();
+
+  glMakeTextureHandleNonResidentARB(fallback_handle);
+  glDeleteTextures(1, &fallback_texture);
 
+  glDeleteBuffers(1, &buffers.textureHandleBuffer);
+  glDeleteBuffers(1, &buffers.transformBuffer);
   glDeleteProgram(program);
 }
 
+void TextureLevels::onKey(int key, int action)
+{
+  if (action)
+  {
+    switch (key)
+    {
+    // The next budget. The textures are all made again.
+    case 'B':
+      budget_index = (budget_index + 1) % BUDGET_COUNT;
+      residency.Create(TEXTURE_COUNT, budgets[budget_index], UPLOADS_PER_FRAME, make_texture);
+      reset_handles();
+      frames = uploads = misses = handles_written = 0;
+      break;
+    }
+  }
+}
+
 void TextureLevels::load_shaders()
 {
   GLuint shaders[2];
 
+  shaders[0] = sb7::shader::load("render.vs.glsl", GL_VERTEX_SHADER);
+  shaders[1] = sb7::shader::load("render.fs.glsl", GL_FRAGMENT_SHADER);
 
+  program = sb7::program::link_from_shaders(shaders, 2, true);
 }
 
 DECLARE_MAIN(TextureLevels)
\ No newline at end of file
@@ -0,0 +1,54 @@
+#version 440 core
+
+// Per-vertex inputs
+layout (location = 0) in vec4 position;
+layout (location = 1) in vec3 normal;
+layout (location = 4) in vec2 tc;
+
+// Matrices we'll need. Model matrices are affine and stored as their top
+// three rows (see vmath::pack_affine), so "position * m" gives a vec3.
+layout (std140, binding = 0) uniform MATRIX_BLOCK
+{
+    mat4 view_matrix;
+    mat4 proj_matrix;
+    mat3x4 model_matrix[384];
+};
+
+// Inputs from vertex shader
+out VS_OUT
+{
+    vec3 N;
+    vec3 L;
+    vec3 V;
+    vec2 tc;
+    flat uint instance_index;
+} vs_out;
+
+// Position of light
+const vec3 light_pos = vec3(100.0, 100.0, 100.0);
+
+void main(void)
+{
+    mat3x4 model = model_matrix[gl_InstanceID];
+
+    // Calculate view-space coordinate
+    vec4 P = view_matrix * vec4(position * model, 1.0);
+
+    // Calculate normal in view-space
+    vs_out.N = mat3(view_matrix) * (normal * mat3(model));
+
+    // Calculate light vector
+    vs_out.L = light_pos - P.xyz;
+
+    // Calculate view vector
+    vs_out.V = -P.xyz;
+
+    // Pass texture coordinate through
+    vs_out.tc = tc * vec2(5.0, 1.0);
+
+    // Pass instance ID through
+    vs_out.instance_index = gl_InstanceID;
+
+    // Calculate the clip-space position of each vertex
+    gl_Position = proj_matrix * P;
+}
@@ -1,8 +1,14 @@
 #include <sb7.h>
 #include <sb7ktx.h>
+#include <sb7glstate.h>
 #include <vmath.h>
 
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
 #include <string>
+#include <vector>
 
 static void print_shader_log(GLuint shader)
 {
@@ -24,7 +30,71 @@ static void print_shader_log(GLuint shader)
 
 #define GLSL(version, shader) "#version " #version "\n" #shader  
 
+// Draws every wall of every segment with one instanced draw. Instance i
+// is wall i & 3 of segment i >> 2, and picks its matrix and its layer of
+// the texture array by that.
 static const GLchar* vertex_shader_source = GLSL
+(
+  450 core,
+  out VS_OUT
+  {
+    vec2 tc;
+    flat int layer;
+  } vs_out;
+
+  // Each wall of the nearest segment, then what each segment further on
+  // adds in clip space
+  layout (binding = 0, std140) uniform WALLS
+  {
+    mat4 mvp[4];
+    vec4 segment_step;
+  } walls;
+
+  uniform float offset;
+
+  void main(void)
+  {
+    const vec2[4] position = vec2[4](vec2(-0.5, -0.5),
+                                     vec2( 0.5, -0.5),
+                                     vec2(-0.5,  0.5),
+                                     vec2( 0.5,  0.5));
+
+    // The wall, floor, wall and ceiling, as the walls go around
+    const int[4] layers = int[4](1, 0, 1, 2);
+
+    int wall = gl_InstanceID & 3;
+    int segment = gl_InstanceID >> 2;
+
+    vs_out.tc = (position[gl_VertexID].xy + vec2(offset, 0.5)) * vec2(30.0, 1.0);
+    vs_out.layer = layers[wall];
+
+    gl_Position = walls.mvp[wall] * vec4(position[gl_VertexID], 0.0, 1.0) +
+                  float(segment) * walls.segment_step;
+  }
+);
+
+static const GLchar* fragment_shader_source = GLSL
+(
+  450 core,
+  layout (location = 0) out vec4 color;
+
+  in VS_OUT
+  {
+    vec2 tc;
+    flat int layer;
+  } fs_in;
+
+  layout (binding = 0) uniform sampler2DArray tex;
+
+  void main(void)
+  {
+    color = texture(tex, vec3(fs_in.tc, float(fs_in.layer)));
+  }
+);
+
+// The sample as it was: one wall per draw, with its own matrix and
+// texture. Kept to compare against.
+static const GLchar* single_vertex_shader_source = GLSL
 (
   450 core,
   out VS_OUT
@@ -48,7 +118,7 @@ static const GLchar* vertex_shader_source = GLSL
   }
 );
 
-static const GLchar* fragment_shader_source = GLSL
+static const GLchar* single_fragment_shader_source = GLSL
 (
   450 core,
   layout (location = 0) out vec4 color;
@@ -66,15 +136,180 @@ static const GLchar* fragment_shader_source = GLSL
   }
 );
 
+enum
+{
+  // Each segment is a copy of the tunnel, SEGMENT_LENGTH further on
+  MAX_SEGMENTS = 4096,
+
+  // Timer queries in flight, and frames averaged for the title
+  TIMER_QUERIES = 4,
+  TIMED_FRAMES = 64
+};
+
+static const float SEGMENT_LENGTH = 30.0f;
+
+enum
+{
+  // The filter sweep draws SWEEP_SIZE x SWEEP_SIZE frames, and compares
+  // them against one drawn SWEEP_SUPERSAMPLE times larger and averaged
+  // down. Each setting is timed over SWEEP_PASSES draws of the tunnel.
+  SWEEP_SIZE = 512,
+  SWEEP_SUPERSAMPLE = 4,
+  SWEEP_PASSES = 32,
+
+  // Sizes swept, as base levels of the 512 x 512 textures
+  SWEEP_BASE_LEVELS = 3
+};
+
+// The time the sweep draws the tunnel at
+static const float SWEEP_TIME = 10.0f;
+
+static const struct
+{
+  GLenum filter;
+  const char *name;
+} sweep_filters[] =
+{
+  { GL_NEAREST,                "NEAREST" },
+  { GL_LINEAR,                 "LINEAR" },
+  { GL_NEAREST_MIPMAP_NEAREST, "NEAREST_MIPMAP_NEAREST" },
+  { GL_LINEAR_MIPMAP_NEAREST,  "LINEAR_MIPMAP_NEAREST" },
+  { GL_NEAREST_MIPMAP_LINEAR,  "NEAREST_MIPMAP_LINEAR" },
+  { GL_LINEAR_MIPMAP_LINEAR,   "LINEAR_MIPMAP_LINEAR" }
+};
+
+static const float sweep_anisotropy[] = { 1.0f, 2.0f, 4.0f, 8.0f, 16.0f };
+static const float sweep_bias[] = { -1.0f, 0.0f, 1.0f };
+
+// How fast a pixel's texture coordinates change across the screen, in
+// repeats of the texture per pixel. Pixels that miss the tunnel have
+// hit set to false.
+struct Footprint
+{
+  float dsdx, dtdx;
+  float dsdy, dtdy;
+  bool hit;
+};
+
+// Where the ray through (nx, ny) in normalized device coordinates meets
+// the quad that mvp draws, in the quad's own coordinates. Returns false if
+// it misses, or the point is behind the eye or clipped.
+static bool wall_coords(const vmath::mat4& mvp, float nx, float ny, float& a, float& b, float& depth)
+{
+  // Solve x_clip = nx * w_clip and y_clip = ny * w_clip for a and b,
+  // where clip = a * mvp[0] + b * mvp[1] + mvp[3]
+  const float m00 = mvp[0][0] - nx * mvp[0][3];
+  const float m01 = mvp[1][0] - nx * mvp[1][3];
+  const float m10 = mvp[0][1] - ny * mvp[0][3];
+  const float m11 = mvp[1][1] - ny * mvp[1][3];
+  const float r0 = nx * mvp[3][3] - mvp[3][0];
+  const float r1 = ny * mvp[3][3] - mvp[3][1];
+  const float det = m00 * m11 - m01 * m10;
+
+  if (fabsf(det) < 1.0e-12f)
+  {
+    return false;
+  }
+
+  a = (r0 * m11 - m01 * r1) / det;
+  b = (m00 * r1 - r0 * m10) / det;
+
+  if (fabsf(a) > 0.5f || fabsf(b) > 0.5f)
+  {
+    return false;
+  }
+
+  const vmath::vec4 clip = mvp[0] * a + mvp[1] * b + mvp[3];
+
+  if (clip[3] <= 0.0f || fabsf(clip[2]) > clip[3])
+  {
+    return false;
+  }
+
+  depth = clip[2] / clip[3];
+  return true;
+}
+
+// Texels one pixel would fetch under the GL rules for picking a level,
+// with no texel shared between taps or pixels. size is the texture's
+// width at its base level and levels the number from there on. The
+// magnification filter is taken to be GL_LINEAR.
+static float texels_fetched(const Footprint& f, GLenum min_filter, float max_anisotropy,
+                            float bias, float size, int levels)
+{
+  const float px = sqrtf(f.dsdx * f.dsdx + f.dtdx * f.dtdx) * size;
+  const float py = sqrtf(f.dsdy * f.dsdy + f.dtdy * f.dtdy) * size;
+  const float rho_max = std::max(px, py);
+  const float rho_min = std::min(px, py);
+  const bool mipmapped = min_filter != GL_NEAREST && min_filter != GL_LINEAR;
+
+  float taps = 1.0f;
+
+  if (mipmapped && max_anisotropy > 1.0f && rho_min > 0.0f)
+  {
+    taps = std::min(ceilf(rho_max / rho_min), max_anisotropy);
+  }
+
+  const float lambda = rho_max > 0.0f ? log2f(rho_max / taps) + bias : -1.0f;
+
+  if (lambda <= 0.0f)
+  {
+    return 4.0f;
+  }
+
+  // Past the last level there is only one to read
+  const float blended_levels = lambda < float(levels - 1) ? 2.0f : 1.0f;
+
+  switch (min_filter)
+  {
+  case GL_NEAREST:                return 1.0f;
+  case GL_LINEAR:                 return 4.0f;
+  case GL_NEAREST_MIPMAP_NEAREST: return taps;
+  case GL_LINEAR_MIPMAP_NEAREST:  return taps * 4.0f;
+  case GL_NEAREST_MIPMAP_LINEAR:  return taps * blended_levels;
+  default:                        return taps * 4.0f * blended_levels;
+  }
+}
+
+enum
+{
+  // One instanced draw of every wall
+  MODE_BATCHED,
+  // A uniform upload, texture bind and draw per wall, as the sample
+  // started out
+  MODE_UNBATCHED,
+  MODE_COUNT
+};
+
+static const char *mode_names[MODE_COUNT] = { "batched", "unbatched" };
+
+// The matrices and step in the WALLS block, laid out for std140
+struct WallBlock
+{
+  vmath::mat4 mvp[4];
+  vmath::vec4 segment_step;
+};
+
 class Tunnel : public sb7::application
 {
 public:
+  Tunnel()
+    : mode(MODE_BATCHED),
+      segments(1),
+      timer_frame(0),
+      timed_frames(0),
+      gpu_time(0.0),
+      cpu_time(0.0)
+  {
+  }
+
   virtual void startup() override
   {
     load_shaders();
 
-    uniforms.mvp = glGetUniformLocation(render_prog, "mvp");
     uniforms.offset = glGetUniformLocation(render_prog, "offset");
+    uniforms.single_mvp = glGetUniformLocation(single_prog, "mvp");
+    uniforms.single_offset = glGetUniformLocation(single_prog, "offset");
 
     glGenVertexArrays(1, &render_vao);
     glBindVertexArray(render_vao);
@@ -92,84 +327,675 @@ public:
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     }
 
+    tex_array = make_texture_array(textures, 3);
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tex_array);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    glGenBuffers(1, &walls_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, walls_buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(WallBlock), nullptr, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, walls_buffer);
+
+    glGenQueries(TIMER_QUERIES, timer_queries);
+
+    for (int i = 0; i < TIMER_QUERIES; ++i)
+    {
+      timer_pending[i] = false;
+    }
+
     glBindVertexArray(render_vao);
+
+    // The binds above went behind its back
+    state.invalidate();
+
+    if (info.flags.headless)
+    {
+      run_benchmark();
+      run_sweep();
+      glfwSetWindowShouldClose(window, GL_TRUE);
+    }
+  }
+
+  virtual void shutdown() override
+  {
+    glDeleteQueries(TIMER_QUERIES, timer_queries);
+    glDeleteBuffers(1, &walls_buffer);
+
+    GLuint textures[] = { tex_floor, tex_wall, tex_ceiling, tex_array };
+    glDeleteTextures(4, textures);
+
+    glDeleteVertexArrays(1, &render_vao);
+    glDeleteProgram(single_prog);
+    glDeleteProgram(render_prog);
   }
 
   virtual void render(double current_time) override
+  {
+    read_timers();
+
+    const int slot = timer_frame;
+
+    draw_frame((float)current_time, timer_queries[slot]);
+    timer_pending[slot] = true;
+    timer_frame = (timer_frame + 1) % TIMER_QUERIES;
+
+    state.end_frame();
+  }
+
+  virtual void onKey(int key, int action) override
+  {
+    if (action)
+    {
+      switch (key)
+      {
+      case 'M':
+        mode = (mode + 1) % MODE_COUNT;
+        break;
+      case 'S':
+        segments = segments * 4 > MAX_SEGMENTS ? 1 : segments * 4;
+        break;
+      case 'B':
+        run_benchmark();
+        break;
+      case 'F':
+        run_sweep();
+        break;
+      }
+    }
+  }
+
+  // Copies each level of each texture into a layer of a new array. The
+  // textures must have the same size and format. Levels that a texture
+  // doesn't have are made with glGenerateMipmap.
+  static GLuint make_texture_array(const GLuint *textures, int count)
+  {
+    GLint width, height, format;
+
+    glGetTextureLevelParameteriv(textures[0], 0, GL_TEXTURE_WIDTH, &width);
+    glGetTextureLevelParameteriv(textures[0], 0, GL_TEXTURE_HEIGHT, &height);
+    glGetTextureLevelParameteriv(textures[0], 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+
+    int levels = 1;
+
+    while ((std::max(width, height) >> levels) > 0)
+    {
+      ++levels;
+    }
+
+    GLuint array;
+    glGenTextures(1, &array);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, format, width, height, count);
+
+    bool complete = true;
+
+    for (int layer = 0; layer < count; ++layer)
+    {
+      for (int level = 0; level < levels; ++level)
+      {
+        GLint w, h;
+
+        glGetTextureLevelParameteriv(textures[layer], level, GL_TEXTURE_WIDTH, &w);
+        glGetTextureLevelParameteriv(textures[layer], level, GL_TEXTURE_HEIGHT, &h);
+
+        if (w == 0 || h == 0)
+        {
+          complete = false;
+          break;
+        }
+
+        glCopyImageSubData(textures[layer], GL_TEXTURE_2D, level, 0, 0, 0,
+                           array, GL_TEXTURE_2D_ARRAY, level, 0, 0, layer,
+                           w, h, 1);
+      }
+    }
+
+    if (!complete)
+    {
+      glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+    }
+
+    return array;
+  }
+
+  // Draws segments copies of the tunnel at time t. timer_query, if not
+  // zero, times the draws on the GPU. The time taken to issue them is
+  // added to cpu_time.
+  void draw_frame(float t, GLuint timer_query)
   {
     static const GLfloat black[] = { 0.0f, 0.0f, 0.0f, 1.0f };
-    float t = (float)current_time;
 
     glViewport(0, 0, info.windowWidth, info.windowHeight);
     glClearBufferfv(GL_COLOR, 0, black);
 
-    glUseProgram(render_prog);
+    const float aspect = (float)info.windowWidth / (float)info.windowHeight;
 
-    vmath::mat4 proj_matrix = 
-        vmath::perspective(60.0f, (float)info.windowWidth / 
-                                  (float)info.windowHeight, 
-                           0.1f, 1000.0f);
+    vmath::mat4 proj_matrix;
+    vmath::mat4 mv_matrix[4];
 
-    glUniform1f(uniforms.offset, t*0.03f);
+    wall_matrices(aspect, proj_matrix, mv_matrix);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    if (timer_query)
+    {
+      glBeginQuery(GL_TIME_ELAPSED, timer_query);
+    }
+
+    if (mode == MODE_BATCHED)
+    {
+      use_batched(t, aspect);
+      glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, 4 * segments);
+    }
+    else
+    {
+      state.use_program(single_prog);
+
+      glUniform1f(uniforms.single_offset, t*0.03f);
+
+      // Both walls first so that they share one texture bind
+      static const int sides[] = { 0, 2, 1, 3 };
+      GLuint textures[] = { tex_wall, tex_floor, tex_wall, tex_ceiling };
+
+      for (int segment = 0; segment < segments; ++segment)
+      {
+        const vmath::mat4 segment_matrix = proj_matrix *
+            vmath::translate(0.0f, 0.0f, -SEGMENT_LENGTH * (float)segment);
+
+        for (int i : sides)
+        {
+          vmath::mat4 mvp = segment_matrix * mv_matrix[i];
 
-    GLuint textures[] = { tex_wall, tex_floor, tex_wall, tex_ceiling };
+          glUniformMatrix4fv(uniforms.single_mvp, 1, GL_FALSE, mvp);
+          state.bind_texture(0, GL_TEXTURE_2D, textures[i]);
+          glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        }
+      }
+    }
+
+    if (timer_query)
+    {
+      glEndQuery(GL_TIME_ELAPSED);
+    }
+
+    cpu_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  static void wall_matrices(float aspect, vmath::mat4& proj_matrix, vmath::mat4 mv_matrix[4])
+  {
+    proj_matrix = vmath::perspective(60.0f, aspect, 0.1f, 1000.0f);
 
     for (int i = 0; i < 4; ++i)
     {
-      vmath::mat4 mv_matrix = vmath::rotate(90.0f*(float)i, 
-                                            vmath::vec3(0.0f, 0.0f, 1.0f)) *
-                              vmath::translate(-0.5f, 0.0f, -10.0f) *
-                              vmath::rotate(90.0f, 0.0f, 1.0f, 0.0f) *
-                              vmath::scale(30.0f, 1.0f, 1.0f);
+      mv_matrix[i] = vmath::rotate(90.0f*(float)i, 
+                                   vmath::vec3(0.0f, 0.0f, 1.0f)) *
+                     vmath::translate(-0.5f, 0.0f, -10.0f) *
+                     vmath::rotate(90.0f, 0.0f, 1.0f, 0.0f) *
+                     vmath::scale(30.0f, 1.0f, 1.0f);
+    }
+  }
 
-      vmath::mat4 mvp = proj_matrix * mv_matrix;
+  static WallBlock wall_block(float aspect)
+  {
+    vmath::mat4 proj_matrix;
+    vmath::mat4 mv_matrix[4];
+    WallBlock block;
 
-      glUniformMatrix4fv(uniforms.mvp, 1, GL_FALSE, mvp);
-      glBindTexture(GL_TEXTURE_2D, textures[i]);
-      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    wall_matrices(aspect, proj_matrix, mv_matrix);
+
+    for (int i = 0; i < 4; ++i)
+    {
+      block.mvp[i] = proj_matrix * mv_matrix[i];
     }
+
+    // The rotations are about z, so moving a segment along z can come
+    // last, and is the same step in clip space for every wall
+    block.segment_step = proj_matrix * vmath::vec4(0.0f, 0.0f, -SEGMENT_LENGTH, 0.0f);
+
+    return block;
   }
 
-  void load_shaders()
+  // Sets up render_prog to draw the tunnel at time t
+  void use_batched(float t, float aspect)
+  {
+    const WallBlock block = wall_block(aspect);
+
+    state.use_program(render_prog);
+    state.bind_buffer(GL_UNIFORM_BUFFER, walls_buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+
+    glUniform1f(uniforms.offset, t*0.03f);
+    state.bind_texture(0, GL_TEXTURE_2D_ARRAY, tex_array);
+  }
+
+  // Adds up the draw times that have landed, and shows their average
+  // every TIMED_FRAMES frames
+  void read_timers()
+  {
+    for (int i = 0; i < TIMER_QUERIES; ++i)
+    {
+      GLuint available = GL_FALSE;
+
+      if (timer_pending[i])
+      {
+        glGetQueryObjectuiv(timer_queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+      }
+
+      if (!available)
+      {
+        continue;
+      }
+
+      GLuint64 elapsed;
+      glGetQueryObjectui64v(timer_queries[i], GL_QUERY_RESULT, &elapsed);
+      gpu_time += double(elapsed) * 1.0e-9;
+      timer_pending[i] = false;
+
+      if (++timed_frames == TIMED_FRAMES)
+      {
+        char buffer[256];
+
+        sprintf(buffer, "TunnelTexLev: %s, %d segments, %d draws, cpu %.3f ms, gpu %.3f ms",
+                mode_names[mode], segments, mode == MODE_BATCHED ? 1 : 4 * segments,
+                1000.0 * cpu_time / timed_frames, 1000.0 * gpu_time / timed_frames);
+        setWindowTitle(buffer);
+
+        gpu_time = 0.0;
+        cpu_time = 0.0;
+        timed_frames = 0;
+      }
+    }
+  }
+
+  // Draws the same frames in each mode for a range of segment counts,
+  // waiting for each frame's timer, and prints the time taken to issue
+  // the draws and to run them
+  void run_benchmark()
+  {
+    static const int frames = 16;
+    static const int segment_counts[] = { 1, 16, 256, MAX_SEGMENTS };
+
+    const int saved_mode = mode;
+    const int saved_segments = segments;
+    char buffer[256];
+    GLuint query;
+
+    glGenQueries(1, &query);
+
+    for (int count : segment_counts)
+    {
+      segments = count;
+
+      for (mode = 0; mode < MODE_COUNT; ++mode)
+      {
+        double gpu_total = 0.0;
+
+        cpu_time = 0.0;
+
+        for (int i = 0; i < frames; ++i)
+        {
+          GLuint64 elapsed;
+
+          draw_frame((float)i, query);
+          glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+
+          gpu_total += double(elapsed) * 1.0e-9;
+          state.end_frame();
+        }
+
+        sprintf(buffer, "TunnelTexLev: %-9s %5d segments, %5d draws, cpu %8.3f ms, gpu %8.3f ms",
+                mode_names[mode], segments, mode == MODE_BATCHED ? 1 : 4 * segments,
+                1000.0 * cpu_time / frames, 1000.0 * gpu_total / frames);
+        fprintf(stderr, "%s\n", buffer);
+      }
+    }
+
+    glDeleteQueries(1, &query);
+
+    mode = saved_mode;
+    segments = saved_segments;
+    cpu_time = 0.0;
+    setWindowTitle(buffer);
+  }
+
+  // Works out each pixel's footprint in a SWEEP_SIZE x SWEEP_SIZE frame by
+  // casting a ray through it and its neighbours at the walls
+  static void make_footprints(std::vector<Footprint>& footprints)
+  {
+    const WallBlock block = wall_block(1.0f);
+    const int size = SWEEP_SIZE;
+
+    // Quad coordinates and the wall hit, per pixel
+    std::vector<vmath::vec2> coords(size * size);
+    std::vector<int> walls(size * size, -1);
+
+    for (int y = 0; y < size; ++y)
+    {
+      for (int x = 0; x < size; ++x)
+      {
+        const float nx = (float(x) + 0.5f) / size * 2.0f - 1.0f;
+        const float ny = (float(y) + 0.5f) / size * 2.0f - 1.0f;
+        float nearest = 2.0f;
+
+        for (int i = 0; i < 4; ++i)
+        {
+          float a, b, depth;
+
+          if (wall_coords(block.mvp[i], nx, ny, a, b, depth) && depth < nearest)
+          {
+            nearest = depth;
+            coords[y * size + x] = vmath::vec2(a, b);
+            walls[y * size + x] = i;
+          }
+        }
+      }
+    }
+
+    footprints.resize(size * size);
+
+    for (int y = 0; y < size; ++y)
+    {
+      for (int x = 0; x < size; ++x)
+      {
+        const int p = y * size + x;
+        Footprint& f = footprints[p];
+
+        f.dsdx = f.dtdx = f.dsdy = f.dtdy = 0.0f;
+        f.hit = walls[p] >= 0;
+
+        if (!f.hit)
+        {
+          continue;
+        }
+
+        // The difference to a neighbour on the same wall, forwards if
+        // there is one. The shader's s is 30 repeats across a wall.
+        const int px = (x + 1 < size && walls[p + 1] == walls[p]) ? p + 1 :
+                       (x > 0 && walls[p - 1] == walls[p]) ? p - 1 : -1;
+        const int py = (y + 1 < size && walls[p + size] == walls[p]) ? p + size :
+                       (y > 0 && walls[p - size] == walls[p]) ? p - size : -1;
+
+        if (px >= 0)
+        {
+          f.dsdx = fabsf(coords[px][0] - coords[p][0]) * 30.0f;
+          f.dtdx = fabsf(coords[px][1] - coords[p][1]);
+        }
+
+        if (py >= 0)
+        {
+          f.dsdy = fabsf(coords[py][0] - coords[p][0]) * 30.0f;
+          f.dtdy = fabsf(coords[py][1] - coords[p][1]);
+        }
+      }
+    }
+  }
+
+  // Draws the tunnel as the sweep sees it passes times over into the
+  // bound framebuffer
+  void draw_sweep_frame(int size, int passes)
+  {
+    static const GLfloat black[] = { 0.0f, 0.0f, 0.0f, 1.0f };
+
+    glViewport(0, 0, size, size);
+    glClearBufferfv(GL_COLOR, 0, black);
+
+    use_batched(SWEEP_TIME, 1.0f);
+
+    for (int i = 0; i < passes; ++i)
+    {
+      glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, 4);
+    }
+  }
+
+  // Draws one frame of the tunnel with each filter setting and prints how
+  // long a frame took, the texels fetched by the estimate above and the
+  // error against a supersampled frame drawn with the best filtering
+  // there is. Aniso and bias only change mipmapped filters, so the others
+  // are only drawn once per size.
+  void run_sweep()
+  {
+    const int ref_size = SWEEP_SIZE * SWEEP_SUPERSAMPLE;
+
+    GLfloat max_anisotropy = 1.0f;
+
+    if (sb6IsExtensionSupported("GL_EXT_texture_filter_anisotropic") ||
+        sb6IsExtensionSupported("GL_ARB_texture_filter_anisotropic"))
+    {
+      glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &max_anisotropy);
+    }
+
+    GLint width, levels;
+
+    state.bind_texture(0, GL_TEXTURE_2D_ARRAY, tex_array);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D_ARRAY, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexParameteriv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_IMMUTABLE_LEVELS, &levels);
+
+    GLuint targets[2];
+    GLuint fbos[2];
+    const int sizes[2] = { ref_size, SWEEP_SIZE };
+
+    glGenTextures(2, targets);
+    glGenFramebuffers(2, fbos);
+
+    for (int i = 0; i < 2; ++i)
+    {
+      glBindTexture(GL_TEXTURE_2D, targets[i]);
+      glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, sizes[i], sizes[i]);
+      glBindFramebuffer(GL_FRAMEBUFFER, fbos[i]);
+      glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, targets[i], 0);
+    }
+
+    state.invalidate();
+
+    GLuint sampler;
+    glGenSamplers(1, &sampler);
+    glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindSampler(0, sampler);
+
+    GLuint query;
+    glGenQueries(1, &query);
+
+    // The reference, averaged down to SWEEP_SIZE
+    std::vector<unsigned char> pixels(ref_size * ref_size * 4);
+    std::vector<float> reference(SWEEP_SIZE * SWEEP_SIZE * 3, 0.0f);
+
+    glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glSamplerParameterf(sampler, GL_TEXTURE_LOD_BIAS, 0.0f);
+
+    if (max_anisotropy > 1.0f)
+    {
+      glSamplerParameterf(sampler, GL_TEXTURE_MAX_ANISOTROPY_EXT, max_anisotropy);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbos[0]);
+    draw_sweep_frame(ref_size, 1);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, ref_size, ref_size, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+
+    for (int y = 0; y < ref_size; ++y)
+    {
+      for (int x = 0; x < ref_size; ++x)
+      {
+        const unsigned char *texel = &pixels[(y * ref_size + x) * 4];
+        float *sum = &reference[((y / SWEEP_SUPERSAMPLE) * SWEEP_SIZE + x / SWEEP_SUPERSAMPLE) * 3];
+
+        for (int c = 0; c < 3; ++c)
+        {
+          sum[c] += texel[c] / float(SWEEP_SUPERSAMPLE * SWEEP_SUPERSAMPLE);
+        }
+      }
+    }
+
+    std::vector<Footprint> footprints;
+    make_footprints(footprints);
+
+    fprintf(stderr, "TunnelTexLev: filter sweep, %dx%d, max anisotropy %.0f\n",
+            int(SWEEP_SIZE), int(SWEEP_SIZE), max_anisotropy);
+    fprintf(stderr, "%-22s %5s %5s %5s %9s %10s %8s %8s\n",
+            "min filter", "aniso", "bias", "size", "gpu ms", "Mtexels", "rmse", "psnr dB");
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbos[1]);
+
+    for (int base = 0; base < SWEEP_BASE_LEVELS && base < levels; ++base)
+    {
+      const int size = width >> base;
+
+      state.bind_texture(0, GL_TEXTURE_2D_ARRAY, tex_array);
+      glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, base);
+
+      for (const auto& filter : sweep_filters)
+      {
+        const bool mipmapped = filter.filter != GL_NEAREST && filter.filter != GL_LINEAR;
+
+        for (float anisotropy : sweep_anisotropy)
+        {
+          if (anisotropy > max_anisotropy || (!mipmapped && anisotropy > 1.0f))
+          {
+            continue;
+          }
+
+          for (float bias : sweep_bias)
+          {
+            if (!mipmapped && bias != 0.0f)
+            {
+              continue;
+            }
+
+            GLuint64 elapsed;
+
+            glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, filter.filter);
+            glSamplerParameterf(sampler, GL_TEXTURE_LOD_BIAS, bias);
+
+            if (max_anisotropy > 1.0f)
+            {
+              glSamplerParameterf(sampler, GL_TEXTURE_MAX_ANISOTROPY_EXT, anisotropy);
+            }
+
+            // Once to warm up, then timed
+            draw_sweep_frame(SWEEP_SIZE, 1);
+            glBeginQuery(GL_TIME_ELAPSED, query);
+            draw_sweep_frame(SWEEP_SIZE, SWEEP_PASSES);
+            glEndQuery(GL_TIME_ELAPSED);
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+
+            draw_sweep_frame(SWEEP_SIZE, 1);
+            glReadPixels(0, 0, SWEEP_SIZE, SWEEP_SIZE, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+
+            double squared_error = 0.0;
+            double texels = 0.0;
+
+            for (int p = 0; p < SWEEP_SIZE * SWEEP_SIZE; ++p)
+            {
+              for (int c = 0; c < 3; ++c)
+              {
+                const double d = double(pixels[p * 4 + c]) - reference[p * 3 + c];
+                squared_error += d * d;
+              }
+
+              if (footprints[p].hit)
+              {
+                texels += texels_fetched(footprints[p], filter.filter, anisotropy, bias,
+                                         float(size), levels - base);
+              }
+            }
+
+            const double rmse = sqrt(squared_error / (SWEEP_SIZE * SWEEP_SIZE * 3));
+            const double psnr = rmse > 0.0 ? 20.0 * log10(255.0 / rmse) : 99.0;
+
+            fprintf(stderr, "%-22s %5.0f %+5.1f %5d %9.4f %10.3f %8.3f %8.2f\n",
+                    filter.name, anisotropy, bias, size,
+                    1.0e-6 * double(elapsed) / SWEEP_PASSES, texels * 1.0e-6, rmse, psnr);
+          }
+        }
+      }
+    }
+
+    state.bind_texture(0, GL_TEXTURE_2D_ARRAY, tex_array);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+
+    glDeleteQueries(1, &query);
+    glBindSampler(0, 0);
+    glDeleteSamplers(1, &sampler);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(2, fbos);
+    glDeleteTextures(2, targets);
+
+    state.invalidate();
+  }
+
+  static GLuint link_program(const GLchar *vs_source, const GLchar *fs_source)
   {
     char buffer[1024];
 
     GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertex_shader, 1, &vertex_shader_source, nullptr);
+    glShaderSource(vertex_shader, 1, &vs_source, nullptr);
     glCompileShader(vertex_shader);
 
     glGetShaderInfoLog(vertex_shader, 1024, nullptr, buffer);
 
     GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment_shader, 1, &fragment_shader_source, nullptr);
+    glShaderSource(fragment_shader, 1, &fs_source, nullptr);
     glCompileShader(fragment_shader);
 
     glGetShaderInfoLog(fragment_shader, 1024, nullptr, buffer);
 
-    render_prog = glCreateProgram();
-    glAttachShader(render_prog, vertex_shader);
-    glAttachShader(render_prog, fragment_shader);
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
 
-    glLinkProgram(render_prog);
+    glLinkProgram(program);
 
     glDeleteShader(vertex_shader);
     glDeleteShader(fragment_shader);
 
-    glGetProgramInfoLog(render_prog, 1024, nullptr, buffer);
+    glGetProgramInfoLog(program, 1024, nullptr, buffer);
+
+    return program;
+  }
+
+  void load_shaders()
+  {
+    render_prog = link_program(vertex_shader_source, fragment_shader_source);
+    single_prog = link_program(single_vertex_shader_source, single_fragment_shader_source);
   }
 protected:
   GLuint render_prog;
+  GLuint single_prog;
   GLuint render_vao;
 
   struct
   {
-    GLuint mvp;
     GLuint offset;
+    GLuint single_mvp;
+    GLuint single_offset;
   } uniforms;
 
   GLuint tex_wall;
   GLuint tex_ceiling;
   GLuint tex_floor;
+
+  // The floor, wall and ceiling, in that order
+  GLuint tex_array;
+
+  // The WALLS block
+  GLuint walls_buffer;
+
+  // One of MODE_BATCHED and MODE_UNBATCHED
+  int mode;
+  int segments;
+
+  // Draw timers, read back a few frames late, and the GPU and CPU times
+  // summed since the title last showed them
+  GLuint timer_queries[TIMER_QUERIES];
+  bool timer_pending[TIMER_QUERIES];
+  int timer_frame;
+  int timed_frames;
+  double gpu_time;
+  double cpu_time;
+
+  sb7::gl_state state;
 };
 
 DECLARE_MAIN(Tunnel)
\ No newline at end of file
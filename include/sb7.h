@@ -47,6 +47,7 @@
 #include "sb7ext.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
@@ -97,6 +98,7 @@ public:
         glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
         glfwWindowHint(GLFW_SAMPLES, info.samples);
         glfwWindowHint(GLFW_STEREO, info.flags.stereo ? GL_TRUE : GL_FALSE);
+        glfwWindowHint(GLFW_VISIBLE, info.flags.headless ? GL_FALSE : GL_TRUE);
 //        if (info.flags.fullscreen)
 //        {
 //            if (info.windowWidth == 0 || info.windowHeight == 0)
@@ -190,6 +192,9 @@ public:
         info.samples = 0;
         info.flags.all = 0;
         info.flags.cursor = 1;
+        // Samples that support it run their checks or benchmarks without
+        // showing the window and then exit.
+        info.flags.headless = getenv("SB7_HEADLESS") ? 1 : 0;
 #ifdef _DEBUG
         info.flags.debug = 1;
 #endif
@@ -282,6 +287,7 @@ public:
                 unsigned int    stereo      : 1;
                 unsigned int    debug       : 1;
                 unsigned int    robust      : 1;
+                unsigned int    headless    : 1;
             };
             unsigned int        all;
         } flags;
@@ -0,0 +1,376 @@
+#ifndef __SB7CMDLIST_H__
+#define __SB7CMDLIST_H__
+
+#include "GL/gl3w.h"
+#include "sb7glstate.h"
+#include "sb7threadpool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+namespace sb7
+{
+
+// A list of GL commands recorded as plain words, to be replayed later on
+// the thread that owns the context. Recording makes no GL calls, so any
+// thread can fill a list. Each command is an opcode followed by its
+// arguments. clear() keeps the memory, so once a list has grown to the
+// size of a frame, recording allocates nothing.
+//
+// Commands are grouped into packets by begin(key). Replay sorts the
+// packets by key, so keys that put the program and vertex array in the
+// high bits keep binds together, and the gl_state that replays them skips
+// the binds that repeat.
+class cmd_list
+{
+public:
+    enum opcode : uint32_t
+    {
+        OP_USE_PROGRAM,
+        OP_BIND_VERTEX_ARRAY,
+        OP_BIND_BUFFER,
+        OP_BIND_TEXTURE,
+        OP_UNIFORM_1UI,
+        OP_UNIFORM_1F,
+        OP_UNIFORM_MATRIX_4FV,
+        OP_DRAW_ARRAYS,
+        OP_DRAW_ARRAYS_INSTANCED_BASE_INSTANCE
+    };
+
+    struct packet
+    {
+        uint64_t    key;
+        uint32_t    begin;      // First word of the packet
+    };
+
+    cmd_list()
+        : draws(0)
+    {
+    }
+
+    void clear()
+    {
+        words.clear();
+        packets.clear();
+        draws = 0;
+    }
+
+    // Starts a packet. Commands recorded before the first begin() go in a
+    // packet with key 0.
+    void begin(uint64_t key)
+    {
+        packet p = { key, static_cast<uint32_t>(words.size()) };
+        packets.push_back(p);
+    }
+
+    void use_program(GLuint program)
+    {
+        uint32_t* w = push(OP_USE_PROGRAM, 1);
+        w[0] = program;
+    }
+
+    void bind_vertex_array(GLuint vao)
+    {
+        uint32_t* w = push(OP_BIND_VERTEX_ARRAY, 1);
+        w[0] = vao;
+    }
+
+    void bind_buffer(GLenum target, GLuint buffer)
+    {
+        uint32_t* w = push(OP_BIND_BUFFER, 2);
+        w[0] = target;
+        w[1] = buffer;
+    }
+
+    void bind_texture(GLuint unit, GLenum target, GLuint texture)
+    {
+        uint32_t* w = push(OP_BIND_TEXTURE, 3);
+        w[0] = unit;
+        w[1] = target;
+        w[2] = texture;
+    }
+
+    void uniform1ui(GLint location, GLuint value)
+    {
+        uint32_t* w = push(OP_UNIFORM_1UI, 2);
+        w[0] = static_cast<uint32_t>(location);
+        w[1] = value;
+    }
+
+    void uniform1f(GLint location, GLfloat value)
+    {
+        uint32_t* w = push(OP_UNIFORM_1F, 2);
+        w[0] = static_cast<uint32_t>(location);
+        memcpy(&w[1], &value, sizeof(value));
+    }
+
+    // One matrix, column major
+    void uniform_matrix4fv(GLint location, const GLfloat* value)
+    {
+        uint32_t* w = push(OP_UNIFORM_MATRIX_4FV, 17);
+        w[0] = static_cast<uint32_t>(location);
+        memcpy(&w[1], value, 16 * sizeof(GLfloat));
+    }
+
+    void draw_arrays(GLenum mode, GLint first, GLsizei count)
+    {
+        uint32_t* w = push(OP_DRAW_ARRAYS, 3);
+        w[0] = mode;
+        w[1] = static_cast<uint32_t>(first);
+        w[2] = static_cast<uint32_t>(count);
+        draws++;
+    }
+
+    void draw_arrays_instanced_base_instance(GLenum mode, GLint first, GLsizei count,
+                                             GLsizei instance_count, GLuint base_instance)
+    {
+        uint32_t* w = push(OP_DRAW_ARRAYS_INSTANCED_BASE_INSTANCE, 5);
+        w[0] = mode;
+        w[1] = static_cast<uint32_t>(first);
+        w[2] = static_cast<uint32_t>(count);
+        w[3] = static_cast<uint32_t>(instance_count);
+        w[4] = base_instance;
+        draws++;
+    }
+
+    size_t draw_count() const
+    {
+        return draws;
+    }
+
+    size_t packet_count() const
+    {
+        return packets.size();
+    }
+
+    // Bytes of commands recorded
+    size_t size() const
+    {
+        return words.size() * sizeof(uint32_t);
+    }
+
+    const std::vector<packet>& get_packets() const
+    {
+        return packets;
+    }
+
+    // Last word of packet index, plus one
+    uint32_t packet_end(size_t index) const
+    {
+        return index + 1 < packets.size() ? packets[index + 1].begin
+                                          : static_cast<uint32_t>(words.size());
+    }
+
+    // Makes the GL calls for words [begin, end). Binds go through state,
+    // which skips the ones that change nothing.
+    void execute(uint32_t begin, uint32_t end, gl_state& state) const
+    {
+        const uint32_t* w = words.data() + begin;
+        const uint32_t* last = words.data() + end;
+
+        while (w < last)
+        {
+            switch (*w++)
+            {
+                case OP_USE_PROGRAM:
+                    state.use_program(w[0]);
+                    w += 1;
+                    break;
+                case OP_BIND_VERTEX_ARRAY:
+                    state.bind_vertex_array(w[0]);
+                    w += 1;
+                    break;
+                case OP_BIND_BUFFER:
+                    state.bind_buffer(w[0], w[1]);
+                    w += 2;
+                    break;
+                case OP_BIND_TEXTURE:
+                    state.bind_texture(w[0], w[1], w[2]);
+                    w += 3;
+                    break;
+                case OP_UNIFORM_1UI:
+                    glUniform1ui(GLint(w[0]), w[1]);
+                    w += 2;
+                    break;
+                case OP_UNIFORM_1F:
+                {
+                    GLfloat value;
+                    memcpy(&value, &w[1], sizeof(value));
+                    glUniform1f(GLint(w[0]), value);
+                    w += 2;
+                    break;
+                }
+                case OP_UNIFORM_MATRIX_4FV:
+                {
+                    GLfloat value[16];
+                    memcpy(value, &w[1], sizeof(value));
+                    glUniformMatrix4fv(GLint(w[0]), 1, GL_FALSE, value);
+                    w += 17;
+                    break;
+                }
+                case OP_DRAW_ARRAYS:
+                    glDrawArrays(w[0], GLint(w[1]), GLsizei(w[2]));
+                    w += 3;
+                    break;
+                case OP_DRAW_ARRAYS_INSTANCED_BASE_INSTANCE:
+                    glDrawArraysInstancedBaseInstance(w[0], GLint(w[1]), GLsizei(w[2]),
+                                                      GLsizei(w[3]), w[4]);
+                    w += 5;
+                    break;
+            }
+        }
+    }
+
+private:
+    std::vector<uint32_t>   words;
+    std::vector<packet>     packets;
+    size_t                  draws;
+
+    // cmd_recorder keeps one list per thread in a std::vector, and before
+    // C++17 its allocator need not honour alignas. A cache line of padding
+    // keeps the members that two threads write on different lines however
+    // the lists are aligned.
+    char                    padding[64];
+
+    uint32_t* push(opcode op, size_t argument_count)
+    {
+        if (packets.empty())
+        {
+            begin(0);
+        }
+
+        const size_t at = words.size();
+        words.resize(at + 1 + argument_count);
+        words[at] = op;
+
+        return &words[at + 1];
+    }
+};
+
+// One cmd_list per thread of a pool. record() has every thread fill its
+// own list; execute() replays all of them on the calling thread, which
+// must be the one with the GL context.
+//
+//     sb7::cmd_recorder recorder(pool);
+//
+//     recorder.record(objects, [&](sb7::cmd_list& list, size_t first, size_t last)
+//     {
+//         for (size_t i = first; i < last; i++)
+//         {
+//             list.begin(key_of(i));
+//             list.uniform_matrix4fv(mv_location, model_view(i));
+//             list.draw_arrays(GL_TRIANGLES, 0, 36);
+//         }
+//     });
+//
+//     recorder.execute(state);
+class cmd_recorder
+{
+public:
+    explicit cmd_recorder(thread_pool& pool)
+        : pool(pool),
+          lists(pool.size())
+    {
+    }
+
+    // Clears the lists and splits [0, count) between them. fn(list, first,
+    // last) is called once per non-empty range, each time with a different
+    // list.
+    void record(size_t count, const std::function<void(cmd_list&, size_t, size_t)>& fn)
+    {
+        const size_t parts = lists.size();
+
+        pool.parallel_for(parts, [&](size_t first_part, size_t last_part)
+        {
+            for (size_t part = first_part; part < last_part; part++)
+            {
+                const size_t first = count * part / parts;
+                const size_t last = count * (part + 1) / parts;
+
+                lists[part].clear();
+
+                if (first < last)
+                {
+                    fn(lists[part], first, last);
+                }
+            }
+        });
+    }
+
+    // Replays every packet in key order. Packets with equal keys keep the
+    // order they were recorded in, first list first.
+    void execute(gl_state& state)
+    {
+        order.clear();
+
+        for (size_t l = 0; l < lists.size(); l++)
+        {
+            const std::vector<cmd_list::packet>& packets = lists[l].get_packets();
+
+            for (size_t p = 0; p < packets.size(); p++)
+            {
+                const entry e = { packets[p].key, static_cast<uint32_t>(l), static_cast<uint32_t>(p) };
+                order.push_back(e);
+            }
+        }
+
+        auto by_key = [](const entry& a, const entry& b) { return a.key < b.key; };
+
+        if (!std::is_sorted(order.begin(), order.end(), by_key))
+        {
+            std::stable_sort(order.begin(), order.end(), by_key);
+        }
+
+        for (const entry& e : order)
+        {
+            const cmd_list& list = lists[e.list];
+            list.execute(list.get_packets()[e.packet].begin, list.packet_end(e.packet), state);
+        }
+    }
+
+    size_t draw_count() const
+    {
+        size_t total = 0;
+
+        for (const cmd_list& list : lists)
+        {
+            total += list.draw_count();
+        }
+
+        return total;
+    }
+
+    // Bytes of commands recorded by the last record()
+    size_t size() const
+    {
+        size_t total = 0;
+
+        for (const cmd_list& list : lists)
+        {
+            total += list.size();
+        }
+
+        return total;
+    }
+
+private:
+    struct entry
+    {
+        uint64_t    key;
+        uint32_t    list;
+        uint32_t    packet;
+    };
+
+    thread_pool&            pool;
+    std::vector<cmd_list>   lists;
+    std::vector<entry>      order;
+};
+
+} // namespace sb7
+
+#endif /* __SB7CMDLIST_H__ */
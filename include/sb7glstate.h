@@ -0,0 +1,320 @@
+#ifndef __SB7GLSTATE_H__
+#define __SB7GLSTATE_H__
+
+#include "GL/gl3w.h"
+
+namespace sb7
+{
+
+// A shadow copy of the most often changed GL state. Each setter compares
+// against the copy and only calls GL when the value changes, counting the
+// calls it makes and the ones it skips.
+//
+// The copy starts out unknown, so the first call of each kind always goes
+// through. Any GL call made behind gl_state's back that changes tracked
+// state, including deleting a bound object, must be followed by
+// invalidate().
+class gl_state
+{
+public:
+    enum
+    {
+        MAX_TEXTURE_UNITS = 32
+    };
+
+    struct counters
+    {
+        unsigned int    calls;      // Calls passed on to GL
+        unsigned int    elided;     // Calls skipped as redundant
+    };
+
+    gl_state()
+    {
+        invalidate();
+        current.calls = current.elided = 0;
+        last.calls = last.elided = 0;
+    }
+
+    // Forgets everything, so that the next call of each kind reaches GL
+    void invalidate()
+    {
+        program = UNKNOWN;
+        vao = UNKNOWN;
+        active_texture = UNKNOWN;
+
+        for (int i = 0; i < BUFFER_TARGET_COUNT; i++)
+        {
+            buffers[i] = UNKNOWN;
+        }
+
+        for (int i = 0; i < MAX_TEXTURE_UNITS; i++)
+        {
+            texture_targets[i] = UNKNOWN;
+            textures[i] = UNKNOWN;
+        }
+
+        for (int i = 0; i < CAP_COUNT; i++)
+        {
+            caps[i] = -1;
+        }
+
+        blend_src = blend_dst = UNKNOWN;
+        depth_func = UNKNOWN;
+        depth_mask = -1;
+        cull_face = UNKNOWN;
+    }
+
+    void use_program(GLuint name)
+    {
+        if (changed(program, name))
+        {
+            glUseProgram(name);
+        }
+    }
+
+    // GL_ELEMENT_ARRAY_BUFFER is part of the VAO and is not tracked
+    void bind_vertex_array(GLuint name)
+    {
+        if (changed(vao, name))
+        {
+            glBindVertexArray(name);
+        }
+    }
+
+    // Targets that are not tracked are always passed on
+    void bind_buffer(GLenum target, GLuint name)
+    {
+        const int index = buffer_index(target);
+
+        if (index < 0 || changed(buffers[index], name))
+        {
+            if (index < 0)
+            {
+                current.calls++;
+            }
+            glBindBuffer(target, name);
+        }
+    }
+
+    // Always calls GL, as indexed bindings are not tracked. The generic
+    // binding that glBindBufferBase also sets is.
+    void bind_buffer_base(GLenum target, GLuint index, GLuint name)
+    {
+        const int generic = buffer_index(target);
+
+        current.calls++;
+        glBindBufferBase(target, index, name);
+
+        if (generic >= 0)
+        {
+            buffers[generic] = name;
+        }
+    }
+
+    // Binds to unit with glActiveTexture and glBindTexture. Leaves the
+    // active texture unit set to unit.
+    void bind_texture(GLuint unit, GLenum target, GLuint name)
+    {
+        if (unit >= MAX_TEXTURE_UNITS)
+        {
+            current.calls += 2;
+            glActiveTexture(GL_TEXTURE0 + unit);
+            glBindTexture(target, name);
+            active_texture = unit;
+            return;
+        }
+
+        if (textures[unit] == name && texture_targets[unit] == target)
+        {
+            current.elided++;
+            return;
+        }
+
+        if (changed(active_texture, unit))
+        {
+            glActiveTexture(GL_TEXTURE0 + unit);
+        }
+
+        current.calls++;
+        glBindTexture(target, name);
+        texture_targets[unit] = target;
+        textures[unit] = name;
+    }
+
+    void enable(GLenum cap)
+    {
+        set_cap(cap, true);
+    }
+
+    void disable(GLenum cap)
+    {
+        set_cap(cap, false);
+    }
+
+    void set_blend_func(GLenum src, GLenum dst)
+    {
+        if (blend_src == src && blend_dst == dst)
+        {
+            current.elided++;
+            return;
+        }
+
+        current.calls++;
+        glBlendFunc(src, dst);
+        blend_src = src;
+        blend_dst = dst;
+    }
+
+    void set_depth_func(GLenum func)
+    {
+        if (changed(depth_func, func))
+        {
+            glDepthFunc(func);
+        }
+    }
+
+    void set_depth_mask(bool write)
+    {
+        if (depth_mask == int(write))
+        {
+            current.elided++;
+            return;
+        }
+
+        current.calls++;
+        glDepthMask(write ? GL_TRUE : GL_FALSE);
+        depth_mask = int(write);
+    }
+
+    void set_cull_face(GLenum mode)
+    {
+        if (changed(cull_face, mode))
+        {
+            glCullFace(mode);
+        }
+    }
+
+    // Counts for the frame so far
+    const counters& frame_counters() const
+    {
+        return current;
+    }
+
+    // Counts for the last frame that end_frame() closed
+    const counters& last_frame_counters() const
+    {
+        return last;
+    }
+
+    // Call once per frame
+    void end_frame()
+    {
+        last = current;
+        current.calls = current.elided = 0;
+    }
+
+private:
+    static const GLuint UNKNOWN = 0xFFFFFFFFu;
+
+    enum
+    {
+        BUFFER_TARGET_COUNT = 9
+    };
+
+    static int buffer_index(GLenum target)
+    {
+        switch (target)
+        {
+            case GL_ARRAY_BUFFER:               return 0;
+            case GL_DRAW_INDIRECT_BUFFER:       return 1;
+            case GL_DISPATCH_INDIRECT_BUFFER:   return 2;
+            case GL_PARAMETER_BUFFER_ARB:       return 3;
+            case GL_SHADER_STORAGE_BUFFER:      return 4;
+            case GL_UNIFORM_BUFFER:             return 5;
+            case GL_ATOMIC_COUNTER_BUFFER:      return 6;
+            case GL_PIXEL_PACK_BUFFER:          return 7;
+            case GL_PIXEL_UNPACK_BUFFER:        return 8;
+            default:                            return -1;
+        }
+    }
+
+    enum
+    {
+        CAP_COUNT = 6
+    };
+
+    static int cap_index(GLenum cap)
+    {
+        switch (cap)
+        {
+            case GL_BLEND:                      return 0;
+            case GL_DEPTH_TEST:                 return 1;
+            case GL_CULL_FACE:                  return 2;
+            case GL_SCISSOR_TEST:               return 3;
+            case GL_STENCIL_TEST:               return 4;
+            case GL_RASTERIZER_DISCARD:         return 5;
+            default:                            return -1;
+        }
+    }
+
+    // Updates value and counts the call. Returns whether GL needs calling.
+    bool changed(GLuint& value, GLuint new_value)
+    {
+        if (value == new_value)
+        {
+            current.elided++;
+            return false;
+        }
+
+        current.calls++;
+        value = new_value;
+        return true;
+    }
+
+    void set_cap(GLenum cap, bool on)
+    {
+        const int index = cap_index(cap);
+
+        if (index >= 0 && caps[index] == int(on))
+        {
+            current.elided++;
+            return;
+        }
+
+        current.calls++;
+
+        if (on)
+        {
+            glEnable(cap);
+        }
+        else
+        {
+            glDisable(cap);
+        }
+
+        if (index >= 0)
+        {
+            caps[index] = int(on);
+        }
+    }
+
+    GLuint      program;
+    GLuint      vao;
+    GLuint      active_texture;
+    GLuint      buffers[BUFFER_TARGET_COUNT];
+    GLuint      texture_targets[MAX_TEXTURE_UNITS];
+    GLuint      textures[MAX_TEXTURE_UNITS];
+    int         caps[CAP_COUNT];
+    GLuint      blend_src;
+    GLuint      blend_dst;
+    GLuint      depth_func;
+    int         depth_mask;
+    GLuint      cull_face;
+
+    counters    current;
+    counters    last;
+};
+
+} // namespace sb7
+
+#endif /* __SB7GLSTATE_H__ */
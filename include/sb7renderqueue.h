@@ -0,0 +1,354 @@
+#ifndef __SB7RENDERQUEUE_H__
+#define __SB7RENDERQUEUE_H__
+
+#include "GL/gl3w.h"
+#include "sb7glstate.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+namespace sb7
+{
+
+// Collects a frame's draws, sorts them by a 64-bit key and submits them
+// with as few calls as it can. After sorting, a run of items that share a
+// program, vertex array, texture and primitive mode becomes one
+// glMultiDrawArraysIndirect, or one plain draw if the run has a single
+// command. Within a run, items that draw the same vertices with
+// consecutive instances are folded into one instanced command.
+//
+// Each item's instance is passed as its baseInstance, so a shader can
+// find per-item data with an instanced attribute or gl_BaseInstance.
+//
+//     queue.clear();
+//
+//     for (each object)
+//     {
+//         sb7::render_queue::item& it = queue.push();
+//         it.key = sb7::render_queue::make_key(0, program_index, material, depth);
+//         ...
+//     }
+//
+//     queue.sort();
+//     queue.flush(state);
+class render_queue
+{
+public:
+    struct item
+    {
+        uint64_t    key;
+        GLuint      program;
+        GLuint      vao;
+        GLuint      texture;        // Bound to unit 0 if not zero
+        GLenum      mode;
+        GLuint      first;
+        GLuint      count;          // Items with no vertices are dropped
+        GLuint      instance;
+    };
+
+    // What the last flush() did
+    struct counters
+    {
+        size_t      items;          // Items with vertices
+        size_t      commands;       // After folding instances
+        size_t      calls;          // Draw calls made
+    };
+
+    explicit render_queue(GLenum texture_target = GL_TEXTURE_2D)
+        : texture_target(texture_target),
+          indirect_buffer(0),
+          indirect_buffer_size(0)
+    {
+        stats.items = stats.commands = stats.calls = 0;
+    }
+
+    // Pass in the top 4 bits, then 12 of program, 16 of material and 32
+    // of depth. Items sort by pass first and depth last.
+    static uint64_t make_key(unsigned int pass, unsigned int program,
+                             unsigned int material, uint32_t depth)
+    {
+        return (uint64_t(pass & 0xF) << 60) |
+               (uint64_t(program & 0xFFF) << 48) |
+               (uint64_t(material & 0xFFFF) << 32) |
+               uint64_t(depth);
+    }
+
+    // A depth key that sorts front to back. The bits of a non-negative
+    // float sort in the same order as its value.
+    static uint32_t depth_key(float depth)
+    {
+        uint32_t bits;
+
+        if (!(depth > 0.0f))
+        {
+            return 0;
+        }
+
+        memcpy(&bits, &depth, sizeof(bits));
+        return bits;
+    }
+
+    void clear()
+    {
+        items.clear();
+    }
+
+    item& push()
+    {
+        items.resize(items.size() + 1);
+        return items.back();
+    }
+
+    // Adds count items and returns the first, so that several threads can
+    // fill them in
+    item* push(size_t count)
+    {
+        const size_t at = items.size();
+
+        items.resize(at + count);
+        return items.data() + at;
+    }
+
+    size_t size() const
+    {
+        return items.size();
+    }
+
+    // Sorts the items by key with an LSD radix sort, DIGIT_BITS per pass.
+    // Digits that are the same in every key are skipped, which is most of
+    // the pass and program bits in a typical frame.
+    void sort()
+    {
+        const size_t n = items.size();
+
+        sorted.resize(n);
+        scratch.resize(n);
+        histogram.assign(DIGIT_COUNT * RADIX, 0);
+
+        for (size_t i = 0; i < n; i++)
+        {
+            const uint64_t key = items[i].key;
+
+            sorted[i].key = key;
+            sorted[i].index = static_cast<uint32_t>(i);
+
+            for (int d = 0; d < DIGIT_COUNT; d++)
+            {
+                histogram[d * RADIX + digit(key, d)]++;
+            }
+        }
+
+        for (int d = 0; d < DIGIT_COUNT; d++)
+        {
+            uint32_t* offset = &histogram[d * RADIX];
+
+            if (n == 0 || offset[digit(sorted[0].key, d)] == n)
+            {
+                continue;
+            }
+
+            uint32_t total = 0;
+
+            for (int r = 0; r < RADIX; r++)
+            {
+                const uint32_t count = offset[r];
+                offset[r] = total;
+                total += count;
+            }
+
+            for (size_t i = 0; i < n; i++)
+            {
+                scratch[offset[digit(sorted[i].key, d)]++] = sorted[i];
+            }
+
+            sorted.swap(scratch);
+        }
+    }
+
+    // Draws the items in the order sort() left them in. Binds go through
+    // state. Needs a current context; the first call creates the buffer
+    // the commands are uploaded to.
+    void flush(gl_state& state)
+    {
+        build_batches();
+
+        stats.calls = batches.size();
+
+        if (batches.empty())
+        {
+            return;
+        }
+
+        const GLsizeiptr size = commands.size() * sizeof(command);
+
+        if (!indirect_buffer)
+        {
+            glGenBuffers(1, &indirect_buffer);
+        }
+
+        state.bind_buffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+
+        if (size > indirect_buffer_size)
+        {
+            indirect_buffer_size = size;
+            glBufferData(GL_DRAW_INDIRECT_BUFFER, size, commands.data(), GL_STREAM_DRAW);
+        }
+        else
+        {
+            // Orphan the old contents, which may still be in use
+            glBufferData(GL_DRAW_INDIRECT_BUFFER, indirect_buffer_size, nullptr, GL_STREAM_DRAW);
+            glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, size, commands.data());
+        }
+
+        for (const batch& b : batches)
+        {
+            const item& it = items[b.item];
+
+            state.use_program(it.program);
+            state.bind_vertex_array(it.vao);
+
+            if (it.texture)
+            {
+                state.bind_texture(0, texture_target, it.texture);
+            }
+
+            if (b.command_count == 1)
+            {
+                const command& c = commands[b.first_command];
+                glDrawArraysInstancedBaseInstance(it.mode, c.first, c.count,
+                                                  c.instance_count, c.base_instance);
+            }
+            else
+            {
+                glMultiDrawArraysIndirect(it.mode,
+                                          reinterpret_cast<const void*>(b.first_command * sizeof(command)),
+                                          GLsizei(b.command_count), 0);
+            }
+        }
+    }
+
+    const counters& last_flush_counters() const
+    {
+        return stats;
+    }
+
+    // Needs a current context
+    void destroy()
+    {
+        glDeleteBuffers(1, &indirect_buffer);
+        indirect_buffer = 0;
+        indirect_buffer_size = 0;
+    }
+
+private:
+    // 11 bit digits take six passes for 64 bits with a histogram that
+    // still fits in L1
+    enum
+    {
+        DIGIT_BITS = 11,
+        RADIX = 1 << DIGIT_BITS,
+        DIGIT_COUNT = (64 + DIGIT_BITS - 1) / DIGIT_BITS
+    };
+
+    static unsigned int digit(uint64_t key, int d)
+    {
+        return static_cast<unsigned int>(key >> (d * DIGIT_BITS)) & (RADIX - 1);
+    }
+
+    struct sort_entry
+    {
+        uint64_t    key;
+        uint32_t    index;
+    };
+
+    // Same layout as DrawArraysIndirectCommand
+    struct command
+    {
+        GLuint      count;
+        GLuint      instance_count;
+        GLuint      first;
+        GLuint      base_instance;
+    };
+
+    struct batch
+    {
+        size_t      item;           // Supplies the state
+        size_t      first_command;
+        size_t      command_count;
+    };
+
+    static bool same_state(const item& a, const item& b)
+    {
+        return a.program == b.program && a.vao == b.vao &&
+               a.texture == b.texture && a.mode == b.mode;
+    }
+
+    void build_batches()
+    {
+        commands.clear();
+        batches.clear();
+        stats.items = 0;
+
+        const item* last = nullptr;
+
+        for (const sort_entry& e : sorted)
+        {
+            const item& it = items[e.index];
+
+            if (it.count == 0)
+            {
+                continue;
+            }
+
+            stats.items++;
+
+            if (last && same_state(*last, it))
+            {
+                command& c = commands.back();
+
+                if (c.first == it.first && c.count == it.count &&
+                    c.base_instance + c.instance_count == it.instance)
+                {
+                    c.instance_count++;
+                }
+                else
+                {
+                    const command next = { it.count, 1, it.first, it.instance };
+                    commands.push_back(next);
+                    batches.back().command_count++;
+                }
+            }
+            else
+            {
+                const command next = { it.count, 1, it.first, it.instance };
+                const batch b = { e.index, commands.size(), 1 };
+                commands.push_back(next);
+                batches.push_back(b);
+            }
+
+            last = &it;
+        }
+
+        stats.commands = commands.size();
+    }
+
+    GLenum                      texture_target;
+    GLuint                      indirect_buffer;
+    GLsizeiptr                  indirect_buffer_size;
+
+    std::vector<item>           items;
+    std::vector<sort_entry>     sorted;
+    std::vector<sort_entry>     scratch;
+    std::vector<uint32_t>       histogram;
+    std::vector<command>        commands;
+    std::vector<batch>          batches;
+
+    counters                    stats;
+};
+
+} // namespace sb7
+
+#endif /* __SB7RENDERQUEUE_H__ */
@@ -0,0 +1,308 @@
+#ifndef __SB7RNG_H__
+#define __SB7RNG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SB7_RNG_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace sb7
+{
+
+namespace rng
+{
+
+// All generators hold their state explicitly. Give each thread its own
+// instance rather than sharing one.
+
+// Maps the top 23 bits of x onto [0, 1).
+static inline float to_unit_float(uint32_t x)
+{
+    const uint32_t bits = (x >> 9) | 0x3F800000;
+    float f;
+
+    memcpy(&f, &bits, sizeof(f));
+
+    return f - 1.0f;
+}
+
+static inline uint64_t splitmix64(uint64_t& x)
+{
+    uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+
+    return z ^ (z >> 31);
+}
+
+// The generator the samples have always used. Seeding it with a sample's
+// old seed reproduces that sample's output exactly.
+class legacy
+{
+public:
+    explicit legacy(uint32_t s = 0x13371337)
+        : state(s)
+    {
+    }
+
+    void seed(uint32_t s)
+    {
+        state = s;
+    }
+
+    uint32_t next_uint()
+    {
+        state *= 16807;
+
+        return state ^ (state >> 4) ^ (state << 15);
+    }
+
+    float next_float()
+    {
+        return to_unit_float(next_uint());
+    }
+
+    void fill_uniform(float* out, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            out[i] = next_float();
+        }
+    }
+
+private:
+    uint32_t state;
+};
+
+// PCG-XSH-RR 64/32. The stream selects one of 2^63 independent sequences.
+class pcg32
+{
+public:
+    explicit pcg32(uint64_t s = 0x853C49E6748FEA9Bull, uint64_t stream = 0xDA3E39CB94B95BDBull)
+    {
+        seed(s, stream);
+    }
+
+    void seed(uint64_t s, uint64_t stream = 0xDA3E39CB94B95BDBull)
+    {
+        state = 0;
+        inc = (stream << 1) | 1;
+        next_uint();
+        state += s;
+        next_uint();
+    }
+
+    uint32_t next_uint()
+    {
+        const uint64_t old = state;
+        state = old * 6364136223846793005ull + inc;
+
+        const uint32_t xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+        const uint32_t rot = static_cast<uint32_t>(old >> 59);
+
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+
+    float next_float()
+    {
+        return to_unit_float(next_uint());
+    }
+
+    void fill_uniform(float* out, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            out[i] = next_float();
+        }
+    }
+
+private:
+    uint64_t state;
+    uint64_t inc;
+};
+
+// Four interleaved xoshiro128+ lanes. Bulk fills run all four lanes at once
+// with SSE2; the scalar path produces the same sequence.
+class xoshiro128x4
+{
+public:
+    explicit xoshiro128x4(uint64_t s = 0x13371337)
+    {
+        seed(s);
+    }
+
+    void seed(uint64_t s)
+    {
+        for (int lane = 0; lane < 4; lane++)
+        {
+            const uint64_t a = splitmix64(s);
+            const uint64_t b = splitmix64(s);
+
+            state[0][lane] = static_cast<uint32_t>(a);
+            state[1][lane] = static_cast<uint32_t>(a >> 32);
+            state[2][lane] = static_cast<uint32_t>(b);
+            state[3][lane] = static_cast<uint32_t>(b >> 32);
+        }
+    }
+
+    // Fills n floats in [0, 1). Lane k writes elements k, k + 4, k + 8...
+    void fill_uniform(float* out, size_t n)
+    {
+        size_t i = 0;
+
+#ifdef SB7_RNG_SSE2
+        __m128i s0 = _mm_loadu_si128((const __m128i*)state[0]);
+        __m128i s1 = _mm_loadu_si128((const __m128i*)state[1]);
+        __m128i s2 = _mm_loadu_si128((const __m128i*)state[2]);
+        __m128i s3 = _mm_loadu_si128((const __m128i*)state[3]);
+        const __m128i exponent = _mm_set1_epi32(0x3F800000);
+        const __m128 one = _mm_set1_ps(1.0f);
+
+        for (; i + 4 <= n; i += 4)
+        {
+            const __m128i result = _mm_add_epi32(s0, s3);
+            const __m128i t = _mm_slli_epi32(s1, 9);
+
+            s2 = _mm_xor_si128(s2, s0);
+            s3 = _mm_xor_si128(s3, s1);
+            s1 = _mm_xor_si128(s1, s2);
+            s0 = _mm_xor_si128(s0, s3);
+            s2 = _mm_xor_si128(s2, t);
+            s3 = _mm_or_si128(_mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21));
+
+            const __m128i bits = _mm_or_si128(_mm_srli_epi32(result, 9), exponent);
+            _mm_storeu_ps(out + i, _mm_sub_ps(_mm_castsi128_ps(bits), one));
+        }
+
+        _mm_storeu_si128((__m128i*)state[0], s0);
+        _mm_storeu_si128((__m128i*)state[1], s1);
+        _mm_storeu_si128((__m128i*)state[2], s2);
+        _mm_storeu_si128((__m128i*)state[3], s3);
+#endif
+
+        for (; i < n; i += 4)
+        {
+            uint32_t result[4];
+
+            step(result);
+
+            for (int lane = 0; lane < 4 && i + lane < n; lane++)
+            {
+                out[i + lane] = to_unit_float(result[lane]);
+            }
+        }
+    }
+
+    void fill_uint(uint32_t* out, size_t n)
+    {
+        for (size_t i = 0; i < n; i += 4)
+        {
+            uint32_t result[4];
+
+            step(result);
+
+            for (int lane = 0; lane < 4 && i + lane < n; lane++)
+            {
+                out[i + lane] = result[lane];
+            }
+        }
+    }
+
+private:
+    uint32_t state[4][4];
+
+    void step(uint32_t result[4])
+    {
+        for (int lane = 0; lane < 4; lane++)
+        {
+            uint32_t& s0 = state[0][lane];
+            uint32_t& s1 = state[1][lane];
+            uint32_t& s2 = state[2][lane];
+            uint32_t& s3 = state[3][lane];
+
+            result[lane] = s0 + s3;
+
+            const uint32_t t = s1 << 9;
+
+            s2 ^= s0;
+            s3 ^= s1;
+            s1 ^= s2;
+            s0 ^= s3;
+            s2 ^= t;
+            s3 = (s3 << 11) | (s3 >> 21);
+        }
+    }
+};
+
+// Fills n floats in [0, 1) using every core. The output is split into fixed
+// size blocks with independently seeded generators, so it depends only on
+// the seed and not on the number of threads.
+static inline void parallel_fill_uniform(float* out,
+                                         size_t n,
+                                         uint64_t seed,
+                                         unsigned int thread_count = 0)
+{
+    static const size_t block_size = 64 * 1024;
+    const size_t block_count = (n + block_size - 1) / block_size;
+
+    if (thread_count == 0)
+    {
+        thread_count = std::thread::hardware_concurrency();
+    }
+    if (thread_count == 0)
+    {
+        thread_count = 1;
+    }
+    if (thread_count > block_count)
+    {
+        thread_count = static_cast<unsigned int>(block_count);
+    }
+
+    auto worker = [=](unsigned int first_block)
+    {
+        for (size_t block = first_block; block < block_count; block += thread_count)
+        {
+            uint64_t block_seed = seed ^ (block * 0xD1B54A32D192ED03ull);
+            xoshiro128x4 gen(splitmix64(block_seed));
+            const size_t first = block * block_size;
+            const size_t count = (n - first) < block_size ? (n - first) : block_size;
+
+            gen.fill_uniform(out + first, count);
+        }
+    };
+
+    if (thread_count <= 1)
+    {
+        worker(0);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count - 1);
+
+    for (unsigned int t = 1; t < thread_count; t++)
+    {
+        threads.emplace_back(worker, t);
+    }
+
+    worker(0);
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+} // namespace rng
+
+} // namespace sb7
+
+#endif /* __SB7RNG_H__ */
@@ -0,0 +1,164 @@
+#ifndef __SB7THREADPOOL_H__
+#define __SB7THREADPOOL_H__
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sb7
+{
+
+// A fixed set of worker threads for data-parallel loops. The threads are
+// created once and sleep between jobs, so a loop can be dispatched every
+// frame without paying for thread creation.
+//
+//     sb7::thread_pool pool;
+//
+//     pool.parallel_for(rows, [&](size_t first, size_t last)
+//     {
+//         for (size_t row = first; row < last; row++)
+//             process_row(row);
+//     });
+class thread_pool
+{
+public:
+    // thread_count includes the calling thread. Zero uses one thread per core.
+    explicit thread_pool(unsigned int thread_count = 0)
+        : job(nullptr),
+          job_size(0),
+          generation(0),
+          pending(0),
+          quit(false)
+    {
+        if (thread_count == 0)
+        {
+            thread_count = std::thread::hardware_concurrency();
+        }
+        if (thread_count == 0)
+        {
+            thread_count = 1;
+        }
+
+        workers.reserve(thread_count - 1);
+
+        for (unsigned int index = 1; index < thread_count; index++)
+        {
+            workers.emplace_back(&thread_pool::worker, this, index);
+        }
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+
+        wake.notify_all();
+
+        for (auto& thread : workers)
+        {
+            thread.join();
+        }
+    }
+
+    unsigned int size() const
+    {
+        return static_cast<unsigned int>(workers.size()) + 1;
+    }
+
+    // Splits [0, count) into size() contiguous ranges and calls
+    // fn(first, last) once per non-empty range. The calling thread takes the
+    // first range. Returns when every range is done.
+    void parallel_for(size_t count, const std::function<void(size_t, size_t)>& fn)
+    {
+        if (workers.empty() || count < 2)
+        {
+            if (count != 0)
+            {
+                fn(0, count);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            job_size = count;
+            pending = static_cast<unsigned int>(workers.size());
+            generation++;
+        }
+
+        wake.notify_all();
+
+        run_range(fn, count, 0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return pending == 0; });
+        job = nullptr;
+    }
+
+private:
+    std::vector<std::thread>                        workers;
+    std::mutex                                      mutex;
+    std::condition_variable                         wake;
+    std::condition_variable                         done;
+    const std::function<void(size_t, size_t)>*      job;
+    size_t                                          job_size;
+    unsigned long long                              generation;
+    unsigned int                                    pending;
+    bool                                            quit;
+
+    void run_range(const std::function<void(size_t, size_t)>& fn, size_t count, unsigned int index)
+    {
+        const size_t parts = size();
+        const size_t first = count * index / parts;
+        const size_t last = count * (index + 1) / parts;
+
+        if (first < last)
+        {
+            fn(first, last);
+        }
+    }
+
+    void worker(unsigned int index)
+    {
+        unsigned long long seen = 0;
+
+        for (;;)
+        {
+            const std::function<void(size_t, size_t)>* fn;
+            size_t count;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return quit || generation != seen; });
+
+                if (quit)
+                {
+                    return;
+                }
+
+                seen = generation;
+                fn = job;
+                count = job_size;
+            }
+
+            run_range(*fn, count, index);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0)
+            {
+                done.notify_one();
+            }
+        }
+    }
+};
+
+} // namespace sb7
+
+#endif /* __SB7THREADPOOL_H__ */
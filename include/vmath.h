@@ -4,6 +4,16 @@
 
 #define _USE_MATH_DEFINES  1 // Include constants defined in math.h
 #include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+// GCC and Clang define __F16C__ when they may emit F16C, and AVX2 does not
+// imply it. MSVC never says, so define VMATH_USE_F16C there to opt in on
+// CPUs known to have it.
+#if defined(__F16C__) || (defined(VMATH_USE_F16C) && defined(_MSC_VER) && !defined(__clang__))
+#define VMATH_F16C 1
+#include <immintrin.h>
+#endif
 
 namespace vmath
 {
@@ -13,23 +23,61 @@ template <typename T, const int len> class vecN;
 template <typename T> class Tquaternion;
 
 template <typename T> 
-inline T degrees(T angleInRadians)
+inline constexpr T degrees(T angleInRadians)
 {
     return angleInRadians * static_cast<T>(180.0/M_PI);
 }
 
 template <typename T>
-inline T radians(T angleInDegrees)
+inline constexpr T radians(T angleInDegrees)
 {
     return angleInDegrees * static_cast<T>(M_PI/180.0);
 }
 
+// Trigonometry usable in constant expressions. Arguments are reduced to
+// [-pi, pi] and evaluated with a Taylor series in double precision, which is
+// accurate to well below float epsilon.
+template <typename T>
+inline constexpr T constexpr_sin(T angleInRadians)
+{
+    const double two_pi = 2.0 * M_PI;
+    double x = static_cast<double>(angleInRadians);
+    const long long k = static_cast<long long>(x / two_pi + (x >= 0.0 ? 0.5 : -0.5));
+    x -= static_cast<double>(k) * two_pi;
+
+    const double x2 = x * x;
+    double term = x;
+    double sum = x;
+
+    for (int n = 1; n < 16; n++)
+    {
+        term *= -x2 / static_cast<double>((2 * n) * (2 * n + 1));
+        sum += term;
+    }
+
+    return static_cast<T>(sum);
+}
+
+template <typename T>
+inline constexpr T constexpr_cos(T angleInRadians)
+{
+    return constexpr_sin<T>(angleInRadians + static_cast<T>(M_PI * 0.5));
+}
+
+template <typename T>
+inline constexpr T constexpr_tan(T angleInRadians)
+{
+    return constexpr_sin<T>(angleInRadians) / constexpr_cos<T>(angleInRadians);
+}
+
+// Each thread steps its own copy of the seed, so concurrent callers don't
+// race. For explicit, seedable state use the generators in sb7rng.h.
 template <typename T>
 struct random
 {
     operator T ()
     {
-        static unsigned int seed = 0x13371337;
+        static thread_local unsigned int seed = 0x13371337;
         unsigned int res;
         unsigned int tmp;
         
@@ -48,7 +96,7 @@ struct random<float>
 {
     operator float()
     {
-        static unsigned int seed = 0x13371337;
+        static thread_local unsigned int seed = 0x13371337;
         float res;
         unsigned int tmp;
 
@@ -67,7 +115,7 @@ struct random<unsigned int>
 {
     operator unsigned int()
     {
-        static unsigned int seed = 0x13371337;
+        static thread_local unsigned int seed = 0x13371337;
         unsigned int res;
         unsigned int tmp;
 
@@ -88,146 +136,140 @@ public:
     typedef class vecN<T,len> my_type;
     typedef T element_type;
 
-    // Default constructor does nothing, just like built-in types
-    inline vecN()
+    // Default constructor zero-fills so that vectors can be used in
+    // constant expressions
+    inline constexpr vecN()
+        : data()
     {
-        // Uninitialized variable
     }
 
     // Copy constructor
-    inline vecN(const vecN& that)
+    inline constexpr vecN(const vecN& that)
+        : data()
     {
         assign(that);
     }
 
     // Construction from scalar
-    inline vecN(T s)
+    inline constexpr vecN(T s)
+        : data()
     {
-        int n;
-        for (n = 0; n < len; n++)
+        for (int n = 0; n < len; n++)
         {
             data[n] = s;
         }
     }
 
     // Assignment operator
-    inline vecN& operator=(const vecN& that)
+    inline constexpr vecN& operator=(const vecN& that)
     {
         assign(that);
         return *this;
     }
 
-    inline vecN& operator=(const T& that)
+    inline constexpr vecN& operator=(const T& that)
     {
-        int n;
-        for (n = 0; n < len; n++)
+        for (int n = 0; n < len; n++)
             data[n] = that;
 
         return *this;
     }
 
-    inline vecN operator+(const vecN& that) const
+    inline constexpr vecN operator+(const vecN& that) const
     {
         my_type result;
-        int n;
-        for (n = 0; n < len; n++)
+        for (int n = 0; n < len; n++)
             result.data[n] = data[n] + that.data[n];
         return result;
     }
 
-    inline vecN& operator+=(const vecN& that)
+    inline constexpr vecN& operator+=(const vecN& that)
     {
         return (*this = *this + that);
     }
 
-    inline vecN operator-() const
+    inline constexpr vecN operator-() const
     {
         my_type result;
-        int n;
-        for (n = 0; n < len; n++)
+        for (int n = 0; n < len; n++)
             result.data[n] = -data[n];
         return result;
     }
 
-    inline vecN operator-(const vecN& that) const
+    inline constexpr vecN operator-(const vecN& that) const
     {
         my_type result;
-        int n;
-        for (n = 0; n < len; n++)
+        for (int n = 0; n < len; n++)
             result.data[n] = data[n] - that.data[n];
         return result;
     }
 
-    inline vecN& operator-=(const vecN& that)
+    inline constexpr vecN& operator-=(const vecN& that)
     {
         return (*this = *this - that);
     }
 
-    inline vecN operator*(const vecN& that) const
+    inline constexpr vecN operator*(const vecN& that) const
     {
         my_type result;
-        int n;
-        for (n = 0; n < len; n++)
+        for (int n = 0; n < len; n++)
             result.data[n] = data[n] * that.data[n];
         return result;
     }
 
-    inline vecN& operator*=(const vecN& that)
+    inline constexpr vecN& operator*=(const vecN& that)
     {
         return (*this = *this * that);
     }
 
-    inline vecN operator*(const T& that) const
+    inline constexpr vecN operator*(const T& that) const
     {
         my_type result;
-        int n;
-        for (n = 0; n < len; n++)
+        for (int n = 0; n < len; n++)
             result.data[n] = data[n] * that;
         return result;
     }
 
-    inline vecN& operator*=(const T& that)
+    inline constexpr vecN& operator*=(const T& that)
     {
         assign(*this * that);
 
         return *this;
     }
 
-    inline vecN operator/(const vecN& that) const
+    inline constexpr vecN operator/(const vecN& that) const
     {
         my_type result;
-        int n;
-        for (n = 0; n < len; n++)
+        for (int n = 0; n < len; n++)
             result.data[n] = data[n] / that.data[n];
         return result;
     }
 
-    inline vecN& operator/=(const vecN& that)
+    inline constexpr vecN& operator/=(const vecN& that)
     {
         assign(*this / that);
 
         return *this;
     }
 
-    inline vecN operator/(const T& that) const
+    inline constexpr vecN operator/(const T& that) const
     {
         my_type result;
-        int n;
-        for (n = 0; n < len; n++)
+        for (int n = 0; n < len; n++)
             result.data[n] = data[n] / that;
         return result;
     }
 
-    inline vecN& operator/=(const T& that)
+    inline constexpr vecN& operator/=(const T& that)
     {
         assign(*this / that);
         return *this;
     }
 
-    inline T& operator[](int n) { return data[n]; }
-    inline const T& operator[](int n) const { return data[n]; }
+    inline constexpr T& operator[](int n) { return data[n]; }
+    inline constexpr const T& operator[](int n) const { return data[n]; }
 
-    inline static int size(void) { return len; }
+    static inline constexpr int size(void) { return len; }
 
     inline operator const T* () const { return &data[0]; }
 
@@ -246,10 +288,9 @@ public:
 protected:
     T data[len];
 
-    inline void assign(const vecN& that)
+    inline constexpr void assign(const vecN& that)
     {
-        int n;
-        for (n = 0; n < len; n++)
+        for (int n = 0; n < len; n++)
             data[n] = that.data[n];
     }
 };
@@ -260,13 +301,13 @@ class Tvec2 : public vecN<T,2>
 public:
     typedef vecN<T,2> base;
 
-    // Uninitialized variable
-    inline Tvec2() {}
+    // Zero-filled by vecN
+    inline constexpr Tvec2() {}
     // Copy constructor
-    inline Tvec2(const base& v) : base(v) {}
+    inline constexpr Tvec2(const base& v) : base(v) {}
 
     // vec2(x, y);
-    inline Tvec2(T x, T y)
+    inline constexpr Tvec2(T x, T y)
     {
         base::data[0] = x;
         base::data[1] = y;
@@ -279,14 +320,14 @@ class Tvec3 : public vecN<T,3>
 public:
     typedef vecN<T,3> base;
 
-    // Uninitialized variable
-    inline Tvec3() {}
+    // Zero-filled by vecN
+    inline constexpr Tvec3() {}
 
     // Copy constructor
-    inline Tvec3(const base& v) : base(v) {}
+    inline constexpr Tvec3(const base& v) : base(v) {}
 
     // vec3(x, y, z);
-    inline Tvec3(T x, T y, T z)
+    inline constexpr Tvec3(T x, T y, T z)
     {
         base::data[0] = x;
         base::data[1] = y;
@@ -294,7 +335,7 @@ public:
     }
 
     // vec3(v, z);
-    inline Tvec3(const Tvec2<T>& v, T z)
+    inline constexpr Tvec3(const Tvec2<T>& v, T z)
     {
         base::data[0] = v[0];
         base::data[1] = v[1];
@@ -302,7 +343,7 @@ public:
     }
 
     // vec3(x, v)
-    inline Tvec3(T x, const Tvec2<T>& v)
+    inline constexpr Tvec3(T x, const Tvec2<T>& v)
     {
         base::data[0] = x;
         base::data[1] = v[0];
@@ -316,14 +357,14 @@ class Tvec4 : public vecN<T,4>
 public:
     typedef vecN<T,4> base;
 
-    // Uninitialized variable
-    inline Tvec4() {}
+    // Zero-filled by vecN
+    inline constexpr Tvec4() {}
 
     // Copy constructor
-    inline Tvec4(const base& v) : base(v) {}
+    inline constexpr Tvec4(const base& v) : base(v) {}
 
     // vec4(x, y, z, w);
-    inline Tvec4(T x, T y, T z, T w)
+    inline constexpr Tvec4(T x, T y, T z, T w)
     {
         base::data[0] = x;
         base::data[1] = y;
@@ -332,7 +373,7 @@ public:
     }
 
     // vec4(v, z, w);
-    inline Tvec4(const Tvec2<T>& v, T z, T w)
+    inline constexpr Tvec4(const Tvec2<T>& v, T z, T w)
     {
         base::data[0] = v[0];
         base::data[1] = v[1];
@@ -341,7 +382,7 @@ public:
     }
 
     // vec4(x, v, w);
-    inline Tvec4(T x, const Tvec2<T>& v, T w)
+    inline constexpr Tvec4(T x, const Tvec2<T>& v, T w)
     {
         base::data[0] = x;
         base::data[1] = v[0];
@@ -350,7 +391,7 @@ public:
     }
 
     // vec4(x, y, v);
-    inline Tvec4(T x, T y, const Tvec2<T>& v)
+    inline constexpr Tvec4(T x, T y, const Tvec2<T>& v)
     {
         base::data[0] = x;
         base::data[1] = y;
@@ -359,7 +400,7 @@ public:
     }
 
     // vec4(v1, v2);
-    inline Tvec4(const Tvec2<T>& u, const Tvec2<T>& v)
+    inline constexpr Tvec4(const Tvec2<T>& u, const Tvec2<T>& v)
     {
         base::data[0] = u[0];
         base::data[1] = u[1];
@@ -368,7 +409,7 @@ public:
     }
 
     // vec4(v, w);
-    inline Tvec4(const Tvec3<T>& v, T w)
+    inline constexpr Tvec4(const Tvec3<T>& v, T w)
     {
         base::data[0] = v[0];
         base::data[1] = v[1];
@@ -377,7 +418,7 @@ public:
     }
 
     // vec4(x, v);
-    inline Tvec4(T x, const Tvec3<T>& v)
+    inline constexpr Tvec4(T x, const Tvec3<T>& v)
     {
         base::data[0] = x;
         base::data[1] = v[0];
@@ -409,34 +450,197 @@ typedef Tvec4<int> ivec4;
 typedef Tvec4<unsigned int> uvec4;
 typedef Tvec4<double> dvec4;
 
+// IEEE 754 binary16 storage type. Arithmetic is done in float; the value is
+// rounded to nearest-even whenever it is stored back.
+static inline unsigned short float_to_half_bits(float f)
+{
+    unsigned int x;
+    unsigned int result;
+
+    memcpy(&x, &f, sizeof(x));
+
+    const unsigned int sign = (x >> 16) & 0x8000;
+    x &= 0x7FFFFFFF;
+
+    if (x >= 0x47800000)
+    {
+        // Too large for half, infinity or NaN. NaN payloads are truncated and
+        // quieted, matching F16C.
+        result = (x > 0x7F800000) ? (0x7E00 | ((x >> 13) & 0x3FF)) : 0x7C00;
+    }
+    else if (x < 0x38800000)
+    {
+        // Denormal or zero. Adding a magic number lets the FPU do the
+        // rounding.
+        const unsigned int magic_bits = 0x3F000000;
+        float magic;
+        float v;
+
+        memcpy(&magic, &magic_bits, sizeof(magic));
+        memcpy(&v, &x, sizeof(v));
+        v += magic;
+        memcpy(&result, &v, sizeof(result));
+        result -= magic_bits;
+    }
+    else
+    {
+        const unsigned int mantissa_odd = (x >> 13) & 1;
+
+        x += 0xC8000FFF;
+        x += mantissa_odd;
+        result = x >> 13;
+    }
+
+    return static_cast<unsigned short>(result | sign);
+}
+
+static inline float half_bits_to_float(unsigned short h)
+{
+    const unsigned int shifted_exponent = 0x7C00 << 13;
+    unsigned int x = (h & 0x7FFF) << 13;
+    const unsigned int exponent = x & shifted_exponent;
+    float f;
+
+    x += (127 - 15) << 23;
+
+    if (exponent == shifted_exponent)
+    {
+        // Infinity or NaN. NaNs come back quiet, matching F16C.
+        x += (128 - 16) << 23;
+        if (x & 0x007FFFFF)
+        {
+            x |= 0x00400000;
+        }
+        memcpy(&f, &x, sizeof(f));
+    }
+    else if (exponent == 0)
+    {
+        // Zero or denormal
+        const unsigned int magic_bits = 113 << 23;
+        float magic;
+
+        x += 1 << 23;
+        memcpy(&f, &x, sizeof(f));
+        memcpy(&magic, &magic_bits, sizeof(magic));
+        f -= magic;
+    }
+    else
+    {
+        memcpy(&f, &x, sizeof(f));
+    }
+
+    return (h & 0x8000) ? -f : f;
+}
+
+class half
+{
+public:
+    inline constexpr half()
+        : bits(0)
+    {
+    }
+
+    inline half(float f)
+        : bits(float_to_half_bits(f))
+    {
+    }
+
+    inline operator float() const
+    {
+        return half_bits_to_float(bits);
+    }
+
+    static inline half from_bits(unsigned short b)
+    {
+        half result;
+        result.bits = b;
+        return result;
+    }
+
+    unsigned short bits;
+};
+
+typedef Tvec2<half> vec2h;
+typedef Tvec3<half> vec3h;
+typedef Tvec4<half> vec4h;
+
+// Storage for normalized integer vertex data. Use the pack/unpack functions
+// below to convert to and from float vectors.
+typedef Tvec2<signed char> i8vec2;
+typedef Tvec4<signed char> i8vec4;
+typedef Tvec2<unsigned char> u8vec2;
+typedef Tvec4<unsigned char> u8vec4;
+typedef Tvec2<short> i16vec2;
+typedef Tvec4<short> i16vec4;
+typedef Tvec2<unsigned short> u16vec2;
+typedef Tvec4<unsigned short> u16vec4;
+
+// Bulk conversions. These use F16C when the compiler targets it and are
+// bit-exact with the scalar path otherwise.
+static inline void float_to_half(half* dst, const float* src, size_t count)
+{
+    size_t i = 0;
+
+#ifdef VMATH_F16C
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i*)(dst + i), h);
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        dst[i].bits = float_to_half_bits(src[i]);
+    }
+}
+
+static inline void half_to_float(float* dst, const half* src, size_t count)
+{
+    size_t i = 0;
+
+#ifdef VMATH_F16C
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128i h = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        dst[i] = half_bits_to_float(src[i].bits);
+    }
+}
+
 template <typename T, int n>
-static inline const vecN<T,n> operator * (T x, const vecN<T,n>& v)
+static inline constexpr const vecN<T,n> operator * (T x, const vecN<T,n>& v)
 {
     return v * x;
 }
 
 template <typename T>
-static inline const Tvec2<T> operator / (T x, const Tvec2<T>& v)
+static inline constexpr const Tvec2<T> operator / (T x, const Tvec2<T>& v)
 {
     return Tvec2<T>(x / v[0], x / v[1]);
 }
 
 template <typename T>
-static inline const Tvec3<T> operator / (T x, const Tvec3<T>& v)
+static inline constexpr const Tvec3<T> operator / (T x, const Tvec3<T>& v)
 {
     return Tvec3<T>(x / v[0], x / v[1], x / v[2]);
 }
 
 template <typename T>
-static inline const Tvec4<T> operator / (T x, const Tvec4<T>& v)
+static inline constexpr const Tvec4<T> operator / (T x, const Tvec4<T>& v)
 {
     return Tvec4<T>(x / v[0], x / v[1], x / v[2], x / v[3]);
 }
 
 template <typename T, int len>
-static inline T dot(const vecN<T,len>& a, const vecN<T,len>& b)
+static inline constexpr T dot(const vecN<T,len>& a, const vecN<T,len>& b)
 {
-    int n;
+    int n = 0;
     T total = T(0);
     for (n = 0; n < len; n++)
     {
@@ -446,7 +650,7 @@ static inline T dot(const vecN<T,len>& a, const vecN<T,len>& b)
 }
 
 template <typename T>
-static inline vecN<T,3> cross(const vecN<T,3>& a, const vecN<T,3>& b)
+static inline constexpr vecN<T,3> cross(const vecN<T,3>& a, const vecN<T,3>& b)
 {
     return Tvec3<T>(a[1] * b[2] - b[1] * a[2],
                     a[2] * b[0] - b[2] * a[0],
@@ -725,21 +929,24 @@ public:
     typedef class matNM<T,w,h> my_type;
     typedef class vecN<T,h> vector_type;
 
-    // Default constructor does nothing, just like built-in types
-    inline matNM()
+    // Default constructor zero-fills so that matrices can be used in
+    // constant expressions
+    inline constexpr matNM()
+        : data()
     {
-        // Uninitialized variable
     }
 
     // Copy constructor
-    inline matNM(const matNM& that)
+    inline constexpr matNM(const matNM& that)
+        : data()
     {
         assign(that);
     }
 
     // Construction from element type
     // explicit to prevent assignment from T
-    explicit inline matNM(T f)
+    explicit inline constexpr matNM(T f)
+        : data()
     {
         for (int n = 0; n < w; n++)
         {
@@ -748,7 +955,8 @@ public:
     }
 
     // Construction from vector
-    inline matNM(const vector_type& v)
+    inline constexpr matNM(const vector_type& v)
+        : data()
     {
         for (int n = 0; n < w; n++)
         {
@@ -757,64 +965,61 @@ public:
     }
 
     // Assignment operator
-    inline matNM& operator=(const my_type& that)
+    inline constexpr matNM& operator=(const my_type& that)
     {
         assign(that);
         return *this;
     }
 
-    inline matNM operator+(const my_type& that) const
+    inline constexpr matNM operator+(const my_type& that) const
     {
         my_type result;
-        int n;
-        for (n = 0; n < w; n++)
+        for (int n = 0; n < w; n++)
             result.data[n] = data[n] + that.data[n];
         return result;
     }
 
-    inline my_type& operator+=(const my_type& that)
+    inline constexpr my_type& operator+=(const my_type& that)
     {
         return (*this = *this + that);
     }
 
-    inline my_type operator-(const my_type& that) const
+    inline constexpr my_type operator-(const my_type& that) const
     {
         my_type result;
-        int n;
-        for (n = 0; n < w; n++)
+        for (int n = 0; n < w; n++)
             result.data[n] = data[n] - that.data[n];
         return result;
     }
 
-    inline my_type& operator-=(const my_type& that)
+    inline constexpr my_type& operator-=(const my_type& that)
     {
         return (*this = *this - that);
     }
 
-    inline my_type operator*(const T& that) const
+    inline constexpr my_type operator*(const T& that) const
     {
         my_type result;
-        int n;
-        for (n = 0; n < w; n++)
+        for (int n = 0; n < w; n++)
             result.data[n] = data[n] * that;
         return result;
     }
 
-    inline my_type& operator*=(const T& that)
+    inline constexpr my_type& operator*=(const T& that)
     {
-        int n;
-        for (n = 0; n < w; n++)
+        for (int n = 0; n < w; n++)
             data[n] = data[n] * that;
         return *this;
     }
 
-    // Matrix multiply.
-    // TODO: This only works for square matrices. Need more template skill to make a non-square version.
-    inline my_type operator*(const my_type& that) const
+    // Matrix multiply. A w-column matrix can be multiplied by any matrix
+    // with w rows; the result has this matrix's rows and that one's columns.
+    template <const int w2>
+    inline constexpr matNM<T,w2,h> operator*(const matNM<T,w2,w>& that) const
     {
-        my_type result(0);
+        matNM<T,w2,h> result(0);
 
-        for (int j = 0; j < w; j++)
+        for (int j = 0; j < w2; j++)
         {
             for (int i = 0; i < h; i++)
             {
@@ -832,20 +1037,33 @@ public:
         return result;
     }
 
-    inline my_type& operator*=(const my_type& that)
+    // Matrix times column vector
+    inline constexpr vector_type operator*(const vecN<T,w>& v) const
+    {
+        vector_type result(T(0));
+
+        for (int n = 0; n < w; n++)
+        {
+            result += data[n] * v[n];
+        }
+
+        return result;
+    }
+
+    inline constexpr my_type& operator*=(const my_type& that)
     {
         return (*this = *this * that);
     }
 
-    inline vector_type& operator[](int n) { return data[n]; }
-    inline const vector_type& operator[](int n) const { return data[n]; }
+    inline constexpr vector_type& operator[](int n) { return data[n]; }
+    inline constexpr const vector_type& operator[](int n) const { return data[n]; }
     inline operator T*() { return &data[0][0]; }
     inline operator const T*() const { return &data[0][0]; }
 
-    inline matNM<T,h,w> transpose(void) const
+    inline constexpr matNM<T,h,w> transpose(void) const
     {
         matNM<T,h,w> result;
-        int x, y;
+        int x = 0, y = 0;
 
         for (y = 0; y < w; y++)
         {
@@ -858,11 +1076,11 @@ public:
         return result;
     }
 
-    static inline my_type identity()
+    static inline constexpr my_type identity()
     {
         my_type result(0);
 
-        for (int i = 0; i < w; i++)
+        for (int i = 0; i < w && i < h; i++)
         {
             result[i][i] = 1;
         }
@@ -870,18 +1088,17 @@ public:
         return result;
     }
 
-    static inline int width(void) { return w; }
-    static inline int height(void) { return h; }
+    static inline constexpr int width(void) { return w; }
+    static inline constexpr int height(void) { return h; }
 
 protected:
     // Column primary data (essentially, array of vectors)
     vecN<T,h> data[w];
 
     // Assignment function - called from assignment operator and copy constructor.
-    inline void assign(const matNM& that)
+    inline constexpr void assign(const matNM& that)
     {
-        int n;
-        for (n = 0; n < w; n++)
+        for (int n = 0; n < w; n++)
             data[n] = that.data[n];
     }
 };
@@ -924,11 +1141,11 @@ public:
     typedef matNM<T,4,4> base;
     typedef Tmat4<T> my_type;
 
-    inline Tmat4() {}
-    inline Tmat4(const my_type& that) : base(that) {}
-    inline Tmat4(const base& that) : base(that) {}
-    inline Tmat4(const vecN<T,4>& v) : base(v) {}
-    inline Tmat4(const vecN<T,4>& v0,
+    inline constexpr Tmat4() {}
+    inline constexpr Tmat4(const my_type& that) : base(that) {}
+    inline constexpr Tmat4(const base& that) : base(that) {}
+    inline constexpr Tmat4(const vecN<T,4>& v) : base(v) {}
+    inline constexpr Tmat4(const vecN<T,4>& v0,
                  const vecN<T,4>& v1,
                  const vecN<T,4>& v2,
                  const vecN<T,4>& v3)
@@ -952,11 +1169,11 @@ public:
     typedef matNM<T,3,3> base;
     typedef Tmat3<T> my_type;
 
-    inline Tmat3() {}
-    inline Tmat3(const my_type& that) : base(that) {}
-    inline Tmat3(const base& that) : base(that) {}
-    inline Tmat3(const vecN<T,3>& v) : base(v) {}
-    inline Tmat3(const vecN<T,3>& v0,
+    inline constexpr Tmat3() {}
+    inline constexpr Tmat3(const my_type& that) : base(that) {}
+    inline constexpr Tmat3(const base& that) : base(that) {}
+    inline constexpr Tmat3(const vecN<T,3>& v) : base(v) {}
+    inline constexpr Tmat3(const vecN<T,3>& v0,
                  const vecN<T,3>& v1,
                  const vecN<T,3>& v2)
     {
@@ -978,11 +1195,11 @@ public:
     typedef matNM<T,2,2> base;
     typedef Tmat2<T> my_type;
 
-    inline Tmat2() {}
-    inline Tmat2(const my_type& that) : base(that) {}
-    inline Tmat2(const base& that) : base(that) {}
-    inline Tmat2(const vecN<T,2>& v) : base(v) {}
-    inline Tmat2(const vecN<T,2>& v0,
+    inline constexpr Tmat2() {}
+    inline constexpr Tmat2(const my_type& that) : base(that) {}
+    inline constexpr Tmat2(const base& that) : base(that) {}
+    inline constexpr Tmat2(const vecN<T,2>& v) : base(v) {}
+    inline constexpr Tmat2(const vecN<T,2>& v0,
                  const vecN<T,2>& v1)
     {
         base::data[0] = v0;
@@ -992,7 +1209,53 @@ public:
 
 typedef Tmat2<float> mat2;
 
-static inline mat4 frustum(float left, float right, float bottom, float top, float n, float f)
+// Non-square matrices, named as in GLSL: matCxR has C columns and R rows.
+typedef matNM<float,2,3> mat2x3;
+typedef matNM<float,2,4> mat2x4;
+typedef matNM<float,3,2> mat3x2;
+typedef matNM<float,3,4> mat3x4;
+typedef matNM<float,4,2> mat4x2;
+typedef matNM<float,4,3> mat4x3;
+typedef matNM<double,3,4> dmat3x4;
+typedef matNM<double,4,3> dmat4x3;
+
+// Compact storage for affine transforms. The bottom row of an affine matrix
+// is always (0, 0, 0, 1), so only the top three rows are kept, stored as the
+// columns of a mat3x4 (48 bytes instead of 64). In GLSL, transform a point
+// with "vec4(p, 1.0) * m", which yields a vec3.
+template <typename T>
+static inline constexpr matNM<T,3,4> pack_affine(const matNM<T,4,4>& m)
+{
+    matNM<T,3,4> result;
+
+    for (int row = 0; row < 3; row++)
+    {
+        for (int col = 0; col < 4; col++)
+        {
+            result[row][col] = m[col][row];
+        }
+    }
+
+    return result;
+}
+
+template <typename T>
+static inline constexpr Tmat4<T> unpack_affine(const matNM<T,3,4>& m)
+{
+    Tmat4<T> result(Tmat4<T>::identity());
+
+    for (int row = 0; row < 3; row++)
+    {
+        for (int col = 0; col < 4; col++)
+        {
+            result[col][row] = m[row][col];
+        }
+    }
+
+    return result;
+}
+
+static inline constexpr mat4 frustum(float left, float right, float bottom, float top, float n, float f)
 {
     mat4 result(mat4::identity());
 
@@ -1017,9 +1280,9 @@ static inline mat4 frustum(float left, float right, float bottom, float top, flo
     return result;
 }
 
-static inline mat4 perspective(float fovy, float aspect, float n, float f)
+static inline constexpr mat4 perspective(float fovy, float aspect, float n, float f)
 {
-    float q = 1.0f / tan(radians(0.5f * fovy));
+    float q = 1.0f / constexpr_tan(radians(0.5f * fovy));
     float A = q / aspect;
     float B = (n + f) / (n - f);
     float C = (2.0f * n * f) / (n - f);
@@ -1034,7 +1297,7 @@ static inline mat4 perspective(float fovy, float aspect, float n, float f)
     return result;
 }
 
-static inline mat4 ortho(float left, float right, float bottom, float top, float n, float f)
+static inline constexpr mat4 ortho(float left, float right, float bottom, float top, float n, float f)
 {
     return mat4( vec4(2.0f / (right - left), 0.0f, 0.0f, 0.0f),
                  vec4(0.0f, 2.0f / (top - bottom), 0.0f, 0.0f),
@@ -1043,7 +1306,7 @@ static inline mat4 ortho(float left, float right, float bottom, float top, float
 }
 
 template <typename T>
-static inline Tmat4<T> translate(T x, T y, T z)
+static inline constexpr Tmat4<T> translate(T x, T y, T z)
 {
     return Tmat4<T>(Tvec4<T>(1.0f, 0.0f, 0.0f, 0.0f),
                     Tvec4<T>(0.0f, 1.0f, 0.0f, 0.0f),
@@ -1052,7 +1315,7 @@ static inline Tmat4<T> translate(T x, T y, T z)
 }
 
 template <typename T>
-static inline Tmat4<T> translate(const vecN<T,3>& v)
+static inline constexpr Tmat4<T> translate(const vecN<T,3>& v)
 {
     return translate(v[0], v[1], v[2]);
 }
@@ -1073,7 +1336,7 @@ static inline Tmat4<T> lookat(const vecN<T,3>& eye, const vecN<T,3>& center, con
 }
 
 template <typename T>
-static inline Tmat4<T> scale(T x, T y, T z)
+static inline constexpr Tmat4<T> scale(T x, T y, T z)
 {
     return Tmat4<T>(Tvec4<T>(x, 0.0f, 0.0f, 0.0f),
                     Tvec4<T>(0.0f, y, 0.0f, 0.0f),
@@ -1082,13 +1345,13 @@ static inline Tmat4<T> scale(T x, T y, T z)
 }
 
 template <typename T>
-static inline Tmat4<T> scale(const Tvec3<T>& v)
+static inline constexpr Tmat4<T> scale(const Tvec3<T>& v)
 {
     return scale(v[0], v[1], v[2]);
 }
 
 template <typename T>
-static inline Tmat4<T> scale(T x)
+static inline constexpr Tmat4<T> scale(T x)
 {
     return Tmat4<T>(Tvec4<T>(x, 0.0f, 0.0f, 0.0f),
                     Tvec4<T>(0.0f, x, 0.0f, 0.0f),
@@ -1136,7 +1399,7 @@ static inline Tmat4<T> rotate(T angle_x, T angle_y, T angle_z)
 #endif
 
 template <typename T>
-static inline T min(T a, T b)
+static inline constexpr T min(T a, T b)
 {
     return a < b ? a : b;
 }
@@ -1146,16 +1409,16 @@ static inline T min(T a, T b)
 #endif
 
 template <typename T>
-static inline T max(T a, T b)
+static inline constexpr T max(T a, T b)
 {
     return a >= b ? a : b;
 }
 
 template <typename T, const int N>
-static inline vecN<T,N> min(const vecN<T,N>& x, const vecN<T,N>& y)
+static inline constexpr vecN<T,N> min(const vecN<T,N>& x, const vecN<T,N>& y)
 {
     vecN<T,N> t;
-    int n;
+    int n = 0;
 
     for (n = 0; n < N; n++)
     {
@@ -1166,10 +1429,10 @@ static inline vecN<T,N> min(const vecN<T,N>& x, const vecN<T,N>& y)
 }
 
 template <typename T, const int N>
-static inline vecN<T,N> max(const vecN<T,N>& x, const vecN<T,N>& y)
+static inline constexpr vecN<T,N> max(const vecN<T,N>& x, const vecN<T,N>& y)
 {
     vecN<T,N> t;
-    int n;
+    int n = 0;
 
     for (n = 0; n < N; n++)
     {
@@ -1180,7 +1443,7 @@ static inline vecN<T,N> max(const vecN<T,N>& x, const vecN<T,N>& y)
 }
 
 template <typename T, const int N>
-static inline vecN<T,N> clamp(const vecN<T,N>& x, const vecN<T,N>& minVal, const vecN<T,N>& maxVal)
+static inline constexpr vecN<T,N> clamp(const vecN<T,N>& x, const vecN<T,N>& minVal, const vecN<T,N>& maxVal)
 {
     return min<T>(max<T>(x, minVal), maxVal);
 }
@@ -1215,10 +1478,10 @@ static inline vecN<T,S> refract(const vecN<T,S>& I, const vecN<T,S>& N, T eta)
 }
 
 template <typename T, const int N, const int M>
-static inline matNM<T,N,M> matrixCompMult(const matNM<T,N,M>& x, const matNM<T,N,M>& y)
+static inline constexpr matNM<T,N,M> matrixCompMult(const matNM<T,N,M>& x, const matNM<T,N,M>& y)
 {
     matNM<T,N,M> result;
-    int i, j;
+    int i = 0, j = 0;
 
     for (j = 0; j < M; ++j)
     {
@@ -1232,9 +1495,9 @@ static inline matNM<T,N,M> matrixCompMult(const matNM<T,N,M>& x, const matNM<T,N
 }
 
 template <typename T, const int N, const int M>
-static inline vecN<T,N> operator*(const vecN<T,M>& vec, const matNM<T,N,M>& mat)
+static inline constexpr vecN<T,N> operator*(const vecN<T,M>& vec, const matNM<T,N,M>& mat)
 {
-    int n, m;
+    int n = 0, m = 0;
     vecN<T,N> result(T(0));
 
     for (m = 0; m < M; m++)
@@ -1249,9 +1512,9 @@ static inline vecN<T,N> operator*(const vecN<T,M>& vec, const matNM<T,N,M>& mat)
 }
 
 template <typename T, const int N>
-static inline vecN<T,N> operator/(const T s, const vecN<T,N>& v)
+static inline constexpr vecN<T,N> operator/(const T s, const vecN<T,N>& v)
 {
-    int n;
+    int n = 0;
     vecN<T,N> result;
 
     for (n = 0; n < N; n++)
@@ -1294,6 +1557,123 @@ static inline void quaternionToMatrix(const Tquaternion<T>& q, matNM<T,4,4>& m)
     m = q.asMatrix();
 }
 
+// Normalized integer packing, following the GLSL pack*/unpack* built-ins.
+// Element 0 goes in the least significant bits.
+static inline float pack_clamp(float v, float lo, float hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+static inline unsigned int pack_round(float v)
+{
+    return static_cast<unsigned int>(static_cast<int>(floorf(v + 0.5f)));
+}
+
+static inline unsigned int packUnorm4x8(const vecN<float,4>& v)
+{
+    unsigned int result = 0;
+
+    for (int n = 0; n < 4; n++)
+    {
+        result |= (pack_round(pack_clamp(v[n], 0.0f, 1.0f) * 255.0f) & 0xFF) << (8 * n);
+    }
+
+    return result;
+}
+
+static inline unsigned int packSnorm4x8(const vecN<float,4>& v)
+{
+    unsigned int result = 0;
+
+    for (int n = 0; n < 4; n++)
+    {
+        result |= (pack_round(pack_clamp(v[n], -1.0f, 1.0f) * 127.0f) & 0xFF) << (8 * n);
+    }
+
+    return result;
+}
+
+static inline unsigned int packUnorm2x16(const vecN<float,2>& v)
+{
+    return (pack_round(pack_clamp(v[0], 0.0f, 1.0f) * 65535.0f) & 0xFFFF) |
+           ((pack_round(pack_clamp(v[1], 0.0f, 1.0f) * 65535.0f) & 0xFFFF) << 16);
+}
+
+static inline unsigned int packSnorm2x16(const vecN<float,2>& v)
+{
+    return (pack_round(pack_clamp(v[0], -1.0f, 1.0f) * 32767.0f) & 0xFFFF) |
+           ((pack_round(pack_clamp(v[1], -1.0f, 1.0f) * 32767.0f) & 0xFFFF) << 16);
+}
+
+static inline vec4 unpackUnorm4x8(unsigned int p)
+{
+    return vec4(float(p & 0xFF), float((p >> 8) & 0xFF),
+                float((p >> 16) & 0xFF), float(p >> 24)) / 255.0f;
+}
+
+static inline vec4 unpackSnorm4x8(unsigned int p)
+{
+    vec4 result;
+
+    for (int n = 0; n < 4; n++)
+    {
+        const float f = float(static_cast<signed char>((p >> (8 * n)) & 0xFF)) / 127.0f;
+        result[n] = pack_clamp(f, -1.0f, 1.0f);
+    }
+
+    return result;
+}
+
+static inline vec2 unpackUnorm2x16(unsigned int p)
+{
+    return vec2(float(p & 0xFFFF) / 65535.0f, float(p >> 16) / 65535.0f);
+}
+
+static inline vec2 unpackSnorm2x16(unsigned int p)
+{
+    return vec2(pack_clamp(float(static_cast<short>(p & 0xFFFF)) / 32767.0f, -1.0f, 1.0f),
+                pack_clamp(float(static_cast<short>(p >> 16)) / 32767.0f, -1.0f, 1.0f));
+}
+
+// GL_UNSIGNED_INT_2_10_10_10_REV and GL_INT_2_10_10_10_REV layouts.
+static inline unsigned int packUnorm_2_10_10_10(const vecN<float,4>& v)
+{
+    return (pack_round(pack_clamp(v[0], 0.0f, 1.0f) * 1023.0f) & 0x3FF) |
+           ((pack_round(pack_clamp(v[1], 0.0f, 1.0f) * 1023.0f) & 0x3FF) << 10) |
+           ((pack_round(pack_clamp(v[2], 0.0f, 1.0f) * 1023.0f) & 0x3FF) << 20) |
+           ((pack_round(pack_clamp(v[3], 0.0f, 1.0f) * 3.0f) & 0x3) << 30);
+}
+
+static inline unsigned int packSnorm_2_10_10_10(const vecN<float,4>& v)
+{
+    return (pack_round(pack_clamp(v[0], -1.0f, 1.0f) * 511.0f) & 0x3FF) |
+           ((pack_round(pack_clamp(v[1], -1.0f, 1.0f) * 511.0f) & 0x3FF) << 10) |
+           ((pack_round(pack_clamp(v[2], -1.0f, 1.0f) * 511.0f) & 0x3FF) << 20) |
+           ((pack_round(pack_clamp(v[3], -1.0f, 1.0f)) & 0x3) << 30);
+}
+
+static inline vec4 unpackUnorm_2_10_10_10(unsigned int p)
+{
+    return vec4(float(p & 0x3FF) / 1023.0f,
+                float((p >> 10) & 0x3FF) / 1023.0f,
+                float((p >> 20) & 0x3FF) / 1023.0f,
+                float(p >> 30) / 3.0f);
+}
+
+static inline vec4 unpackSnorm_2_10_10_10(unsigned int p)
+{
+    // Sign extend each field by shifting it to the top of an int
+    const int x = static_cast<int>(p << 22) >> 22;
+    const int y = static_cast<int>(p << 12) >> 22;
+    const int z = static_cast<int>(p << 2) >> 22;
+    const int w = static_cast<int>(p) >> 30;
+
+    return vec4(pack_clamp(float(x) / 511.0f, -1.0f, 1.0f),
+                pack_clamp(float(y) / 511.0f, -1.0f, 1.0f),
+                pack_clamp(float(z) / 511.0f, -1.0f, 1.0f),
+                pack_clamp(float(w), -1.0f, 1.0f));
+}
+
 template <typename T>
 static inline T mix(const T& A, const T& B, typename T::element_type t)
 {
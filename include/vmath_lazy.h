@@ -0,0 +1,311 @@
+#ifndef __VMATH_LAZY_H__
+#define __VMATH_LAZY_H__
+
+#include "vmath.h"
+
+#include <cmath>
+
+// Opt-in lazy transform chains for vmath.
+//
+//     vmath::mat4 mv = vmath::lazy::translate(0.0f, 0.0f, -20.0f) *
+//                      vmath::lazy::rotate_y(45.0f) *
+//                      vmath::lazy::scale(2.0f);
+//
+// The products build a small expression object instead of a mat4 per
+// operator. Converting it to a matrix walks the chain once, right-multiplying
+// a single accumulator by each factor. Translations, scales and axis
+// rotations are applied in their sparse form (a column update or a mix of
+// two columns), so they cost far less than a full 4x4 multiply. Multiplying a
+// chain by a vector applies each factor to the vector and never builds the
+// matrix.
+
+namespace vmath
+{
+
+namespace lazy
+{
+
+template <typename D>
+struct expression
+{
+    inline const D& derived() const { return static_cast<const D&>(*this); }
+
+    // Evaluates the whole chain into a matrix.
+    template <typename T>
+    inline operator Tmat4<T>() const
+    {
+        Tmat4<T> result;
+        derived().init(result);
+        return result;
+    }
+};
+
+template <typename A, typename B>
+class product : public expression<product<A,B> >
+{
+public:
+    typedef typename A::element_type element_type;
+
+    inline product(const A& _a, const B& _b) : a(_a), b(_b) {}
+
+    inline void init(Tmat4<element_type>& m) const
+    {
+        a.init(m);
+        b.apply(m);
+    }
+
+    // m = m * (a * b)
+    inline void apply(Tmat4<element_type>& m) const
+    {
+        a.apply(m);
+        b.apply(m);
+    }
+
+    // v = (a * b) * v
+    inline void transform(vecN<element_type,4>& v) const
+    {
+        b.transform(v);
+        a.transform(v);
+    }
+
+private:
+    A a;
+    B b;
+};
+
+template <typename T>
+class translation : public expression<translation<T> >
+{
+public:
+    typedef T element_type;
+
+    inline translation(T x, T y, T z) : t(x, y, z) {}
+
+    inline void init(Tmat4<T>& m) const
+    {
+        m = Tmat4<T>::identity();
+        m[3] = Tvec4<T>(t, T(1));
+    }
+
+    inline void apply(Tmat4<T>& m) const
+    {
+        m[3] = m[0] * t[0] + m[1] * t[1] + m[2] * t[2] + m[3];
+    }
+
+    inline void transform(vecN<T,4>& v) const
+    {
+        v[0] += t[0] * v[3];
+        v[1] += t[1] * v[3];
+        v[2] += t[2] * v[3];
+    }
+
+private:
+    Tvec3<T> t;
+};
+
+template <typename T>
+class scaling : public expression<scaling<T> >
+{
+public:
+    typedef T element_type;
+
+    inline scaling(T x, T y, T z) : s(x, y, z) {}
+
+    inline void init(Tmat4<T>& m) const
+    {
+        m = Tmat4<T>::identity();
+        m[0][0] = s[0];
+        m[1][1] = s[1];
+        m[2][2] = s[2];
+    }
+
+    inline void apply(Tmat4<T>& m) const
+    {
+        m[0] *= s[0];
+        m[1] *= s[1];
+        m[2] *= s[2];
+    }
+
+    inline void transform(vecN<T,4>& v) const
+    {
+        v[0] *= s[0];
+        v[1] *= s[1];
+        v[2] *= s[2];
+    }
+
+private:
+    Tvec3<T> s;
+};
+
+// Rotation about one of the coordinate axes. Only the two columns that
+// the rotation touches are updated.
+template <typename T, int axis>
+class axis_rotation : public expression<axis_rotation<T,axis> >
+{
+public:
+    typedef T element_type;
+
+    inline axis_rotation(T angle)
+    {
+        // In T, so double chains keep double precision
+        const T rads = radians(angle);
+        c = std::cos(rads);
+        s = std::sin(rads);
+    }
+
+    inline void init(Tmat4<T>& m) const
+    {
+        m = Tmat4<T>::identity();
+        apply(m);
+    }
+
+    inline void apply(Tmat4<T>& m) const
+    {
+        const int i = (axis + 1) % 3;
+        const int j = (axis + 2) % 3;
+        const vecN<T,4> ci = m[i];
+        const vecN<T,4> cj = m[j];
+
+        m[i] = ci * c + cj * s;
+        m[j] = cj * c - ci * s;
+    }
+
+    inline void transform(vecN<T,4>& v) const
+    {
+        const int i = (axis + 1) % 3;
+        const int j = (axis + 2) % 3;
+        const T vi = v[i];
+        const T vj = v[j];
+
+        v[i] = vi * c - vj * s;
+        v[j] = vi * s + vj * c;
+    }
+
+private:
+    T c;
+    T s;
+};
+
+// Any other matrix. Falls back to a full multiply.
+template <typename T>
+class matrix : public expression<matrix<T> >
+{
+public:
+    typedef T element_type;
+
+    inline matrix(const matNM<T,4,4>& _m) : mat(_m) {}
+
+    inline void init(Tmat4<T>& m) const
+    {
+        m = mat;
+    }
+
+    inline void apply(Tmat4<T>& m) const
+    {
+        m = m * mat;
+    }
+
+    inline void transform(vecN<T,4>& v) const
+    {
+        vecN<T,4> result(T(0));
+
+        for (int n = 0; n < 4; n++)
+        {
+            result += mat[n] * v[n];
+        }
+
+        v = result;
+    }
+
+private:
+    Tmat4<T> mat;
+};
+
+template <typename T>
+static inline translation<T> translate(T x, T y, T z)
+{
+    return translation<T>(x, y, z);
+}
+
+template <typename T>
+static inline translation<T> translate(const vecN<T,3>& v)
+{
+    return translation<T>(v[0], v[1], v[2]);
+}
+
+template <typename T>
+static inline scaling<T> scale(T x, T y, T z)
+{
+    return scaling<T>(x, y, z);
+}
+
+template <typename T>
+static inline scaling<T> scale(T x)
+{
+    return scaling<T>(x, x, x);
+}
+
+template <typename T>
+static inline axis_rotation<T,0> rotate_x(T angle)
+{
+    return axis_rotation<T,0>(angle);
+}
+
+template <typename T>
+static inline axis_rotation<T,1> rotate_y(T angle)
+{
+    return axis_rotation<T,1>(angle);
+}
+
+template <typename T>
+static inline axis_rotation<T,2> rotate_z(T angle)
+{
+    return axis_rotation<T,2>(angle);
+}
+
+template <typename T>
+static inline matrix<T> wrap(const matNM<T,4,4>& m)
+{
+    return matrix<T>(m);
+}
+
+template <typename A, typename B>
+static inline product<A,B> operator*(const expression<A>& a, const expression<B>& b)
+{
+    return product<A,B>(a.derived(), b.derived());
+}
+
+template <typename T, typename B>
+static inline product<matrix<T>,B> operator*(const matNM<T,4,4>& a, const expression<B>& b)
+{
+    return product<matrix<T>,B>(matrix<T>(a), b.derived());
+}
+
+template <typename A, typename T>
+static inline product<A,matrix<T> > operator*(const expression<A>& a, const matNM<T,4,4>& b)
+{
+    return product<A,matrix<T> >(a.derived(), matrix<T>(b));
+}
+
+template <typename D>
+static inline Tmat4<typename D::element_type> eval(const expression<D>& e)
+{
+    Tmat4<typename D::element_type> result;
+    e.derived().init(result);
+    return result;
+}
+
+template <typename D>
+static inline vecN<typename D::element_type,4> operator*(const expression<D>& e,
+                                                         const vecN<typename D::element_type,4>& v)
+{
+    vecN<typename D::element_type,4> result(v);
+    e.derived().transform(result);
+    return result;
+}
+
+} // namespace lazy
+
+} // namespace vmath
+
+#endif /* __VMATH_LAZY_H__ */